@@ -0,0 +1,656 @@
+/**
+ * @file BiasProfile.cpp
+ *
+ * @brief Bias level, row and column profiles, and overscan level tracked during the sweep.
+ *
+ */
+
+// Dependencies
+#include "BiasProfile.h"
+#include "FrameWriter.h"
+#include "Timing.h"
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <map>
+#include <set>
+#include <thread>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+using namespace std;
+
+static const int ROWS_PER_CLAIM = 64; // Rows a thread claims at a time
+
+/**
+  @fn static void SumRowScalar(const unsigned short *row, unsigned int count, int ceiling, uint32_t *columnSums, uint32_t *columnCounts, uint64_t *rowSum, uint32_t *rowCount)
+    @brief Adds the pixels of a row up to a ceiling into its row sum and into the sums of their columns
+    @param row Pixels of the row
+    @param count Number of pixels
+    @param ceiling Highest pixel value kept
+    @param columnSums Sum of the kept pixels of each column, added to
+    @param columnCounts Kept pixels of each column, added to
+    @param rowSum Sum of the kept pixels of the row
+    @param rowCount Kept pixels of the row
+*/
+static void SumRowScalar(const unsigned short *row, unsigned int count, int ceiling, uint32_t *columnSums,
+                         uint32_t *columnCounts, uint64_t *rowSum, uint32_t *rowCount)
+{
+  uint64_t sum = 0;
+  uint32_t kept = 0;
+  for (unsigned int x = 0; x < count; x++)
+  {
+    int value = row[x];
+    if (value <= ceiling)
+    {
+      columnSums[x] += value;
+      columnCounts[x]++;
+      sum += value;
+      kept++;
+    }
+  }
+  *rowSum = sum;
+  *rowCount = kept;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/**
+  @fn static void SumRowSSE2(const unsigned short *row, unsigned int count, int ceiling, uint32_t *columnSums, uint32_t *columnCounts, uint64_t *rowSum, uint32_t *rowCount)
+    @brief SSE2 row kernel, 8 pixels per step
+*/
+__attribute__((target("sse2"))) static void SumRowSSE2(const unsigned short *row, unsigned int count, int ceiling,
+                                                      uint32_t *columnSums, uint32_t *columnCounts, uint64_t *rowSum,
+                                                      uint32_t *rowCount)
+{
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i one = _mm_set1_epi32(1);
+  const __m128i limit = _mm_set1_epi32(ceiling + 1);
+  __m128i sum = zero, kept = zero;
+  unsigned int x = 0;
+  for (; x + 8 <= count; x += 8)
+  {
+    __m128i pixels = _mm_loadu_si128((const __m128i *)(row + x));
+    __m128i halves[2] = {_mm_unpacklo_epi16(pixels, zero), _mm_unpackhi_epi16(pixels, zero)};
+    for (int h = 0; h < 2; h++)
+    {
+      __m128i mask = _mm_cmplt_epi32(halves[h], limit);
+      __m128i value = _mm_and_si128(halves[h], mask);
+      __m128i in = _mm_and_si128(mask, one);
+      __m128i *sums = (__m128i *)(columnSums + x + 4 * h);
+      __m128i *counts = (__m128i *)(columnCounts + x + 4 * h);
+      _mm_storeu_si128(sums, _mm_add_epi32(_mm_loadu_si128(sums), value));
+      _mm_storeu_si128(counts, _mm_add_epi32(_mm_loadu_si128(counts), in));
+      sum = _mm_add_epi32(sum, value);
+      kept = _mm_add_epi32(kept, in);
+    }
+  }
+  uint32_t sumLanes[4], keptLanes[4];
+  _mm_storeu_si128((__m128i *)sumLanes, sum);
+  _mm_storeu_si128((__m128i *)keptLanes, kept);
+  SumRowScalar(row + x, count - x, ceiling, columnSums + x, columnCounts + x, rowSum, rowCount);
+  for (int i = 0; i < 4; i++)
+  {
+    *rowSum += sumLanes[i];
+    *rowCount += keptLanes[i];
+  }
+}
+
+/**
+  @fn static void SumRowAVX2(const unsigned short *row, unsigned int count, int ceiling, uint32_t *columnSums, uint32_t *columnCounts, uint64_t *rowSum, uint32_t *rowCount)
+    @brief AVX2 row kernel, 16 pixels per step
+*/
+__attribute__((target("avx2"))) static void SumRowAVX2(const unsigned short *row, unsigned int count, int ceiling,
+                                                      uint32_t *columnSums, uint32_t *columnCounts, uint64_t *rowSum,
+                                                      uint32_t *rowCount)
+{
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i one = _mm256_set1_epi32(1);
+  const __m256i limit = _mm256_set1_epi32(ceiling + 1);
+  __m256i sum = zero, kept = zero;
+  unsigned int x = 0;
+  for (; x + 16 <= count; x += 16)
+  {
+    for (int h = 0; h < 2; h++)
+    {
+      // Widening keeps the pixels in column order, which the in-lane unpacks of AVX2 would not
+      __m256i pixels = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)(row + x + 8 * h)));
+      __m256i mask = _mm256_cmpgt_epi32(limit, pixels);
+      __m256i value = _mm256_and_si256(pixels, mask);
+      __m256i in = _mm256_and_si256(mask, one);
+      __m256i *sums = (__m256i *)(columnSums + x + 8 * h);
+      __m256i *counts = (__m256i *)(columnCounts + x + 8 * h);
+      _mm256_storeu_si256(sums, _mm256_add_epi32(_mm256_loadu_si256(sums), value));
+      _mm256_storeu_si256(counts, _mm256_add_epi32(_mm256_loadu_si256(counts), in));
+      sum = _mm256_add_epi32(sum, value);
+      kept = _mm256_add_epi32(kept, in);
+    }
+  }
+  uint32_t sumLanes[8], keptLanes[8];
+  _mm256_storeu_si256((__m256i *)sumLanes, sum);
+  _mm256_storeu_si256((__m256i *)keptLanes, kept);
+  SumRowScalar(row + x, count - x, ceiling, columnSums + x, columnCounts + x, rowSum, rowCount);
+  for (int i = 0; i < 8; i++)
+  {
+    *rowSum += sumLanes[i];
+    *rowCount += keptLanes[i];
+  }
+}
+#endif
+
+typedef void (*RowKernel)(const unsigned short *, unsigned int, int, uint32_t *, uint32_t *, uint64_t *, uint32_t *);
+
+/**
+  @fn static RowKernel SelectKernel(const char **name)
+    @brief Picks the fastest row kernel the CPU supports
+    @param name Name of the kernel
+  @return Kernel
+*/
+static RowKernel SelectKernel(const char **name)
+{
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+  {
+    *name = "AVX2";
+    return SumRowAVX2;
+  }
+  if (__builtin_cpu_supports("sse2"))
+  {
+    *name = "SSE2";
+    return SumRowSSE2;
+  }
+#endif
+  *name = "scalar";
+  return SumRowScalar;
+}
+
+static const char *kernelName;
+static const RowKernel kernel = SelectKernel(&kernelName);
+
+/**
+  @fn static double Median(vector<float> &values)
+    @brief Median of the values that are not NAN (reorders them)
+    @param values Values
+  @return Median, NAN if every value is NAN
+*/
+static double Median(vector<float> &values)
+{
+  values.erase(remove_if(values.begin(), values.end(), [](float v) { return std::isnan(v); }), values.end());
+  if (values.empty())
+  {
+    return NAN;
+  }
+  size_t middle = values.size() / 2;
+  nth_element(values.begin(), values.begin() + middle, values.end());
+  double median = values[middle];
+  if (values.size() % 2 == 0)
+  {
+    median = (median + *max_element(values.begin(), values.begin() + middle)) / 2;
+  }
+  return median;
+}
+
+/**
+  @fn static double PatternSigma(const vector<float> &profile)
+  @return Standard deviation of the values of a profile that are not NAN (0 for fewer than two)
+*/
+static double PatternSigma(const vector<float> &profile)
+{
+  double sum = 0, squares = 0;
+  long count = 0;
+  for (size_t i = 0; i < profile.size(); i++)
+  {
+    if (!std::isnan(profile[i]))
+    {
+      sum += profile[i];
+      squares += (double)profile[i] * profile[i];
+      count++;
+    }
+  }
+  if (count < 2)
+  {
+    return 0;
+  }
+  double mean = sum / count;
+  return sqrt(max(0.0, (squares - count * mean * mean) / (count - 1)));
+}
+
+BiasTracker::BiasTracker(const BiasRegion &overscan, int numThreads, const string &profilePath)
+    : overscan(overscan), numThreads(numThreads > 0 ? numThreads : 1), profilePath(profilePath), profileFile(NULL),
+      open(false), sizeX(0), sizeY(0), reduceSeconds(0), reduced(0), nextSequence(0)
+{
+  if (profilePath.empty())
+  {
+    return;
+  }
+  profileFile = fopen(profilePath.c_str(), "wb");
+  if (profileFile == NULL)
+  {
+    printf("Could not create bias profile file %s.\n", profilePath.c_str());
+    return;
+  }
+  fwrite(BIAS_PROFILE_MAGIC, sizeof(BIAS_PROFILE_MAGIC), 1, profileFile);
+}
+
+BiasTracker::~BiasTracker()
+{
+  if (profileFile != NULL)
+  {
+    fclose(profileFile);
+  }
+}
+
+void BiasTracker::Add(const FrameJob &job)
+{
+  unique_lock<mutex> guard(lock);
+  turn.wait(guard, [&] { return job.sequence == nextSequence; });
+
+  // Only the thread holding the turn touches the setting, so the other writers can wait without the lock
+  guard.unlock();
+  const unsigned short *pixels = reinterpret_cast<const unsigned short *>(job.pImgData);
+  double exposure = job.exposureTime / 1000000;
+
+  // A setting is complete once the sweep moves on from it
+  if (open && (current.gainSetting != job.gainSetting || current.offsetSetting != job.offsetSetting ||
+               current.tempSetting != job.tempSetting || current.readMode != job.readMode ||
+               current.filter != job.filter || current.exposureTime != exposure || sizeX != job.roiSizeX ||
+               sizeY != job.roiSizeY))
+  {
+    PhaseTimer timer(PHASE_DETAIL, "Bias summary");
+    Finish();
+  }
+  if (!open)
+  {
+    open = true;
+    current = BiasResult();
+    current.gainSetting = job.gainSetting;
+    current.offsetSetting = job.offsetSetting;
+    current.tempSetting = job.tempSetting;
+    current.readMode = job.readMode;
+    current.filter = job.filter;
+    current.exposureTime = exposure;
+    sizeX = job.roiSizeX;
+    sizeY = job.roiSizeY;
+  }
+
+  // Hot pixels and cosmic rays are left out above a ceiling taken from the frame's own statistics
+  FrameStats stats = job.hasStats ? job.stats : ComputeFrameStats(pixels, job.roiSizeX, job.roiSizeY, 65535, 3.0, numThreads);
+  int ceiling = (int)min(65535.0, ceil(stats.clippedMean + BIAS_CLIP_SIGMA * stats.clippedStddev));
+  {
+    PhaseTimer timer(PHASE_DETAIL, "Bias profile");
+    double start = MonotonicSeconds();
+    Frame frame;
+    frame.unixTime = job.unixTime;
+    frame.sensorTemp = job.sensorTemp;
+    Reduce(pixels, ceiling, &frame);
+    frames.push_back(move(frame));
+    reduceSeconds += MonotonicSeconds() - start;
+    reduced++;
+  }
+  guard.lock();
+
+  nextSequence++;
+  turn.notify_all();
+}
+
+/**
+  @fn void BiasTracker::Reduce(const unsigned short *pixels, int ceiling, Frame *frame)
+    @brief Computes the row and column levels, frame level and overscan level of a frame
+    @param pixels Frame of sizeX by sizeY pixels
+    @param ceiling Highest pixel value kept
+    @param frame Reduction
+*/
+void BiasTracker::Reduce(const unsigned short *pixels, int ceiling, Frame *frame)
+{
+  vector<uint64_t> rowSums(sizeY);
+  vector<uint32_t> rowCounts(sizeY);
+  vector<uint64_t> columnSums(sizeX, 0), columnCounts(sizeX, 0);
+  mutex merge;
+
+  // Each thread adds its rows' columns up in 32 bits of its own, then merges them once
+  atomic<unsigned int> nextRow(0);
+  auto reduceBands = [&]() {
+    vector<uint32_t> sums(sizeX, 0), counts(sizeX, 0);
+    while (true)
+    {
+      unsigned int first = nextRow.fetch_add(ROWS_PER_CLAIM);
+      if (first >= sizeY)
+      {
+        break;
+      }
+      unsigned int last = min(sizeY, first + ROWS_PER_CLAIM);
+      for (unsigned int y = first; y < last; y++)
+      {
+        kernel(pixels + (size_t)y * sizeX, sizeX, ceiling, sums.data(), counts.data(), &rowSums[y], &rowCounts[y]);
+      }
+    }
+    lock_guard<mutex> guard(merge);
+    for (unsigned int x = 0; x < sizeX; x++)
+    {
+      columnSums[x] += sums[x];
+      columnCounts[x] += counts[x];
+    }
+  };
+
+  vector<thread> workers;
+  for (int i = 1; i < numThreads; i++)
+  {
+    workers.push_back(thread(reduceBands));
+  }
+  reduceBands();
+  for (size_t i = 0; i < workers.size(); i++)
+  {
+    workers[i].join();
+  }
+
+  // The overscan pixels get a level of their own and are taken back out of the profiles
+  frame->overscan = NAN;
+  if (overscan.sizeX > 0 && overscan.sizeY > 0 && overscan.startX + overscan.sizeX <= sizeX &&
+      overscan.startY + overscan.sizeY <= sizeY)
+  {
+    vector<uint32_t> sums(overscan.sizeX, 0), counts(overscan.sizeX, 0);
+    uint64_t total = 0, kept = 0;
+    for (unsigned int y = overscan.startY; y < overscan.startY + overscan.sizeY; y++)
+    {
+      uint64_t sum;
+      uint32_t count;
+      kernel(pixels + (size_t)y * sizeX + overscan.startX, overscan.sizeX, ceiling, sums.data(), counts.data(), &sum,
+             &count);
+      rowSums[y] -= sum;
+      rowCounts[y] -= count;
+      total += sum;
+      kept += count;
+    }
+    for (unsigned int x = 0; x < overscan.sizeX; x++)
+    {
+      columnSums[overscan.startX + x] -= sums[x];
+      columnCounts[overscan.startX + x] -= counts[x];
+    }
+    if (kept > 0)
+    {
+      frame->overscan = (double)total / kept;
+    }
+  }
+
+  frame->rows.resize(sizeY);
+  for (unsigned int y = 0; y < sizeY; y++)
+  {
+    frame->rows[y] = rowCounts[y] > 0 ? (float)((double)rowSums[y] / rowCounts[y]) : NAN;
+  }
+  frame->columns.resize(sizeX);
+  for (unsigned int x = 0; x < sizeX; x++)
+  {
+    frame->columns[x] = columnCounts[x] > 0 ? (float)((double)columnSums[x] / columnCounts[x]) : NAN;
+  }
+  vector<float> rows(frame->rows);
+  frame->level = Median(rows);
+}
+
+/**
+  @fn void BiasTracker::Finish()
+    @brief Combines the frames of the open setting, appends its profiles to the profile file and records its summary
+*/
+void BiasTracker::Finish()
+{
+  if (!open)
+  {
+    return;
+  }
+  open = false;
+  size_t count = frames.size();
+
+  // Median across repeats of each row and column level
+  vector<float> rows(sizeY), columns(sizeX), values;
+  for (unsigned int y = 0; y < sizeY; y++)
+  {
+    values.clear();
+    for (size_t f = 0; f < count; f++)
+    {
+      values.push_back(frames[f].rows[y]);
+    }
+    rows[y] = (float)Median(values);
+  }
+  for (unsigned int x = 0; x < sizeX; x++)
+  {
+    values.clear();
+    for (size_t f = 0; f < count; f++)
+    {
+      values.push_back(frames[f].columns[x]);
+    }
+    columns[x] = (float)Median(values);
+  }
+
+  // Frame levels, overscan, and drift of the level over the frames
+  double sensorTemp = 0, overscanSum = 0, maxStep = 0;
+  int overscans = 0;
+  double sumT = 0, sumL = 0, sumTT = 0, sumTL = 0;
+  long firstTime = frames[0].unixTime, lastTime = frames[0].unixTime;
+  values.clear();
+  for (size_t f = 0; f < count; f++)
+  {
+    const Frame &frame = frames[f];
+    values.push_back((float)frame.level);
+    sensorTemp += frame.sensorTemp;
+    if (!std::isnan(frame.overscan))
+    {
+      overscanSum += frame.overscan;
+      overscans++;
+    }
+    if (f > 0)
+    {
+      maxStep = max(maxStep, fabs(frame.level - frames[f - 1].level));
+    }
+    double t = frame.unixTime - frames[0].unixTime;
+    sumT += t;
+    sumL += frame.level;
+    sumTT += t * t;
+    sumTL += t * frame.level;
+    firstTime = min(firstTime, frame.unixTime);
+    lastTime = max(lastTime, frame.unixTime);
+  }
+  double spread = count * sumTT - sumT * sumT;
+
+  current.frames = (int)count;
+  current.sensorTemp = sensorTemp / count;
+  current.level = Median(values);
+  current.overscan = overscans > 0 ? overscanSum / overscans : NAN;
+  current.rowPattern = PatternSigma(rows);
+  current.columnPattern = PatternSigma(columns);
+  current.drift = lastTime > firstTime && spread > 0 ? 60 * (count * sumTL - sumT * sumL) / spread : NAN;
+  current.maxStep = maxStep;
+  results.push_back(current);
+  frames.clear();
+
+  if (profileFile != NULL)
+  {
+    BiasProfileRecord record;
+    memset(&record, 0, sizeof(record));
+    record.gainSetting = current.gainSetting;
+    record.offsetSetting = current.offsetSetting;
+    record.readMode = current.readMode;
+    record.filter = current.filter;
+    record.frames = current.frames;
+    record.tempSetting = (float)current.tempSetting;
+    record.sensorTemp = (float)current.sensorTemp;
+    record.exposureTime = current.exposureTime;
+    record.level = (float)current.level;
+    record.overscan = (float)current.overscan;
+    record.rowPattern = (float)current.rowPattern;
+    record.columnPattern = (float)current.columnPattern;
+    record.drift = (float)current.drift;
+    record.maxStep = (float)current.maxStep;
+    record.sizeX = sizeX;
+    record.sizeY = sizeY;
+    if (fwrite(&record, sizeof(record), 1, profileFile) != 1 || fwrite(rows.data(), sizeof(float), sizeY, profileFile) != sizeY ||
+        fwrite(columns.data(), sizeof(float), sizeX, profileFile) != sizeX || fflush(profileFile) != 0)
+    {
+      printf("Could not write the bias profiles to %s.\n", profilePath.c_str());
+      fclose(profileFile);
+      profileFile = NULL;
+    }
+  }
+}
+
+void BiasTracker::Close()
+{
+  Finish();
+}
+
+void BiasTracker::PrintResults(const string &csvPath)
+{
+  lock_guard<mutex> guard(lock);
+  FILE *csv = NULL;
+  if (!csvPath.empty())
+  {
+    csv = fopen(csvPath.c_str(), "w");
+    if (csv == NULL)
+    {
+      printf("Could not create bias summary %s.\n", csvPath.c_str());
+    }
+    else
+    {
+      fprintf(csv, "gain,offset,temp,read_mode,filter,exposure_s,frames,sensor_temp,level_adu,overscan_adu,row_pattern_adu,"
+                   "column_pattern_adu,drift_adu_per_min,max_step_adu\n");
+    }
+  }
+
+  printf(" \n");
+  printf("Bias levels (%lu frames, %.1f ms each with the %s kernel):\n", reduced,
+         reduced > 0 ? reduceSeconds / reduced * 1000 : 0.0, kernelName);
+  printf("%5s %6s %7s %4s %6s %8s %6s %7s %8s %8s %7s %7s %9s %7s\n", "Gain", "Offset", "Temp", "Mode", "Filter",
+         "Exp (s)", "Frames", "Sensor", "Level", "Overscan", "Row", "Column", "Drift/min", "Step");
+  for (size_t i = 0; i < results.size(); i++)
+  {
+    const BiasResult &r = results[i];
+    printf("%5d %6d %7.2f %4d %6d %8.3f %6d %7.2f %8.2f", r.gainSetting, r.offsetSetting, r.tempSetting, r.readMode,
+           r.filter, r.exposureTime, r.frames, r.sensorTemp, r.level);
+    std::isnan(r.overscan) ? printf(" %8s", "-") : printf(" %8.2f", r.overscan);
+    printf(" %7.3f %7.3f", r.rowPattern, r.columnPattern);
+    std::isnan(r.drift) ? printf(" %9s", "-") : printf(" %9.3f", r.drift);
+    printf(" %7.3f\n", r.maxStep);
+
+    if (csv != NULL)
+    {
+      fprintf(csv, "%d,%d,%.2f,%d,%d,%.6f,%d,%.2f,%.3f,%.3f,%.4f,%.4f,%.4f,%.3f\n", r.gainSetting, r.offsetSetting,
+              r.tempSetting, r.readMode, r.filter, r.exposureTime, r.frames, r.sensorTemp, r.level, r.overscan, r.rowPattern,
+              r.columnPattern, r.drift, r.maxStep);
+    }
+  }
+  if (csv != NULL)
+  {
+    fclose(csv);
+    printf("Bias summary written to %s.\n", csvPath.c_str());
+  }
+  if (results.empty())
+  {
+    printf("No frames.\n");
+    return;
+  }
+  if (profileFile != NULL)
+  {
+    printf("Bias profiles written to %s.\n", profilePath.c_str());
+  }
+
+  // The tables use the shortest exposure, the closest to a pure bias frame
+  double shortest = results[0].exposureTime;
+  for (size_t i = 1; i < results.size(); i++)
+  {
+    shortest = min(shortest, results[i].exposureTime);
+  }
+  set<int> gains, offsets;
+  set<double> temps;
+  map<pair<int, int>, pair<double, int>> byOffset;    // (offset, gain) -> level sum, settings
+  map<pair<double, int>, pair<double, int>> byTemp;   // (temperature, offset) -> level sum, settings
+  map<double, pair<double, int>> overscanByTemp;      // temperature -> sum of level above overscan, settings
+  map<double, pair<double, int>> sensorByTemp;        // temperature -> sensor temperature sum, settings
+  for (size_t i = 0; i < results.size(); i++)
+  {
+    const BiasResult &r = results[i];
+    if (r.exposureTime != shortest || std::isnan(r.level))
+    {
+      continue;
+    }
+    gains.insert(r.gainSetting);
+    offsets.insert(r.offsetSetting);
+    temps.insert(r.tempSetting);
+    pair<double, int> &o = byOffset[make_pair(r.offsetSetting, r.gainSetting)];
+    o.first += r.level;
+    o.second++;
+    pair<double, int> &t = byTemp[make_pair(r.tempSetting, r.offsetSetting)];
+    t.first += r.level;
+    t.second++;
+    pair<double, int> &s = sensorByTemp[r.tempSetting];
+    s.first += r.sensorTemp;
+    s.second++;
+    if (!std::isnan(r.overscan))
+    {
+      pair<double, int> &v = overscanByTemp[r.tempSetting];
+      v.first += r.level - r.overscan;
+      v.second++;
+    }
+  }
+
+  // Level against offset for each gain, with the ADU per offset step from a straight line fit
+  printf(" \n");
+  printf("Bias level (ADU) against offset, %g s exposures, mean over temperatures:\n", shortest);
+  printf("%8s", "Offset");
+  for (set<int>::iterator g = gains.begin(); g != gains.end(); ++g)
+  {
+    printf("  Gain %-4d", *g);
+  }
+  printf("\n");
+  for (set<int>::iterator o = offsets.begin(); o != offsets.end(); ++o)
+  {
+    printf("%8d", *o);
+    for (set<int>::iterator g = gains.begin(); g != gains.end(); ++g)
+    {
+      map<pair<int, int>, pair<double, int>>::iterator cell = byOffset.find(make_pair(*o, *g));
+      cell == byOffset.end() ? printf(" %10s", "-") : printf(" %10.2f", cell->second.first / cell->second.second);
+    }
+    printf("\n");
+  }
+  printf("%8s", "ADU/step");
+  for (set<int>::iterator g = gains.begin(); g != gains.end(); ++g)
+  {
+    double n = 0, sumX = 0, sumY = 0, sumXX = 0, sumXY = 0;
+    for (set<int>::iterator o = offsets.begin(); o != offsets.end(); ++o)
+    {
+      map<pair<int, int>, pair<double, int>>::iterator cell = byOffset.find(make_pair(*o, *g));
+      if (cell != byOffset.end())
+      {
+        double level = cell->second.first / cell->second.second;
+        n++;
+        sumX += *o;
+        sumY += level;
+        sumXX += (double)*o * *o;
+        sumXY += *o * level;
+      }
+    }
+    double spread = n * sumXX - sumX * sumX;
+    spread > 0 ? printf(" %10.3f", (n * sumXY - sumX * sumY) / spread) : printf(" %10s", "-");
+  }
+  printf("\n");
+
+  // Level against temperature for each offset, with the measured sensor temperature and the level above the overscan
+  printf(" \n");
+  printf("Bias level (ADU) against temperature, %g s exposures, mean over gains:\n", shortest);
+  printf("%8s %7s", "Temp", "Sensor");
+  for (set<int>::iterator o = offsets.begin(); o != offsets.end(); ++o)
+  {
+    printf("  Off %-5d", *o);
+  }
+  printf(" %12s\n", "Above OS");
+  for (set<double>::iterator t = temps.begin(); t != temps.end(); ++t)
+  {
+    printf("%8.2f %7.2f", *t, sensorByTemp[*t].first / sensorByTemp[*t].second);
+    for (set<int>::iterator o = offsets.begin(); o != offsets.end(); ++o)
+    {
+      map<pair<double, int>, pair<double, int>>::iterator cell = byTemp.find(make_pair(*t, *o));
+      cell == byTemp.end() ? printf(" %10s", "-") : printf(" %10.2f", cell->second.first / cell->second.second);
+    }
+    map<double, pair<double, int>>::iterator v = overscanByTemp.find(*t);
+    v == overscanByTemp.end() ? printf(" %12s\n", "-") : printf(" %12.2f\n", v->second.first / v->second.second);
+  }
+}
@@ -0,0 +1,163 @@
+/**
+ * @file BiasProfile.h
+ *
+ * @brief Bias level, row and column profiles, and overscan level tracked during the sweep.
+ * Every frame is reduced as it is written, in parallel over row bands: one pass (SSE2 or AVX2 where available) adds
+ * up each row and each column, leaving out pixels more than BIAS_CLIP_SIGMA clipped standard deviations above the
+ * clipped mean (hot pixels and cosmic rays). This gives the clipped mean level of every row and column. The level of
+ * the frame is the median of its row levels, and the overscan level is the clipped mean of the camera's overscan area
+ * where it falls inside the ROI (its pixels are left out of the profiles). The frames of a setting are reduced to the
+ * median of their row and column profiles across repeats, the level drift over time and the largest step between
+ * consecutive frames. Each finished setting is appended to a profile file (see BiasProfileRecord), and only its
+ * summary is kept in memory. At the end of the sweep the levels are tabulated against offset and temperature.
+ *
+ */
+
+#ifndef BIASPROFILE_H
+#define BIASPROFILE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <vector>
+
+struct FrameJob;
+
+static const double BIAS_CLIP_SIGMA = 5.0;       // Clipped standard deviations above which a pixel is left out
+static const char BIAS_PROFILE_MAGIC[8] = "QHYBIAS"; // First 8 bytes of a profile file
+
+/**
+  @struct BiasRegion
+    @brief Rectangle of a frame, in frame pixels
+*/
+struct BiasRegion
+{
+  unsigned int startX;
+  unsigned int startY;
+  unsigned int sizeX;
+  unsigned int sizeY;
+};
+
+/**
+  @struct BiasProfileRecord
+    @brief Header of one setting in the profile file. It is followed by sizeY float row levels, then sizeX float
+           column levels (NAN where every pixel was left out). All values are little-endian.
+*/
+struct BiasProfileRecord
+{
+  int32_t gainSetting;      // Gain setting
+  int32_t offsetSetting;    // Offset setting
+  int32_t readMode;         // Read mode
+  int32_t filter;           // Filter wheel position
+  int32_t frames;           // Frames combined
+  int32_t reserved;         // Zero (keeps exposureTime 8-byte aligned)
+  float tempSetting;        // Temperature setting (C)
+  float sensorTemp;         // Mean sensor temperature of the frames (C)
+  double exposureTime;      // Exposure time (s)
+  float level;              // Median frame level (ADU)
+  float overscan;           // Mean overscan level (ADU, NAN without overscan)
+  float rowPattern;         // Standard deviation of the row profile (ADU)
+  float columnPattern;      // Standard deviation of the column profile (ADU)
+  float drift;              // Level drift over time (ADU per minute, NAN when the frames span under a second)
+  float maxStep;            // Largest level change between consecutive frames (ADU)
+  uint32_t sizeX;           // Frame size, the length of the column profile
+  uint32_t sizeY;           // Length of the row profile
+};
+
+/**
+  @struct BiasResult
+    @brief Bias summary of one setting
+*/
+struct BiasResult
+{
+  int gainSetting;       // Gain setting
+  int offsetSetting;     // Offset setting
+  double tempSetting;    // Temperature setting
+  int readMode;          // Read mode
+  int filter;            // Filter wheel position
+  double exposureTime;   // Exposure time (s)
+  int frames;            // Frames combined
+  double sensorTemp;     // Mean sensor temperature
+  double level;          // Median frame level (ADU)
+  double overscan;       // Mean overscan level (ADU, NAN without overscan)
+  double rowPattern;     // Standard deviation of the row profile (ADU)
+  double columnPattern;  // Standard deviation of the column profile (ADU)
+  double drift;          // Level drift (ADU per minute, NAN if unknown)
+  double maxStep;        // Largest level change between consecutive frames (ADU)
+};
+
+/**
+  @class BiasTracker
+    @brief Reduces every frame to its bias profiles and summarizes them per setting
+*/
+class BiasTracker
+{
+public:
+  /**
+    @fn BiasTracker(const BiasRegion &overscan, int numThreads, const std::string &profilePath)
+      @param overscan Overscan area of the frames (sizeX or sizeY 0 for none)
+      @param numThreads Threads sharing the row bands of each frame
+      @param profilePath Profile file of the settings (empty for none)
+  */
+  BiasTracker(const BiasRegion &overscan, int numThreads, const std::string &profilePath);
+  ~BiasTracker();
+
+  /**
+    @fn void Add(const FrameJob &job)
+      @brief Adds a frame. Frames are taken in submission order (job.sequence), so writer threads may call this
+             concurrently. Must be called before the pixels are converted for writing.
+      @param job Frame to add (its statistics are computed here if the writer did not)
+  */
+  void Add(const FrameJob &job);
+
+  /**
+    @fn void Close()
+      @brief Summarizes the setting still open
+  */
+  void Close();
+
+  /**
+    @fn void PrintResults(const std::string &csvPath)
+      @brief Prints the summary of every setting and the offset and temperature tables, and writes the summary file
+      @param csvPath Summary file (empty for none)
+  */
+  void PrintResults(const std::string &csvPath);
+
+private:
+  /**
+    @struct Frame
+      @brief Reduction of one frame
+  */
+  struct Frame
+  {
+    long unixTime;              // When it was read out
+    double sensorTemp;          // Sensor temperature
+    double level;               // Median row level
+    double overscan;            // Overscan level (NAN for none)
+    std::vector<float> rows;    // Clipped mean of every row
+    std::vector<float> columns; // Clipped mean of every column
+  };
+
+  void Reduce(const unsigned short *pixels, int ceiling, Frame *frame);
+  void Finish();
+
+  BiasRegion overscan;        // Overscan area of the frames
+  int numThreads;
+  std::string profilePath;
+  FILE *profileFile;          // Profiles of the finished settings (NULL for none)
+  bool open;                  // A setting is being collected
+  BiasResult current;         // Setting being collected
+  unsigned int sizeX;         // Its frame size
+  unsigned int sizeY;
+  std::vector<Frame> frames;  // Its frames
+  std::vector<BiasResult> results; // Finished settings
+  double reduceSeconds;       // Time spent reducing frames
+  unsigned long reduced;      // Frames reduced
+  unsigned long nextSequence; // Sequence number of the next frame to add
+  std::mutex lock;
+  std::condition_variable turn; // Signalled when nextSequence advances
+};
+
+#endif
@@ -0,0 +1,92 @@
+/**
+ * @file BroadcastMonitor.cpp
+ *
+ * @brief Example consumer of the shared-memory frame ring.
+ * Follows the latest frame published by SingleFrameMode --broadcast and prints, for each frame it sees, its settings,
+ * the mean of a sparse sample of its pixels (read in place), the frames skipped since the previous one, and the time
+ * from readout to publication and to this reader. Attaches again when the capture is restarted.
+ *
+ */
+
+// Dependencies
+#include "BroadcastReader.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include <string>
+#include <thread>
+
+using namespace std;
+
+static const size_t SAMPLE_STEP = 97; // Pixels between the ones sampled for the mean
+
+int main(int argc, char *argv[])
+{
+  if (argc < 2)
+  {
+    printf("Usage: %s NAME [FRAMES]\n", argv[0]);
+    printf("Prints the frames broadcast by SingleFrameMode --broadcast NAME, until FRAMES frames were seen.\n");
+    return 1;
+  }
+  string name = argv[1];
+  long limit = argc > 2 ? atol(argv[2]) : 0;
+
+  BroadcastReader reader;
+  string error;
+  uint64_t last = 0;
+  long seen = 0, skipped = 0, torn = 0;
+  double totalLatency = 0;
+  while (limit == 0 || seen < limit)
+  {
+    if (reader.Closed())
+    {
+      if (!reader.Attach(name, &error))
+      {
+        this_thread::sleep_for(chrono::milliseconds(500));
+        continue;
+      }
+      last = 0;
+      printf("Attached to %s.\n", name.c_str());
+    }
+
+    BroadcastView view;
+    if (!reader.Wait(last, 1.0) || !reader.Peek(last, &view))
+    {
+      continue;
+    }
+
+    // Read the frame in place, then make sure it was not overwritten meanwhile
+    double sum = 0;
+    size_t samples = 0;
+    const uint16_t *pixels = reinterpret_cast<const uint16_t *>(view.pixels);
+    for (size_t i = 0; i < view.info.payloadBytes / 2; i += SAMPLE_STEP)
+    {
+      sum += pixels[i];
+      samples++;
+    }
+    double now = BroadcastClock();
+    if (!reader.Valid(view))
+    {
+      torn++;
+      continue;
+    }
+
+    if (last != 0 && view.info.frame > last + 1)
+    {
+      skipped += view.info.frame - last - 1;
+    }
+    last = view.info.frame;
+    seen++;
+    totalLatency += now - view.info.readoutTime;
+    printf("Frame %llu: %ux%u, exp %.3fs, gain %d, offset %d, temp %.2fC, mean %.1f, published %.2f ms and read "
+           "%.2f ms after readout.\n",
+           (unsigned long long)view.info.frame, view.info.sizeX, view.info.sizeY, view.info.exposureUs / 1e6,
+           view.info.gain, view.info.offset, view.info.sensorTemp, samples > 0 ? sum / samples : 0.0,
+           (view.info.publishTime - view.info.readoutTime) * 1000, (now - view.info.readoutTime) * 1000);
+    fflush(stdout);
+  }
+
+  printf("%ld frames seen, %ld skipped, %ld overwritten while read, %.2f ms mean readout to reader.\n", seen, skipped,
+         torn, seen > 0 ? totalLatency / seen * 1000 : 0.0);
+  return 0;
+}
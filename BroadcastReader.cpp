@@ -0,0 +1,165 @@
+/**
+ * @file BroadcastReader.cpp
+ *
+ * @brief Reader library for the shared-memory frame ring written by SingleFrameMode --broadcast.
+ *
+ */
+
+// Dependencies
+#include "BroadcastReader.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <chrono>
+#include <thread>
+
+using namespace std;
+
+static const int PEEK_ATTEMPTS = 4; // Tries at the latest frame while the publisher keeps overwriting it
+
+double BroadcastClock()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+BroadcastReader::BroadcastReader() : map(NULL), mapBytes(0), ring(NULL)
+{
+}
+
+BroadcastReader::~BroadcastReader()
+{
+  Detach();
+}
+
+bool BroadcastReader::Attach(const string &name, string *error)
+{
+  Detach();
+  string shmName = BroadcastName(name);
+  int fd = shm_open(shmName.c_str(), O_RDONLY, 0);
+  if (fd < 0)
+  {
+    *error = shmName + ": " + strerror(errno);
+    return false;
+  }
+  struct stat info;
+  void *mapped = MAP_FAILED;
+  if (fstat(fd, &info) == 0 && (size_t)info.st_size >= BROADCAST_PAGE)
+  {
+    mapped = mmap(0, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  }
+  close(fd);
+  if (mapped == MAP_FAILED)
+  {
+    *error = "Could not map " + shmName;
+    return false;
+  }
+
+  const BroadcastRing *mappedRing = static_cast<const BroadcastRing *>(mapped);
+  bool ready = memcmp(mappedRing->magic, BROADCAST_MAGIC, sizeof(BROADCAST_MAGIC)) == 0;
+  atomic_thread_fence(memory_order_acquire);
+  if (!ready || BROADCAST_PAGE + mappedRing->slotCount * mappedRing->slotStride > (size_t)info.st_size)
+  {
+    *error = shmName + " is not a frame ring, or is still being set up";
+    munmap(mapped, info.st_size);
+    return false;
+  }
+  map = static_cast<const unsigned char *>(mapped);
+  mapBytes = info.st_size;
+  ring = mappedRing;
+  return true;
+}
+
+void BroadcastReader::Detach()
+{
+  if (map != NULL)
+  {
+    munmap(const_cast<unsigned char *>(map), mapBytes);
+  }
+  map = NULL;
+  mapBytes = 0;
+  ring = NULL;
+}
+
+bool BroadcastReader::Closed() const
+{
+  return ring == NULL || ring->closed.load(memory_order_acquire) != 0;
+}
+
+uint64_t BroadcastReader::Latest() const
+{
+  return ring == NULL ? 0 : ring->published.load(memory_order_acquire);
+}
+
+bool BroadcastReader::Wait(uint64_t after, double timeout) const
+{
+  double deadline = BroadcastClock() + timeout;
+  while (Latest() <= after)
+  {
+    if (Closed() || BroadcastClock() > deadline)
+    {
+      return false;
+    }
+    this_thread::sleep_for(chrono::milliseconds(1));
+  }
+  return true;
+}
+
+bool BroadcastReader::Peek(uint64_t after, BroadcastView *view) const
+{
+  for (int attempt = 0; attempt < PEEK_ATTEMPTS; attempt++)
+  {
+    uint64_t frame = Latest();
+    if (frame <= after)
+    {
+      return false;
+    }
+    const unsigned char *slotStart = map + BROADCAST_PAGE + (frame - 1) % ring->slotCount * ring->slotStride;
+    const BroadcastSlot *slot = reinterpret_cast<const BroadcastSlot *>(slotStart);
+    uint64_t sequence = slot->sequence.load(memory_order_acquire);
+    if (sequence != 2 * frame)
+    {
+      continue; // Already being reused for a newer frame
+    }
+    memcpy(&view->info, &slot->info, sizeof(view->info));
+    view->pixels = slotStart + BROADCAST_PAGE;
+    view->sequence = sequence;
+    view->slot = slot;
+    if (Valid(*view))
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool BroadcastReader::Valid(const BroadcastView &view) const
+{
+  atomic_thread_fence(memory_order_acquire);
+  return static_cast<const BroadcastSlot *>(view.slot)->sequence.load(memory_order_relaxed) == view.sequence;
+}
+
+bool BroadcastReader::Copy(uint64_t after, BroadcastFrameInfo *info, vector<unsigned char> *pixels) const
+{
+  BroadcastView view;
+  for (int attempt = 0; attempt < PEEK_ATTEMPTS; attempt++)
+  {
+    if (!Peek(after, &view))
+    {
+      return false;
+    }
+    pixels->resize(view.info.payloadBytes);
+    memcpy(pixels->data(), view.pixels, view.info.payloadBytes);
+    if (Valid(view))
+    {
+      *info = view.info;
+      return true;
+    }
+  }
+  return false;
+}
@@ -0,0 +1,117 @@
+/**
+ * @file BroadcastReader.h
+ *
+ * @brief Reader library for the shared-memory frame ring written by SingleFrameMode --broadcast.
+ * A reader maps the ring read-only and never takes a lock or writes to it, so any number of readers can attach
+ * without slowing the capture. Peek gives the latest frame in place (no copy); once done with the pixels, Valid
+ * tells whether the publisher overwrote the slot meanwhile, in which case what was read must be dropped. Copy does
+ * both for a reader that wants its own copy. A reader that is slower than the camera simply sees every latest frame
+ * and skips the ones in between, which shows as a gap in the frame numbers. Link BroadcastReader.o (and -lrt on
+ * older C libraries).
+ *
+ */
+
+#ifndef BROADCASTREADER_H
+#define BROADCASTREADER_H
+
+#include "FrameBroadcast.h"
+#include <string>
+#include <vector>
+
+/**
+  @struct BroadcastView
+    @brief A frame read in place from the ring
+*/
+struct BroadcastView
+{
+  BroadcastFrameInfo info;     // Settings of the frame
+  const unsigned char *pixels; // Pixels in the ring, valid until the slot is reused
+  uint64_t sequence;           // Slot sequence the frame was read at
+  const void *slot;            // Slot holding the frame
+};
+
+/**
+  @class BroadcastReader
+    @brief Attaches to a frame ring and reads its latest frames without locking
+*/
+class BroadcastReader
+{
+public:
+  BroadcastReader();
+  ~BroadcastReader();
+
+  /**
+    @fn bool Attach(const std::string &name, std::string *error)
+      @brief Maps a ring, detaching from the previous one
+      @param name Shared-memory object name given to --broadcast
+      @param error Reason for a failure
+    @return False if there is no ring of that name yet
+  */
+  bool Attach(const std::string &name, std::string *error);
+
+  /**
+    @fn void Detach()
+      @brief Unmaps the ring
+  */
+  void Detach();
+
+  /**
+    @fn bool Closed() const
+    @return True if not attached, or if the publisher has exited (attach again to follow its next run)
+  */
+  bool Closed() const;
+
+  /**
+    @fn uint64_t Latest() const
+    @return Number of the latest frame published (0 for none)
+  */
+  uint64_t Latest() const;
+
+  /**
+    @fn bool Wait(uint64_t after, double timeout) const
+      @brief Waits for a frame newer than a given one, polling every millisecond
+      @param after Frame number already seen
+      @param timeout Longest wait in seconds
+    @return True if a newer frame is there
+  */
+  bool Wait(uint64_t after, double timeout) const;
+
+  /**
+    @fn bool Peek(uint64_t after, BroadcastView *view) const
+      @brief Gives the latest frame in place, if it is newer than a given one
+      @param after Frame number already seen
+      @param view Latest frame
+    @return False if there is no newer complete frame
+  */
+  bool Peek(uint64_t after, BroadcastView *view) const;
+
+  /**
+    @fn bool Valid(const BroadcastView &view) const
+      @brief Call after reading a view's pixels
+    @return True if the frame was not overwritten while it was read
+  */
+  bool Valid(const BroadcastView &view) const;
+
+  /**
+    @fn bool Copy(uint64_t after, BroadcastFrameInfo *info, std::vector<unsigned char> *pixels) const
+      @brief Copies the latest frame out of the ring, if it is newer than a given one
+      @param after Frame number already seen
+      @param info Settings of the frame
+      @param pixels Pixels of the frame
+    @return False if there is no newer complete frame
+  */
+  bool Copy(uint64_t after, BroadcastFrameInfo *info, std::vector<unsigned char> *pixels) const;
+
+private:
+  const unsigned char *map; // Mapping of the ring (NULL if not attached)
+  size_t mapBytes;          // Size of the mapping
+  const BroadcastRing *ring;
+};
+
+/**
+  @fn double BroadcastClock()
+  @return CLOCK_MONOTONIC seconds, the clock of BroadcastFrameInfo::readoutTime and publishTime
+*/
+double BroadcastClock();
+
+#endif
@@ -0,0 +1,197 @@
+/**
+ * @file CameraState.cpp
+ *
+ * @brief Cache of the settings applied to a camera.
+ *
+ */
+
+// Dependencies
+#include "CameraState.h"
+#include "Timing.h"
+#include <stdio.h>
+
+using namespace std;
+
+CameraState::CameraState(qhyccd_handle *pCamHandle)
+    : pCamHandle(pCamHandle), readMode(-1), streamMode(-1), initialized(false), roiSet(false), bits(0)
+{
+  bin[0] = bin[1] = 0;
+}
+
+/**
+  @fn void CameraState::Count(const string &call, bool issued)
+    @brief Counts an SDK call issued or skipped
+    @param call SDK function (and control)
+    @param issued True if the camera was called
+*/
+void CameraState::Count(const string &call, bool issued)
+{
+  CallCount &count = calls[call];
+  if (issued)
+  {
+    count.issued++;
+  }
+  else
+  {
+    count.skipped++;
+  }
+}
+
+unsigned int CameraState::SetParam(CONTROL_ID control, double value, const char *name, bool *issued)
+{
+  map<int, double>::iterator applied = params.find(control);
+  bool needed = applied == params.end() || applied->second != value;
+  Count(name, needed);
+  if (issued != NULL)
+  {
+    *issued = needed;
+  }
+  if (!needed)
+  {
+    return QHYCCD_SUCCESS;
+  }
+
+  double setStart = MonotonicSeconds();
+  unsigned int retVal = SetQHYCCDParam(pCamHandle, control, value);
+  TimingSpan(PHASE_DETAIL, name, setStart, MonotonicSeconds());
+  if (retVal == QHYCCD_SUCCESS)
+  {
+    params[control] = value;
+  }
+  else
+  {
+    params.erase(control); // The camera may be in either state
+  }
+  return retVal;
+}
+
+unsigned int CameraState::SetReadMode(int readMode)
+{
+  bool needed = this->readMode != readMode;
+  Count("SetQHYCCDReadMode", needed);
+  if (!needed)
+  {
+    return QHYCCD_SUCCESS;
+  }
+
+  unsigned int retVal = SetQHYCCDReadMode(pCamHandle, readMode);
+  this->readMode = retVal == QHYCCD_SUCCESS ? readMode : -1;
+  initialized = false;
+  return retVal;
+}
+
+unsigned int CameraState::SetStreamMode(int streamMode)
+{
+  bool needed = this->streamMode != streamMode;
+  Count("SetQHYCCDStreamMode", needed);
+  if (!needed)
+  {
+    return QHYCCD_SUCCESS;
+  }
+
+  unsigned int retVal = SetQHYCCDStreamMode(pCamHandle, streamMode);
+  this->streamMode = retVal == QHYCCD_SUCCESS ? streamMode : -1;
+  initialized = false;
+  return retVal;
+}
+
+unsigned int CameraState::Initialize(bool *issued)
+{
+  Count("InitQHYCCD", !initialized);
+  if (issued != NULL)
+  {
+    *issued = !initialized;
+  }
+  if (initialized)
+  {
+    return QHYCCD_SUCCESS;
+  }
+
+  double initStart = MonotonicSeconds();
+  unsigned int retVal = InitQHYCCD(pCamHandle);
+  TimingSpan(PHASE_DETAIL, "InitQHYCCD", initStart, MonotonicSeconds());
+
+  // Initialization resets the controls and the geometry
+  params.clear();
+  roiSet = false;
+  bin[0] = bin[1] = 0;
+  bits = 0;
+  initialized = retVal == QHYCCD_SUCCESS;
+  return retVal;
+}
+
+unsigned int CameraState::SetResolution(unsigned int x, unsigned int y, unsigned int sizeX, unsigned int sizeY)
+{
+  bool needed = !roiSet || roi[0] != x || roi[1] != y || roi[2] != sizeX || roi[3] != sizeY;
+  Count("SetQHYCCDResolution", needed);
+  if (!needed)
+  {
+    return QHYCCD_SUCCESS;
+  }
+
+  unsigned int retVal = SetQHYCCDResolution(pCamHandle, x, y, sizeX, sizeY);
+  roiSet = retVal == QHYCCD_SUCCESS;
+  roi[0] = x;
+  roi[1] = y;
+  roi[2] = sizeX;
+  roi[3] = sizeY;
+  return retVal;
+}
+
+unsigned int CameraState::SetBinMode(int binX, int binY)
+{
+  bool needed = bin[0] != binX || bin[1] != binY;
+  Count("SetQHYCCDBinMode", needed);
+  if (!needed)
+  {
+    return QHYCCD_SUCCESS;
+  }
+
+  unsigned int retVal = SetQHYCCDBinMode(pCamHandle, binX, binY);
+  bin[0] = retVal == QHYCCD_SUCCESS ? binX : 0;
+  bin[1] = retVal == QHYCCD_SUCCESS ? binY : 0;
+  return retVal;
+}
+
+unsigned int CameraState::SetBitsMode(int bits)
+{
+  bool needed = this->bits != bits;
+  Count("SetQHYCCDBitsMode", needed);
+  if (!needed)
+  {
+    return QHYCCD_SUCCESS;
+  }
+
+  unsigned int retVal = SetQHYCCDBitsMode(pCamHandle, bits);
+  this->bits = retVal == QHYCCD_SUCCESS ? bits : 0;
+  return retVal;
+}
+
+unsigned long CameraState::CallsIssued() const
+{
+  unsigned long issued = 0;
+  for (map<string, CallCount>::const_iterator it = calls.begin(); it != calls.end(); ++it)
+  {
+    issued += it->second.issued;
+  }
+  return issued;
+}
+
+unsigned long CameraState::CallsSkipped() const
+{
+  unsigned long skipped = 0;
+  for (map<string, CallCount>::const_iterator it = calls.begin(); it != calls.end(); ++it)
+  {
+    skipped += it->second.skipped;
+  }
+  return skipped;
+}
+
+void CameraState::PrintStats()
+{
+  printf("SDK setting calls: %lu issued, %lu skipped (camera already set).\n", CallsIssued(), CallsSkipped());
+  for (map<string, CallCount>::const_iterator it = calls.begin(); it != calls.end(); ++it)
+  {
+    printf("  %-30s %6lu issued %6lu skipped\n", it->first.c_str(), it->second.issued, it->second.skipped);
+  }
+}
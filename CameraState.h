@@ -0,0 +1,132 @@
+/**
+ * @file CameraState.h
+ *
+ * @brief Cache of the settings applied to a camera.
+ * Every setter goes through the SDK only if the value differs from the one last applied successfully, so repeated
+ * settings cost no USB round trip. InitQHYCCD is only issued when the read mode or stream mode changed since the last
+ * initialization, and it forgets every other setting, as the SDK resets them. Calls issued and skipped are counted
+ * per SDK function for the end-of-sweep report.
+ *
+ */
+
+#ifndef CAMERASTATE_H
+#define CAMERASTATE_H
+
+#include <map>
+#include <string>
+#include "qhyccd.h"
+
+/**
+  @class CameraState
+    @brief Applies settings to one camera, skipping writes of values it already has. Used by the camera's capture
+           thread only.
+*/
+class CameraState
+{
+public:
+  /**
+    @fn CameraState(qhyccd_handle *pCamHandle)
+      @param pCamHandle Open camera, not yet initialized
+  */
+  explicit CameraState(qhyccd_handle *pCamHandle);
+
+  /**
+    @fn unsigned int SetParam(CONTROL_ID control, double value, const char *name, bool *issued)
+      @brief Sets a control with SetQHYCCDParam unless it already has the value
+      @param control Control
+      @param value Value to apply
+      @param name Call name for the trace and the call counts, e.g. "SetQHYCCDParam GAIN" (a string literal)
+      @param issued Set to whether the SDK was called (may be NULL)
+    @return SDK return value (QHYCCD_SUCCESS when skipped)
+  */
+  unsigned int SetParam(CONTROL_ID control, double value, const char *name, bool *issued);
+
+  /**
+    @fn unsigned int SetReadMode(int readMode)
+      @brief Sets the read mode; takes effect at the next Initialize
+      @param readMode Read mode
+    @return SDK return value (QHYCCD_SUCCESS when skipped)
+  */
+  unsigned int SetReadMode(int readMode);
+
+  /**
+    @fn unsigned int SetStreamMode(int streamMode)
+      @brief Selects single frame (0) or live (1) mode; takes effect at the next Initialize
+      @param streamMode Stream mode
+    @return SDK return value (QHYCCD_SUCCESS when skipped)
+  */
+  unsigned int SetStreamMode(int streamMode);
+
+  /**
+    @fn unsigned int Initialize(bool *issued)
+      @brief Initializes the camera with InitQHYCCD if the read or stream mode changed since it last was
+      @param issued Set to whether the SDK was called (may be NULL)
+    @return SDK return value (QHYCCD_SUCCESS when skipped)
+  */
+  unsigned int Initialize(bool *issued);
+
+  /**
+    @fn unsigned int SetResolution(unsigned int x, unsigned int y, unsigned int sizeX, unsigned int sizeY)
+      @brief Sets the region of interest
+    @return SDK return value (QHYCCD_SUCCESS when skipped)
+  */
+  unsigned int SetResolution(unsigned int x, unsigned int y, unsigned int sizeX, unsigned int sizeY);
+
+  /**
+    @fn unsigned int SetBinMode(int binX, int binY)
+      @brief Sets the binning
+    @return SDK return value (QHYCCD_SUCCESS when skipped)
+  */
+  unsigned int SetBinMode(int binX, int binY);
+
+  /**
+    @fn unsigned int SetBitsMode(int bits)
+      @brief Sets the bit depth
+    @return SDK return value (QHYCCD_SUCCESS when skipped)
+  */
+  unsigned int SetBitsMode(int bits);
+
+  /**
+    @fn void PrintStats()
+      @brief Prints the SDK calls issued and skipped, per function
+  */
+  void PrintStats();
+
+  /**
+    @fn unsigned long CallsIssued() const
+    @return SDK calls issued so far
+  */
+  unsigned long CallsIssued() const;
+
+  /**
+    @fn unsigned long CallsSkipped() const
+    @return SDK calls skipped so far because the camera already had the value
+  */
+  unsigned long CallsSkipped() const;
+
+private:
+  /**
+    @struct CallCount
+      @brief Calls of one SDK function
+  */
+  struct CallCount
+  {
+    unsigned long issued;  // Sent to the camera
+    unsigned long skipped; // Not needed
+  };
+
+  void Count(const std::string &call, bool issued);
+
+  qhyccd_handle *pCamHandle;
+  std::map<int, double> params;           // Last value applied to each control
+  int readMode;                           // Read mode set (-1 if unknown)
+  int streamMode;                         // Stream mode set (-1 if unknown)
+  bool initialized;                       // InitQHYCCD done since the read and stream mode were last changed
+  unsigned int roi[4];                    // Region of interest set
+  bool roiSet;                            // roi is valid
+  int bin[2];                             // Binning set (0 if unknown)
+  int bits;                               // Bit depth set (0 if unknown)
+  std::map<std::string, CallCount> calls; // Calls per SDK function (and control)
+};
+
+#endif
@@ -0,0 +1,139 @@
+/**
+ * @file CatalogQuery.cpp
+ *
+ * @brief Looks up frames in the catalog of an output directory.
+ * Prints the frames taken at a setting or over a time range, with the byte offset of their pixels and, if asked,
+ * their statistics, from frames.catalog alone without opening any FITS file.
+ *
+ */
+
+// Dependencies
+#include "FrameCatalog.h"
+#include "Timing.h"
+#include <getopt.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+/**
+  @fn void PrintUsage(const char *programName)
+    @brief Prints the command line options
+    @param programName Name the program was run as
+*/
+void PrintUsage(const char *programName)
+{
+  printf("Usage: %s [options] [DIRECTORY]\n", programName);
+  printf("Lists the frames in DIRECTORY/frames.catalog (default: the current directory) matching every option given.\n");
+  printf("      --temp C             Temperature setting (degrees C)\n");
+  printf("      --gain N             Gain setting\n");
+  printf("      --offset N           Offset setting\n");
+  printf("      --exposure S         Exposure time (seconds)\n");
+  printf("      --read-mode N        Camera readmode\n");
+  printf("      --filter N           Filter wheel position\n");
+  printf("      --since T            Frames read out at or after UNIX time T\n");
+  printf("      --until T            Frames read out at or before UNIX time T\n");
+  printf("      --stats              Also print the statistics of each frame\n");
+  printf("      --count              Only print the number of frames found\n");
+  printf("  -h, --help               Print this help\n");
+}
+
+int main(int argc, char *argv[])
+{
+  CatalogQuery query;
+  int printStats = 0;
+  int countOnly = 0;
+
+  struct option longOptions[] = {
+      {"temp", required_argument, 0, 't'},
+      {"gain", required_argument, 0, 'g'},
+      {"offset", required_argument, 0, 'o'},
+      {"exposure", required_argument, 0, 'e'},
+      {"read-mode", required_argument, 0, 'r'},
+      {"filter", required_argument, 0, 'f'},
+      {"since", required_argument, 0, 's'},
+      {"until", required_argument, 0, 'u'},
+      {"stats", no_argument, &printStats, 1},
+      {"count", no_argument, &countOnly, 1},
+      {"help", no_argument, 0, 'h'},
+      {0, 0, 0, 0}};
+
+  int opt;
+  while ((opt = getopt_long(argc, argv, "h", longOptions, 0)) != -1)
+  {
+    switch (opt)
+    {
+    case 0:
+      break;
+    case 't':
+      query.hasTemp = true;
+      query.tempCenti = (int32_t)lround(atof(optarg) * 100);
+      break;
+    case 'g':
+      query.hasGain = true;
+      query.gain = atoi(optarg);
+      break;
+    case 'o':
+      query.hasOffset = true;
+      query.offset = atoi(optarg);
+      break;
+    case 'e':
+      query.hasExposure = true;
+      query.exposureUs = llround(atof(optarg) * 1000000);
+      break;
+    case 'r':
+      query.hasReadMode = true;
+      query.readMode = atoi(optarg);
+      break;
+    case 'f':
+      query.hasFilter = true;
+      query.filter = atoi(optarg);
+      break;
+    case 's':
+      query.since = atoll(optarg);
+      break;
+    case 'u':
+      query.until = atoll(optarg);
+      break;
+    case 'h':
+      PrintUsage(argv[0]);
+      return 0;
+    default:
+      PrintUsage(argv[0]);
+      return 1;
+    }
+  }
+  string directory = optind < argc ? argv[optind] : ".";
+
+  double start = MonotonicSeconds();
+  vector<CatalogRecord> matches;
+  string error;
+  if (!QueryCatalog(directory, query, &matches, &error))
+  {
+    printf("%s\n", error.c_str());
+    return 1;
+  }
+  double seconds = MonotonicSeconds() - start;
+
+  if (!countOnly)
+  {
+    for (size_t i = 0; i < matches.size(); i++)
+    {
+      const CatalogRecord &record = matches[i];
+      printf("%s @%llu temp %.2fC exp %.6fs gain %d offset %d readmode %d filter %d time %lld", record.path,
+             (unsigned long long)record.dataOffset, record.tempCenti / 100.0, record.exposureUs / 1e6, record.gain,
+             record.offset, record.readMode, record.filter, (long long)record.unixTime);
+      if (printStats && (record.flags & CATALOG_HAS_STATS))
+      {
+        printf(" mean %.2f median %.1f stddev %.2f min %d max %d saturated %lld", record.mean, record.median,
+               record.stddev, record.min, record.max, (long long)record.saturated);
+      }
+      printf("\n");
+    }
+  }
+  printf("%zu frames found in %.2f ms.\n", matches.size(), seconds * 1000);
+  return 0;
+}
@@ -0,0 +1,470 @@
+/**
+ * @file DefectMap.cpp
+ *
+ * @brief Hot and dead pixel maps built during the sweep.
+ *
+ */
+
+// Dependencies
+#include "DefectMap.h"
+#include "FrameWriter.h"
+#include "Timing.h"
+#include <stdio.h>
+#include <string.h>
+#include <fitsio.h>
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <thread>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+using namespace std;
+
+static const int ROWS_PER_CLAIM = 64;     // Rows a thread claims at a time
+static const double DEAD_FRACTION = 0.5;  // Fraction of the clipped mean below which a pixel counts as dead
+static const int DEFECT_HOT = 1;          // Mask bit of a hot pixel
+static const int DEFECT_DEAD = 2;         // Mask bit of a dead pixel
+
+/**
+  @fn static void CompareScalar(const unsigned short *pixels, size_t count, int above, int below, uint64_t *aboveBits, uint64_t *belowBits)
+    @brief Sets one bit per pixel for the pixels above one level and for those below another, 64 pixels to a word
+    @param pixels Pixels to compare
+    @param count Number of pixels
+    @param above Level pixels must exceed (65535 for none)
+    @param below Level pixels must be under (0 for none)
+    @param aboveBits Bits of the pixels above, one word per 64 pixels
+    @param belowBits Bits of the pixels below
+*/
+static void CompareScalar(const unsigned short *pixels, size_t count, int above, int below, uint64_t *aboveBits,
+                          uint64_t *belowBits)
+{
+  for (size_t w = 0; w * 64 < count; w++)
+  {
+    size_t n = min((size_t)64, count - w * 64);
+    uint64_t aboveWord = 0, belowWord = 0;
+    for (size_t i = 0; i < n; i++)
+    {
+      int value = pixels[w * 64 + i];
+      aboveWord |= (uint64_t)(value > above) << i;
+      belowWord |= (uint64_t)(value < below) << i;
+    }
+    aboveBits[w] = aboveWord;
+    belowBits[w] = belowWord;
+  }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/**
+  @fn static void CompareSSE2(const unsigned short *pixels, size_t count, int above, int below, uint64_t *aboveBits, uint64_t *belowBits)
+    @brief SSE2 compare kernel, 16 pixels per mask step
+    @param pixels Pixels to compare
+    @param count Number of pixels
+    @param above Level pixels must exceed
+    @param below Level pixels must be under
+    @param aboveBits Bits of the pixels above
+    @param belowBits Bits of the pixels below
+*/
+__attribute__((target("sse2"))) static void CompareSSE2(const unsigned short *pixels, size_t count, int above,
+                                                        int below, uint64_t *aboveBits, uint64_t *belowBits)
+{
+  // Unsigned compares as signed ones, with the sign bit flipped
+  const __m128i flip = _mm_set1_epi16((short)0x8000);
+  const __m128i aboveLevel = _mm_set1_epi16((short)(above ^ 0x8000));
+  const __m128i belowLevel = _mm_set1_epi16((short)(below ^ 0x8000));
+  size_t words = count / 64;
+  for (size_t w = 0; w < words; w++)
+  {
+    uint64_t aboveWord = 0, belowWord = 0;
+    for (int step = 0; step < 4; step++)
+    {
+      const unsigned short *p = pixels + w * 64 + step * 16;
+      __m128i first = _mm_xor_si128(_mm_loadu_si128((const __m128i *)p), flip);
+      __m128i second = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(p + 8)), flip);
+      __m128i high = _mm_packs_epi16(_mm_cmpgt_epi16(first, aboveLevel), _mm_cmpgt_epi16(second, aboveLevel));
+      __m128i low = _mm_packs_epi16(_mm_cmpgt_epi16(belowLevel, first), _mm_cmpgt_epi16(belowLevel, second));
+      aboveWord |= (uint64_t)(uint16_t)_mm_movemask_epi8(high) << (step * 16);
+      belowWord |= (uint64_t)(uint16_t)_mm_movemask_epi8(low) << (step * 16);
+    }
+    aboveBits[w] = aboveWord;
+    belowBits[w] = belowWord;
+  }
+  if (words * 64 < count)
+  {
+    CompareScalar(pixels + words * 64, count - words * 64, above, below, aboveBits + words, belowBits + words);
+  }
+}
+
+/**
+  @fn static void CompareAVX2(const unsigned short *pixels, size_t count, int above, int below, uint64_t *aboveBits, uint64_t *belowBits)
+    @brief AVX2 compare kernel, 32 pixels per mask step
+    @param pixels Pixels to compare
+    @param count Number of pixels
+    @param above Level pixels must exceed
+    @param below Level pixels must be under
+    @param aboveBits Bits of the pixels above
+    @param belowBits Bits of the pixels below
+*/
+__attribute__((target("avx2"))) static void CompareAVX2(const unsigned short *pixels, size_t count, int above,
+                                                        int below, uint64_t *aboveBits, uint64_t *belowBits)
+{
+  const __m256i flip = _mm256_set1_epi16((short)0x8000);
+  const __m256i aboveLevel = _mm256_set1_epi16((short)(above ^ 0x8000));
+  const __m256i belowLevel = _mm256_set1_epi16((short)(below ^ 0x8000));
+  size_t words = count / 64;
+  for (size_t w = 0; w < words; w++)
+  {
+    uint64_t aboveWord = 0, belowWord = 0;
+    for (int step = 0; step < 2; step++)
+    {
+      const unsigned short *p = pixels + w * 64 + step * 32;
+      __m256i first = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)p), flip);
+      __m256i second = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(p + 16)), flip);
+      // Packing interleaves the 128-bit lanes; the permute puts the pixels back in order
+      __m256i high = _mm256_packs_epi16(_mm256_cmpgt_epi16(first, aboveLevel), _mm256_cmpgt_epi16(second, aboveLevel));
+      __m256i low = _mm256_packs_epi16(_mm256_cmpgt_epi16(belowLevel, first), _mm256_cmpgt_epi16(belowLevel, second));
+      high = _mm256_permute4x64_epi64(high, 0xD8);
+      low = _mm256_permute4x64_epi64(low, 0xD8);
+      aboveWord |= (uint64_t)(uint32_t)_mm256_movemask_epi8(high) << (step * 32);
+      belowWord |= (uint64_t)(uint32_t)_mm256_movemask_epi8(low) << (step * 32);
+    }
+    aboveBits[w] = aboveWord;
+    belowBits[w] = belowWord;
+  }
+  if (words * 64 < count)
+  {
+    CompareScalar(pixels + words * 64, count - words * 64, above, below, aboveBits + words, belowBits + words);
+  }
+}
+#endif
+
+typedef void (*CompareKernel)(const unsigned short *, size_t, int, int, uint64_t *, uint64_t *);
+
+/**
+  @fn static CompareKernel SelectKernel()
+    @brief Picks the fastest compare kernel the CPU supports
+  @return Kernel
+*/
+static CompareKernel SelectKernel()
+{
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+  {
+    return CompareAVX2;
+  }
+  if (__builtin_cpu_supports("sse2"))
+  {
+    return CompareSSE2;
+  }
+#endif
+  return CompareScalar;
+}
+
+static const CompareKernel kernel = SelectKernel();
+
+/**
+  @fn static void AddBits(uint64_t *planes, int planeCount, size_t planeWords, size_t index, uint64_t bits)
+    @brief Adds one to the counters of the pixels whose bits are set, with a ripple carry through the bit-planes.
+           The caller adds planes before the frames counted could overflow them.
+    @param planes Consecutive bit-planes, least significant first
+    @param planeCount Number of planes
+    @param planeWords Words per plane
+    @param index Word to update
+    @param bits Pixels to count
+*/
+static void AddBits(uint64_t *planes, int planeCount, size_t planeWords, size_t index, uint64_t bits)
+{
+  uint64_t carry = bits;
+  for (int p = 0; p < planeCount && carry; p++)
+  {
+    uint64_t &word = planes[p * planeWords + index];
+    uint64_t next = word & carry;
+    word ^= carry;
+    carry = next;
+  }
+}
+
+/**
+  @fn static void FitCounter(vector<uint64_t> &planes, size_t planeWords, int frames)
+    @brief Adds a zeroed most significant bit-plane when the counters could no longer hold a count of frames
+    @param planes Counter bit-planes
+    @param planeWords Words per plane
+    @param frames Frames the counters must be able to count
+*/
+static void FitCounter(vector<uint64_t> &planes, size_t planeWords, int frames)
+{
+  while (frames > (1 << (planes.size() / planeWords)) - 1)
+  {
+    planes.resize(planes.size() + planeWords, 0);
+  }
+}
+
+/**
+  @fn static long Flag(const vector<uint64_t> &planes, size_t planeWords, int frames, int bit, vector<unsigned char> &mask, size_t wordsPerRow, unsigned int sizeX)
+    @brief Marks the pixels counted in at least half the frames
+    @param planes Counter bit-planes
+    @param planeWords Words per plane
+    @param frames Frames counted
+    @param bit Mask bit to set
+    @param mask Defect mask, one byte per pixel
+    @param wordsPerRow Words per row in the planes
+    @param sizeX Pixels per row
+  @return Pixels marked
+*/
+static long Flag(const vector<uint64_t> &planes, size_t planeWords, int frames, int bit, vector<unsigned char> &mask,
+                 size_t wordsPerRow, unsigned int sizeX)
+{
+  if (frames == 0)
+  {
+    return 0;
+  }
+  int need = max(1, (frames + 1) / 2);
+  int planeCount = (int)(planes.size() / planeWords);
+  long flagged = 0;
+  for (size_t w = 0; w < planeWords; w++)
+  {
+    uint64_t any = 0;
+    for (int p = 0; p < planeCount; p++)
+    {
+      any |= planes[p * planeWords + w];
+    }
+    if (!any)
+    {
+      continue;
+    }
+    size_t y = w / wordsPerRow;
+    size_t x0 = (w % wordsPerRow) * 64;
+    for (int i = 0; i < 64 && x0 + i < sizeX; i++)
+    {
+      int count = 0;
+      for (int p = 0; p < planeCount; p++)
+      {
+        count |= (int)((planes[p * planeWords + w] >> i) & 1) << p;
+      }
+      if (count >= need)
+      {
+        mask[y * sizeX + x0 + i] |= bit;
+        flagged++;
+      }
+    }
+  }
+  return flagged;
+}
+
+DefectTracker::DefectTracker(double hotSigma, double minExposure, double minSignal, int numThreads,
+                             const string &outputPrefix)
+    : hotSigma(hotSigma), minExposure(minExposure), minSignal(minSignal), numThreads(numThreads > 0 ? numThreads : 1),
+      outputPrefix(outputPrefix), sizeX(0), sizeY(0), wordsPerRow(0), nextSequence(0)
+{
+}
+
+void DefectTracker::Add(const FrameJob &job)
+{
+  unique_lock<mutex> guard(lock);
+  turn.wait(guard, [&] { return job.sequence == nextSequence; });
+
+  // Only the thread holding the turn touches the maps, so the other writers can wait without the lock
+  guard.unlock();
+  const unsigned short *pixels = reinterpret_cast<const unsigned short *>(job.pImgData);
+
+  // The maps of a temperature are complete once the sweep leaves it
+  if (!open.empty() && (open[0]->tempSetting != job.tempSetting || sizeX != job.roiSizeX || sizeY != job.roiSizeY))
+  {
+    PhaseTimer timer(PHASE_DETAIL, "Defect mask");
+    for (size_t i = 0; i < open.size(); i++)
+    {
+      Finish(open[i].get());
+    }
+    open.clear();
+  }
+
+  // Thresholds from the frame's own statistics
+  FrameStats stats = job.hasStats ? job.stats : ComputeFrameStats(pixels, job.roiSizeX, job.roiSizeY, 65535, 3.0, numThreads);
+  bool hot = job.exposureTime >= minExposure * 1000000;
+  bool dead = stats.clippedMean >= minSignal;
+  if (hot || dead)
+  {
+    PhaseTimer timer(PHASE_DETAIL, "Defect count");
+    Map *map = NULL;
+    for (size_t i = 0; i < open.size(); i++)
+    {
+      if (open[i]->gainSetting == job.gainSetting && open[i]->readMode == job.readMode)
+      {
+        map = open[i].get();
+      }
+    }
+    if (map == NULL)
+    {
+      sizeX = job.roiSizeX;
+      sizeY = job.roiSizeY;
+      wordsPerRow = (sizeX + 63) / 64;
+      map = new Map();
+      map->gainSetting = job.gainSetting;
+      map->tempSetting = job.tempSetting;
+      map->readMode = job.readMode;
+      map->hotFrames = 0;
+      map->deadFrames = 0;
+      map->hot.assign(DEFECT_INITIAL_BITS * wordsPerRow * sizeY, 0);
+      map->dead.assign(DEFECT_INITIAL_BITS * wordsPerRow * sizeY, 0);
+      open.push_back(unique_ptr<Map>(map));
+    }
+
+    int hotLevel = hot ? (int)min(65535.0, ceil(stats.clippedMean + hotSigma * stats.clippedStddev)) : 65535;
+    int deadLevel = dead ? (int)(DEAD_FRACTION * stats.clippedMean) : 0;
+    map->hotFrames += hot;
+    map->deadFrames += dead;
+    size_t planeWords = wordsPerRow * sizeY;
+    FitCounter(map->hot, planeWords, map->hotFrames);
+    FitCounter(map->dead, planeWords, map->deadFrames);
+    Count(map, pixels, hotLevel, deadLevel);
+  }
+  guard.lock();
+
+  nextSequence++;
+  turn.notify_all();
+}
+
+/**
+  @fn void DefectTracker::Count(Map *map, const unsigned short *pixels, int hotLevel, int deadLevel)
+    @brief Adds a frame's hot and dead pixels to the counters, in parallel over row bands
+    @param map Counters of the frame's setting
+    @param pixels Frame pixels
+    @param hotLevel Level above which a pixel counts as hot (65535 for none)
+    @param deadLevel Level below which a pixel counts as dead (0 for none)
+*/
+void DefectTracker::Count(Map *map, const unsigned short *pixels, int hotLevel, int deadLevel)
+{
+  size_t planeWords = wordsPerRow * sizeY;
+  int hotPlanes = (int)(map->hot.size() / planeWords);
+  int deadPlanes = (int)(map->dead.size() / planeWords);
+  atomic<unsigned int> nextRow(0);
+  auto countBands = [&]() {
+    vector<uint64_t> aboveBits(wordsPerRow), belowBits(wordsPerRow);
+    while (true)
+    {
+      unsigned int first = nextRow.fetch_add(ROWS_PER_CLAIM);
+      if (first >= sizeY)
+      {
+        return;
+      }
+      unsigned int last = min(sizeY, first + ROWS_PER_CLAIM);
+      for (unsigned int y = first; y < last; y++)
+      {
+        kernel(pixels + (size_t)y * sizeX, sizeX, hotLevel, deadLevel, aboveBits.data(), belowBits.data());
+        for (size_t w = 0; w < wordsPerRow; w++)
+        {
+          if (aboveBits[w])
+          {
+            AddBits(map->hot.data(), hotPlanes, planeWords, y * wordsPerRow + w, aboveBits[w]);
+          }
+          if (belowBits[w])
+          {
+            AddBits(map->dead.data(), deadPlanes, planeWords, y * wordsPerRow + w, belowBits[w]);
+          }
+        }
+      }
+    }
+  };
+
+  vector<thread> workers;
+  for (int i = 1; i < numThreads; i++)
+  {
+    workers.push_back(thread(countBands));
+  }
+  countBands();
+  for (size_t i = 0; i < workers.size(); i++)
+  {
+    workers[i].join();
+  }
+}
+
+/**
+  @fn void DefectTracker::Finish(Map *map)
+    @brief Writes the defect mask of a setting (bit 1 hot, bit 2 dead) and records its result
+    @param map Counters of the setting
+*/
+void DefectTracker::Finish(Map *map)
+{
+  size_t planeWords = wordsPerRow * sizeY;
+  vector<unsigned char> mask((size_t)sizeX * sizeY, 0);
+  DefectResult result;
+  result.gainSetting = map->gainSetting;
+  result.tempSetting = map->tempSetting;
+  result.readMode = map->readMode;
+  result.hotFrames = map->hotFrames;
+  result.deadFrames = map->deadFrames;
+  result.hotPixels = Flag(map->hot, planeWords, map->hotFrames, DEFECT_HOT, mask, wordsPerRow, sizeX);
+  result.deadPixels = Flag(map->dead, planeWords, map->deadFrames, DEFECT_DEAD, mask, wordsPerRow, sizeX);
+  result.file = outputPrefix + "_defects_gain_" + to_string(map->gainSetting) + "_temp_" +
+                to_string((int)map->tempSetting) + ".fits";
+  const char *fitsfilename = result.file.c_str();
+
+  fitsfile *fptr;
+  int status = 0;
+  long naxes[2] = {(long)sizeX, (long)sizeY};
+
+  // Remove if exists already
+  remove(fitsfilename);
+
+  fits_create_file(&fptr, fitsfilename, &status);
+  fits_create_img(fptr, BYTE_IMG, 2, naxes, &status);
+  double tempSetting = map->tempSetting;
+  int gainSetting = map->gainSetting;
+  int readMode = map->readMode;
+  double sigma = hotSigma;
+  fits_update_key(fptr, TDOUBLE, "INTTEMP", &tempSetting, "Camera Temperature", &status);
+  fits_update_key(fptr, TINT, "GAIN", &gainSetting, "Gain Setting", &status);
+  fits_update_key(fptr, TINT, "QHREADMOE", &readMode, "ReadMode Setting", &status);
+  fits_update_key(fptr, TINT, "HOTFRAME", &result.hotFrames, "Long exposures compared for hot pixels", &status);
+  fits_update_key(fptr, TINT, "DEADFRAM", &result.deadFrames, "High signal frames compared for dead pixels", &status);
+  fits_update_key(fptr, TDOUBLE, "HOTSIGMA", &sigma, "Hot pixel threshold above clipped mean (sigma)", &status);
+  fits_update_key(fptr, TLONG, "NHOT", &result.hotPixels, "Hot pixels (mask bit 1)", &status);
+  fits_update_key(fptr, TLONG, "NDEAD", &result.deadPixels, "Dead pixels (mask bit 2)", &status);
+  fits_write_img(fptr, TBYTE, 1, (LONGLONG)mask.size(), mask.data(), &status);
+
+  // Close File (always, so a failed write does not leak the handle)
+  int closeStatus = 0;
+  fits_close_file(fptr, &closeStatus);
+  if (status == 0)
+  {
+    status = closeStatus;
+  }
+
+  if (status != 0)
+  {
+    char errText[FLEN_STATUS];
+    fits_get_errstatus(status, errText);
+    printf("Could not write %s. CFITSIO error: %d (%s).\n", fitsfilename, status, errText);
+    result.file.clear();
+  }
+
+  lock_guard<mutex> guard(lock);
+  results.push_back(result);
+}
+
+void DefectTracker::Close()
+{
+  for (size_t i = 0; i < open.size(); i++)
+  {
+    Finish(open[i].get());
+  }
+  open.clear();
+}
+
+void DefectTracker::PrintResults()
+{
+  lock_guard<mutex> guard(lock);
+  printf(" \n");
+  printf("Defect maps:\n");
+  printf("%6s %8s %5s %11s %12s %10s %11s  %s\n", "Gain", "Temp (C)", "Mode", "Hot frames", "Dead frames", "Hot pixels",
+         "Dead pixels", "Mask");
+  for (size_t i = 0; i < results.size(); i++)
+  {
+    const DefectResult &result = results[i];
+    printf("%6d %8.1f %5d %11d %12d %10ld %11ld  %s\n", result.gainSetting, result.tempSetting, result.readMode,
+           result.hotFrames, result.deadFrames, result.hotPixels, result.deadPixels,
+           result.file.empty() ? "(not written)" : result.file.c_str());
+  }
+}
@@ -0,0 +1,118 @@
+/**
+ * @file DefectMap.h
+ *
+ * @brief Hot and dead pixel maps built during the sweep.
+ * Every frame is compared against two thresholds taken from its own statistics: pixels above the clipped mean plus
+ * a number of standard deviations in long exposures (hot), and pixels below half the clipped mean in frames with a
+ * high signal (dead or stuck low). Each comparison yields one bit per pixel, 64 pixels to a word (SSE2 or AVX2
+ * compares where available), which is added to a counter stored as bit-planes, in parallel over row bands. A plane
+ * is added whenever the frames compared could overflow a counter, so each counter takes ceil(log2(frames + 1)) bits
+ * per pixel (at least DEFECT_INITIAL_BITS) and a pixel is flagged when counted in at least half the frames. Maps
+ * are kept per gain, temperature and read mode. Every gain and read mode seen at the current temperature keeps its
+ * map until the sweep moves on to the next temperature, when they are written as defect masks, so memory is the sum
+ * of the two counters' bits over those maps, per pixel.
+ *
+ */
+
+#ifndef DEFECTMAP_H
+#define DEFECTMAP_H
+
+#include <stdint.h>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+struct FrameJob;
+
+static const int DEFECT_INITIAL_BITS = 3; // Bit-planes each counter starts with (more are added as frames are counted)
+
+/**
+  @struct DefectResult
+    @brief Defects found at one gain, temperature and read mode
+*/
+struct DefectResult
+{
+  int gainSetting;     // Gain setting
+  double tempSetting;  // Temperature setting
+  int readMode;        // Read mode
+  int hotFrames;       // Long exposures compared for hot pixels
+  int deadFrames;      // High signal frames compared for dead pixels
+  long hotPixels;      // Pixels flagged hot
+  long deadPixels;     // Pixels flagged dead
+  std::string file;    // Defect mask written
+};
+
+/**
+  @class DefectTracker
+    @brief Counts, per pixel, the frames in which it looked hot or dead
+*/
+class DefectTracker
+{
+public:
+  /**
+    @fn DefectTracker(double hotSigma, double minExposure, double minSignal, int numThreads, const std::string &outputPrefix)
+      @param hotSigma Standard deviations above the clipped mean at which a pixel counts as hot
+      @param minExposure Shortest exposure compared for hot pixels (seconds)
+      @param minSignal Lowest clipped mean of a frame compared for dead pixels (ADU)
+      @param numThreads Threads sharing the row bands of each frame
+      @param outputPrefix Directory and name prefix of the defect masks
+  */
+  DefectTracker(double hotSigma, double minExposure, double minSignal, int numThreads, const std::string &outputPrefix);
+
+  /**
+    @fn void Add(const FrameJob &job)
+      @brief Adds a frame. Frames are taken in submission order (job.sequence), so writer threads may call this
+             concurrently. Must be called before the pixels are converted for writing.
+      @param job Frame to add (its statistics are computed here if the writer did not)
+  */
+  void Add(const FrameJob &job);
+
+  /**
+    @fn void Close()
+      @brief Writes the masks still open
+  */
+  void Close();
+
+  /**
+    @fn void PrintResults()
+      @brief Prints the defects found at every gain, temperature and read mode
+  */
+  void PrintResults();
+
+private:
+  /**
+    @struct Map
+      @brief Counters of one gain, temperature and read mode
+  */
+  struct Map
+  {
+    int gainSetting;
+    double tempSetting;
+    int readMode;
+    int hotFrames;
+    int deadFrames;
+    std::vector<uint64_t> hot;  // Bit-planes of wordsPerRow * sizeY words, least significant first
+    std::vector<uint64_t> dead; // Same layout
+  };
+
+  void Count(Map *map, const unsigned short *pixels, int hotLevel, int deadLevel);
+  void Finish(Map *map);
+
+  double hotSigma;
+  double minExposure;
+  double minSignal;
+  int numThreads;
+  std::string outputPrefix;
+  unsigned int sizeX;                // Frame size of the open maps
+  unsigned int sizeY;
+  size_t wordsPerRow;                // 64-pixel words per row (rows start on a word)
+  std::vector<std::unique_ptr<Map>> open; // Maps of the current temperature
+  std::vector<DefectResult> results; // Maps written
+  unsigned long nextSequence;        // Sequence number of the next frame to add
+  std::mutex lock;
+  std::condition_variable turn; // Signalled when nextSequence advances
+};
+
+#endif
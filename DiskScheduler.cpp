@@ -0,0 +1,85 @@
+/**
+ * @file DiskScheduler.cpp
+ *
+ * @brief Fair sharing of the output disk between cameras.
+ *
+ */
+
+// Dependencies
+#include "DiskScheduler.h"
+#include "Timing.h"
+
+using namespace std;
+
+DiskScheduler::DiskScheduler(int slots) : slots(slots > 0 ? slots : 1), active(0)
+{
+}
+
+int DiskScheduler::AddClient(const string &name)
+{
+  lock_guard<mutex> guard(lock);
+  Client client = {name, 0.0, 0.0, 0};
+  for (size_t i = 0; i < clients.size(); i++)
+  {
+    if (i == 0 || clients[i].servedBytes < client.servedBytes)
+    {
+      client.servedBytes = clients[i].servedBytes;
+    }
+  }
+  clients.push_back(client);
+  return clients.size() - 1;
+}
+
+/**
+  @fn bool DiskScheduler::IsNext(int client) const
+    @brief Whether the client is the waiting client with the fewest bytes served (lock held)
+    @param client Client number
+  @return True if the next free slot belongs to the client
+*/
+bool DiskScheduler::IsNext(int client) const
+{
+  for (size_t i = 0; i < clients.size(); i++)
+  {
+    if ((int)i != client && clients[i].waiting > 0 &&
+        (clients[i].servedBytes < clients[client].servedBytes ||
+         (clients[i].servedBytes == clients[client].servedBytes && (int)i < client)))
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+void DiskScheduler::Acquire(int client, double bytes)
+{
+  double start = MonotonicSeconds();
+  unique_lock<mutex> guard(lock);
+  clients[client].waiting++;
+  freed.wait(guard, [&] { return active < slots && IsNext(client); });
+  clients[client].waiting--;
+  clients[client].servedBytes += bytes;
+  active++;
+
+  double end = MonotonicSeconds();
+  clients[client].waitSeconds += end - start;
+  guard.unlock();
+
+  // Others may be next now that this client has been served
+  freed.notify_all();
+  TimingSpan(PHASE_DETAIL, "Disk slot wait", start, end);
+}
+
+void DiskScheduler::Release()
+{
+  {
+    lock_guard<mutex> guard(lock);
+    active--;
+  }
+  freed.notify_all();
+}
+
+double DiskScheduler::WaitSeconds(int client)
+{
+  lock_guard<mutex> guard(lock);
+  return clients[client].waitSeconds;
+}
@@ -0,0 +1,82 @@
+/**
+ * @file DiskScheduler.h
+ *
+ * @brief Fair sharing of the output disk between cameras.
+ * When several cameras are swept at once, their writer threads take a write slot before each frame goes to disk.
+ * A limited number of slots keeps the disk from thrashing. When a slot frees up, it goes to the waiting camera that
+ * has been granted the fewest bytes so far, so a camera with fast frames cannot starve one with slow frames.
+ *
+ */
+
+#ifndef DISKSCHEDULER_H
+#define DISKSCHEDULER_H
+
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/**
+  @class DiskScheduler
+    @brief Grants a limited number of concurrent disk writes to cameras in least-served-bytes order
+*/
+class DiskScheduler
+{
+public:
+  /**
+    @fn DiskScheduler(int slots)
+      @param slots Frames that may be written at the same time, over all cameras
+  */
+  explicit DiskScheduler(int slots);
+
+  /**
+    @fn int AddClient(const std::string &name)
+      @brief Registers a camera. It starts level with the least served camera so far.
+      @param name Camera name, for reports
+    @return Client number to pass to Acquire
+  */
+  int AddClient(const std::string &name);
+
+  /**
+    @fn void Acquire(int client, double bytes)
+      @brief Blocks until the client is granted a write slot
+      @param client Client number
+      @param bytes Size of the frame about to be written
+  */
+  void Acquire(int client, double bytes);
+
+  /**
+    @fn void Release()
+      @brief Returns a write slot
+  */
+  void Release();
+
+  /**
+    @fn double WaitSeconds(int client)
+    @return Time the client's writers spent waiting for a slot
+  */
+  double WaitSeconds(int client);
+
+private:
+  /**
+    @struct Client
+      @brief Accounting of one camera
+  */
+  struct Client
+  {
+    std::string name;   // Camera name
+    double servedBytes; // Bytes granted so far
+    double waitSeconds; // Time spent waiting for a slot
+    int waiting;        // Writers currently waiting
+  };
+
+  bool IsNext(int client) const;
+
+  int slots;                   // Concurrent writes allowed
+  int active;                  // Writes in progress
+  std::vector<Client> clients;
+  std::mutex lock;
+  std::condition_variable freed; // Signalled when a slot is released
+};
+
+#endif
@@ -0,0 +1,281 @@
+/**
+ * @file FilterWheel.cpp
+ *
+ * @brief Asynchronous filter wheel control.
+ *
+ */
+
+// Dependencies
+#include "FilterWheel.h"
+#include "SweepPlan.h"
+#include "Timing.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <chrono>
+
+using namespace std;
+
+static const double FALLBACK_MOVE_SECONDS = 11.0; // Move time assumed before any move has been measured
+static const int FALLBACK_SLOTS = 7;              // Slots assumed when the camera does not report them
+static const int MAX_SLOTS = 16;                  // Largest slot count taken as reported
+static const double MIN_POLL_SECONDS = 0.02;      // First poll interval once the move is due
+static const double MAX_POLL_SECONDS = 0.5;       // Poll interval cap
+static const double PROGRESS_SECONDS = 5.0;       // How often WaitInPosition reports progress
+
+FilterWheel::FilterWheel(qhyccd_handle *pCamHandle, double timeoutSeconds)
+    : pCamHandle(pCamHandle), timeoutSeconds(timeoutSeconds), plugged(false), slots(0), position(-1), target(-1), moveSlots(0),
+      moveStart(0), moveFailed(false), moves(0), timedMoves(0), skippedMoves(0), polls(0), totalSeconds(0), maxSeconds(0), secondsPerSlot(0),
+      stopping(false)
+{
+  plugged = IsQHYCCDCFWPlugged(pCamHandle) == QHYCCD_SUCCESS; // Check if filter wheel is plugged in
+  if (!plugged)
+  {
+    printf("No filter wheel detected. \n"); // Print that it is not detected
+    return;
+  }
+
+  // Moves are measured the short way round, so the wheel's size matters
+  double reported = GetQHYCCDParam(pCamHandle, CONTROL_CFWSLOTSNUM);
+  slots = reported >= 1 && reported <= MAX_SLOTS ? (int)reported : FALLBACK_SLOTS;
+
+  char status[64] = {0};
+  unsigned int retVal = GetQHYCCDCFWStatus(pCamHandle, status); // Get current position
+  if (retVal == QHYCCD_SUCCESS)
+  {
+    printf("Filter wheel is plugged in and is at position: %s. \n", status); // Print current position
+    if (status[0] >= '0' && status[0] <= '9')
+    {
+      position = status[0] - '0';
+    }
+  }
+  else
+  {
+    printf("Could not get filter wheel status. Error: %d.\n", retVal); // Print error
+  }
+
+  tracker = thread(&FilterWheel::Run, this);
+}
+
+FilterWheel::~FilterWheel()
+{
+  Stop();
+}
+
+bool FilterWheel::Plugged() const
+{
+  return plugged;
+}
+
+int FilterWheel::Slots() const
+{
+  return slots;
+}
+
+int FilterWheel::Position()
+{
+  lock_guard<mutex> guard(lock);
+  return target < 0 ? position : -1;
+}
+
+void FilterWheel::MoveTo(int fwPos)
+{
+  if (!plugged)
+  {
+    return;
+  }
+
+  lock_guard<mutex> guard(lock);
+
+  // Nothing to do if the wheel is already there or on its way
+  if ((target < 0 && position == fwPos) || target == fwPos)
+  {
+    skippedMoves++;
+    return;
+  }
+
+  char fwPosition = '0' + fwPos;
+  unsigned int retVal = SendOrder2QHYCCDCFW(pCamHandle, &fwPosition, 1); // Send order to filter wheel to move to new position
+  if (retVal != QHYCCD_SUCCESS)
+  {
+    printf("Could not move filter wheel. Error: %d.\n", retVal); // Print error
+    position = -1;
+    target = -1;
+    moveFailed = true;
+    arrived.notify_all();
+    return;
+  }
+  printf("Filter wheel is moving to position: %c. \n", fwPosition); // Print that the filter wheel is moving
+
+  int from = target >= 0 ? target : position;
+  moveSlots = from < 0 ? 0 : FilterDistance(from, fwPos, slots);
+  moveStart = MonotonicSeconds();
+  moveFailed = false;
+  position = -1;
+  target = fwPos;
+  wake.notify_all();
+}
+
+bool FilterWheel::WaitInPosition()
+{
+  unique_lock<mutex> guard(lock);
+  while (target >= 0 && !stopping)
+  {
+    if (!arrived.wait_for(guard, chrono::duration<double>(PROGRESS_SECONDS), [this] { return target < 0 || stopping; }))
+    {
+      printf("Filter wheel is still moving (%.0f s).\n", MonotonicSeconds() - moveStart);
+    }
+  }
+  return !moveFailed;
+}
+
+void FilterWheel::PrintStats()
+{
+  if (!plugged)
+  {
+    return;
+  }
+
+  lock_guard<mutex> guard(lock);
+  printf("Filter wheel moves: %d, %d of them timed (mean %.2f s, max %.2f s, %.2f s per slot), %d skipped (already in "
+         "position), %ld status polls.\n",
+         moves, timedMoves, timedMoves > 0 ? totalSeconds / timedMoves : 0.0, maxSeconds, secondsPerSlot, skippedMoves,
+         polls);
+}
+
+void FilterWheel::Stop()
+{
+  {
+    lock_guard<mutex> guard(lock);
+    stopping = true;
+  }
+  wake.notify_all();
+  arrived.notify_all();
+  if (tracker.joinable())
+  {
+    tracker.join();
+  }
+}
+
+/**
+  @fn double FilterWheel::ExpectedSeconds(int slots)
+    @brief Expected duration of a move, from the latencies measured so far
+    @param slots Slots to travel (0 if unknown)
+    @return Expected move time (seconds)
+*/
+double FilterWheel::ExpectedSeconds(int slots)
+{
+  if (secondsPerSlot > 0 && slots > 0)
+  {
+    return slots * secondsPerSlot;
+  }
+  return FALLBACK_MOVE_SECONDS;
+}
+
+/**
+  @fn void FilterWheel::Run()
+    @brief Tracking thread body: waits for a move to be ordered and polls the wheel until it is in position
+*/
+void FilterWheel::Run()
+{
+  TimingThreadName("filter wheel");
+  unique_lock<mutex> guard(lock);
+  while (!stopping)
+  {
+    if (target < 0)
+    {
+      wake.wait(guard);
+      continue;
+    }
+
+    int goal = target;
+    double start = moveStart;
+    double expected = ExpectedSeconds(moveSlots);
+    bool learned = secondsPerSlot > 0 && moveSlots > 0;
+    bool seenMoving = false;
+    double interval = MIN_POLL_SECONDS;
+
+    // Sleep through most of a move whose duration has been learned, then poll with a growing interval
+    if (learned)
+    {
+      wake.wait_for(guard, chrono::duration<double>(expected * 0.8),
+                    [&] { return stopping || target != goal || moveStart != start; });
+    }
+
+    while (!stopping && target == goal && moveStart == start)
+    {
+      guard.unlock();
+      char status[64] = {0};
+      unsigned int retVal = GetQHYCCDCFWStatus(pCamHandle, status);
+      double now = MonotonicSeconds();
+      guard.lock();
+      polls++;
+
+      if (stopping || target != goal || moveStart != start)
+      {
+        break; // A new move was ordered meanwhile
+      }
+
+      double elapsed = now - start;
+      bool failed = false;
+      if (retVal != QHYCCD_SUCCESS)
+      {
+        printf("Could not get filter wheel status. Error: %d.\n", retVal); // Print error
+        failed = true;
+      }
+      else if (status[0] == '0' + goal)
+      {
+        // Some wheels report the target slot straight after the order; trust it once the wheel was seen moving
+        // or the expected move time has passed. Only a move seen in progress is timed: otherwise the elapsed time
+        // is just the expected time (or the first poll), and learning it would feed the guess back in.
+        if (seenMoving || elapsed >= expected)
+        {
+          position = goal;
+          target = -1;
+          moves++;
+          if (seenMoving)
+          {
+            timedMoves++;
+            totalSeconds += elapsed;
+            maxSeconds = max(maxSeconds, elapsed);
+            if (moveSlots > 0)
+            {
+              double perSlot = elapsed / moveSlots;
+              secondsPerSlot = secondsPerSlot > 0 ? 0.5 * (secondsPerSlot + perSlot) : perSlot;
+            }
+            printf("Filter wheel reached position: %d in %.2f s (%d slots). \n", goal, elapsed, moveSlots);
+          }
+          else
+          {
+            printf("Filter wheel is at position: %d (not seen moving, so the move is not timed). \n", goal);
+          }
+          TimingSpan(PHASE_DETAIL, "Filter wheel move", start, now);
+          arrived.notify_all();
+          break;
+        }
+      }
+      else
+      {
+        seenMoving = true;
+      }
+
+      if (!failed && elapsed > timeoutSeconds)
+      {
+        printf("Filter wheel did not reach position %d within %.0f s.\n", goal, timeoutSeconds);
+        failed = true;
+      }
+      if (failed)
+      {
+        position = -1;
+        target = -1;
+        moveFailed = true;
+        arrived.notify_all();
+        break;
+      }
+
+      wake.wait_for(guard, chrono::duration<double>(interval),
+                    [&] { return stopping || target != goal || moveStart != start; });
+      interval = min(interval * 1.5, MAX_POLL_SECONDS);
+    }
+  }
+}
@@ -0,0 +1,107 @@
+/**
+ * @file FilterWheel.h
+ *
+ * @brief Asynchronous filter wheel control.
+ * A move is ordered with SendOrder2QHYCCDCFW and its completion is tracked by a background thread that polls
+ * GetQHYCCDCFWStatus adaptively: it sleeps through most of the expected move time (learned from previous moves)
+ * and then polls with a growing interval. Temperature regulation and camera settings can proceed meanwhile; only
+ * the capture waits for the wheel to be in position.
+ *
+ */
+
+#ifndef FILTERWHEEL_H
+#define FILTERWHEEL_H
+
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include "qhyccd.h"
+
+/**
+  @class FilterWheel
+    @brief Moves the filter wheel in the background and logs the measured move latencies
+*/
+class FilterWheel
+{
+public:
+  /**
+    @fn FilterWheel(qhyccd_handle *pCamHandle, double timeoutSeconds)
+      @brief Checks if a filter wheel is connected, reads its position and starts the tracking thread
+      @param pCamHandle Camera handle
+      @param timeoutSeconds Time after which a move is reported as failed
+  */
+  FilterWheel(qhyccd_handle *pCamHandle, double timeoutSeconds);
+  ~FilterWheel();
+
+  /**
+    @fn bool Plugged()
+    @return True if a filter wheel is connected
+  */
+  bool Plugged() const;
+
+  /**
+    @fn int Slots() const
+    @return Slots on the wheel, as reported by the camera (fallback if it does not say; 0 if no wheel)
+  */
+  int Slots() const;
+
+  /**
+    @fn int Position()
+    @return Slot the wheel is in (-1 if unknown, moving, or no wheel)
+  */
+  int Position();
+
+  /**
+    @fn void MoveTo(int fwPos)
+      @brief Orders a move to the requested slot and returns straight away (nothing is sent if the wheel is already there)
+      @param fwPos Filter wheel position to move to
+  */
+  void MoveTo(int fwPos);
+
+  /**
+    @fn bool WaitInPosition()
+      @brief Blocks until the last ordered move has completed, reporting progress every few seconds
+      @return True if the wheel is in position, false if the move failed or timed out
+  */
+  bool WaitInPosition();
+
+  /**
+    @fn void PrintStats()
+      @brief Prints the number of moves (sent and skipped) and their measured latencies
+  */
+  void PrintStats();
+
+  /**
+    @fn void Stop()
+      @brief Stops the tracking thread
+  */
+  void Stop();
+
+private:
+  void Run();
+  double ExpectedSeconds(int slots);
+
+  qhyccd_handle *pCamHandle;
+  double timeoutSeconds;
+  bool plugged;
+  int slots;             // Slots on the wheel
+  int position;          // Slot the wheel is in (-1 if unknown)
+  int target;            // Slot the wheel is moving to (-1 if no move is pending)
+  int moveSlots;         // Slots travelled by the pending move
+  double moveStart;      // Monotonic time the pending move was ordered
+  bool moveFailed;       // Set if the pending move timed out or the status could not be read
+  int moves;             // Completed moves
+  int timedMoves;        // Completed moves seen in progress, whose latency was measured
+  int skippedMoves;      // Moves not sent because the wheel was already at or headed to the slot
+  long polls;            // GetQHYCCDCFWStatus calls made while tracking moves
+  double totalSeconds;   // Sum of measured move latencies
+  double maxSeconds;     // Longest measured move latency
+  double secondsPerSlot; // Learned move time per slot (0 until the first move completes)
+  bool stopping;
+  std::mutex lock;
+  std::condition_variable arrived; // Signalled when a move completes or fails
+  std::condition_variable wake;    // Wakes the tracking thread (new move or stop)
+  std::thread tracker;
+};
+
+#endif
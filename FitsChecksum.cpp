@@ -0,0 +1,197 @@
+/**
+ * @file FitsChecksum.cpp
+ *
+ * @brief FITS DATASUM and CHECKSUM computation.
+ *
+ */
+
+// Dependencies
+#include "FitsChecksum.h"
+#include <string.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+using namespace std;
+
+static const size_t SUM_BLOCK_BYTES = 1 << 30; // Bytes summed before the 64-bit lanes are folded, far from overflow
+
+/**
+  @fn static uint32_t Fold(uint64_t sum)
+  @return 64-bit sum folded into a 32-bit ones' complement sum (end-around carry)
+*/
+static uint32_t Fold(uint64_t sum)
+{
+  while (sum >> 32)
+  {
+    sum = (sum & 0xFFFFFFFFu) + (sum >> 32);
+  }
+  return (uint32_t)sum;
+}
+
+/**
+  @fn static uint64_t SumScalar(const unsigned char *data, size_t words)
+    @brief Adds up big-endian 32-bit words without folding
+    @param data Words
+    @param words Number of words
+  @return 64-bit sum
+*/
+static uint64_t SumScalar(const unsigned char *data, size_t words)
+{
+  uint64_t sum = 0;
+  for (size_t i = 0; i < words; i++)
+  {
+    const unsigned char *word = data + 4 * i;
+    sum += (uint32_t)word[0] << 24 | (uint32_t)word[1] << 16 | (uint32_t)word[2] << 8 | word[3];
+  }
+  return sum;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/**
+  @fn static uint64_t SumSSE2(const unsigned char *data, size_t words)
+    @brief SSE2 sum kernel, 4 words per step
+    @param data Words
+    @param words Number of words
+  @return 64-bit sum
+*/
+__attribute__((target("sse2"))) static uint64_t SumSSE2(const unsigned char *data, size_t words)
+{
+  const __m128i zero = _mm_setzero_si128();
+  __m128i low = zero, high = zero;
+  size_t i = 0;
+  for (; i + 4 <= words; i += 4)
+  {
+    __m128i v = _mm_loadu_si128((const __m128i *)(data + 4 * i));
+    v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8)); // Bytes of each 16-bit half
+    v = _mm_shufflehi_epi16(_mm_shufflelo_epi16(v, 0xB1), 0xB1);   // Halves of each word
+    low = _mm_add_epi64(low, _mm_unpacklo_epi32(v, zero));
+    high = _mm_add_epi64(high, _mm_unpackhi_epi32(v, zero));
+  }
+  uint64_t lanes[2];
+  _mm_storeu_si128((__m128i *)lanes, _mm_add_epi64(low, high));
+  return lanes[0] + lanes[1] + SumScalar(data + 4 * i, words - i);
+}
+
+/**
+  @fn static uint64_t SumAVX2(const unsigned char *data, size_t words)
+    @brief AVX2 sum kernel, 8 words per step
+    @param data Words
+    @param words Number of words
+  @return 64-bit sum
+*/
+__attribute__((target("avx2"))) static uint64_t SumAVX2(const unsigned char *data, size_t words)
+{
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i swap = _mm256_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12, 3, 2, 1, 0, 7, 6, 5, 4,
+                                        11, 10, 9, 8, 15, 14, 13, 12);
+  __m256i low = zero, high = zero;
+  size_t i = 0;
+  for (; i + 8 <= words; i += 8)
+  {
+    __m256i v = _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i *)(data + 4 * i)), swap);
+    low = _mm256_add_epi64(low, _mm256_unpacklo_epi32(v, zero));
+    high = _mm256_add_epi64(high, _mm256_unpackhi_epi32(v, zero));
+  }
+  uint64_t lanes[4];
+  _mm256_storeu_si256((__m256i *)lanes, _mm256_add_epi64(low, high));
+  return lanes[0] + lanes[1] + lanes[2] + lanes[3] + SumScalar(data + 4 * i, words - i);
+}
+#endif
+
+typedef uint64_t (*SumKernel)(const unsigned char *, size_t);
+
+/**
+  @fn static SumKernel SelectKernel(const char **name)
+    @brief Picks the fastest sum kernel the CPU supports
+    @param name Name of the kernel
+  @return Kernel
+*/
+static SumKernel SelectKernel(const char **name)
+{
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+  {
+    *name = "AVX2";
+    return SumAVX2;
+  }
+  if (__builtin_cpu_supports("sse2"))
+  {
+    *name = "SSE2";
+    return SumSSE2;
+  }
+#endif
+  *name = "scalar";
+  return SumScalar;
+}
+
+static const char *kernelName;
+static const SumKernel kernel = SelectKernel(&kernelName);
+
+uint32_t FitsSum(const unsigned char *data, size_t bytes, uint32_t sum)
+{
+  for (size_t done = 0; done < bytes; done += SUM_BLOCK_BYTES)
+  {
+    size_t block = bytes - done < SUM_BLOCK_BYTES ? bytes - done : SUM_BLOCK_BYTES;
+    sum = Fold((uint64_t)sum + kernel(data + done, block / 4));
+  }
+  return sum;
+}
+
+uint32_t FitsSumAdd(uint32_t first, uint32_t second)
+{
+  return Fold((uint64_t)first + second);
+}
+
+string FitsEncodeChecksum(uint32_t sum)
+{
+  // Each byte of the complement is spread over four printable characters, avoiding the punctuation between the
+  // digits and letters, then the string is rotated by one character (the FITS checksum convention)
+  static const unsigned char exclude[13] = {0x3a, 0x3b, 0x3c, 0x3d, 0x3e, 0x3f, 0x40,
+                                            0x5b, 0x5c, 0x5d, 0x5e, 0x5f, 0x60};
+  uint32_t value = ~sum;
+  char encoded[16];
+  for (int i = 0; i < 4; i++)
+  {
+    int byte = (value >> (24 - 8 * i)) & 0xFF;
+    int ch[4];
+    for (int j = 0; j < 4; j++)
+    {
+      ch[j] = byte / 4 + '0';
+    }
+    ch[0] += byte % 4;
+    bool changed = true;
+    while (changed)
+    {
+      changed = false;
+      for (int k = 0; k < 13; k++)
+      {
+        for (int j = 0; j < 4; j += 2)
+        {
+          if (ch[j] == exclude[k] || ch[j + 1] == exclude[k])
+          {
+            ch[j]++;
+            ch[j + 1]--;
+            changed = true;
+          }
+        }
+      }
+    }
+    for (int j = 0; j < 4; j++)
+    {
+      encoded[4 * j + i] = (char)ch[j];
+    }
+  }
+  string checksum(16, ' ');
+  for (int i = 0; i < 16; i++)
+  {
+    checksum[i] = encoded[(i + 15) % 16];
+  }
+  return checksum;
+}
+
+const char *FitsChecksumKernel()
+{
+  return kernelName;
+}
@@ -0,0 +1,46 @@
+/**
+ * @file FitsChecksum.h
+ *
+ * @brief FITS DATASUM and CHECKSUM computation.
+ * Both are 32-bit ones' complement sums of the big-endian 32-bit words of an HDU (DATASUM over its data unit,
+ * CHECKSUM over header and data, stored as the 16-character ASCII encoding of the complement so that the whole HDU
+ * sums to -0). Sums are computed with SSE2 or AVX2 byte swaps and 64-bit lane accumulators where available.
+ *
+ */
+
+#ifndef FITSCHECKSUM_H
+#define FITSCHECKSUM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+/**
+  @fn uint32_t FitsSum(const unsigned char *data, size_t bytes, uint32_t sum)
+    @brief Adds a block of a FITS file to a running ones' complement sum
+    @param data Bytes, starting on a 32-bit word of the HDU
+    @param bytes Number of bytes (a multiple of 4)
+    @param sum Sum so far (0 to start)
+  @return New sum
+*/
+uint32_t FitsSum(const unsigned char *data, size_t bytes, uint32_t sum);
+
+/**
+  @fn uint32_t FitsSumAdd(uint32_t first, uint32_t second)
+  @return Ones' complement sum of two sums
+*/
+uint32_t FitsSumAdd(uint32_t first, uint32_t second);
+
+/**
+  @fn std::string FitsEncodeChecksum(uint32_t sum)
+  @return 16-character CHECKSUM value for an HDU whose sum, with CHECKSUM set to '0000000000000000', is sum
+*/
+std::string FitsEncodeChecksum(uint32_t sum);
+
+/**
+  @fn const char *FitsChecksumKernel()
+  @return Name of the sum kernel used on this CPU
+*/
+const char *FitsChecksumKernel();
+
+#endif
@@ -0,0 +1,308 @@
+/**
+ * @file FitsCompress.cpp
+ *
+ * @brief Tile-compressed FITS output.
+ *
+ */
+
+// Dependencies
+#include "FitsCompress.h"
+#include "FrameWriter.h"
+#include "Timing.h"
+#include <stdio.h>
+#include <string.h>
+#include <fitsio.h>
+#include <zlib.h>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+static const int RICE_BLOCKSIZE = 32;  // Pixels per Rice block (the FITS default)
+static const int HCOMPRESS_ROWS = 16;  // Default HCOMPRESS tile height, as used by fpack
+static const int TILES_PER_CLAIM = 16; // Tiles a compression thread claims at a time
+
+// CFITSIO's HCOMPRESS coder keeps its state in static variables, so only one tile can be coded at a time
+static mutex hcompressLock;
+
+bool ParseCompression(const char *name, FitsCompression *compression)
+{
+  if (strcmp(name, "none") == 0)
+  {
+    *compression = COMPRESS_NONE;
+  }
+  else if (strcmp(name, "rice") == 0)
+  {
+    *compression = COMPRESS_RICE;
+  }
+  else if (strcmp(name, "gzip") == 0)
+  {
+    *compression = COMPRESS_GZIP;
+  }
+  else if (strcmp(name, "hcompress") == 0)
+  {
+    *compression = COMPRESS_HCOMPRESS;
+  }
+  else
+  {
+    return false;
+  }
+  return true;
+}
+
+const char *CompressionName(FitsCompression compression)
+{
+  switch (compression)
+  {
+  case COMPRESS_RICE:
+    return "RICE_1";
+  case COMPRESS_GZIP:
+    return "GZIP_1";
+  case COMPRESS_HCOMPRESS:
+    return "HCOMPRESS_1";
+  default:
+    return "NONE";
+  }
+}
+
+/**
+  @fn static bool CompressTile(FitsCompression compression, int level, const unsigned short *pixels, int tileX, int tileY, vector<unsigned char> &out)
+    @brief Compresses one tile the way CFITSIO does for a USHORT_IMG (BZERO = 32768) image
+    @param compression Compression type
+    @param level zlib level for GZIP, scale for HCOMPRESS
+    @param pixels First pixel of the tile (rows are tileX pixels apart)
+    @param tileX Tile width
+    @param tileY Tile height
+    @param out Compressed bytes
+  @return True on success
+*/
+static bool CompressTile(FitsCompression compression, int level, const unsigned short *pixels, int tileX, int tileY,
+                         vector<unsigned char> &out)
+{
+  size_t count = (size_t)tileX * tileY;
+
+  // Stored values are the signed shorts pixel - BZERO, i.e. the pixel with its top bit flipped
+  vector<short> stored(count);
+  for (size_t i = 0; i < count; i++)
+  {
+    stored[i] = (short)(pixels[i] ^ 0x8000);
+  }
+
+  if (compression == COMPRESS_RICE)
+  {
+    out.resize(count * 2 + count / RICE_BLOCKSIZE + 64);
+    int length = fits_rcomp_short(stored.data(), (int)count, out.data(), (int)out.size(), RICE_BLOCKSIZE);
+    if (length < 0)
+    {
+      return false;
+    }
+    out.resize(length);
+    return true;
+  }
+
+  if (compression == COMPRESS_GZIP)
+  {
+    // GZIP_1 compresses the big-endian bytes with a gzip wrapper
+    for (size_t i = 0; i < count; i++)
+    {
+      unsigned short value = (unsigned short)stored[i];
+      stored[i] = (short)((value >> 8) | (value << 8));
+    }
+
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    if (deflateInit2(&stream, level, Z_DEFLATED, MAX_WBITS + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+    {
+      return false;
+    }
+    out.resize(deflateBound(&stream, count * 2) + 32);
+    stream.next_in = reinterpret_cast<Bytef *>(stored.data());
+    stream.avail_in = (uInt)(count * 2);
+    stream.next_out = out.data();
+    stream.avail_out = (uInt)out.size();
+    int result = deflate(&stream, Z_FINISH);
+    out.resize(stream.total_out);
+    deflateEnd(&stream);
+    return result == Z_STREAM_END;
+  }
+
+  // HCOMPRESS_1 works on ints
+  vector<int> values(stored.begin(), stored.end());
+  out.resize(count * 4 + 1024);
+  long length = (long)out.size();
+  int status = 0;
+  {
+    lock_guard<mutex> guard(hcompressLock);
+    fits_hcompress(values.data(), tileX, tileY, level, reinterpret_cast<char *>(out.data()), &length, &status);
+  }
+  if (status != 0)
+  {
+    return false;
+  }
+  out.resize(length);
+  return true;
+}
+
+int WriteCompressedFitsFrame(const FrameJob &job, FitsCompression compression, int level, int numThreads)
+{
+  int tileX = job.roiSizeX;
+  int tileY = 1;
+  if (compression == COMPRESS_HCOMPRESS)
+  {
+    // HCOMPRESS needs 2-D tiles; keep the last tile at least 4 rows high, as CFITSIO does
+    tileY = HCOMPRESS_ROWS;
+    while (job.roiSizeY % tileY != 0 && job.roiSizeY % tileY < 4)
+    {
+      tileY++;
+    }
+  }
+  int numTiles = (job.roiSizeY + tileY - 1) / tileY;
+
+  // Compress the tiles in parallel
+  double spanStart = MonotonicSeconds();
+  vector<vector<unsigned char>> tiles(numTiles);
+  atomic<int> nextTile(0);
+  atomic<bool> failed(false);
+  const unsigned short *pixels = reinterpret_cast<const unsigned short *>(job.pImgData);
+  auto compressTiles = [&]() {
+    while (!failed)
+    {
+      int first = nextTile.fetch_add(TILES_PER_CLAIM);
+      if (first >= numTiles)
+      {
+        return;
+      }
+      for (int t = first; t < first + TILES_PER_CLAIM && t < numTiles; t++)
+      {
+        int rows = (int)job.roiSizeY - t * tileY < tileY ? (int)job.roiSizeY - t * tileY : tileY;
+        if (!CompressTile(compression, level, pixels + (size_t)t * tileY * tileX, tileX, rows, tiles[t]))
+        {
+          failed = true;
+        }
+      }
+    }
+  };
+
+  vector<thread> workers;
+  for (int i = 1; i < numThreads; i++)
+  {
+    workers.push_back(thread(compressTiles));
+  }
+  compressTiles();
+  for (size_t i = 0; i < workers.size(); i++)
+  {
+    workers[i].join();
+  }
+  double spanEnd = MonotonicSeconds();
+  TimingSpan(PHASE_DETAIL, "FITS compress", spanStart, spanEnd);
+
+  const char *fitsfilename = job.fileName.c_str();
+  if (failed)
+  {
+    printf("Could not compress %s with %s.\n", fitsfilename, CompressionName(compression));
+    return DATA_COMPRESSION_ERR;
+  }
+
+  fitsfile *fptr;
+  int status = 0;
+
+  // Remove if exists already
+  spanStart = spanEnd;
+  remove(fitsfilename);
+
+  // Empty primary array, followed by the compressed image extension
+  fits_create_file(&fptr, fitsfilename, &status);
+  fits_create_img(fptr, BYTE_IMG, 0, 0, &status);
+
+  char ttypeName[] = "COMPRESSED_DATA";
+  char tformName[] = "1PB";
+  char tunitName[] = "";
+  char *ttype[] = {ttypeName};
+  char *tform[] = {tformName};
+  char *tunit[] = {tunitName};
+  fits_create_tbl(fptr, BINARY_TBL, numTiles, 1, ttype, tform, tunit, "COMPRESSED_IMAGE", &status);
+
+  // Tile compression keywords (FITS tiled image compression convention)
+  int logicalTrue = 1;
+  int zbitpix = 16;
+  int znaxis = 2;
+  long znaxis1 = job.roiSizeX;
+  long znaxis2 = job.roiSizeY;
+  long ztile1 = tileX;
+  long ztile2 = tileY;
+  char zcmptype[FLEN_VALUE];
+  strcpy(zcmptype, CompressionName(compression));
+  fits_write_key(fptr, TLOGICAL, "ZIMAGE", &logicalTrue, "extension contains compressed image", &status);
+  fits_write_key(fptr, TLOGICAL, "ZSIMPLE", &logicalTrue, "file does conform to FITS standard", &status);
+  fits_write_key(fptr, TINT, "ZBITPIX", &zbitpix, "data type of original image", &status);
+  fits_write_key(fptr, TINT, "ZNAXIS", &znaxis, "dimension of original image", &status);
+  fits_write_key(fptr, TLONG, "ZNAXIS1", &znaxis1, "length of original image axis", &status);
+  fits_write_key(fptr, TLONG, "ZNAXIS2", &znaxis2, "length of original image axis", &status);
+  fits_write_key(fptr, TLONG, "ZTILE1", &ztile1, "size of tiles to be compressed", &status);
+  fits_write_key(fptr, TLONG, "ZTILE2", &ztile2, "size of tiles to be compressed", &status);
+  fits_write_key(fptr, TSTRING, "ZCMPTYPE", zcmptype, "compression algorithm", &status);
+  if (compression == COMPRESS_RICE)
+  {
+    char blocksize[] = "BLOCKSIZE";
+    char bytepix[] = "BYTEPIX";
+    int blocksizeValue = RICE_BLOCKSIZE;
+    int bytepixValue = 2;
+    fits_write_key(fptr, TSTRING, "ZNAME1", blocksize, "compression block size", &status);
+    fits_write_key(fptr, TINT, "ZVAL1", &blocksizeValue, "pixels per block", &status);
+    fits_write_key(fptr, TSTRING, "ZNAME2", bytepix, "bytes per pixel (1, 2, 4, or 8)", &status);
+    fits_write_key(fptr, TINT, "ZVAL2", &bytepixValue, "bytes per pixel (1, 2, 4, or 8)", &status);
+  }
+  else if (compression == COMPRESS_HCOMPRESS)
+  {
+    char scale[] = "SCALE";
+    char smooth[] = "SMOOTH";
+    int scaleValue = level;
+    int smoothValue = 0;
+    fits_write_key(fptr, TSTRING, "ZNAME1", scale, "HCOMPRESS scale factor", &status);
+    fits_write_key(fptr, TINT, "ZVAL1", &scaleValue, "HCOMPRESS scale factor", &status);
+    fits_write_key(fptr, TSTRING, "ZNAME2", smooth, "HCOMPRESS smooth option", &status);
+    fits_write_key(fptr, TINT, "ZVAL2", &smoothValue, "HCOMPRESS smooth option", &status);
+  }
+  fits_write_key(fptr, TLOGICAL, "ZEXTEND", &logicalTrue, "FITS dataset may contain extensions", &status);
+
+  // Scaling of the original unsigned image
+  long bzero = 32768;
+  long bscale = 1;
+  fits_write_key(fptr, TLONG, "BZERO", &bzero, "offset data range to that of unsigned short", &status);
+  fits_write_key(fptr, TLONG, "BSCALE", &bscale, "default scaling factor", &status);
+
+  // Headers Information
+  WriteFrameKeys(fptr, job, &status);
+  spanEnd = MonotonicSeconds();
+  TimingSpan(PHASE_DETAIL, "FITS create", spanStart, spanEnd);
+
+  // Compressed tiles, in order, into the heap
+  spanStart = spanEnd;
+  for (int t = 0; t < numTiles && status == 0; t++)
+  {
+    fits_write_col(fptr, TBYTE, 1, t + 1, 1, tiles[t].size(), tiles[t].data(), &status);
+  }
+  spanEnd = MonotonicSeconds();
+  TimingSpan(PHASE_DETAIL, "FITS write", spanStart, spanEnd);
+
+  // Close File (always, so a failed write does not leak the handle)
+  spanStart = spanEnd;
+  int closeStatus = 0;
+  fits_close_file(fptr, &closeStatus);
+  TimingSpan(PHASE_DETAIL, "FITS close", spanStart, MonotonicSeconds());
+  if (status == 0)
+  {
+    status = closeStatus;
+  }
+
+  if (status != 0)
+  {
+    char errText[FLEN_STATUS];
+    fits_get_errstatus(status, errText);
+    printf("Could not write %s. CFITSIO error: %d (%s).\n", fitsfilename, status, errText);
+  }
+
+  return status;
+}
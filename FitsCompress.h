@@ -0,0 +1,54 @@
+/**
+ * @file FitsCompress.h
+ *
+ * @brief Tile-compressed FITS output.
+ * Frames are written as a standard tile-compressed image (compressed binary table), readable by funpack,
+ * astropy and CFITSIO. The tiles are compressed in parallel across cores and then written in order.
+ *
+ */
+
+#ifndef FITSCOMPRESS_H
+#define FITSCOMPRESS_H
+
+struct FrameJob;
+
+/**
+  @enum FitsCompression
+    @brief Output compression of the saved frames
+*/
+enum FitsCompression
+{
+  COMPRESS_NONE,     // Plain USHORT_IMG, as written by fits_write_img
+  COMPRESS_RICE,     // RICE_1, lossless
+  COMPRESS_GZIP,     // GZIP_1, lossless
+  COMPRESS_HCOMPRESS // HCOMPRESS_1, lossless at scale 0
+};
+
+/**
+  @fn bool ParseCompression(const char *name, FitsCompression *compression)
+    @brief Parses a compression name from the command line
+    @param name One of none, rice, gzip, hcompress
+    @param compression Parsed compression
+  @return True if the name was recognized
+*/
+bool ParseCompression(const char *name, FitsCompression *compression);
+
+/**
+  @fn const char *CompressionName(FitsCompression compression)
+    @param compression Compression type
+  @return FITS ZCMPTYPE name of the compression, or "NONE"
+*/
+const char *CompressionName(FitsCompression compression);
+
+/**
+  @fn int WriteCompressedFitsFrame(const FrameJob &job, FitsCompression compression, int level, int numThreads)
+    @brief Writes a frame and its headers as a tile-compressed .fits file
+    @param job Frame to write
+    @param compression Compression type (not COMPRESS_NONE)
+    @param level zlib level (1-9) for GZIP, scale for HCOMPRESS (0 is lossless); unused for RICE
+    @param numThreads Threads compressing tiles in parallel
+  @return CFITSIO status (0 on success)
+*/
+int WriteCompressedFitsFrame(const FrameJob &job, FitsCompression compression, int level, int numThreads);
+
+#endif
@@ -0,0 +1,521 @@
+/**
+ * @file FitsContainer.cpp
+ *
+ * @brief Batched FITS output: all repeats of a setting in one file.
+ *
+ */
+
+// Dependencies
+#include "FitsContainer.h"
+#include "FitsNative.h"
+#include "FrameWriter.h"
+#include "Timing.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <cmath>
+#include <vector>
+
+using namespace std;
+
+/**
+  @struct TableColumn
+    @brief A column of the FRAMES binary table
+*/
+struct TableColumn
+{
+  const char *name; // TTYPE
+  const char *form; // TFORM
+  size_t bytes;     // Width in a row
+  const char *unit; // TUNIT (empty for none)
+};
+
+static const TableColumn TABLE_COLUMNS[] = {
+    {"FRAME", "1J", 4, ""},      {"TIME", "1K", 8, "s"},      {"SENSTEMP", "1D", 8, "C"},
+    {"MEAN", "1D", 8, "ADU"},    {"MEDIAN", "1D", 8, "ADU"},  {"STDDEV", "1D", 8, "ADU"},
+    {"DATAMIN", "1J", 4, "ADU"}, {"DATAMAX", "1J", 4, "ADU"}, {"NSATUR", "1K", 8, ""}};
+static const int TABLE_FIELDS = sizeof(TABLE_COLUMNS) / sizeof(TABLE_COLUMNS[0]);
+static const size_t TABLE_ROW_BYTES = 60; // Sum of the column widths
+
+/**
+  @struct FitsContainerRow
+    @brief FRAMES table entry of one frame
+*/
+struct FitsContainerRow
+{
+  bool written;      // Frame was written
+  long unixTime;     // TIME of the frame
+  double sensorTemp; // Measured sensor temperature
+  bool hasStats;     // Statistics were computed
+  FrameStats stats;  // Statistics of the frame
+};
+
+/**
+  @struct FitsContainerWriter::Container
+    @brief One open file
+*/
+struct FitsContainerWriter::Container
+{
+  int fd;                        // File (-1 if it could not be created)
+  string fileName;               // Path of the file
+  FrameJob settings;             // Settings of the first frame, for the primary header (no pixels)
+  size_t headerBytes;            // Primary header size
+  size_t frameBytes;             // Pixel bytes of one frame
+  size_t slotBytes;              // File space of one frame (MEF: extension header and padded pixels)
+  vector<FitsContainerRow> rows; // Table rows, by stackIndex
+  int written;                   // Writes finished
+  int expected;                  // Frames submitted (-1 until the setting has ended)
+};
+
+/**
+  @fn static size_t PadToBlock(size_t bytes)
+    @param bytes Size of a header or data unit
+  @return Size rounded up to whole 2880-byte blocks
+*/
+static size_t PadToBlock(size_t bytes)
+{
+  return (bytes + FITS_BLOCK - 1) / FITS_BLOCK * FITS_BLOCK;
+}
+
+/**
+  @fn static void PutBigEndian(unsigned char *out, uint64_t value, size_t bytes)
+    @brief Stores the low bytes of an integer, most significant first
+    @param out Destination
+    @param value Value
+    @param bytes Bytes to store (4 or 8)
+*/
+static void PutBigEndian(unsigned char *out, uint64_t value, size_t bytes)
+{
+  for (size_t i = 0; i < bytes; i++)
+  {
+    out[i] = (unsigned char)(value >> (8 * (bytes - 1 - i)));
+  }
+}
+
+/**
+  @fn static void PutDouble(unsigned char *out, double value)
+    @brief Stores an IEEE double, most significant byte first
+    @param out Destination
+    @param value Value
+*/
+static void PutDouble(unsigned char *out, double value)
+{
+  uint64_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+  PutBigEndian(out, bits, 8);
+}
+
+/**
+  @fn static string PrimaryHeader(FitsContainerType type, const FrameJob &job, int frames)
+    @brief Builds the primary header: the whole cube, or an empty primary HDU ahead of the extensions
+    @param type CONTAINER_CUBE or CONTAINER_MEF
+    @param job Settings of the frames
+    @param frames Frames in the file (its size does not depend on this)
+  @return Header padded to whole blocks
+*/
+static string PrimaryHeader(FitsContainerType type, const FrameJob &job, int frames)
+{
+  string header;
+  FitsAppendCard(header, "SIMPLE", "T", "file does conform to FITS standard");
+  if (type == CONTAINER_CUBE)
+  {
+    FitsAppendCard(header, "BITPIX", "16", "number of bits per data pixel");
+    FitsAppendCard(header, "NAXIS", "3", "number of data axes");
+    FitsAppendCard(header, "NAXIS1", to_string(job.roiSizeX), "length of data axis 1");
+    FitsAppendCard(header, "NAXIS2", to_string(job.roiSizeY), "length of data axis 2");
+    FitsAppendCard(header, "NAXIS3", to_string(frames), "length of data axis 3");
+    FitsAppendCard(header, "EXTEND", "T", "FITS dataset may contain extensions");
+    FitsAppendCard(header, "BZERO", "32768", "offset data range to that of unsigned short");
+    FitsAppendCard(header, "BSCALE", "1", "default scaling factor");
+  }
+  else
+  {
+    FitsAppendCard(header, "BITPIX", "8", "number of bits per data pixel");
+    FitsAppendCard(header, "NAXIS", "0", "number of data axes");
+    FitsAppendCard(header, "EXTEND", "T", "FITS dataset may contain extensions");
+    FitsAppendCard(header, "NEXTEND", to_string(frames + 1), "Number of extensions");
+  }
+  FitsAppendSettingKeys(header, job);
+  FitsAppendCard(header, "TIME", to_string(job.unixTime), "UNIX Time of the first frame");
+  FitsAppendCard(header, "NFRAMES", to_string(frames), "Frames in the file");
+  FitsEndHeader(header);
+  return header;
+}
+
+/**
+  @fn static string TableHeader(int rows)
+    @brief Builds the header of the FRAMES binary table
+    @param rows Frames in the table
+  @return Header padded to whole blocks
+*/
+static string TableHeader(int rows)
+{
+  string header;
+  FitsAppendCard(header, "XTENSION", FitsQuote("BINTABLE"), "binary table extension");
+  FitsAppendCard(header, "BITPIX", "8", "8-bit bytes");
+  FitsAppendCard(header, "NAXIS", "2", "2-dimensional binary table");
+  FitsAppendCard(header, "NAXIS1", to_string(TABLE_ROW_BYTES), "width of table in bytes");
+  FitsAppendCard(header, "NAXIS2", to_string(rows), "number of rows in table");
+  FitsAppendCard(header, "PCOUNT", "0", "size of special data area");
+  FitsAppendCard(header, "GCOUNT", "1", "one data group (required keyword)");
+  FitsAppendCard(header, "TFIELDS", to_string(TABLE_FIELDS), "number of fields in each row");
+  for (int i = 0; i < TABLE_FIELDS; i++)
+  {
+    string n = to_string(i + 1);
+    FitsAppendCard(header, ("TTYPE" + n).c_str(), FitsQuote(TABLE_COLUMNS[i].name), "label for field");
+    FitsAppendCard(header, ("TFORM" + n).c_str(), FitsQuote(TABLE_COLUMNS[i].form), "data format of field");
+    if (TABLE_COLUMNS[i].unit[0] != '\0')
+    {
+      FitsAppendCard(header, ("TUNIT" + n).c_str(), FitsQuote(TABLE_COLUMNS[i].unit), "physical unit of field");
+    }
+  }
+  FitsAppendCard(header, "EXTNAME", FitsQuote("FRAMES"), "Per-frame time, temperature and statistics");
+  FitsEndHeader(header);
+  return header;
+}
+
+bool ParseContainer(const char *name, FitsContainerType *type)
+{
+  if (strcmp(name, "none") == 0)
+  {
+    *type = CONTAINER_NONE;
+  }
+  else if (strcmp(name, "cube") == 0)
+  {
+    *type = CONTAINER_CUBE;
+  }
+  else if (strcmp(name, "mef") == 0)
+  {
+    *type = CONTAINER_MEF;
+  }
+  else
+  {
+    return false;
+  }
+  return true;
+}
+
+FitsContainerWriter::FitsContainerWriter(FitsContainerType type, const string &outputPrefix)
+    : type(type), outputPrefix(outputPrefix)
+{
+  // Extension headers get a fixed size, that of a frame with statistics, so every frame has a fixed offset
+  FrameJob probe = FrameJob();
+  probe.hasStats = true;
+  extensionHeaderBytes = ExtensionHeader(probe, 0, 0).size();
+}
+
+FitsContainerWriter::~FitsContainerWriter()
+{
+  Close();
+}
+
+/**
+  @fn string FitsContainerWriter::ExtensionHeader(const FrameJob &job, int index, size_t size) const
+    @brief Builds the IMAGE extension header of a frame in a multi-extension file
+    @param job Frame
+    @param index Frame number in the file (from 0)
+    @param size Size to pad the header to with blank cards (0 for whole blocks)
+  @return Header
+*/
+string FitsContainerWriter::ExtensionHeader(const FrameJob &job, int index, size_t size) const
+{
+  string header;
+  FitsAppendCard(header, "XTENSION", FitsQuote("IMAGE"), "IMAGE extension");
+  FitsAppendCard(header, "BITPIX", "16", "number of bits per data pixel");
+  FitsAppendCard(header, "NAXIS", "2", "number of data axes");
+  FitsAppendCard(header, "NAXIS1", to_string(job.roiSizeX), "length of data axis 1");
+  FitsAppendCard(header, "NAXIS2", to_string(job.roiSizeY), "length of data axis 2");
+  FitsAppendCard(header, "PCOUNT", "0", "required keyword; must = 0");
+  FitsAppendCard(header, "GCOUNT", "1", "required keyword; must = 1");
+  FitsAppendCard(header, "BZERO", "32768", "offset data range to that of unsigned short");
+  FitsAppendCard(header, "BSCALE", "1", "default scaling factor");
+  FitsAppendCard(header, "EXTNAME", FitsQuote("FRAME" + to_string(index + 1)), "Frame in the sequence");
+  FitsAppendSettingKeys(header, job);
+  FitsAppendFrameKeys(header, job);
+  if (size > 0)
+  {
+    header.resize(size - FITS_CARD, ' '); // Blank cards ahead of END
+  }
+  FitsEndHeader(header);
+  return header;
+}
+
+/**
+  @fn size_t FitsContainerWriter::FrameOffset(const Container *container, int index) const
+    @param container File
+    @param index Frame number in the file (from 0)
+  @return Offset of the frame's pixels (MEF: of its extension header)
+*/
+size_t FitsContainerWriter::FrameOffset(const Container *container, int index) const
+{
+  return container->headerBytes + (size_t)index * container->slotBytes;
+}
+
+/**
+  @fn FitsContainerWriter::Container *FitsContainerWriter::Open(const FrameJob &job)
+    @brief Creates the file of a setting and preallocates it for all its repeats (lock held)
+    @param job First frame of the setting to arrive
+  @return Container (with fd -1 if the file could not be created)
+*/
+FitsContainerWriter::Container *FitsContainerWriter::Open(const FrameJob &job)
+{
+  Container *container = new Container();
+  container->settings = job;
+  container->settings.pImgData = NULL;
+  container->settings.hasStats = false;
+  container->fileName = outputPrefix + "_" + to_string(job.unixTime) + "_exp_" + to_string((int)job.exposureTime) +
+                        "us_gain_" + to_string(job.gainSetting) + "_offset_" + to_string(job.offsetSetting) +
+                        "_temp_" + to_string((int)job.tempSetting) + (type == CONTAINER_CUBE ? "_cube" : "_mef") +
+                        ".fits";
+  container->headerBytes = PrimaryHeader(type, job, job.stackSize).size();
+  container->frameBytes = 2 * (size_t)job.roiSizeX * job.roiSizeY;
+  container->slotBytes =
+      type == CONTAINER_CUBE ? container->frameBytes : extensionHeaderBytes + PadToBlock(container->frameBytes);
+  container->written = 0;
+  container->expected = -1;
+
+  map<int, int>::iterator ended = endedBlocks.find(job.stackKey);
+  if (ended != endedBlocks.end())
+  {
+    container->expected = ended->second;
+    endedBlocks.erase(ended);
+  }
+
+  remove(container->fileName.c_str());
+  container->fd = open(container->fileName.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0666);
+  if (container->fd < 0)
+  {
+    printf("Could not create %s. Error: %s.\n", container->fileName.c_str(), strerror(errno));
+    return container;
+  }
+
+  // Reserve the pixels of every repeat and the table, so the frames stream into contiguous space
+  PhaseTimer timer(PHASE_DETAIL, "Container preallocate");
+  int frames = job.stackSize > 0 ? job.stackSize : 1;
+  size_t total = FrameOffset(container, frames);
+  total = PadToBlock(total) + TableHeader(frames).size() + PadToBlock(TABLE_ROW_BYTES * frames);
+  int error = posix_fallocate(container->fd, 0, total);
+  if (error != 0)
+  {
+    printf("Could not preallocate %.1f MB for %s. Error: %s.\n", total / 1e6, container->fileName.c_str(),
+           strerror(error));
+  }
+  return container;
+}
+
+int FitsContainerWriter::Write(FrameJob &job, double *fileBytes)
+{
+  Container *container;
+  {
+    lock_guard<mutex> guard(lock);
+    map<int, Container *>::iterator found = containers.find(job.stackKey);
+    if (found == containers.end())
+    {
+      found = containers.insert(make_pair(job.stackKey, Open(job))).first;
+    }
+    container = found->second;
+    if ((size_t)job.stackIndex >= container->rows.size())
+    {
+      container->rows.resize(job.stackIndex + 1, FitsContainerRow());
+    }
+  }
+
+  int status = FILE_NOT_CREATED;
+  *fileBytes = 0;
+  if (container->fd >= 0 && 2 * (size_t)job.roiSizeX * job.roiSizeY == container->frameBytes)
+  {
+    // Header and byte order, in memory
+    double spanStart = MonotonicSeconds();
+    string header;
+    if (type == CONTAINER_MEF)
+    {
+      header = ExtensionHeader(job, job.stackIndex, extensionHeaderBytes);
+    }
+    FitsPixelsToBigEndian(reinterpret_cast<unsigned short *>(job.pImgData), (size_t)job.roiSizeX * job.roiSizeY);
+    double spanEnd = MonotonicSeconds();
+    TimingSpan(PHASE_DETAIL, "FITS byte swap", spanStart, spanEnd);
+
+    // The frame's slot: its pixels, or extension header, pixels and zero padding
+    vector<char> padding(type == CONTAINER_MEF ? PadToBlock(container->frameBytes) - container->frameBytes : 0, 0);
+    struct iovec parts[3];
+    parts[0].iov_base = const_cast<char *>(header.data());
+    parts[0].iov_len = header.size();
+    parts[1].iov_base = job.pImgData;
+    parts[1].iov_len = container->frameBytes;
+    parts[2].iov_base = padding.data();
+    parts[2].iov_len = padding.size();
+    status = FitsWriteAll(container->fd, parts, 3, FrameOffset(container, job.stackIndex),
+                          container->fileName.c_str());
+    TimingSpan(PHASE_DETAIL, "FITS write", spanEnd, MonotonicSeconds());
+    if (status == 0)
+    {
+      *fileBytes = container->slotBytes;
+      job.dataOffset = FrameOffset(container, job.stackIndex) + header.size();
+    }
+  }
+  else if (container->fd >= 0)
+  {
+    printf("Frame size %ux%u does not match %s.\n", job.roiSizeX, job.roiSizeY, container->fileName.c_str());
+    status = WRITE_ERROR;
+  }
+
+  // Cube plane or extension, in CFITSIO's extended file name syntax
+  job.fileName = container->fileName + (type == CONTAINER_CUBE ? "[*,*," + to_string(job.stackIndex + 1) + "]"
+                                                               : "[FRAME" + to_string(job.stackIndex + 1) + "]");
+
+  bool finished;
+  {
+    lock_guard<mutex> guard(lock);
+    FitsContainerRow &row = container->rows[job.stackIndex];
+    row.written = status == 0;
+    row.unixTime = job.unixTime;
+    row.sensorTemp = job.sensorTemp;
+    row.hasStats = job.hasStats;
+    row.stats = job.stats;
+    container->written++;
+    finished = container->expected >= 0 && container->written >= container->expected;
+    if (finished)
+    {
+      containers.erase(job.stackKey);
+    }
+  }
+  if (finished)
+  {
+    Finish(container);
+  }
+  return status;
+}
+
+void FitsContainerWriter::EndBlock(int key, int frames)
+{
+  Container *container = NULL;
+  {
+    lock_guard<mutex> guard(lock);
+    map<int, Container *>::iterator found = containers.find(key);
+    if (found == containers.end())
+    {
+      if (frames > 0)
+      {
+        endedBlocks[key] = frames; // Nothing written yet
+      }
+      return;
+    }
+    found->second->expected = frames;
+    if (found->second->written >= frames)
+    {
+      container = found->second;
+      containers.erase(found);
+    }
+  }
+  if (container != NULL)
+  {
+    Finish(container);
+  }
+}
+
+void FitsContainerWriter::Close()
+{
+  vector<Container *> open;
+  {
+    lock_guard<mutex> guard(lock);
+    for (map<int, Container *>::iterator it = containers.begin(); it != containers.end(); ++it)
+    {
+      open.push_back(it->second);
+    }
+    containers.clear();
+    endedBlocks.clear();
+  }
+  for (size_t i = 0; i < open.size(); i++)
+  {
+    Finish(open[i]);
+  }
+}
+
+/**
+  @fn void FitsContainerWriter::Finish(Container *container)
+    @brief Writes the primary header and the FRAMES table, trims the preallocated space and closes the file
+    @param container File, no longer in the map; deleted here
+*/
+void FitsContainerWriter::Finish(Container *container)
+{
+  if (container->fd < 0)
+  {
+    delete container;
+    return;
+  }
+  PhaseTimer timer(PHASE_DETAIL, "Container finish");
+  int frames = container->rows.size();
+  int status = 0;
+
+  // Primary header, now that the number of frames is known
+  string header = PrimaryHeader(type, container->settings, frames);
+  struct iovec part;
+  part.iov_base = const_cast<char *>(header.data());
+  part.iov_len = header.size();
+  status = FitsWriteAll(container->fd, &part, 1, 0, container->fileName.c_str());
+
+  // Extensions of frames that failed to write still need their header for the file to be readable
+  for (int i = 0; i < frames && type == CONTAINER_MEF && status == 0; i++)
+  {
+    if (!container->rows[i].written)
+    {
+      string extension = ExtensionHeader(container->settings, i, extensionHeaderBytes);
+      part.iov_base = const_cast<char *>(extension.data());
+      part.iov_len = extension.size();
+      status = FitsWriteAll(container->fd, &part, 1, FrameOffset(container, i), container->fileName.c_str());
+    }
+  }
+
+  // FRAMES table after the image data
+  size_t dataEnd = FrameOffset(container, frames);
+  size_t tableStart = PadToBlock(dataEnd);
+  string tableHeader = TableHeader(frames);
+  vector<unsigned char> table(PadToBlock(TABLE_ROW_BYTES * frames), 0);
+  for (int i = 0; i < frames; i++)
+  {
+    const FitsContainerRow &row = container->rows[i];
+    unsigned char *out = table.data() + i * TABLE_ROW_BYTES;
+    PutBigEndian(out, (uint32_t)(i + 1), 4);
+    PutBigEndian(out + 4, (uint64_t)row.unixTime, 8);
+    PutDouble(out + 12, row.written ? row.sensorTemp : NAN);
+    PutDouble(out + 20, row.hasStats ? row.stats.mean : NAN);
+    PutDouble(out + 28, row.hasStats ? row.stats.median : NAN);
+    PutDouble(out + 36, row.hasStats ? row.stats.stddev : NAN);
+    PutBigEndian(out + 44, (uint32_t)(row.hasStats ? row.stats.min : 0), 4);
+    PutBigEndian(out + 48, (uint32_t)(row.hasStats ? row.stats.max : 0), 4);
+    PutBigEndian(out + 52, (uint64_t)(row.hasStats ? row.stats.saturated : 0), 8);
+  }
+  vector<char> padding(tableStart - dataEnd, 0);
+  struct iovec parts[3];
+  parts[0].iov_base = padding.data();
+  parts[0].iov_len = padding.size();
+  parts[1].iov_base = const_cast<char *>(tableHeader.data());
+  parts[1].iov_len = tableHeader.size();
+  parts[2].iov_base = table.data();
+  parts[2].iov_len = table.size();
+  if (status == 0)
+  {
+    status = FitsWriteAll(container->fd, parts, 3, dataEnd, container->fileName.c_str());
+  }
+
+  // Give back what was preallocated for repeats that were not taken
+  size_t fileSize = tableStart + tableHeader.size() + table.size();
+  if (status == 0 && ftruncate(container->fd, fileSize) != 0)
+  {
+    printf("Could not trim %s. Error: %s.\n", container->fileName.c_str(), strerror(errno));
+  }
+  if (close(container->fd) != 0 && status == 0)
+  {
+    printf("Could not write %s. Error: %s.\n", container->fileName.c_str(), strerror(errno));
+    status = WRITE_ERROR;
+  }
+  if (status == 0)
+  {
+    printf("%d frames saved to %s (%.1f MB).\n", frames, container->fileName.c_str(), fileSize / 1e6);
+  }
+  delete container;
+}
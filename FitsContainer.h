@@ -0,0 +1,99 @@
+/**
+ * @file FitsContainer.h
+ *
+ * @brief Batched FITS output: all repeats of a setting in one file.
+ * Instead of one file per frame, the repeats of each setting are appended to a 3-D cube (NAXIS3 = repeats) or to a
+ * multi-extension file (one IMAGE extension per frame). The file is preallocated for all repeats when the first
+ * frame arrives, and each frame goes to a fixed offset, so the writer threads stream into it in parallel. Once the
+ * setting is complete the primary header is written and a FRAMES binary table with the TIME, sensor temperature and
+ * statistics of every frame is appended.
+ *
+ */
+
+#ifndef FITSCONTAINER_H
+#define FITSCONTAINER_H
+
+#include <stddef.h>
+#include <map>
+#include <mutex>
+#include <string>
+
+struct FrameJob;
+
+/**
+  @enum FitsContainerType
+    @brief How the frames of a setting are batched into files
+*/
+enum FitsContainerType
+{
+  CONTAINER_NONE, // One .fits file per frame
+  CONTAINER_CUBE, // One 3-D image per setting
+  CONTAINER_MEF   // One IMAGE extension per frame, in one file per setting
+};
+
+/**
+  @fn bool ParseContainer(const char *name, FitsContainerType *type)
+    @brief Parses a container name from the command line
+    @param name One of none, cube, mef
+    @param type Parsed container type
+  @return True if the name was recognized
+*/
+bool ParseContainer(const char *name, FitsContainerType *type);
+
+/**
+  @class FitsContainerWriter
+    @brief Writes frames into one cube or multi-extension file per setting (FrameJob::stackKey)
+*/
+class FitsContainerWriter
+{
+public:
+  /**
+    @fn FitsContainerWriter(FitsContainerType type, const std::string &outputPrefix)
+      @param type CONTAINER_CUBE or CONTAINER_MEF
+      @param outputPrefix Path the file names start with
+  */
+  FitsContainerWriter(FitsContainerType type, const std::string &outputPrefix);
+  ~FitsContainerWriter();
+
+  /**
+    @fn int Write(FrameJob &job, double *fileBytes)
+      @brief Writes a frame at its place (job.stackIndex) in the file of its setting. Writer threads may call this
+             concurrently. The pixels are converted to big-endian in place, and job.fileName is set to the
+             file and frame written.
+      @param job Frame to write
+      @param fileBytes Space the frame takes in the file, headers and padding included
+    @return CFITSIO status (0 on success)
+  */
+  int Write(FrameJob &job, double *fileBytes);
+
+  /**
+    @fn void EndBlock(int key, int frames)
+      @brief Tells how many frames of a setting were submitted, so its file is finished once they are written
+      @param key Setting (FrameJob::stackKey)
+      @param frames Frames submitted at the setting
+  */
+  void EndBlock(int key, int frames);
+
+  /**
+    @fn void Close()
+      @brief Finishes every file still open. Call once no more frames are being written.
+  */
+  void Close();
+
+private:
+  struct Container;
+
+  Container *Open(const FrameJob &job);
+  size_t FrameOffset(const Container *container, int index) const;
+  std::string ExtensionHeader(const FrameJob &job, int index, size_t size) const;
+  void Finish(Container *container);
+
+  FitsContainerType type;
+  std::string outputPrefix;
+  size_t extensionHeaderBytes;           // MEF: size of each IMAGE extension header
+  std::map<int, Container *> containers; // Open files, by setting
+  std::map<int, int> endedBlocks;        // Frames submitted at settings that ended before their file was opened
+  std::mutex lock;
+};
+
+#endif
@@ -0,0 +1,354 @@
+/**
+ * @file FitsNative.cpp
+ *
+ * @brief Native writer for plain 16-bit FITS frames.
+ *
+ */
+
+// Dependencies
+#include "FitsNative.h"
+#include "FrameWriter.h"
+#include "Timing.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <vector>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+using namespace std;
+
+void FitsAppendCard(string &header, const char *keyName, const string &value, const char *comment)
+{
+  string card;
+  if (strlen(keyName) <= 8)
+  {
+    card = keyName;
+    card.resize(8, ' ');
+    card += "= ";
+  }
+  else
+  {
+    card = string("HIERARCH ") + keyName + " = ";
+  }
+  if (!value.empty() && value[0] == '\'')
+  {
+    // Strings start in column 11; the comment still begins after column 30
+    card += value;
+    if (card.size() < 30)
+    {
+      card.resize(30, ' ');
+    }
+  }
+  else
+  {
+    if (card.size() + value.size() < 30)
+    {
+      card.append(30 - card.size() - value.size(), ' ');
+    }
+    card += value;
+  }
+  if (card.size() < 77 && comment[0] != '\0')
+  {
+    card += " / ";
+    card += string(comment).substr(0, 77 - (card.size() - 3));
+  }
+  card.resize(FITS_CARD, ' ');
+  header += card;
+}
+
+/**
+  @fn static void AppendComment(string &header, const char *comment)
+    @brief Appends a COMMENT card
+    @param header Header being built
+    @param comment Comment text
+*/
+static void AppendComment(string &header, const char *comment)
+{
+  string text = string("COMMENT ") + comment;
+  text.resize(FITS_CARD, ' ');
+  header += text;
+}
+
+string FitsFormatDouble(double value)
+{
+  char text[FITS_CARD];
+  snprintf(text, sizeof(text), "%.15G", value);
+  if (strchr(text, '.') == NULL && strchr(text, 'E') != NULL)
+  {
+    snprintf(text, sizeof(text), "%.1E", value);
+  }
+  char *comma = strchr(text, ',');
+  if (comma != NULL)
+  {
+    *comma = '.'; // Locales with a decimal comma
+  }
+  if (strchr(text, '.') == NULL && strchr(text, 'E') == NULL)
+  {
+    strcat(text, ".");
+  }
+  return text;
+}
+
+string FitsQuote(const string &value)
+{
+  string quoted = "'";
+  for (size_t i = 0; i < value.size(); i++)
+  {
+    quoted += value[i];
+    if (value[i] == '\'')
+    {
+      quoted += '\''; // Quotes are doubled
+    }
+  }
+  if (quoted.size() < 9)
+  {
+    quoted.resize(9, ' '); // At least 8 characters between the quotes
+  }
+  return quoted + "'";
+}
+
+void FitsAppendSettingKeys(string &header, const FrameJob &job)
+{
+  FitsAppendCard(header, "INTTEMP", FitsFormatDouble(job.tempSetting), "Camera Temperature");
+  FitsAppendCard(header, "EXPTIME", to_string((int)job.exposureTime), "Exposure time in microseconds");
+  FitsAppendCard(header, "OFFSET", to_string(job.offsetSetting), "Offset Setting");
+  FitsAppendCard(header, "GAIN", to_string(job.gainSetting), "Gain Setting");
+  FitsAppendCard(header, "QHREADMOE", to_string(job.readMode), "ReadMode Setting");
+}
+
+void FitsAppendFrameKeys(string &header, const FrameJob &job)
+{
+  FitsAppendCard(header, "TIME", to_string(job.unixTime), "UNIX Time");
+  if (job.hasStats)
+  {
+    FitsAppendCard(header, "MEAN", FitsFormatDouble(job.stats.mean), "Mean pixel value (ADU)");
+    FitsAppendCard(header, "MEDIAN", FitsFormatDouble(job.stats.median), "Median pixel value (ADU)");
+    FitsAppendCard(header, "STDDEV", FitsFormatDouble(job.stats.stddev), "Standard deviation (ADU)");
+    FitsAppendCard(header, "DATAMIN", to_string(job.stats.min), "Lowest pixel value");
+    FitsAppendCard(header, "DATAMAX", to_string(job.stats.max), "Highest pixel value");
+    FitsAppendCard(header, "NSATUR", to_string(job.stats.saturated), "Saturated pixels");
+    FitsAppendCard(header, "CLIPMEAN", FitsFormatDouble(job.stats.clippedMean), "Sigma-clipped mean (ADU)");
+    FitsAppendCard(header, "CLIPSTD", FitsFormatDouble(job.stats.clippedStddev), "Sigma-clipped standard deviation (ADU)");
+  }
+}
+
+void FitsEndHeader(string &header)
+{
+  string end = "END";
+  end.resize(FITS_CARD, ' ');
+  header += end;
+
+  // Pad with blanks to a whole number of blocks
+  header.resize((header.size() + FITS_BLOCK - 1) / FITS_BLOCK * FITS_BLOCK, ' ');
+}
+
+string FitsFrameHeader(const FrameJob &job)
+{
+  string header;
+  header.reserve(FITS_BLOCK);
+
+  // As written by fits_create_img(USHORT_IMG)
+  FitsAppendCard(header, "SIMPLE", "T", "file does conform to FITS standard");
+  FitsAppendCard(header, "BITPIX", "16", "number of bits per data pixel");
+  FitsAppendCard(header, "NAXIS", "2", "number of data axes");
+  FitsAppendCard(header, "NAXIS1", to_string(job.roiSizeX), "length of data axis 1");
+  FitsAppendCard(header, "NAXIS2", to_string(job.roiSizeY), "length of data axis 2");
+  FitsAppendCard(header, "EXTEND", "T", "FITS dataset may contain extensions");
+  AppendComment(header, "  FITS (Flexible Image Transport System) format is defined in 'Astronomy");
+  AppendComment(header, "  and Astrophysics', volume 376, page 359; bibcode: 2001A&A...376..359H");
+  FitsAppendCard(header, "BZERO", "32768", "offset data range to that of unsigned short");
+  FitsAppendCard(header, "BSCALE", "1", "default scaling factor");
+
+  // As written by WriteFrameKeys
+  FitsAppendSettingKeys(header, job);
+  FitsAppendFrameKeys(header, job);
+
+  FitsEndHeader(header);
+  return header;
+}
+
+/**
+  @fn static void SwapScalar(unsigned short *pixels, size_t count)
+    @brief Portable conversion kernel
+    @param pixels Pixels to convert
+    @param count Number of pixels
+*/
+static void SwapScalar(unsigned short *pixels, size_t count)
+{
+  for (size_t i = 0; i < count; i++)
+  {
+    unsigned short value = pixels[i] ^ 0x8000;
+    pixels[i] = (unsigned short)((value >> 8) | (value << 8));
+  }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/**
+  @fn static void SwapSSE2(unsigned short *pixels, size_t count)
+    @brief SSE2 conversion kernel, 8 pixels per step
+    @param pixels Pixels to convert
+    @param count Number of pixels
+*/
+__attribute__((target("sse2"))) static void SwapSSE2(unsigned short *pixels, size_t count)
+{
+  const __m128i flip = _mm_set1_epi16((short)0x8000);
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8)
+  {
+    __m128i value = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(pixels + i)), flip);
+    value = _mm_or_si128(_mm_slli_epi16(value, 8), _mm_srli_epi16(value, 8));
+    _mm_storeu_si128((__m128i *)(pixels + i), value);
+  }
+  SwapScalar(pixels + i, count - i);
+}
+
+/**
+  @fn static void SwapAVX2(unsigned short *pixels, size_t count)
+    @brief AVX2 conversion kernel, 32 pixels per step
+    @param pixels Pixels to convert
+    @param count Number of pixels
+*/
+__attribute__((target("avx2"))) static void SwapAVX2(unsigned short *pixels, size_t count)
+{
+  const __m256i flip = _mm256_set1_epi16((short)0x8000);
+  const __m256i swap = _mm256_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14, 1, 0, 3, 2, 5, 4, 7, 6,
+                                        9, 8, 11, 10, 13, 12, 15, 14);
+  size_t i = 0;
+  for (; i + 32 <= count; i += 32)
+  {
+    __m256i first = _mm256_loadu_si256((const __m256i *)(pixels + i));
+    __m256i second = _mm256_loadu_si256((const __m256i *)(pixels + i + 16));
+    first = _mm256_shuffle_epi8(_mm256_xor_si256(first, flip), swap);
+    second = _mm256_shuffle_epi8(_mm256_xor_si256(second, flip), swap);
+    _mm256_storeu_si256((__m256i *)(pixels + i), first);
+    _mm256_storeu_si256((__m256i *)(pixels + i + 16), second);
+  }
+  SwapScalar(pixels + i, count - i);
+}
+#endif
+
+typedef void (*SwapKernel)(unsigned short *, size_t);
+
+/**
+  @fn static SwapKernel SelectKernel(const char **name)
+    @brief Picks the fastest conversion kernel the CPU supports
+    @param name Set to the kernel name
+  @return Kernel
+*/
+static SwapKernel SelectKernel(const char **name)
+{
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+  {
+    *name = "AVX2";
+    return SwapAVX2;
+  }
+  if (__builtin_cpu_supports("sse2"))
+  {
+    *name = "SSE2";
+    return SwapSSE2;
+  }
+#endif
+  *name = "scalar";
+  return SwapScalar;
+}
+
+static const char *kernelName = "";
+static const SwapKernel kernel = SelectKernel(&kernelName);
+
+void FitsPixelsToBigEndian(unsigned short *pixels, size_t count)
+{
+  kernel(pixels, count);
+}
+
+const char *FitsSwapKernel()
+{
+  return kernelName;
+}
+
+int FitsWriteAll(int fd, struct iovec *parts, int count, off_t offset, const char *fileName)
+{
+  int part = 0;
+  while (part < count)
+  {
+    ssize_t written = pwritev(fd, parts + part, count - part, offset);
+    if (written < 0 && errno == EINTR)
+    {
+      continue;
+    }
+    if (written <= 0)
+    {
+      printf("Could not write %s. Error: %s.\n", fileName, written < 0 ? strerror(errno) : "no progress");
+      return WRITE_ERROR;
+    }
+
+    // Skip what was written (a large write may be split by the kernel)
+    offset += written;
+    while (part < count && (size_t)written >= parts[part].iov_len)
+    {
+      written -= parts[part].iov_len;
+      part++;
+    }
+    if (part < count)
+    {
+      parts[part].iov_base = (char *)parts[part].iov_base + written;
+      parts[part].iov_len -= written;
+    }
+  }
+  return 0;
+}
+
+int WriteNativeFitsFrame(const FrameJob &job)
+{
+  const char *fitsfilename = job.fileName.c_str();
+  size_t pixels = (size_t)job.roiSizeX * job.roiSizeY;
+  size_t dataBytes = 2 * pixels;
+
+  // Header and byte order, in memory
+  double spanStart = MonotonicSeconds();
+  string header = FitsFrameHeader(job);
+  FitsPixelsToBigEndian(reinterpret_cast<unsigned short *>(job.pImgData), pixels);
+  double spanEnd = MonotonicSeconds();
+  TimingSpan(PHASE_DETAIL, "FITS byte swap", spanStart, spanEnd);
+
+  // Remove if exists already
+  remove(fitsfilename);
+
+  int fd = open(fitsfilename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (fd < 0)
+  {
+    printf("Could not create %s. Error: %s.\n", fitsfilename, strerror(errno));
+    return FILE_NOT_CREATED;
+  }
+
+  // Header, pixels straight from the frame buffer, and zero padding to the end of the last block
+  spanStart = MonotonicSeconds();
+  vector<char> padding((FITS_BLOCK - dataBytes % FITS_BLOCK) % FITS_BLOCK, 0);
+  struct iovec parts[3];
+  parts[0].iov_base = const_cast<char *>(header.data());
+  parts[0].iov_len = header.size();
+  parts[1].iov_base = job.pImgData;
+  parts[1].iov_len = dataBytes;
+  parts[2].iov_base = padding.data();
+  parts[2].iov_len = padding.size();
+
+  int status = FitsWriteAll(fd, parts, 3, 0, fitsfilename);
+  spanEnd = MonotonicSeconds();
+  TimingSpan(PHASE_DETAIL, "FITS write", spanStart, spanEnd);
+
+  // Close File
+  if (close(fd) != 0 && status == 0)
+  {
+    printf("Could not write %s. Error: %s.\n", fitsfilename, strerror(errno));
+    status = WRITE_ERROR;
+  }
+  TimingSpan(PHASE_DETAIL, "FITS close", spanEnd, MonotonicSeconds());
+
+  return status;
+}
@@ -0,0 +1,118 @@
+/**
+ * @file FitsNative.h
+ *
+ * @brief Native writer for plain 16-bit FITS frames.
+ * The header is formatted in memory exactly as CFITSIO formats it, the pixels are converted to FITS
+ * big-endian signed integers (BZERO 32768) in place in the frame buffer with SIMD, and header, pixels and
+ * padding are handed to the kernel in a single pwritev. The file is byte-identical to WriteFitsFrame's.
+ *
+ */
+
+#ifndef FITSNATIVE_H
+#define FITSNATIVE_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <string>
+
+struct FrameJob;
+struct iovec;
+
+static const size_t FITS_BLOCK = 2880; // FITS logical record length
+static const size_t FITS_CARD = 80;    // Header card length
+
+/**
+  @fn void FitsAppendCard(std::string &header, const char *keyName, const std::string &value, const char *comment)
+    @brief Appends a keyword card formatted as CFITSIO does: value right-justified to column 30 (strings from FitsQuote
+           left-justified at column 11), then " / comment". Names longer than 8 characters (QHREADMOE) get the
+           HIERARCH convention, as in fits_update_key.
+    @param header Header being built
+    @param keyName Keyword
+    @param value Formatted value
+    @param comment Keyword comment
+*/
+void FitsAppendCard(std::string &header, const char *keyName, const std::string &value, const char *comment);
+
+/**
+  @fn std::string FitsFormatDouble(double value)
+    @brief Formats a double as fits_update_key(TDOUBLE) does: 15 significant digits, always with a decimal point or exponent
+    @param value Value to format
+  @return Formatted value
+*/
+std::string FitsFormatDouble(double value);
+
+/**
+  @fn std::string FitsQuote(const std::string &value)
+    @brief Formats a string keyword value: quoted, inner quotes doubled, padded to at least 8 characters
+    @param value String
+  @return Formatted value
+*/
+std::string FitsQuote(const std::string &value);
+
+/**
+  @fn void FitsAppendSettingKeys(std::string &header, const FrameJob &job)
+    @brief Appends the keys of the setting a frame was taken at (INTTEMP, EXPTIME, OFFSET, GAIN, QHREADMOE)
+    @param header Header being built
+    @param job Frame the header describes
+*/
+void FitsAppendSettingKeys(std::string &header, const FrameJob &job);
+
+/**
+  @fn void FitsAppendFrameKeys(std::string &header, const FrameJob &job)
+    @brief Appends the keys of one frame (TIME, and the statistics if they have been computed)
+    @param header Header being built
+    @param job Frame the header describes
+*/
+void FitsAppendFrameKeys(std::string &header, const FrameJob &job);
+
+/**
+  @fn void FitsEndHeader(std::string &header)
+    @brief Appends the END card and pads the header with blanks to whole 2880-byte blocks
+    @param header Header being built
+*/
+void FitsEndHeader(std::string &header);
+
+/**
+  @fn std::string FitsFrameHeader(const FrameJob &job)
+    @brief Formats the primary header of a 2-D USHORT_IMG frame with the frame keys, padded to whole 2880-byte blocks
+    @param job Frame the header describes
+  @return Header blocks
+*/
+std::string FitsFrameHeader(const FrameJob &job);
+
+/**
+  @fn void FitsPixelsToBigEndian(unsigned short *pixels, size_t count)
+    @brief Converts unsigned pixels in place to big-endian signed integers offset by BZERO 32768 (AVX2, SSE2 or scalar)
+    @param pixels Pixels to convert
+    @param count Number of pixels
+*/
+void FitsPixelsToBigEndian(unsigned short *pixels, size_t count);
+
+/**
+  @fn const char *FitsSwapKernel()
+  @return Name of the conversion kernel selected for this CPU
+*/
+const char *FitsSwapKernel();
+
+/**
+  @fn int FitsWriteAll(int fd, struct iovec *parts, int count, off_t offset, const char *fileName)
+    @brief Writes buffers at an offset with pwritev, resuming after partial writes
+    @param fd Open file
+    @param parts Buffers (advanced as they are written)
+    @param count Number of buffers
+    @param offset File offset of the first byte
+    @param fileName File name, for error messages
+  @return 0, or WRITE_ERROR
+*/
+int FitsWriteAll(int fd, struct iovec *parts, int count, off_t offset, const char *fileName);
+
+/**
+  @fn int WriteNativeFitsFrame(const FrameJob &job)
+    @brief Writes a frame and its headers to a .fits file without CFITSIO. The frame buffer is converted in place,
+           so it must not be read as image data afterwards.
+    @param job Frame to write
+  @return CFITSIO-compatible status (0 on success)
+*/
+int WriteNativeFitsFrame(const FrameJob &job);
+
+#endif
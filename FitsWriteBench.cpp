@@ -0,0 +1,136 @@
+/**
+ * @file FitsWriteBench.cpp
+ *
+ * @brief Benchmark of the CFITSIO and native FITS writers.
+ * Writes the same synthetic frames with WriteFitsFrame and WriteNativeFitsFrame, reports the throughput
+ * of each, and checks that the two files are byte-identical.
+ *
+ */
+
+// Dependencies
+#include "FitsNative.h"
+#include "FrameWriter.h"
+#include "Timing.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+/**
+  @fn static bool ReadFile(const string &fileName, vector<char> &contents)
+    @brief Reads a whole file
+    @param fileName File to read
+    @param contents File contents
+  @return True on success
+*/
+static bool ReadFile(const string &fileName, vector<char> &contents)
+{
+  FILE *file = fopen(fileName.c_str(), "rb");
+  if (file == NULL)
+  {
+    return false;
+  }
+  fseek(file, 0, SEEK_END);
+  contents.resize(ftell(file));
+  fseek(file, 0, SEEK_SET);
+  bool ok = fread(contents.data(), 1, contents.size(), file) == contents.size();
+  fclose(file);
+  return ok;
+}
+
+int main(int argc, char *argv[])
+{
+  // Frame size and count (default: a full QHY600 frame)
+  unsigned int roiSizeX = argc > 1 ? atoi(argv[1]) : 9600;
+  unsigned int roiSizeY = argc > 2 ? atoi(argv[2]) : 6422;
+  int frames = argc > 3 ? atoi(argv[3]) : 5;
+  string dir = argc > 4 ? argv[4] : "/tmp/qhybench";
+  size_t pixels = (size_t)roiSizeX * roiSizeY;
+
+  // Synthetic frame covering the full 16-bit range, including values around BZERO
+  vector<unsigned short> pristine(pixels);
+  unsigned int seed = 12345;
+  for (size_t i = 0; i < pixels; i++)
+  {
+    seed = seed * 1103515245 + 12345;
+    pristine[i] = i % 1024 == 0 ? (unsigned short)(32767 + i % 3) : (unsigned short)(seed >> 16);
+  }
+  vector<unsigned short> work(pixels);
+
+  FrameJob job;
+  job.pImgData = reinterpret_cast<unsigned char *>(work.data());
+  job.framePool = NULL;
+  job.roiSizeX = roiSizeX;
+  job.roiSizeY = roiSizeY;
+  job.gainSetting = 56;
+  job.offsetSetting = 20;
+  job.exposureTime = 500000;
+  job.tempSetting = -10.5;
+  job.readMode = 1;
+  job.unixTime = time(0);
+
+  // Statistics keys too, so their number formatting is compared
+  job.stats = ComputeFrameStats(pristine.data(), roiSizeX, roiSizeY, 65535, 3.0, 1);
+  job.hasStats = true;
+
+  printf("Writing %d frames of %ux%u (%.1f MB) with each writer, conversion kernel: %s.\n", frames, roiSizeX,
+         roiSizeY, 2.0 * pixels / 1e6, FitsSwapKernel());
+
+  double cfitsioSeconds = 0, nativeSeconds = 0, swapSeconds = 0;
+  bool identical = true;
+  for (int f = 0; f < frames; f++)
+  {
+    string cfitsioName = dir + "/bench_cfitsio_" + to_string(f) + ".fits";
+    string nativeName = dir + "/bench_native_" + to_string(f) + ".fits";
+
+    memcpy(work.data(), pristine.data(), 2 * pixels);
+    job.fileName = cfitsioName;
+    double start = MonotonicSeconds();
+    int status = WriteFitsFrame(job);
+    cfitsioSeconds += MonotonicSeconds() - start;
+
+    memcpy(work.data(), pristine.data(), 2 * pixels);
+    job.fileName = nativeName;
+    start = MonotonicSeconds();
+    status |= WriteNativeFitsFrame(job);
+    nativeSeconds += MonotonicSeconds() - start;
+
+    // Conversion alone, in memory
+    memcpy(work.data(), pristine.data(), 2 * pixels);
+    start = MonotonicSeconds();
+    FitsPixelsToBigEndian(work.data(), pixels);
+    swapSeconds += MonotonicSeconds() - start;
+
+    vector<char> cfitsioFile, nativeFile;
+    if (status != 0 || !ReadFile(cfitsioName, cfitsioFile) || !ReadFile(nativeName, nativeFile))
+    {
+      printf("Frame %d could not be written or read back.\n", f);
+      return 1;
+    }
+    if (cfitsioFile != nativeFile)
+    {
+      size_t i = 0;
+      while (i < cfitsioFile.size() && i < nativeFile.size() && cfitsioFile[i] == nativeFile[i])
+      {
+        i++;
+      }
+      printf("Frame %d differs at byte %zu (sizes %zu and %zu).\n", f, i, cfitsioFile.size(), nativeFile.size());
+      identical = false;
+    }
+    remove(cfitsioName.c_str());
+    remove(nativeName.c_str());
+  }
+
+  double megabytes = 2.0 * pixels * frames / 1e6;
+  printf("CFITSIO writer: %8.3f s, %8.1f MB/s\n", cfitsioSeconds, megabytes / cfitsioSeconds);
+  printf("Native writer:  %8.3f s, %8.1f MB/s (%.2fx)\n", nativeSeconds, megabytes / nativeSeconds,
+         cfitsioSeconds / nativeSeconds);
+  printf("Conversion:     %8.3f s, %8.1f MB/s\n", swapSeconds, megabytes / swapSeconds);
+  printf("Output files are %s.\n", identical ? "byte-identical" : "DIFFERENT");
+
+  return identical ? 0 : 1;
+}
@@ -0,0 +1,145 @@
+/**
+ * @file FrameBroadcast.cpp
+ *
+ * @brief Shared-memory ring of the latest frames, for live consumers such as focus and monitoring tools.
+ *
+ */
+
+// Dependencies
+#include "FrameBroadcast.h"
+#include "Timing.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <algorithm>
+#include <new>
+
+using namespace std;
+
+FrameBroadcast::FrameBroadcast(const string &name, int slots, size_t payloadBytes)
+    : name(BroadcastName(name)), map(NULL), mapBytes(0), ring(NULL), frames(0), truncated(0), copySeconds(0),
+      maxCopySeconds(0), latencySeconds(0), maxLatencySeconds(0)
+{
+  size_t payloadPages = (payloadBytes + BROADCAST_PAGE - 1) / BROADCAST_PAGE * BROADCAST_PAGE;
+  size_t slotStride = BROADCAST_PAGE + payloadPages;
+  mapBytes = BROADCAST_PAGE + (size_t)slots * slotStride;
+
+  // A stale ring from a run that did not exit cleanly is replaced; readers still attached to it keep their copy
+  shm_unlink(this->name.c_str());
+  int fd = shm_open(this->name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+  if (fd < 0)
+  {
+    printf("Could not create shared memory %s: %s. Frames will not be broadcast.\n", this->name.c_str(), strerror(errno));
+    return;
+  }
+
+  // Reserve the memory up front, so a full /dev/shm fails here rather than faulting during the sweep
+  int error = ftruncate(fd, mapBytes) != 0 ? errno : posix_fallocate(fd, 0, mapBytes);
+  void *mapped = MAP_FAILED;
+  if (error == 0)
+  {
+    mapped = mmap(0, mapBytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, 0);
+    error = mapped == MAP_FAILED ? errno : 0;
+  }
+  close(fd);
+  if (error != 0)
+  {
+    printf("Could not allocate %.1f MB of shared memory for %s: %s. Frames will not be broadcast.\n", mapBytes / 1e6,
+           this->name.c_str(), strerror(error));
+    shm_unlink(this->name.c_str());
+    return;
+  }
+
+  map = static_cast<unsigned char *>(mapped);
+  ring = new (map) BroadcastRing();
+  ring->slotCount = slots;
+  ring->pageBytes = BROADCAST_PAGE;
+  ring->payloadBytes = payloadPages;
+  ring->slotStride = slotStride;
+  ring->published.store(0, memory_order_relaxed);
+  ring->closed.store(0, memory_order_relaxed);
+  ring->publisherPid = getpid();
+  for (int i = 0; i < slots; i++)
+  {
+    new (map + BROADCAST_PAGE + i * slotStride) BroadcastSlot();
+  }
+
+  // Readers check the magic last, so they never see a half-initialized ring
+  atomic_thread_fence(memory_order_release);
+  memcpy(ring->magic, BROADCAST_MAGIC, sizeof(BROADCAST_MAGIC));
+  printf("Broadcasting frames in shared memory %s (%d slots of %.1f MB).\n", this->name.c_str(), slots,
+         payloadPages / 1e6);
+}
+
+FrameBroadcast::~FrameBroadcast()
+{
+  if (map == NULL)
+  {
+    return;
+  }
+  ring->closed.store(1, memory_order_release);
+  munmap(map, mapBytes);
+  shm_unlink(name.c_str());
+}
+
+bool FrameBroadcast::IsOpen() const
+{
+  return map != NULL;
+}
+
+void FrameBroadcast::Publish(const unsigned char *pixels, const BroadcastFrameInfo &info)
+{
+  if (map == NULL)
+  {
+    return;
+  }
+  double start = MonotonicSeconds();
+  uint64_t frame = frames + 1;
+  BroadcastSlot *slot =
+      reinterpret_cast<BroadcastSlot *>(map + BROADCAST_PAGE + (frame - 1) % ring->slotCount * ring->slotStride);
+
+  size_t bytes = (size_t)info.sizeX * info.sizeY * max(info.channels, 1u) * ((info.bpp + 7) / 8);
+  if (bytes > ring->payloadBytes)
+  {
+    bytes = ring->payloadBytes;
+    truncated++;
+  }
+
+  // Odd sequence while the slot is rewritten, so a reader still looking at the frame before knows to drop it
+  slot->sequence.store(2 * frame - 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+  memcpy(reinterpret_cast<unsigned char *>(slot) + BROADCAST_PAGE, pixels, bytes);
+  double end = MonotonicSeconds();
+  slot->info = info;
+  slot->info.frame = frame;
+  slot->info.payloadBytes = bytes;
+  slot->info.publishTime = end;
+  slot->sequence.store(2 * frame, memory_order_release);
+  ring->published.store(frame, memory_order_release);
+
+  frames = frame;
+  copySeconds += end - start;
+  maxCopySeconds = max(maxCopySeconds, end - start);
+  latencySeconds += end - info.readoutTime;
+  maxLatencySeconds = max(maxLatencySeconds, end - info.readoutTime);
+  TimingSpan(PHASE_DETAIL, "Frame broadcast", start, end);
+}
+
+void FrameBroadcast::PrintStats()
+{
+  if (map == NULL || frames == 0)
+  {
+    return;
+  }
+  printf("Broadcast %s: %llu frames published, readout to publication %.2f ms mean, %.2f ms max (copy %.2f ms "
+         "mean, %.2f ms max).\n",
+         name.c_str(), (unsigned long long)frames, latencySeconds / frames * 1000, maxLatencySeconds * 1000,
+         copySeconds / frames * 1000, maxCopySeconds * 1000);
+  if (truncated > 0)
+  {
+    printf("%lu frames were larger than a slot and published cut short.\n", truncated);
+  }
+}
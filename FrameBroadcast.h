@@ -0,0 +1,143 @@
+/**
+ * @file FrameBroadcast.h
+ *
+ * @brief Shared-memory ring of the latest frames, for live consumers such as focus and monitoring tools.
+ * The capture loop copies each frame into the next slot of a POSIX shared-memory object as soon as it is read out,
+ * before it is checked or written to disk. Each slot holds the frame's settings followed by its pixels, page
+ * aligned. A slot's sequence counter is odd while a frame is being copied in and even once it is complete, so readers
+ * attach without any lock: they read the latest frame in place and check afterwards that it was not overwritten
+ * meanwhile. The publisher never waits for readers; a reader that falls behind skips frames. The reader side is in
+ * BroadcastReader.h.
+ *
+ */
+
+#ifndef FRAMEBROADCAST_H
+#define FRAMEBROADCAST_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <string>
+
+static const char BROADCAST_MAGIC[8] = {'Q', 'H', 'Y', 'S', 'H', 'M', '1', 0};
+static const size_t BROADCAST_PAGE = 4096; // Ring header and slot header size; pixels start page aligned
+
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2, "the ring's counters must be lock free to be shared between processes");
+
+/**
+  @struct BroadcastFrameInfo
+    @brief Settings of a frame in the ring
+*/
+struct BroadcastFrameInfo
+{
+  uint64_t frame;        // Frame number, from 1
+  uint32_t sizeX;        // Image size in X
+  uint32_t sizeY;        // Image size in Y
+  uint32_t bpp;          // Bits per pixel
+  uint32_t channels;     // Channels per pixel
+  int32_t gain;          // Gain setting
+  int32_t offset;        // Offset setting
+  int32_t readMode;      // Camera readmode
+  int32_t filter;        // Filter wheel position
+  int32_t repeat;        // Image number at the setting
+  int32_t reserved;
+  double exposureUs;     // Exposure time (us)
+  double tempSetting;    // Temperature setting
+  double sensorTemp;     // Latest sensor temperature
+  int64_t unixTime;      // UNIX time of the readout
+  double readoutTime;    // CLOCK_MONOTONIC seconds when the readout returned
+  double publishTime;    // CLOCK_MONOTONIC seconds when the frame was complete in the ring
+  uint64_t payloadBytes; // Pixel bytes that follow the slot header
+};
+
+/**
+  @struct BroadcastRing
+    @brief First page of the shared-memory object
+*/
+struct BroadcastRing
+{
+  char magic[8];                   // BROADCAST_MAGIC
+  uint32_t slotCount;              // Slots in the ring
+  uint32_t pageBytes;              // BROADCAST_PAGE
+  uint64_t payloadBytes;           // Pixel capacity of each slot
+  uint64_t slotStride;             // Bytes from one slot to the next
+  std::atomic<uint64_t> published; // Number of the latest complete frame (0 for none yet)
+  std::atomic<uint32_t> closed;    // Set when the publisher exits; readers should attach again
+  int32_t publisherPid;            // Process publishing the frames
+};
+
+/**
+  @struct BroadcastSlot
+    @brief Start of each slot; the pixels follow BROADCAST_PAGE bytes further on
+*/
+struct BroadcastSlot
+{
+  std::atomic<uint64_t> sequence; // 2n - 1 while frame n is copied in, 2n once it is complete
+  BroadcastFrameInfo info;        // Settings of the frame
+};
+
+/**
+  @fn std::string BroadcastName(const std::string &name)
+  @return Shared-memory object name, with the leading slash POSIX requires
+*/
+inline std::string BroadcastName(const std::string &name)
+{
+  return name.empty() || name[0] != '/' ? "/" + name : name;
+}
+
+/**
+  @class FrameBroadcast
+    @brief Publishing side of the ring. Publish is called by one capture thread.
+*/
+class FrameBroadcast
+{
+public:
+  /**
+    @fn FrameBroadcast(const std::string &name, int slots, size_t payloadBytes)
+      @brief Creates the shared-memory object (replacing a stale one of the same name) and pre-faults it
+      @param name Shared-memory object name
+      @param slots Frames kept in the ring
+      @param payloadBytes Greatest frame size in bytes
+  */
+  FrameBroadcast(const std::string &name, int slots, size_t payloadBytes);
+
+  /**
+    @fn ~FrameBroadcast()
+      @brief Marks the ring closed and unlinks it; attached readers keep their mapping
+  */
+  ~FrameBroadcast();
+
+  /**
+    @fn bool IsOpen() const
+    @return True if the ring could be created
+  */
+  bool IsOpen() const;
+
+  /**
+    @fn void Publish(const unsigned char *pixels, const BroadcastFrameInfo &info)
+      @brief Copies a frame into the next slot and makes it the latest frame. Never waits for readers.
+      @param pixels Frame as read out
+      @param info Settings of the frame (frame number and publish time are filled in)
+  */
+  void Publish(const unsigned char *pixels, const BroadcastFrameInfo &info);
+
+  /**
+    @fn void PrintStats()
+      @brief Prints the frames published and the time from readout to publication
+  */
+  void PrintStats();
+
+private:
+  std::string name;         // Shared-memory object name
+  unsigned char *map;       // Mapping of the whole object (NULL if it could not be created)
+  size_t mapBytes;          // Size of the object
+  BroadcastRing *ring;      // Ring header at the start of map
+  uint64_t frames;          // Frames published
+  unsigned long truncated;  // Frames larger than a slot, published cut short
+  double copySeconds;       // Time spent copying frames in
+  double maxCopySeconds;    // Slowest copy
+  double latencySeconds;    // Total time from readout to publication
+  double maxLatencySeconds; // Slowest readout to publication
+};
+
+#endif
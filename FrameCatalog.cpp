@@ -0,0 +1,549 @@
+/**
+ * @file FrameCatalog.cpp
+ *
+ * @brief Binary catalog of the frames written to an output directory.
+ *
+ */
+
+// Dependencies
+#include "FrameCatalog.h"
+#include "FrameWriter.h"
+#include "Timing.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <cmath>
+
+using namespace std;
+
+static const char CATALOG_MAGIC[8] = {'Q', 'H', 'Y', 'C', 'A', 'T', '1', 0};
+static const char INDEX_MAGIC[8] = {'Q', 'H', 'Y', 'I', 'D', 'X', '1', 0};
+static const size_t CATALOG_HEADER_BYTES = 16; // Magic, record size, reserved
+static const int FITS_BLOCK_BYTES = 2880;
+static const int FITS_MAX_HDUS = 4;            // HDUs searched for the frame's data
+
+static_assert(sizeof(CatalogRecord) == 256, "catalog records are 256 bytes on disk");
+
+/**
+  @struct IndexEntry
+    @brief Key fields of a record and its number, as kept in the index file
+*/
+struct IndexEntry
+{
+  int32_t tempCenti;
+  int32_t gain;
+  int32_t offset;
+  int32_t readMode;
+  int32_t filter;
+  uint32_t record;
+  int64_t exposureUs;
+  int64_t unixTime;
+};
+
+/**
+  @struct IndexHeader
+    @brief Start of the index file, followed by the entries sorted by setting and then the entries sorted by time
+*/
+struct IndexHeader
+{
+  char magic[8];
+  uint64_t records; // Catalog records covered
+};
+
+/**
+  @fn static int CompareSetting(const IndexEntry &a, const IndexEntry &b, int fields)
+    @brief Compares the first fields of the key (temperature, gain, offset, exposure, read mode, filter, time)
+    @param a First entry
+    @param b Second entry
+    @param fields Key fields to compare (7 for all)
+  @return Negative, zero or positive as a sorts before, with or after b
+*/
+static int CompareSetting(const IndexEntry &a, const IndexEntry &b, int fields)
+{
+  int64_t keyA[7] = {a.tempCenti, a.gain, a.offset, a.exposureUs, a.readMode, a.filter, a.unixTime};
+  int64_t keyB[7] = {b.tempCenti, b.gain, b.offset, b.exposureUs, b.readMode, b.filter, b.unixTime};
+  for (int i = 0; i < fields; i++)
+  {
+    if (keyA[i] != keyB[i])
+    {
+      return keyA[i] < keyB[i] ? -1 : 1;
+    }
+  }
+  return 0;
+}
+
+/**
+  @fn static bool BySetting(const IndexEntry &a, const IndexEntry &b)
+  @return True if a sorts before b by setting, then time, then record
+*/
+static bool BySetting(const IndexEntry &a, const IndexEntry &b)
+{
+  int order = CompareSetting(a, b, 7);
+  return order != 0 ? order < 0 : a.record < b.record;
+}
+
+/**
+  @fn static bool ByTime(const IndexEntry &a, const IndexEntry &b)
+  @return True if a sorts before b by time, then record
+*/
+static bool ByTime(const IndexEntry &a, const IndexEntry &b)
+{
+  return a.unixTime != b.unixTime ? a.unixTime < b.unixTime : a.record < b.record;
+}
+
+/**
+  @fn static IndexEntry EntryOf(const CatalogRecord &record, uint32_t number)
+  @return Index entry of a record
+*/
+static IndexEntry EntryOf(const CatalogRecord &record, uint32_t number)
+{
+  IndexEntry entry;
+  entry.tempCenti = record.tempCenti;
+  entry.gain = record.gain;
+  entry.offset = record.offset;
+  entry.readMode = record.readMode;
+  entry.filter = record.filter;
+  entry.record = number;
+  entry.exposureUs = record.exposureUs;
+  entry.unixTime = record.unixTime;
+  return entry;
+}
+
+/**
+  @fn static bool Matches(const IndexEntry &entry, const CatalogQuery &query)
+  @return True if an entry meets every criterion of the query
+*/
+static bool Matches(const IndexEntry &entry, const CatalogQuery &query)
+{
+  return (!query.hasTemp || entry.tempCenti == query.tempCenti) && (!query.hasGain || entry.gain == query.gain) &&
+         (!query.hasOffset || entry.offset == query.offset) &&
+         (!query.hasExposure || entry.exposureUs == query.exposureUs) &&
+         (!query.hasReadMode || entry.readMode == query.readMode) &&
+         (!query.hasFilter || entry.filter == query.filter) && entry.unixTime >= query.since &&
+         entry.unixTime <= query.until;
+}
+
+/**
+  @fn static long long FitsKeyValue(const char *card)
+  @return Integer value of a header card
+*/
+static long long FitsKeyValue(const char *card)
+{
+  char value[71];
+  memcpy(value, card + 10, 70);
+  value[70] = 0;
+  return atoll(value);
+}
+
+/**
+  @fn static uint64_t FitsDataOffset(const string &fileName)
+    @brief Finds the pixels of a frame file: the data of the first HDU that has any (the image extension of a
+           tile-compressed file, whose primary HDU is empty)
+    @param fileName FITS file
+  @return Byte offset of the data (0 if it could not be found)
+*/
+static uint64_t FitsDataOffset(const string &fileName)
+{
+  int fd = open(fileName.c_str(), O_RDONLY);
+  if (fd < 0)
+  {
+    return 0;
+  }
+  uint64_t position = 0;
+  uint64_t found = 0;
+  char block[FITS_BLOCK_BYTES];
+  for (int hdu = 0; hdu < FITS_MAX_HDUS && found == 0; hdu++)
+  {
+    // Header blocks up to END, picking up the data size keys
+    long long bitpix = 0, naxis = 0, pcount = 0, gcount = 1, pixels = 1;
+    bool end = false;
+    while (!end && pread(fd, block, FITS_BLOCK_BYTES, position) == FITS_BLOCK_BYTES)
+    {
+      position += FITS_BLOCK_BYTES;
+      for (int card = 0; card < FITS_BLOCK_BYTES / 80 && !end; card++)
+      {
+        const char *text = block + card * 80;
+        if (strncmp(text, "END     ", 8) == 0)
+        {
+          end = true;
+        }
+        else if (strncmp(text, "BITPIX  =", 9) == 0)
+        {
+          bitpix = FitsKeyValue(text);
+        }
+        else if (strncmp(text, "NAXIS   =", 9) == 0)
+        {
+          naxis = FitsKeyValue(text);
+        }
+        else if (strncmp(text, "NAXIS", 5) == 0 && text[8] == '=')
+        {
+          pixels *= FitsKeyValue(text);
+        }
+        else if (strncmp(text, "PCOUNT  =", 9) == 0)
+        {
+          pcount = FitsKeyValue(text);
+        }
+        else if (strncmp(text, "GCOUNT  =", 9) == 0)
+        {
+          gcount = FitsKeyValue(text);
+        }
+      }
+    }
+    if (!end)
+    {
+      break;
+    }
+    long long dataBytes = naxis > 0 ? llabs(bitpix) / 8 * gcount * (pcount + pixels) : 0;
+    if (dataBytes > 0)
+    {
+      found = position;
+    }
+    position += (dataBytes + FITS_BLOCK_BYTES - 1) / FITS_BLOCK_BYTES * FITS_BLOCK_BYTES;
+  }
+  close(fd);
+  return found;
+}
+
+string CatalogPath(const string &directory)
+{
+  return (directory.empty() ? string(".") : directory) + "/frames.catalog";
+}
+
+FrameCatalog::FrameCatalog(const string &directory)
+    : directory(directory.empty() ? "." : directory), path(CatalogPath(directory)), fd(-1), added(0), failed(0),
+      seconds(0)
+{
+  fd = open(path.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
+  if (fd < 0)
+  {
+    printf("Could not open frame catalog %s: %s. Frames will not be cataloged.\n", path.c_str(), strerror(errno));
+    return;
+  }
+
+  struct stat info;
+  if (fstat(fd, &info) != 0)
+  {
+    close(fd);
+    fd = -1;
+    return;
+  }
+  if (info.st_size == 0)
+  {
+    char header[CATALOG_HEADER_BYTES] = {0};
+    uint32_t recordBytes = sizeof(CatalogRecord);
+    memcpy(header, CATALOG_MAGIC, sizeof(CATALOG_MAGIC));
+    memcpy(header + 8, &recordBytes, sizeof(recordBytes));
+    if (write(fd, header, sizeof(header)) != (ssize_t)sizeof(header))
+    {
+      printf("Could not write to frame catalog %s.\n", path.c_str());
+    }
+    return;
+  }
+
+  char magic[sizeof(CATALOG_MAGIC)];
+  if (pread(fd, magic, sizeof(magic), 0) != (ssize_t)sizeof(magic) || memcmp(magic, CATALOG_MAGIC, sizeof(magic)) != 0)
+  {
+    printf("%s is not a frame catalog. Frames will not be cataloged.\n", path.c_str());
+    close(fd);
+    fd = -1;
+    return;
+  }
+
+  // A record torn by a crash would shift every record after it
+  off_t whole = CATALOG_HEADER_BYTES +
+                (info.st_size - (off_t)CATALOG_HEADER_BYTES) / sizeof(CatalogRecord) * sizeof(CatalogRecord);
+  if (whole != info.st_size && ftruncate(fd, whole) != 0)
+  {
+    printf("Could not drop the torn record at the end of %s.\n", path.c_str());
+  }
+}
+
+FrameCatalog::~FrameCatalog()
+{
+  if (fd >= 0)
+  {
+    close(fd);
+  }
+}
+
+bool FrameCatalog::IsOpen() const
+{
+  return fd >= 0;
+}
+
+void FrameCatalog::Add(const FrameJob &job)
+{
+  CatalogRecord record;
+  if (Describe(job, &record))
+  {
+    Append(record);
+  }
+}
+
+bool FrameCatalog::Describe(const FrameJob &job, CatalogRecord *out)
+{
+  if (fd < 0)
+  {
+    return false;
+  }
+  double start = MonotonicSeconds();
+
+  CatalogRecord &record = *out;
+  memset(&record, 0, sizeof(record));
+  record.tempCenti = (int32_t)lround(job.tempSetting * 100);
+  record.gain = job.gainSetting;
+  record.offset = job.offsetSetting;
+  record.readMode = job.readMode;
+  record.filter = job.filter;
+  record.repeat = job.repeat;
+  record.exposureUs = (int64_t)job.exposureTime;
+  record.unixTime = job.unixTime;
+  record.checksum = job.checksum;
+  record.flags = job.checksum != 0 ? CATALOG_HAS_CHECKSUM : 0;
+  record.sensorTemp = (float)job.sensorTemp;
+  if (job.hasStats)
+  {
+    record.flags |= CATALOG_HAS_STATS;
+    record.mean = (float)job.stats.mean;
+    record.median = (float)job.stats.median;
+    record.stddev = (float)job.stats.stddev;
+    record.clippedMean = (float)job.stats.clippedMean;
+    record.clippedStddev = (float)job.stats.clippedStddev;
+    record.min = job.stats.min;
+    record.max = job.stats.max;
+    record.saturated = job.stats.saturated;
+  }
+
+  // Containers know where each frame sits; a file per frame is read back for the end of its headers
+  record.dataOffset = job.dataOffset;
+  if (record.dataOffset == 0)
+  {
+    record.dataOffset = FitsDataOffset(job.stagedName.empty() ? job.fileName : job.stagedName);
+  }
+
+  // The name relative to the directory, keeping a container's [plane] or [extension] selector
+  string name = job.fileName;
+  if (name.compare(0, directory.size() + 1, directory + "/") == 0)
+  {
+    name = name.substr(directory.size() + 1);
+  }
+  bool fits = name.size() < (size_t)CATALOG_PATH_BYTES;
+  memcpy(record.path, name.data(), min(name.size(), (size_t)CATALOG_PATH_BYTES - 1));
+
+  lock_guard<mutex> guard(lock);
+  if (!fits)
+  {
+    printf("Could not catalog %s.\n", job.fileName.c_str());
+    failed++;
+  }
+  seconds += MonotonicSeconds() - start;
+  return fits;
+}
+
+void FrameCatalog::Append(const CatalogRecord &record)
+{
+  if (fd < 0)
+  {
+    return;
+  }
+  double start = MonotonicSeconds();
+
+  // One write per record, so records from different writer threads and cameras never interleave
+  lock_guard<mutex> guard(lock);
+  if (write(fd, &record, sizeof(record)) != (ssize_t)sizeof(record))
+  {
+    printf("Could not catalog %.*s.\n", CATALOG_PATH_BYTES, record.path);
+    failed++;
+  }
+  else
+  {
+    added++;
+  }
+  seconds += MonotonicSeconds() - start;
+}
+
+void FrameCatalog::PrintStats()
+{
+  lock_guard<mutex> guard(lock);
+  if (fd < 0)
+  {
+    return;
+  }
+  printf("Frame catalog %s: %lu frames added (%lu failed), %.3f s spent cataloging.\n", path.c_str(), added, failed,
+         seconds);
+}
+
+/**
+  @fn static bool UpdateIndex(const string &catalogPath, int catalogFd, uint64_t records, vector<IndexEntry> &bySetting, vector<IndexEntry> &byTime)
+    @brief Loads the index file, adds the records appended since it was written, and rewrites it if it grew
+    @param catalogPath Catalog file
+    @param catalogFd Catalog opened for reading
+    @param records Records in the catalog
+    @param bySetting Entries sorted by setting
+    @param byTime Entries sorted by time
+  @return False if the catalog could not be read
+*/
+static bool UpdateIndex(const string &catalogPath, int catalogFd, uint64_t records, vector<IndexEntry> &bySetting,
+                        vector<IndexEntry> &byTime)
+{
+  string indexPath = catalogPath + ".idx";
+  IndexHeader header;
+  uint64_t indexed = 0;
+  int indexFd = open(indexPath.c_str(), O_RDONLY);
+  if (indexFd >= 0)
+  {
+    if (pread(indexFd, &header, sizeof(header), 0) == (ssize_t)sizeof(header) &&
+        memcmp(header.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC)) == 0 && header.records <= records)
+    {
+      size_t bytes = header.records * sizeof(IndexEntry);
+      bySetting.resize(header.records);
+      byTime.resize(header.records);
+      if (pread(indexFd, bySetting.data(), bytes, sizeof(header)) == (ssize_t)bytes &&
+          pread(indexFd, byTime.data(), bytes, sizeof(header) + bytes) == (ssize_t)bytes)
+      {
+        indexed = header.records;
+      }
+    }
+    close(indexFd);
+  }
+  bySetting.resize(indexed);
+  byTime.resize(indexed);
+  if (indexed == records)
+  {
+    return true;
+  }
+
+  // Sort the new records and merge them in
+  vector<CatalogRecord> fresh(records - indexed);
+  size_t bytes = fresh.size() * sizeof(CatalogRecord);
+  if (pread(catalogFd, fresh.data(), bytes, CATALOG_HEADER_BYTES + indexed * sizeof(CatalogRecord)) != (ssize_t)bytes)
+  {
+    return false;
+  }
+  vector<IndexEntry> added(fresh.size());
+  for (size_t i = 0; i < fresh.size(); i++)
+  {
+    added[i] = EntryOf(fresh[i], (uint32_t)(indexed + i));
+  }
+  sort(added.begin(), added.end(), BySetting);
+  bySetting.insert(bySetting.end(), added.begin(), added.end());
+  inplace_merge(bySetting.begin(), bySetting.begin() + indexed, bySetting.end(), BySetting);
+  sort(added.begin(), added.end(), ByTime);
+  byTime.insert(byTime.end(), added.begin(), added.end());
+  inplace_merge(byTime.begin(), byTime.begin() + indexed, byTime.end(), ByTime);
+
+  // Replace the index atomically; a read-only directory just means sorting again next time
+  string tmpPath = indexPath + ".tmp";
+  FILE *file = fopen(tmpPath.c_str(), "wb");
+  if (file != NULL)
+  {
+    memcpy(header.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC));
+    header.records = records;
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+              fwrite(bySetting.data(), sizeof(IndexEntry), records, file) == records &&
+              fwrite(byTime.data(), sizeof(IndexEntry), records, file) == records;
+    if (fclose(file) == 0 && ok)
+    {
+      rename(tmpPath.c_str(), indexPath.c_str());
+    }
+    else
+    {
+      remove(tmpPath.c_str());
+    }
+  }
+  return true;
+}
+
+bool QueryCatalog(const string &directory, const CatalogQuery &query, vector<CatalogRecord> *matches, string *error)
+{
+  matches->clear();
+  string catalogPath = CatalogPath(directory);
+  int fd = open(catalogPath.c_str(), O_RDONLY);
+  if (fd < 0)
+  {
+    *error = catalogPath + ": " + strerror(errno);
+    return false;
+  }
+  struct stat info;
+  char magic[sizeof(CATALOG_MAGIC)];
+  if (fstat(fd, &info) != 0 || pread(fd, magic, sizeof(magic), 0) != (ssize_t)sizeof(magic) ||
+      memcmp(magic, CATALOG_MAGIC, sizeof(magic)) != 0)
+  {
+    *error = catalogPath + " is not a frame catalog";
+    close(fd);
+    return false;
+  }
+  uint64_t records = (info.st_size - CATALOG_HEADER_BYTES) / sizeof(CatalogRecord);
+
+  vector<IndexEntry> bySetting, byTime;
+  if (!UpdateIndex(catalogPath, fd, records, bySetting, byTime))
+  {
+    *error = "Could not read " + catalogPath;
+    close(fd);
+    return false;
+  }
+
+  // The leading fields of the setting key given in the query narrow the setting index to one range
+  IndexEntry probe = {query.tempCenti, query.gain, query.offset, query.readMode, query.filter, 0, query.exposureUs, 0};
+  bool given[6] = {query.hasTemp, query.hasGain, query.hasOffset, query.hasExposure, query.hasReadMode,
+                   query.hasFilter};
+  int prefix = 0;
+  while (prefix < 6 && given[prefix])
+  {
+    prefix++;
+  }
+  vector<IndexEntry>::const_iterator first, last;
+  if (prefix > 0)
+  {
+    first = lower_bound(bySetting.begin(), bySetting.end(), probe,
+                        [prefix](const IndexEntry &a, const IndexEntry &b) { return CompareSetting(a, b, prefix) < 0; });
+    last = upper_bound(first, (vector<IndexEntry>::const_iterator)bySetting.end(), probe,
+                       [prefix](const IndexEntry &a, const IndexEntry &b) { return CompareSetting(a, b, prefix) < 0; });
+  }
+  else if (query.since != INT64_MIN || query.until != INT64_MAX)
+  {
+    // Otherwise a time range narrows the time index
+    IndexEntry from = probe, to = probe;
+    from.unixTime = query.since;
+    from.record = 0;
+    to.unixTime = query.until;
+    to.record = UINT32_MAX;
+    first = lower_bound(byTime.begin(), byTime.end(), from, ByTime);
+    last = upper_bound(first, (vector<IndexEntry>::const_iterator)byTime.end(), to, ByTime);
+  }
+  else
+  {
+    first = bySetting.begin();
+    last = bySetting.end();
+  }
+
+  vector<IndexEntry> found;
+  for (vector<IndexEntry>::const_iterator entry = first; entry != last; ++entry)
+  {
+    if (Matches(*entry, query))
+    {
+      found.push_back(*entry);
+    }
+  }
+  sort(found.begin(), found.end(), BySetting);
+
+  // Only the matching records are read
+  matches->resize(found.size());
+  for (size_t i = 0; i < found.size(); i++)
+  {
+    if (pread(fd, &(*matches)[i], sizeof(CatalogRecord), CATALOG_HEADER_BYTES + found[i].record * sizeof(CatalogRecord)) !=
+        (ssize_t)sizeof(CatalogRecord))
+    {
+      *error = "Could not read " + catalogPath;
+      close(fd);
+      return false;
+    }
+  }
+  close(fd);
+  return true;
+}
@@ -0,0 +1,165 @@
+/**
+ * @file FrameCatalog.h
+ *
+ * @brief Binary catalog of the frames written to an output directory.
+ * Each frame written appends one fixed-size record to `frames.catalog` in its directory: the setting it was taken at
+ * (temperature, gain, offset, exposure, read mode, filter), its UNIX time, its file name relative to the directory,
+ * the byte offset of its pixels in that file, and its statistics. The catalog is only ever appended to, so runs over
+ * months build up one file per directory. Lookups go through `frames.catalog.idx`, which holds the key fields of
+ * every record sorted by setting and by time. It is brought up to date with the records appended since it was
+ * written whenever the catalog is queried, so the capture side never pays for sorting.
+ *
+ */
+
+#ifndef FRAMECATALOG_H
+#define FRAMECATALOG_H
+
+#include <stdint.h>
+#include <mutex>
+#include <string>
+#include <vector>
+
+struct FrameJob;
+
+static const int CATALOG_PATH_BYTES = 160; // Room for the file name in a record
+
+// Record flags
+enum CatalogFlag
+{
+  CATALOG_HAS_STATS = 1,   // The statistics fields are set
+  CATALOG_HAS_CHECKSUM = 2 // The checksum field is set
+};
+
+/**
+  @struct CatalogRecord
+    @brief One frame in the catalog (256 bytes, host byte order)
+*/
+struct CatalogRecord
+{
+  int32_t tempCenti;     // Temperature setting (hundredths of a degree C)
+  int32_t gain;          // Gain setting
+  int32_t offset;        // Offset setting
+  int32_t readMode;      // Camera readmode
+  int32_t filter;        // Filter wheel position
+  int32_t repeat;        // Image number at the setting
+  int64_t exposureUs;    // Exposure time (us)
+  int64_t unixTime;      // UNIX time the frame was read out
+  uint64_t dataOffset;   // Byte offset of the frame's pixels (or compressed tiles) in its file
+  uint32_t checksum;     // CRC-32 of the pixels as read out
+  uint32_t flags;        // CatalogFlag bits
+  float sensorTemp;      // Sensor temperature when the frame was taken
+  float mean;            // Statistics of the frame (ADU)
+  float median;
+  float stddev;
+  float clippedMean;
+  float clippedStddev;
+  int32_t min;
+  int32_t max;
+  int64_t saturated;
+  char path[CATALOG_PATH_BYTES]; // File name relative to the catalog's directory (NUL padded)
+};
+
+/**
+  @struct CatalogQuery
+    @brief Lookup criteria; fields left at their "any" value match every frame
+*/
+struct CatalogQuery
+{
+  bool hasTemp = false;     // Match tempCenti
+  int32_t tempCenti = 0;
+  bool hasGain = false;     // Match gain
+  int32_t gain = 0;
+  bool hasOffset = false;   // Match offset
+  int32_t offset = 0;
+  bool hasExposure = false; // Match exposureUs
+  int64_t exposureUs = 0;
+  bool hasReadMode = false; // Match readMode
+  int32_t readMode = 0;
+  bool hasFilter = false;   // Match filter
+  int32_t filter = 0;
+  int64_t since = INT64_MIN; // Earliest UNIX time
+  int64_t until = INT64_MAX; // Latest UNIX time
+};
+
+/**
+  @class FrameCatalog
+    @brief Appends the frames written to the catalog of their directory. Add is called by the writer threads, Append
+           also by the staging migrator.
+*/
+class FrameCatalog
+{
+public:
+  /**
+    @fn FrameCatalog(const std::string &directory)
+      @brief Opens the catalog of a directory for appending, creating it if needed
+      @param directory Output directory
+  */
+  explicit FrameCatalog(const std::string &directory);
+  ~FrameCatalog();
+
+  /**
+    @fn bool IsOpen() const
+    @return True if the catalog could be opened
+  */
+  bool IsOpen() const;
+
+  /**
+    @fn void Add(const FrameJob &job)
+      @brief Appends a frame that was written successfully
+      @param job Frame written (with its file name and, for containers, its data offset)
+  */
+  void Add(const FrameJob &job);
+
+  /**
+    @fn bool Describe(const FrameJob &job, CatalogRecord *record)
+      @brief Fills in the record of a frame written successfully, to be appended later (staged frames are appended
+             once they are migrated)
+      @param job Frame written, under its final name (stagedName is read for the data offset while it is set)
+      @param record Record of the frame
+    @return False if the frame cannot be cataloged
+  */
+  bool Describe(const FrameJob &job, CatalogRecord *record);
+
+  /**
+    @fn void Append(const CatalogRecord &record)
+      @brief Appends a record filled in by Describe
+      @param record Record of a frame
+  */
+  void Append(const CatalogRecord &record);
+
+  /**
+    @fn void PrintStats()
+      @brief Prints the frames cataloged
+  */
+  void PrintStats();
+
+private:
+  std::string directory;
+  std::string path; // Catalog file
+  int fd;           // Catalog opened for appending (-1 if it could not be)
+  std::mutex lock;
+  unsigned long added;
+  unsigned long failed;
+  double seconds;   // Time spent cataloging
+};
+
+/**
+  @fn std::string CatalogPath(const std::string &directory)
+  @return Catalog file of a directory
+*/
+std::string CatalogPath(const std::string &directory);
+
+/**
+  @fn bool QueryCatalog(const std::string &directory, const CatalogQuery &query, std::vector<CatalogRecord> *matches, std::string *error)
+    @brief Finds the frames of a directory matching the criteria, through the sorted indexes, bringing the index file
+           up to date first. Matches are sorted by setting, then time.
+    @param directory Directory holding frames.catalog
+    @param query Criteria
+    @param matches Matching records
+    @param error Reason for a failure
+  @return False if the catalog could not be read
+*/
+bool QueryCatalog(const std::string &directory, const CatalogQuery &query, std::vector<CatalogRecord> *matches,
+                  std::string *error);
+
+#endif
@@ -0,0 +1,254 @@
+/**
+ * @file FramePool.cpp
+ *
+ * @brief Pool of reusable, page-aligned frame buffers.
+ *
+ */
+
+// Dependencies
+#include "FramePool.h"
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <chrono>
+
+using namespace std;
+
+static const size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+
+/**
+  @fn static long MinorFaults()
+  @return Minor page faults taken by the process so far
+*/
+static long MinorFaults()
+{
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_minflt;
+}
+
+/**
+  @fn static long ResidentKb()
+  @return Current resident set size of the process in kB
+*/
+static long ResidentKb()
+{
+  long pages = 0;
+  FILE *statm = fopen("/proc/self/statm", "r");
+  if (statm)
+  {
+    long size;
+    if (fscanf(statm, "%ld %ld", &size, &pages) != 2)
+    {
+      pages = 0;
+    }
+    fclose(statm);
+  }
+  return pages * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+FramePool::FramePool(size_t bufferLength, size_t numBuffers, bool useHugePages, bool lockMemory)
+    : bufferLength(bufferLength), pooled(numBuffers > 0), useHugePages(useHugePages), hugePages(useHugePages), lockMemory(lockMemory),
+      setupSeconds(0), leases(0), acquireSeconds(0), maxAcquireSeconds(0), waitSeconds(0)
+{
+  size_t pageSize = hugePages ? HUGE_PAGE_SIZE : (size_t)sysconf(_SC_PAGESIZE);
+  mapLength = (bufferLength + pageSize - 1) / pageSize * pageSize;
+
+  chrono::steady_clock::time_point setupStart = chrono::steady_clock::now();
+  for (size_t i = 0; i < numBuffers; i++)
+  {
+    unsigned char *buffer = MapBuffer();
+    if (!buffer)
+    {
+      break;
+    }
+
+    // Touch every page now so no frame pays for the page faults
+    memset(buffer, 0, bufferLength);
+
+    all.push_back(buffer);
+    available.push_back(buffer);
+  }
+  setupSeconds = chrono::duration<double>(chrono::steady_clock::now() - setupStart).count();
+
+  if (pooled)
+  {
+    printf("Frame buffer pool: %zu buffers of %zu bytes (%s%s), set up in %.3f s.\n", all.size(), bufferLength,
+           hugePages ? "huge pages" : (useHugePages ? "transparent huge pages" : "normal pages"), lockMemory ? ", locked" : "", setupSeconds);
+    if (all.empty())
+    {
+      printf("Could not allocate any pooled frame buffers, falling back to per-frame allocation.\n");
+      pooled = false;
+    }
+  }
+
+  startFaults = MinorFaults();
+  startRssKb = ResidentKb();
+  peakRssKb = startRssKb;
+}
+
+FramePool::~FramePool()
+{
+  for (size_t i = 0; i < all.size(); i++)
+  {
+    UnmapBuffer(all[i]);
+  }
+}
+
+unsigned char *FramePool::Acquire()
+{
+  return Lease(true);
+}
+
+/**
+  @fn unsigned char *FramePool::Lease(bool wait)
+    @brief Hands out a buffer and records the allocation statistics
+    @param wait Wait for a buffer to be returned if all are in use
+  @return Buffer, or 0 if none was free and wait is false
+*/
+unsigned char *FramePool::Lease(bool wait)
+{
+  unsigned char *buffer;
+  chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+  if (pooled)
+  {
+    unique_lock<mutex> guard(lock);
+    if (available.empty())
+    {
+      if (!wait)
+      {
+        return 0;
+      }
+      returned.wait(guard, [this] { return !available.empty(); });
+      waitSeconds += chrono::duration<double>(chrono::steady_clock::now() - start).count();
+      start = chrono::steady_clock::now();
+    }
+    buffer = available.back();
+    available.pop_back();
+  }
+  else
+  {
+    // Per-frame allocation, the way CamCapture used to do it
+    buffer = new unsigned char[bufferLength];
+    memset(buffer, 0, bufferLength);
+  }
+
+  double elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+  long rss = ResidentKb();
+
+  lock_guard<mutex> guard(lock);
+  leases++;
+  acquireSeconds += elapsed;
+  if (elapsed > maxAcquireSeconds)
+  {
+    maxAcquireSeconds = elapsed;
+  }
+  if (rss > peakRssKb)
+  {
+    peakRssKb = rss;
+  }
+  return buffer;
+}
+
+unsigned char *FramePool::TryAcquire()
+{
+  return Lease(false);
+}
+
+void FramePool::Release(unsigned char *buffer)
+{
+  if (!pooled)
+  {
+    long rss = ResidentKb();
+    delete[] buffer;
+
+    lock_guard<mutex> guard(lock);
+    if (rss > peakRssKb)
+    {
+      peakRssKb = rss;
+    }
+    return;
+  }
+
+  {
+    lock_guard<mutex> guard(lock);
+    available.push_back(buffer);
+  }
+  returned.notify_one();
+}
+
+void FramePool::PrintStats()
+{
+  lock_guard<mutex> guard(lock);
+
+  long faults = MinorFaults() - startFaults;
+  long rss = ResidentKb();
+
+  printf("Frame buffers: %lu leases (%s), allocation %.3f ms/frame on average, %.3f ms worst.\n", leases,
+         pooled ? "pooled" : "allocated per frame", leases ? acquireSeconds * 1000 / leases : 0.0,
+         maxAcquireSeconds * 1000);
+  printf("Capture waited %.2f s for a free frame buffer.\n", waitSeconds);
+  printf("Minor page faults: %.0f per frame. RSS: %ld MB after setup, %ld MB peak, %ld MB now.\n",
+         leases ? (double)faults / leases : 0.0, startRssKb / 1024, peakRssKb / 1024, rss / 1024);
+}
+
+/**
+  @fn unsigned char *FramePool::MapBuffer()
+    @brief Maps one page-aligned buffer, with huge pages and mlock if requested
+  @return The buffer, or 0 if it could not be mapped
+*/
+unsigned char *FramePool::MapBuffer()
+{
+  void *buffer = MAP_FAILED;
+
+  if (hugePages)
+  {
+    buffer = mmap(0, mapLength, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (buffer == MAP_FAILED)
+    {
+      printf("No huge pages available, using transparent huge pages instead.\n");
+      hugePages = false;
+    }
+  }
+
+  if (buffer == MAP_FAILED)
+  {
+    buffer = mmap(0, mapLength, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buffer == MAP_FAILED)
+    {
+      printf("Could not allocate a frame buffer of %zu bytes.\n", mapLength);
+      return 0;
+    }
+#ifdef MADV_HUGEPAGE
+    if (useHugePages)
+    {
+      madvise(buffer, mapLength, MADV_HUGEPAGE);
+    }
+#endif
+  }
+
+  if (lockMemory && mlock(buffer, mapLength) != 0)
+  {
+    printf("Could not lock frame buffer in memory (check ulimit -l), continuing unlocked.\n");
+    lockMemory = false;
+  }
+
+  return static_cast<unsigned char *>(buffer);
+}
+
+/**
+  @fn void FramePool::UnmapBuffer(unsigned char *buffer)
+    @brief Unlocks and unmaps a buffer created by MapBuffer
+    @param buffer Buffer to release
+*/
+void FramePool::UnmapBuffer(unsigned char *buffer)
+{
+  if (lockMemory)
+  {
+    munlock(buffer, mapLength);
+  }
+  munmap(buffer, mapLength);
+}
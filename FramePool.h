@@ -0,0 +1,96 @@
+/**
+ * @file FramePool.h
+ *
+ * @brief Pool of reusable, page-aligned frame buffers.
+ * Buffers are sized once from GetQHYCCDMemLength and leased to the capture loop for each frame;
+ * the writer returns the lease once the frame is on disk.
+ *
+ */
+
+#ifndef FRAMEPOOL_H
+#define FRAMEPOOL_H
+
+#include <stddef.h>
+#include <condition_variable>
+#include <mutex>
+#include <vector>
+
+/**
+  @class FramePool
+    @brief Fixed set of frame buffers handed out and returned for every frame of the sweep
+*/
+class FramePool
+{
+public:
+  /**
+    @fn FramePool(size_t bufferLength, size_t numBuffers, bool useHugePages, bool lockMemory)
+      @brief Allocates and pre-faults the buffers
+      @param bufferLength Size of each buffer in bytes (from GetQHYCCDMemLength)
+      @param numBuffers Number of buffers (0 allocates and frees a buffer for every frame, as older versions did)
+      @param useHugePages Back the buffers with huge pages if the system has them
+      @param lockMemory mlock the buffers so they are never paged out
+  */
+  FramePool(size_t bufferLength, size_t numBuffers, bool useHugePages, bool lockMemory);
+  ~FramePool();
+
+  /**
+    @fn unsigned char *Acquire()
+      @brief Leases a buffer, blocking until one has been returned if all are in use
+    @return Buffer of at least BufferLength() bytes
+  */
+  unsigned char *Acquire();
+
+  /**
+    @fn unsigned char *TryAcquire()
+      @brief Leases a buffer without waiting
+    @return Buffer, or 0 if every pooled buffer is in use
+  */
+  unsigned char *TryAcquire();
+
+  /**
+    @fn void Release(unsigned char *buffer)
+      @brief Returns a leased buffer to the pool
+      @param buffer Buffer obtained from Acquire
+  */
+  void Release(unsigned char *buffer);
+
+  /**
+    @fn size_t BufferLength() const
+    @return Size of each buffer in bytes
+  */
+  size_t BufferLength() const { return bufferLength; }
+
+  /**
+    @fn void PrintStats()
+      @brief Prints per-frame buffer acquisition time, page faults and resident memory
+  */
+  void PrintStats();
+
+private:
+  unsigned char *Lease(bool wait);
+  unsigned char *MapBuffer();
+  void UnmapBuffer(unsigned char *buffer);
+
+  size_t bufferLength;                 // Requested buffer size
+  size_t mapLength;                    // Size actually mapped (rounded up to the page size)
+  bool pooled;                         // False when buffers are allocated per frame
+  bool useHugePages;                   // True if huge pages were requested
+  bool hugePages;                      // True while explicit huge pages are still being used
+  bool lockMemory;                     // True if the buffers should be mlocked
+  std::vector<unsigned char *> all;    // Every buffer owned by the pool
+  std::vector<unsigned char *> available; // Buffers not currently leased
+  std::mutex lock;
+  std::condition_variable returned;    // Signalled when a buffer is released
+
+  // Statistics
+  double setupSeconds;       // Time to allocate and pre-fault the pool
+  unsigned long leases;      // Buffers handed out
+  double acquireSeconds;     // Total time spent allocating in Acquire
+  double maxAcquireSeconds;  // Slowest single allocation
+  double waitSeconds;        // Total time Acquire waited for a returned buffer
+  long startFaults;          // Minor page faults when the pool was created (after setup)
+  long startRssKb;           // Resident set size after setup
+  long peakRssKb;            // Highest resident set size seen at Acquire/Release
+};
+
+#endif
@@ -0,0 +1,441 @@
+/**
+ * @file FramePreview.cpp
+ *
+ * @brief Quick-look previews of each frame: an NxN software-binned FITS image and an 8-bit PNG thumbnail.
+ *
+ */
+
+// Dependencies
+#include "FramePreview.h"
+#include "FrameWriter.h"
+#include "Timing.h"
+#include <stdio.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+using namespace std;
+
+static const int ROWS_PER_CLAIM = 16;       // Binned rows a thread claims at a time
+static const double STRETCH_LOW = 0.005;    // Fraction of thumbnail pixels shown black
+static const double STRETCH_HIGH = 0.995;   // Fraction of thumbnail pixels below white
+
+/**
+  @fn static void AccumulateScalar(const unsigned short *row, uint32_t *sums, unsigned int count)
+    @brief Adds a row of pixels to 32-bit accumulators
+    @param row Pixels
+    @param sums Accumulators, one per pixel
+    @param count Number of pixels
+*/
+static void AccumulateScalar(const unsigned short *row, uint32_t *sums, unsigned int count)
+{
+  for (unsigned int x = 0; x < count; x++)
+  {
+    sums[x] += row[x];
+  }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/**
+  @fn static void AccumulateSSE2(const unsigned short *row, uint32_t *sums, unsigned int count)
+    @brief SSE2 accumulate kernel, 8 pixels per step
+    @param row Pixels
+    @param sums Accumulators
+    @param count Number of pixels
+*/
+__attribute__((target("sse2"))) static void AccumulateSSE2(const unsigned short *row, uint32_t *sums,
+                                                           unsigned int count)
+{
+  const __m128i zero = _mm_setzero_si128();
+  unsigned int x = 0;
+  for (; x + 8 <= count; x += 8)
+  {
+    __m128i pixels = _mm_loadu_si128((const __m128i *)(row + x));
+    __m128i *low = (__m128i *)(sums + x);
+    __m128i *high = (__m128i *)(sums + x + 4);
+    _mm_storeu_si128(low, _mm_add_epi32(_mm_loadu_si128(low), _mm_unpacklo_epi16(pixels, zero)));
+    _mm_storeu_si128(high, _mm_add_epi32(_mm_loadu_si128(high), _mm_unpackhi_epi16(pixels, zero)));
+  }
+  AccumulateScalar(row + x, sums + x, count - x);
+}
+
+/**
+  @fn static void AccumulateAVX2(const unsigned short *row, uint32_t *sums, unsigned int count)
+    @brief AVX2 accumulate kernel, 16 pixels per step
+    @param row Pixels
+    @param sums Accumulators
+    @param count Number of pixels
+*/
+__attribute__((target("avx2"))) static void AccumulateAVX2(const unsigned short *row, uint32_t *sums,
+                                                           unsigned int count)
+{
+  unsigned int x = 0;
+  for (; x + 16 <= count; x += 16)
+  {
+    __m128i first = _mm_loadu_si128((const __m128i *)(row + x));
+    __m128i second = _mm_loadu_si128((const __m128i *)(row + x + 8));
+    __m256i *low = (__m256i *)(sums + x);
+    __m256i *high = (__m256i *)(sums + x + 8);
+    _mm256_storeu_si256(low, _mm256_add_epi32(_mm256_loadu_si256(low), _mm256_cvtepu16_epi32(first)));
+    _mm256_storeu_si256(high, _mm256_add_epi32(_mm256_loadu_si256(high), _mm256_cvtepu16_epi32(second)));
+  }
+  AccumulateScalar(row + x, sums + x, count - x);
+}
+#endif
+
+typedef void (*AccumulateKernel)(const unsigned short *, uint32_t *, unsigned int);
+
+/**
+  @fn static AccumulateKernel SelectKernel()
+    @brief Picks the fastest accumulate kernel the CPU supports
+  @return Kernel
+*/
+static AccumulateKernel SelectKernel()
+{
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+  {
+    return AccumulateAVX2;
+  }
+  if (__builtin_cpu_supports("sse2"))
+  {
+    return AccumulateSSE2;
+  }
+#endif
+  return AccumulateScalar;
+}
+
+static const AccumulateKernel kernel = SelectKernel();
+
+/**
+  @fn static void PutBigEndian(unsigned char *out, uint32_t value)
+    @brief Stores a 32-bit value most significant byte first, as PNG wants
+    @param out Four bytes
+    @param value Value
+*/
+static void PutBigEndian(unsigned char *out, uint32_t value)
+{
+  out[0] = (unsigned char)(value >> 24);
+  out[1] = (unsigned char)(value >> 16);
+  out[2] = (unsigned char)(value >> 8);
+  out[3] = (unsigned char)value;
+}
+
+/**
+  @fn static bool WriteChunk(FILE *file, const char *type, const unsigned char *data, size_t length)
+    @brief Writes a PNG chunk: length, type, data and the CRC-32 of type and data
+    @param file Open PNG file
+    @param type Four-letter chunk type
+    @param data Chunk data
+    @param length Data length
+  @return True if written
+*/
+static bool WriteChunk(FILE *file, const char *type, const unsigned char *data, size_t length)
+{
+  unsigned char header[8], trailer[4];
+  PutBigEndian(header, (uint32_t)length);
+  copy(type, type + 4, header + 4);
+  uLong crc = crc32(0L, header + 4, 4);
+  if (length > 0)
+  {
+    crc = crc32(crc, data, (uInt)length);
+  }
+  PutBigEndian(trailer, (uint32_t)crc);
+  return fwrite(header, 1, 8, file) == 8 && fwrite(data, 1, length, file) == length &&
+         fwrite(trailer, 1, 4, file) == 4;
+}
+
+/**
+  @fn static bool WritePng(const string &fileName, const vector<unsigned char> &pixels, unsigned int width, unsigned int height)
+    @brief Writes an 8-bit grayscale PNG (no filtering, zlib compressed)
+    @param fileName PNG file
+    @param pixels Pixels, row by row
+    @param width Image width
+    @param height Image height
+  @return True if written
+*/
+static bool WritePng(const string &fileName, const vector<unsigned char> &pixels, unsigned int width,
+                     unsigned int height)
+{
+  // Every row starts with its filter type (0, none)
+  vector<unsigned char> raw((size_t)(width + 1) * height);
+  for (unsigned int y = 0; y < height; y++)
+  {
+    raw[(size_t)y * (width + 1)] = 0;
+    copy(pixels.begin() + (size_t)y * width, pixels.begin() + (size_t)(y + 1) * width,
+         raw.begin() + (size_t)y * (width + 1) + 1);
+  }
+  uLongf compressedLength = compressBound(raw.size());
+  vector<unsigned char> compressed(compressedLength);
+  if (compress2(compressed.data(), &compressedLength, raw.data(), raw.size(), Z_BEST_SPEED) != Z_OK)
+  {
+    return false;
+  }
+
+  FILE *file = fopen(fileName.c_str(), "wb");
+  if (file == NULL)
+  {
+    return false;
+  }
+  static const unsigned char signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+  unsigned char header[13];
+  PutBigEndian(header, width);
+  PutBigEndian(header + 4, height);
+  header[8] = 8;  // Bit depth
+  header[9] = 0;  // Grayscale
+  header[10] = 0; // Deflate
+  header[11] = 0; // Adaptive filtering
+  header[12] = 0; // Not interlaced
+  bool ok = fwrite(signature, 1, 8, file) == 8 && WriteChunk(file, "IHDR", header, sizeof(header)) &&
+            WriteChunk(file, "IDAT", compressed.data(), compressedLength) && WriteChunk(file, "IEND", NULL, 0);
+  return fclose(file) == 0 && ok;
+}
+
+/**
+  @fn static vector<unsigned char> Thumbnail(const BinnedFrame &binned, int blockPixels, int maxWidth, unsigned int *width, unsigned int *height)
+    @brief Averages the binned frame down to at most maxWidth pixels across and stretches it to 8 bits, linearly
+           between the STRETCH_LOW and STRETCH_HIGH fractions of its pixels
+    @param binned Binned frame
+    @param blockPixels Frame pixels summed into each binned pixel
+    @param maxWidth Greatest thumbnail width
+    @param width Thumbnail width
+    @param height Thumbnail height
+  @return Thumbnail pixels
+*/
+static vector<unsigned char> Thumbnail(const BinnedFrame &binned, int blockPixels, int maxWidth, unsigned int *width,
+                                       unsigned int *height)
+{
+  unsigned int factor = max(1u, (binned.sizeX + maxWidth - 1) / maxWidth);
+  *width = binned.sizeX / factor;
+  *height = binned.sizeY / factor;
+  double scale = 1.0 / ((double)factor * factor * blockPixels);
+
+  // Mean of each thumbnail block, in ADU
+  vector<unsigned short> levels((size_t)*width * *height);
+  vector<unsigned long> histogram(65536, 0);
+  for (unsigned int y = 0; y < *height; y++)
+  {
+    for (unsigned int x = 0; x < *width; x++)
+    {
+      uint64_t total = 0;
+      for (unsigned int dy = 0; dy < factor; dy++)
+      {
+        const uint32_t *sums = binned.sums.data() + (size_t)(y * factor + dy) * binned.sizeX + x * factor;
+        for (unsigned int dx = 0; dx < factor; dx++)
+        {
+          total += sums[dx];
+        }
+      }
+      unsigned short level = (unsigned short)min(65535.0, total * scale + 0.5);
+      levels[(size_t)y * *width + x] = level;
+      histogram[level]++;
+    }
+  }
+
+  // Stretch between the percentiles
+  size_t count = levels.size();
+  size_t seen = 0;
+  int low = 0, high = 65535;
+  for (int level = 0; level < 65536; level++)
+  {
+    if (seen <= STRETCH_LOW * count && seen + histogram[level] > STRETCH_LOW * count)
+    {
+      low = level;
+    }
+    seen += histogram[level];
+    if (seen >= STRETCH_HIGH * count)
+    {
+      high = level;
+      break;
+    }
+  }
+  double range = max(1, high - low);
+  vector<unsigned char> pixels(count);
+  for (size_t i = 0; i < count; i++)
+  {
+    pixels[i] = (unsigned char)min(255.0, max(0.0, (levels[i] - low) * 255.0 / range + 0.5));
+  }
+  return pixels;
+}
+
+FramePreview::FramePreview(int binFactor, bool sum, int pngWidth, int numThreads)
+    : binFactor(binFactor > 0 ? binFactor : 1), sum(sum), pngWidth(pngWidth), numThreads(numThreads > 0 ? numThreads : 1),
+      binned(0), written(0), errors(0), binSeconds(0), writeSeconds(0), previewBytes(0)
+{
+}
+
+BinnedFrame FramePreview::Bin(const FrameJob &job)
+{
+  double start = MonotonicSeconds();
+  const unsigned short *pixels = reinterpret_cast<const unsigned short *>(job.pImgData);
+  unsigned int sizeX = job.roiSizeX;
+  unsigned int factor = binFactor;
+
+  BinnedFrame frame;
+  frame.sizeX = job.roiSizeX / factor;
+  frame.sizeY = job.roiSizeY / factor;
+  frame.sums.resize((size_t)frame.sizeX * frame.sizeY);
+
+  // Name the previews after the frame, without its extension
+  size_t extension = job.fileName.rfind(".fits");
+  string base = extension == string::npos ? job.fileName : job.fileName.substr(0, extension);
+  frame.fitsName = base + "_preview.fits";
+  if (pngWidth > 0)
+  {
+    frame.pngName = base + "_preview.png";
+  }
+
+  // Add up each band of binFactor rows, then the groups of binFactor columns
+  atomic<unsigned int> nextRow(0);
+  auto binBands = [&]() {
+    vector<uint32_t> rowSums(frame.sizeX * factor);
+    while (true)
+    {
+      unsigned int first = nextRow.fetch_add(ROWS_PER_CLAIM);
+      if (first >= frame.sizeY)
+      {
+        return;
+      }
+      unsigned int last = min(frame.sizeY, first + ROWS_PER_CLAIM);
+      for (unsigned int y = first; y < last; y++)
+      {
+        fill(rowSums.begin(), rowSums.end(), 0);
+        for (unsigned int dy = 0; dy < factor; dy++)
+        {
+          kernel(pixels + (size_t)(y * factor + dy) * sizeX, rowSums.data(), frame.sizeX * factor);
+        }
+        uint32_t *out = frame.sums.data() + (size_t)y * frame.sizeX;
+        for (unsigned int x = 0; x < frame.sizeX; x++)
+        {
+          uint32_t total = 0;
+          for (unsigned int dx = 0; dx < factor; dx++)
+          {
+            total += rowSums[x * factor + dx];
+          }
+          out[x] = total;
+        }
+      }
+    }
+  };
+
+  vector<thread> workers;
+  for (int i = 1; i < numThreads; i++)
+  {
+    workers.push_back(thread(binBands));
+  }
+  binBands();
+  for (size_t i = 0; i < workers.size(); i++)
+  {
+    workers[i].join();
+  }
+
+  double end = MonotonicSeconds();
+  TimingSpan(PHASE_DETAIL, "Preview binning", start, end);
+  lock_guard<mutex> guard(lock);
+  binned++;
+  binSeconds += end - start;
+  return frame;
+}
+
+void FramePreview::Write(const BinnedFrame &frame, const FrameJob &job)
+{
+  double start = MonotonicSeconds();
+  int blockPixels = binFactor * binFactor;
+  const char *fitsfilename = frame.fitsName.c_str();
+
+  // Binned FITS image: sums as 32-bit integers, means as 16-bit like the frames
+  fitsfile *fptr;
+  int status = 0;
+  long naxes[2] = {(long)frame.sizeX, (long)frame.sizeY};
+  remove(fitsfilename);
+  fits_create_file(&fptr, fitsfilename, &status);
+  fits_create_img(fptr, sum ? LONG_IMG : USHORT_IMG, 2, naxes, &status);
+
+  // The settings of the frame; its statistics do not describe the binned pixels
+  FrameJob keys = job;
+  keys.hasStats = false;
+  WriteFrameKeys(fptr, keys, &status);
+  int factor = binFactor;
+  fits_update_key(fptr, TINT, "XBINNING", &factor, "Software binning in X", &status);
+  fits_update_key(fptr, TINT, "YBINNING", &factor, "Software binning in Y", &status);
+  fits_update_key(fptr, TSTRING, "BINCOMB", (void *)(sum ? "SUM" : "MEAN"), "Combination of each binned block", &status);
+
+  LONGLONG count = (LONGLONG)frame.sums.size();
+  if (sum)
+  {
+    vector<int> values(frame.sums.begin(), frame.sums.end());
+    fits_write_img(fptr, TINT, 1, count, values.data(), &status);
+  }
+  else
+  {
+    vector<unsigned short> values(frame.sums.size());
+    for (size_t i = 0; i < values.size(); i++)
+    {
+      values[i] = (unsigned short)((frame.sums[i] + blockPixels / 2) / blockPixels);
+    }
+    fits_write_img(fptr, TUSHORT, 1, count, values.data(), &status);
+  }
+
+  // Close File (always, so a failed write does not leak the handle)
+  int closeStatus = 0;
+  fits_close_file(fptr, &closeStatus);
+  if (status == 0)
+  {
+    status = closeStatus;
+  }
+  if (status != 0)
+  {
+    char errText[FLEN_STATUS];
+    fits_get_errstatus(status, errText);
+    printf("Could not write %s. CFITSIO error: %d (%s).\n", fitsfilename, status, errText);
+  }
+
+  // Thumbnail
+  bool pngOk = true;
+  if (!frame.pngName.empty() && frame.sizeX > 0 && frame.sizeY > 0)
+  {
+    unsigned int width, height;
+    vector<unsigned char> thumbnail = Thumbnail(frame, blockPixels, pngWidth, &width, &height);
+    pngOk = WritePng(frame.pngName, thumbnail, width, height);
+    if (!pngOk)
+    {
+      printf("Could not write %s.\n", frame.pngName.c_str());
+    }
+  }
+
+  double bytes = 0;
+  struct stat fileInfo;
+  if (stat(fitsfilename, &fileInfo) == 0 && status == 0)
+  {
+    bytes += fileInfo.st_size;
+  }
+  if (!frame.pngName.empty() && stat(frame.pngName.c_str(), &fileInfo) == 0 && pngOk)
+  {
+    bytes += fileInfo.st_size;
+  }
+
+  double end = MonotonicSeconds();
+  lock_guard<mutex> guard(lock);
+  written++;
+  errors += status != 0 || !pngOk;
+  writeSeconds += end - start;
+  previewBytes += bytes;
+}
+
+void FramePreview::PrintStats()
+{
+  lock_guard<mutex> guard(lock);
+  if (binned == 0)
+  {
+    return;
+  }
+  printf("Previews (%dx%d %s%s): %lu written, %lu with errors, %.1f MB, binning %.1f ms and writing %.1f ms per frame.\n",
+         binFactor, binFactor, sum ? "sum" : "mean", pngWidth > 0 ? " and thumbnail" : "", written, errors,
+         previewBytes / 1e6, 1000 * binSeconds / binned, written ? 1000 * writeSeconds / written : 0.0);
+}
@@ -0,0 +1,89 @@
+/**
+ * @file FramePreview.h
+ *
+ * @brief Quick-look previews of each frame: an NxN software-binned FITS image and an 8-bit PNG thumbnail.
+ * Binning adds N rows at a time into 32-bit accumulators (SSE2 or AVX2 widening adds where available), then sums
+ * groups of N columns, in parallel over bands of output rows. It runs on the writer thread before the full-resolution
+ * write converts the pixels; the binned image is then written by a helper thread while the full-resolution frame goes
+ * to disk. The thumbnail is the binned image averaged down to a given width and stretched linearly between the 0.5th
+ * and 99.5th percentiles.
+ *
+ */
+
+#ifndef FRAMEPREVIEW_H
+#define FRAMEPREVIEW_H
+
+#include <stdint.h>
+#include <mutex>
+#include <string>
+#include <vector>
+
+struct FrameJob;
+
+/**
+  @struct BinnedFrame
+    @brief A binned frame waiting to be written
+*/
+struct BinnedFrame
+{
+  unsigned int sizeX;          // Binned size in X (partial blocks at the right edge are left out)
+  unsigned int sizeY;          // Binned size in Y (partial blocks at the bottom are left out)
+  std::vector<uint32_t> sums;  // Sum of each NxN block
+  std::string fitsName;        // Binned FITS file
+  std::string pngName;         // Thumbnail file (empty for none)
+};
+
+/**
+  @class FramePreview
+    @brief Bins frames and writes their previews next to them; called by the writer threads
+*/
+class FramePreview
+{
+public:
+  /**
+    @fn FramePreview(int binFactor, bool sum, int pngWidth, int numThreads)
+      @param binFactor Pixels binned in X and Y
+      @param sum True to store the sum of each block, false for its mean
+      @param pngWidth Greatest width of the thumbnail (0 for no thumbnail)
+      @param numThreads Threads binning each frame
+  */
+  FramePreview(int binFactor, bool sum, int pngWidth, int numThreads);
+
+  /**
+    @fn BinnedFrame Bin(const FrameJob &job)
+      @brief Bins a frame. Must be called before the pixels are converted for writing.
+      @param job Frame to bin
+    @return Binned frame, named after the frame
+  */
+  BinnedFrame Bin(const FrameJob &job);
+
+  /**
+    @fn void Write(const BinnedFrame &frame, const FrameJob &job)
+      @brief Writes the binned FITS image, with the frame's header keys, and the thumbnail. May run on a helper
+             thread while the frame itself is written.
+      @param frame Binned frame
+      @param job Frame it was binned from (only its settings and statistics are read)
+  */
+  void Write(const BinnedFrame &frame, const FrameJob &job);
+
+  /**
+    @fn void PrintStats()
+      @brief Prints the previews written and the time spent on them per frame
+  */
+  void PrintStats();
+
+private:
+  int binFactor;
+  bool sum;
+  int pngWidth;
+  int numThreads;
+  std::mutex lock;
+  unsigned long binned;      // Frames binned
+  unsigned long written;     // Previews written
+  unsigned long errors;      // Previews that could not be written
+  double binSeconds;         // Time spent binning
+  double writeSeconds;       // Time spent writing
+  double previewBytes;       // Bytes written
+};
+
+#endif
@@ -0,0 +1,485 @@
+/**
+ * @file FrameQuality.cpp
+ *
+ * @brief Quality check of each frame before it is written.
+ *
+ */
+
+// Dependencies
+#include "FrameQuality.h"
+#include "Timing.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <string>
+#include <thread>
+#include <vector>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+using namespace std;
+
+static const int ROWS_PER_CLAIM = 64;         // Rows a thread claims at a time
+static const int NOISE_ROW_STEP = 32;         // Rows between those sampled for the noise estimate
+static const int NOISE_HISTOGRAM = 4096;      // Differences counted exactly; larger ones share the last bin
+static const double COSMIC_SIGMA = 10.0;      // Noise multiples a hit must stand out from its neighbours by
+static const int COSMIC_MIN_ADU = 64;         // Least a hit must stand out by, for frames with little noise
+static const int ROW_BLOCKS = 32;             // Blocks a row is split into; the row level is the median block mean
+static const int BANDING_WINDOW = 32;         // Rows either side a row level is compared with
+static const double BANDING_SIGMA = 6.0;      // Spread of the row levels a banded row is offset by
+static const double BANDING_MIN_SPREAD = 0.1; // Least spread assumed, for frames with no noise (ADU)
+static const int BANDING_MIN_ROWS = 4;        // Banded rows for a frame to fail
+
+/**
+  @fn static void HitsScalar(const unsigned short *up, const unsigned short *row, const unsigned short *down, unsigned int width, int threshold, unsigned int first, uint64_t *hitBits, unsigned int *orValue)
+    @brief Marks the pixels that exceed the lower of their left and right neighbours, and the lower of their upper
+           and lower neighbours, by more than a threshold; a track along a row or column still stands out against
+           the other pair
+    @param up Row above
+    @param row Row to scan (its first and last pixels are never marked)
+    @param down Row below
+    @param width Pixels per row
+    @param threshold Margin in ADU
+    @param first First pixel to scan
+    @param hitBits One bit per pixel of the row, 64 pixels to a word, set for the pixels marked (not cleared)
+    @param orValue OR of the pixel values of the row, to find zero rows
+*/
+static void HitsScalar(const unsigned short *up, const unsigned short *row, const unsigned short *down,
+                       unsigned int width, int threshold, unsigned int first, uint64_t *hitBits, unsigned int *orValue)
+{
+  unsigned int any = row[0] | row[width - 1];
+  for (unsigned int x = max(first, 1u); x + 1 < width; x++)
+  {
+    int value = row[x];
+    int across = min(row[x - 1], row[x + 1]);
+    int along = min(up[x], down[x]);
+    if (value > max(across, along) + threshold)
+    {
+      hitBits[x / 64] |= (uint64_t)1 << (x % 64);
+    }
+    any |= value;
+  }
+  *orValue = any;
+}
+
+/**
+  @fn static void SetHitBits(uint64_t *hitBits, unsigned int x, uint64_t bits, int count)
+    @brief Sets the bits of count consecutive pixels starting at x, which may straddle two words
+*/
+static void SetHitBits(uint64_t *hitBits, unsigned int x, uint64_t bits, int count)
+{
+  unsigned int shift = x % 64;
+  hitBits[x / 64] |= bits << shift;
+  if (shift + count > 64)
+  {
+    hitBits[x / 64 + 1] |= bits >> (64 - shift);
+  }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/**
+  @fn static void HitsSSE2(const unsigned short *up, const unsigned short *row, const unsigned short *down, unsigned int width, int threshold, unsigned int first, uint64_t *hitBits, unsigned int *orValue)
+    @brief SSE2 hit kernel, 8 pixels per step
+    @param up Row above
+    @param row Row to scan
+    @param down Row below
+    @param width Pixels per row
+    @param threshold Margin in ADU
+    @param first Unused (the whole row is scanned)
+    @param hitBits Bits of the pixels marked
+    @param orValue OR of the pixel values of the row
+*/
+__attribute__((target("sse2"))) static void HitsSSE2(const unsigned short *up, const unsigned short *row,
+                                                     const unsigned short *down, unsigned int width, int threshold,
+                                                     unsigned int first, uint64_t *hitBits, unsigned int *orValue)
+{
+  (void)first;
+  // Unsigned min and max as signed ones, with the sign bit flipped
+  const __m128i flip = _mm_set1_epi16((short)0x8000);
+  const __m128i margin = _mm_set1_epi16((short)threshold);
+  const __m128i zero = _mm_setzero_si128();
+  __m128i any = zero;
+  unsigned int x = 1;
+  for (; x + 8 < width; x += 8)
+  {
+    __m128i value = _mm_loadu_si128((const __m128i *)(row + x));
+    __m128i left = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(row + x - 1)), flip);
+    __m128i right = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(row + x + 1)), flip);
+    __m128i above = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(up + x)), flip);
+    __m128i below = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(down + x)), flip);
+    __m128i base = _mm_xor_si128(_mm_max_epi16(_mm_min_epi16(left, right), _mm_min_epi16(above, below)), flip);
+    // The saturating add keeps bright neighbours at 65535, which nothing exceeds
+    __m128i excess = _mm_subs_epu16(value, _mm_adds_epu16(base, margin));
+    int quiet = _mm_movemask_epi8(_mm_packs_epi16(_mm_cmpeq_epi16(excess, zero), zero));
+    if ((quiet & 0xFF) != 0xFF)
+    {
+      SetHitBits(hitBits, x, ~quiet & 0xFF, 8);
+    }
+    any = _mm_or_si128(any, value);
+  }
+  unsigned short lanes[8];
+  _mm_storeu_si128((__m128i *)lanes, any);
+  HitsScalar(up, row, down, width, threshold, x, hitBits, orValue);
+  for (int i = 0; i < 8; i++)
+  {
+    *orValue |= lanes[i];
+  }
+}
+
+/**
+  @fn static void HitsAVX2(const unsigned short *up, const unsigned short *row, const unsigned short *down, unsigned int width, int threshold, unsigned int first, uint64_t *hitBits, unsigned int *orValue)
+    @brief AVX2 hit kernel, 16 pixels per step
+    @param up Row above
+    @param row Row to scan
+    @param down Row below
+    @param width Pixels per row
+    @param threshold Margin in ADU
+    @param first Unused (the whole row is scanned)
+    @param hitBits Bits of the pixels marked
+    @param orValue OR of the pixel values of the row
+*/
+__attribute__((target("avx2"))) static void HitsAVX2(const unsigned short *up, const unsigned short *row,
+                                                     const unsigned short *down, unsigned int width, int threshold,
+                                                     unsigned int first, uint64_t *hitBits, unsigned int *orValue)
+{
+  (void)first;
+  const __m256i margin = _mm256_set1_epi16((short)threshold);
+  const __m256i zero = _mm256_setzero_si256();
+  __m256i any = zero;
+  unsigned int x = 1;
+  for (; x + 16 < width; x += 16)
+  {
+    __m256i value = _mm256_loadu_si256((const __m256i *)(row + x));
+    __m256i across = _mm256_min_epu16(_mm256_loadu_si256((const __m256i *)(row + x - 1)),
+                                      _mm256_loadu_si256((const __m256i *)(row + x + 1)));
+    __m256i along = _mm256_min_epu16(_mm256_loadu_si256((const __m256i *)(up + x)),
+                                     _mm256_loadu_si256((const __m256i *)(down + x)));
+    __m256i excess = _mm256_subs_epu16(value, _mm256_adds_epu16(_mm256_max_epu16(across, along), margin));
+    __m256i same = _mm256_cmpeq_epi16(excess, zero);
+    // Packing the two halves across lanes keeps the pixels in order
+    int quiet = _mm_movemask_epi8(_mm_packs_epi16(_mm256_castsi256_si128(same), _mm256_extracti128_si256(same, 1)));
+    if (quiet != 0xFFFF)
+    {
+      SetHitBits(hitBits, x, ~quiet & 0xFFFF, 16);
+    }
+    any = _mm256_or_si256(any, value);
+  }
+  unsigned short lanes[16];
+  _mm256_storeu_si256((__m256i *)lanes, any);
+  HitsScalar(up, row, down, width, threshold, x, hitBits, orValue);
+  for (int i = 0; i < 16; i++)
+  {
+    *orValue |= lanes[i];
+  }
+}
+#endif
+
+typedef void (*HitKernel)(const unsigned short *, const unsigned short *, const unsigned short *, unsigned int, int,
+                          unsigned int, uint64_t *, unsigned int *);
+
+/**
+  @fn static HitKernel SelectKernel()
+    @brief Picks the fastest hit kernel the CPU supports
+  @return Kernel
+*/
+static HitKernel SelectKernel()
+{
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+  {
+    return HitsAVX2;
+  }
+  if (__builtin_cpu_supports("sse2"))
+  {
+    return HitsSSE2;
+  }
+#endif
+  return HitsScalar;
+}
+
+static const HitKernel kernel = SelectKernel();
+
+/**
+  @fn static double EstimateNoise(const unsigned short *pixels, unsigned int sizeX, unsigned int sizeY)
+    @brief Estimates the pixel noise from the median absolute difference of neighbouring pixels in a sample of rows,
+           which gradients, hot pixels and hits barely move
+    @param pixels Frame pixels
+    @param sizeX Frame width
+    @param sizeY Frame height
+  @return Standard deviation of one pixel (ADU)
+*/
+static double EstimateNoise(const unsigned short *pixels, unsigned int sizeX, unsigned int sizeY)
+{
+  vector<unsigned long> histogram(NOISE_HISTOGRAM, 0);
+  unsigned long count = 0;
+  for (unsigned int y = NOISE_ROW_STEP / 2; y < sizeY; y += NOISE_ROW_STEP)
+  {
+    const unsigned short *row = pixels + (size_t)y * sizeX;
+    for (unsigned int x = 0; x + 1 < sizeX; x++)
+    {
+      int difference = abs((int)row[x + 1] - (int)row[x]);
+      histogram[min(difference, NOISE_HISTOGRAM - 1)]++;
+    }
+    count += sizeX - 1;
+  }
+  unsigned long seen = 0;
+  int median = 0;
+  while (median < NOISE_HISTOGRAM - 1 && (seen += histogram[median]) * 2 < count)
+  {
+    median++;
+  }
+  // The difference of two pixels has sqrt(2) times their noise
+  return 1.4826 * median / sqrt(2.0);
+}
+
+/**
+  @fn static float RowLevel(const unsigned short *row, unsigned int width)
+    @brief Level of a row: the median of the means of ROW_BLOCKS blocks, which hits and hot pixels confined to a few
+           blocks do not move
+    @param row Row pixels
+    @param width Pixels per row
+  @return Row level (ADU)
+*/
+static float RowLevel(const unsigned short *row, unsigned int width)
+{
+  int blocks = (int)min((unsigned int)ROW_BLOCKS, width);
+  float means[ROW_BLOCKS];
+  for (int b = 0; b < blocks; b++)
+  {
+    unsigned int first = (unsigned int)((unsigned long)width * b / blocks);
+    unsigned int last = (unsigned int)((unsigned long)width * (b + 1) / blocks);
+    unsigned long sum = 0;
+    for (unsigned int x = first; x < last; x++)
+    {
+      sum += row[x];
+    }
+    means[b] = (float)sum / (last - first);
+  }
+  nth_element(means, means + blocks / 2, means + blocks);
+  return means[blocks / 2];
+}
+
+/**
+  @fn static int CountBandedRows(const vector<float> &rowLevels)
+    @brief Counts the rows whose level is offset from the median of the rows around it by more than BANDING_SIGMA
+           times the robust spread of those offsets; comparing with nearby rows ignores smooth gradients
+    @param rowLevels Level of each row
+  @return Banded rows
+*/
+static int CountBandedRows(const vector<float> &rowLevels)
+{
+  int rows = (int)rowLevels.size();
+  vector<float> offsets(rows), window;
+  for (int y = 0; y < rows; y++)
+  {
+    int first = max(0, y - BANDING_WINDOW);
+    int last = min(rows, y + BANDING_WINDOW + 1);
+    window.assign(rowLevels.begin() + first, rowLevels.begin() + last);
+    nth_element(window.begin(), window.begin() + window.size() / 2, window.end());
+    offsets[y] = fabs(rowLevels[y] - window[window.size() / 2]);
+  }
+  vector<float> sorted(offsets);
+  nth_element(sorted.begin(), sorted.begin() + rows / 2, sorted.end());
+  double spread = max(1.4826 * sorted[rows / 2], BANDING_MIN_SPREAD);
+  int banded = 0;
+  for (int y = 0; y < rows; y++)
+  {
+    banded += offsets[y] > BANDING_SIGMA * spread;
+  }
+  return banded;
+}
+
+QualityGate::QualityGate(double cosmicLimit, int numThreads)
+    : cosmicLimit(cosmicLimit), numThreads(numThreads > 0 ? numThreads : 1), checked(0), failed(0), retakes(0),
+      kept(0), unreferenced(0), checkSeconds(0), previousSizeX(0)
+{
+  fill(failures, failures + QUALITY_FLAG_COUNT, 0);
+
+  // More threads than cores only queue up behind each other (and behind the writers)
+  int cores = (int)thread::hardware_concurrency();
+  if (cores > 0 && this->numThreads > cores)
+  {
+    this->numThreads = cores;
+  }
+}
+
+FrameQuality QualityGate::Check(const unsigned short *pixels, unsigned int sizeX, unsigned int sizeY,
+                                unsigned int roiSizeX, unsigned int roiSizeY, bool readoutOk)
+{
+  double start = MonotonicSeconds();
+  FrameQuality quality = {0, 0, 0, 0, 0, 0, 0};
+  if (!readoutOk)
+  {
+    quality.flags |= QUALITY_READOUT;
+  }
+  else if (sizeX != roiSizeX || sizeY != roiSizeY || sizeX < 3 || sizeY < 3)
+  {
+    quality.flags |= QUALITY_TRUNCATED;
+  }
+  else
+  {
+    quality.noise = EstimateNoise(pixels, sizeX, sizeY);
+    int threshold = (int)min(65535.0, max((double)COSMIC_MIN_ADU, ceil(COSMIC_SIGMA * quality.noise)));
+
+    // One pass over row bands: hits and zero rows from the kernel, and the level of every row. The previous frame's
+    // outliers are hot pixels when they stand out again (the frames of a setting are checked one after another).
+    size_t wordsPerRow = (sizeX + 63) / 64;
+    bool reference = previousSizeX == sizeX && previousHits.size() == wordsPerRow * sizeY;
+    hitBits.assign(wordsPerRow * sizeY, 0);
+    vector<float> rowLevels(sizeY);
+    vector<unsigned char> zeroRow(sizeY);
+    atomic<long> hits(0), persistent(0);
+    atomic<unsigned int> nextRow(0);
+    auto scanBands = [&]() {
+      long bandHits = 0, bandPersistent = 0;
+      while (true)
+      {
+        unsigned int first = nextRow.fetch_add(ROWS_PER_CLAIM);
+        if (first >= sizeY)
+        {
+          break;
+        }
+        unsigned int last = min(sizeY, first + ROWS_PER_CLAIM);
+        for (unsigned int y = first; y < last; y++)
+        {
+          const unsigned short *row = pixels + (size_t)y * sizeX;
+          unsigned int any = 0;
+          if (y > 0 && y + 1 < sizeY)
+          {
+            uint64_t *bits = hitBits.data() + y * wordsPerRow;
+            kernel(row - sizeX, row, row + sizeX, sizeX, threshold, 0, bits, &any);
+            const uint64_t *before = reference ? previousHits.data() + y * wordsPerRow : NULL;
+            for (size_t w = 0; w < wordsPerRow; w++)
+            {
+              uint64_t again = before != NULL ? bits[w] & before[w] : 0;
+              bandHits += __builtin_popcountll(bits[w] & ~again);
+              bandPersistent += __builtin_popcountll(again);
+            }
+          }
+          else
+          {
+            for (unsigned int x = 0; x < sizeX; x++)
+            {
+              any |= row[x];
+            }
+          }
+          zeroRow[y] = any == 0;
+          rowLevels[y] = RowLevel(row, sizeX);
+        }
+      }
+      hits += bandHits;
+      persistent += bandPersistent;
+    };
+
+    vector<thread> workers;
+    for (int i = 1; i < numThreads; i++)
+    {
+      workers.push_back(thread(scanBands));
+    }
+    scanBands();
+    for (size_t i = 0; i < workers.size(); i++)
+    {
+      workers[i].join();
+    }
+    previousHits.swap(hitBits);
+    previousSizeX = sizeX;
+
+    // A transfer cut short leaves the end of the buffer zeroed; a bias offset keeps real rows above zero
+    while (quality.zeroRows < (int)sizeY && zeroRow[sizeY - 1 - quality.zeroRows])
+    {
+      quality.zeroRows++;
+    }
+    if (quality.zeroRows == (int)sizeY)
+    {
+      quality.flags |= QUALITY_EMPTY;
+    }
+    else
+    {
+      if (quality.zeroRows > 0)
+      {
+        quality.flags |= QUALITY_TRUNCATED;
+      }
+      quality.cosmicHits = hits;
+      quality.persistentHits = persistent;
+      quality.cosmicDensity = hits * 1e6 / ((double)sizeX * sizeY);
+      if (!reference)
+      {
+        unreferenced++; // Its hits cannot be told from hot pixels; it serves as the next frame's reference
+      }
+      else if (quality.cosmicDensity > cosmicLimit)
+      {
+        quality.flags |= QUALITY_COSMICS;
+      }
+      rowLevels.resize(sizeY - quality.zeroRows);
+      quality.bandedRows = CountBandedRows(rowLevels);
+      if (quality.bandedRows >= BANDING_MIN_ROWS)
+      {
+        quality.flags |= QUALITY_BANDING;
+      }
+    }
+  }
+
+  double end = MonotonicSeconds();
+  TimingSpan(PHASE_DETAIL, "Quality check", start, end);
+  checkSeconds += end - start;
+  checked++;
+  if (quality.flags)
+  {
+    failed++;
+    for (int i = 0; i < QUALITY_FLAG_COUNT; i++)
+    {
+      failures[i] += (quality.flags >> i) & 1;
+    }
+  }
+  return quality;
+}
+
+void QualityGate::CountRetake()
+{
+  retakes++;
+}
+
+void QualityGate::CountKept()
+{
+  kept++;
+}
+
+void QualityGate::PrintStats(double sweepSeconds)
+{
+  string reasons;
+  for (int i = 0; i < QUALITY_FLAG_COUNT; i++)
+  {
+    if (failures[i])
+    {
+      reasons += (reasons.empty() ? "" : ", ") + to_string(failures[i]) + " " + QualityFlagName(1 << i);
+    }
+  }
+  printf("Quality check: %lu frames checked in %.2f s on %d threads (%.1f%% of the sweep, idle time between exposures), "
+         "%lu failed%s%s%s, %lu retaken, %lu written after running out of retakes, %lu not checked for cosmic rays "
+         "(no previous frame of their size).\n",
+         checked, checkSeconds, numThreads, sweepSeconds > 0 ? 100 * checkSeconds / sweepSeconds : 0.0, failed,
+         reasons.empty() ? "" : " (", reasons.c_str(), reasons.empty() ? "" : ")", retakes, kept, unreferenced);
+}
+
+const char *QualityFlagName(int flag)
+{
+  switch (flag)
+  {
+  case QUALITY_READOUT:
+    return "readout failure";
+  case QUALITY_EMPTY:
+    return "empty";
+  case QUALITY_TRUNCATED:
+    return "truncated";
+  case QUALITY_BANDING:
+    return "row banding";
+  case QUALITY_COSMICS:
+    return "cosmic rays";
+  default:
+    return "unknown";
+  }
+}
@@ -0,0 +1,116 @@
+/**
+ * @file FrameQuality.h
+ *
+ * @brief Quality check of each frame before it is written.
+ * Run on the capture thread straight after readout, so a bad frame can be retaken while the camera is still at its
+ * setting. One pass over the frame, in parallel over row bands, finds empty rows and cosmic ray hits: pixels that
+ * stand out from both their horizontal and vertical neighbours by a multiple of the noise (SSE2 or AVX2 where available).
+ * Hot pixels stand out the same way but persist from frame to frame, while hits do not, so pixels that also stood out
+ * in the previous frame checked are left out of the hits (one bit per pixel is kept for this). The first frame, and
+ * the first after a change of frame size, has nothing to compare with, so it only becomes the reference: it is never
+ * failed for cosmic rays.
+ * Row levels, the median of block means along each row, expose banding without being swayed by the hits.
+ *
+ */
+
+#ifndef FRAMEQUALITY_H
+#define FRAMEQUALITY_H
+
+#include <stdint.h>
+#include <vector>
+
+// Reasons a frame fails the check
+enum QualityFlag
+{
+  QUALITY_READOUT = 1,   // GetQHYCCDSingleFrame or GetQHYCCDLiveFrame failed
+  QUALITY_EMPTY = 2,     // Every pixel is zero
+  QUALITY_TRUNCATED = 4, // Smaller than the ROI, or the last rows are zero
+  QUALITY_BANDING = 8,   // Rows offset from their neighbours
+  QUALITY_COSMICS = 16,  // Too many cosmic ray hits
+  QUALITY_FLAG_COUNT = 5
+};
+
+/**
+  @struct FrameQuality
+    @brief Result of the check of one frame
+*/
+struct FrameQuality
+{
+  int flags;            // QualityFlag bits (0 if the frame passed)
+  double noise;         // Pixel noise estimated from neighbouring pixels (ADU)
+  long cosmicHits;      // Pixels taken for cosmic ray hits
+  long persistentHits;  // Pixels that also stood out in the previous frame (hot pixels), left out of cosmicHits
+  double cosmicDensity; // Hits per megapixel
+  int bandedRows;       // Rows whose level is offset from the neighbouring rows
+  int zeroRows;         // Zero rows at the end of the frame
+};
+
+/**
+  @class QualityGate
+    @brief Checks frames and counts failures and retakes, for one camera's capture thread
+*/
+class QualityGate
+{
+public:
+  /**
+    @fn QualityGate(double cosmicLimit, int numThreads)
+      @param cosmicLimit Cosmic ray hits per megapixel above which a frame fails
+      @param numThreads Threads sharing the row bands of each frame (at most the number of cores)
+  */
+  QualityGate(double cosmicLimit, int numThreads);
+
+  /**
+    @fn FrameQuality Check(const unsigned short *pixels, unsigned int sizeX, unsigned int sizeY, unsigned int roiSizeX, unsigned int roiSizeY, bool readoutOk)
+      @brief Checks a frame
+      @param pixels Frame pixels
+      @param sizeX Width returned by the readout
+      @param sizeY Height returned by the readout
+      @param roiSizeX Width requested
+      @param roiSizeY Height requested
+      @param readoutOk False if the readout call failed
+    @return Result of the check
+  */
+  FrameQuality Check(const unsigned short *pixels, unsigned int sizeX, unsigned int sizeY, unsigned int roiSizeX,
+                     unsigned int roiSizeY, bool readoutOk);
+
+  /**
+    @fn void CountRetake()
+      @brief Records that a failed frame was discarded and taken again
+  */
+  void CountRetake();
+
+  /**
+    @fn void CountKept()
+      @brief Records that a failed frame was written because its retakes ran out
+  */
+  void CountKept();
+
+  /**
+    @fn void PrintStats(double sweepSeconds)
+      @brief Prints the frames checked, the time spent checking between exposures, failures by reason, and retakes
+      @param sweepSeconds Duration of the sweep so far
+  */
+  void PrintStats(double sweepSeconds);
+
+private:
+  double cosmicLimit;
+  int numThreads;
+  unsigned long checked;                       // Frames checked
+  unsigned long failed;                        // Frames that failed
+  unsigned long failures[QUALITY_FLAG_COUNT];  // Failures by reason
+  unsigned long retakes;                       // Failed frames taken again
+  unsigned long kept;                          // Failed frames written anyway
+  unsigned long unreferenced;                  // Frames not checked for cosmic rays, for want of a previous frame
+  double checkSeconds;                         // Time spent checking
+  std::vector<uint64_t> hitBits;               // Pixels standing out in the frame being checked, one bit each
+  std::vector<uint64_t> previousHits;          // The same for the previous frame checked (empty for none)
+  unsigned int previousSizeX;                  // Width of the previous frame checked
+};
+
+/**
+  @fn const char *QualityFlagName(int flag)
+  @return Name of a single QualityFlag
+*/
+const char *QualityFlagName(int flag);
+
+#endif
@@ -0,0 +1,532 @@
+/**
+ * @file FrameStack.cpp
+ *
+ * @brief Online master frame combination.
+ *
+ */
+
+// Dependencies
+#include "FrameStack.h"
+#include "FrameWriter.h"
+#include "Timing.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fitsio.h>
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+static const size_t PIXELS_PER_CLAIM = 65536; // Pixels a thread claims at a time
+
+/**
+  @struct FrameStacker::Stack
+    @brief Running combination of the frames of one setting
+*/
+struct FrameStacker::Stack
+{
+  int key;                     // Setting the frames belong to (FrameJob::stackKey)
+  int expected;                // Repeats taken at the setting
+  int frames;                  // Frames added so far
+  unsigned int sizeX;          // Frame width
+  unsigned int sizeY;          // Frame height
+  FrameJob settings;           // Settings of the first frame, for the master header
+  vector<float> mean;          // Running mean, then the master frame
+  vector<float> m2;            // Running sum of squared deviations, then the variance frame
+  vector<unsigned short> kept; // Frame copies for median and clipped combines (if they fit the memory limit)
+  int spillFd;                 // Unlinked scratch file holding the frame copies otherwise (-1 if unused)
+
+  size_t Pixels() const { return (size_t)sizeX * sizeY; }
+  double Bytes() const { return 4.0 * (mean.capacity() + m2.capacity()) + 2.0 * kept.capacity(); }
+};
+
+/**
+  @fn static void ParallelPixels(size_t count, int numThreads, const Function &work)
+    @brief Runs work(first, last) over chunks of [0, count) on numThreads threads
+    @param count Number of pixels
+    @param numThreads Threads to use
+    @param work Function processing the pixels first to last - 1
+*/
+template <typename Function>
+static void ParallelPixels(size_t count, int numThreads, const Function &work)
+{
+  atomic<size_t> next(0);
+  auto claimChunks = [&]() {
+    while (true)
+    {
+      size_t first = next.fetch_add(PIXELS_PER_CLAIM);
+      if (first >= count)
+      {
+        return;
+      }
+      work(first, min(first + PIXELS_PER_CLAIM, count));
+    }
+  };
+
+  vector<thread> workers;
+  for (int i = 1; i < numThreads; i++)
+  {
+    workers.push_back(thread(claimChunks));
+  }
+  claimChunks();
+  for (size_t i = 0; i < workers.size(); i++)
+  {
+    workers[i].join();
+  }
+}
+
+/**
+  @fn static const char *CombineName(StackCombine combine)
+    @brief Name of a combine method, for file names and headers
+    @param combine Combine method
+  @return Name
+*/
+static const char *CombineName(StackCombine combine)
+{
+  switch (combine)
+  {
+  case STACK_MEAN:
+    return "mean";
+  case STACK_MEDIAN:
+    return "median";
+  case STACK_CLIP:
+    return "clip";
+  default:
+    return "none";
+  }
+}
+
+bool ParseStackCombine(const char *name, StackCombine *combine)
+{
+  const StackCombine combines[] = {STACK_NONE, STACK_MEAN, STACK_MEDIAN, STACK_CLIP};
+  for (size_t i = 0; i < sizeof(combines) / sizeof(combines[0]); i++)
+  {
+    if (strcmp(name, CombineName(combines[i])) == 0)
+    {
+      *combine = combines[i];
+      return true;
+    }
+  }
+  return false;
+}
+
+FrameStacker::FrameStacker(StackCombine combine, size_t memoryLimit, double clipSigma, int numThreads,
+                           const string &outputPrefix)
+    : combine(combine), memoryLimit(memoryLimit), clipSigma(clipSigma), numThreads(numThreads > 0 ? numThreads : 1),
+      outputPrefix(outputPrefix), nextSequence(0), stopping(false), mastersWritten(0), incompleteStacks(0),
+      peakBytes(0)
+{
+  finisher = thread(&FrameStacker::FinisherLoop, this);
+}
+
+FrameStacker::~FrameStacker()
+{
+  Close();
+}
+
+void FrameStacker::Add(const FrameJob &job)
+{
+  unique_lock<mutex> guard(lock);
+  turn.wait(guard, [&] { return job.sequence == nextSequence; });
+
+  // A new setting (or a different frame size) closes the previous stack, even if frames were dropped
+  if (open && (open->key != job.stackKey || open->sizeX != job.roiSizeX || open->sizeY != job.roiSizeY))
+  {
+    incompleteStacks++;
+    HandOff(guard);
+  }
+
+  if (!open)
+  {
+    // Reuse the arrays of the last finished stack when the frame size matches
+    unique_ptr<Stack> stack;
+    if (spare && spare->sizeX == job.roiSizeX && spare->sizeY == job.roiSizeY)
+    {
+      stack = move(spare);
+      fill(stack->mean.begin(), stack->mean.end(), 0.0f);
+      fill(stack->m2.begin(), stack->m2.end(), 0.0f);
+    }
+    else
+    {
+      spare.reset();
+      stack.reset(new Stack());
+      stack->sizeX = job.roiSizeX;
+      stack->sizeY = job.roiSizeY;
+      stack->mean.assign(stack->Pixels(), 0.0f);
+      stack->m2.assign(stack->Pixels(), 0.0f);
+    }
+    stack->key = job.stackKey;
+    stack->expected = job.stackSize > 0 ? job.stackSize : 1;
+    stack->frames = 0;
+    stack->settings = job;
+    stack->settings.pImgData = NULL;
+    stack->settings.hasStats = false;
+    stack->spillFd = -1;
+
+    // Frame copies for the median and clipped combines: in memory if they fit, otherwise in a scratch file
+    if (combine == STACK_MEDIAN || combine == STACK_CLIP)
+    {
+      double copyBytes = 2.0 * stack->Pixels() * stack->expected;
+      if (copyBytes <= memoryLimit)
+      {
+        stack->kept.reserve(stack->Pixels() * stack->expected);
+      }
+      else
+      {
+        string spillName = outputPrefix + "_stack.spill";
+        stack->spillFd = ::open(spillName.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+        if (stack->spillFd < 0)
+        {
+          printf("Could not create %s. Error: %s.\n", spillName.c_str(), strerror(errno));
+        }
+        else
+        {
+          unlink(spillName.c_str()); // Removed as soon as it is closed, even on a crash
+        }
+      }
+    }
+
+    open = move(stack);
+    double bytes = open->Bytes() + (finishing ? finishing->Bytes() : 0.0);
+    peakBytes = max(peakBytes, bytes);
+  }
+
+  // Only the thread holding the turn touches the open stack, so the other writers can wait without the lock
+  Stack *stack = open.get();
+  guard.unlock();
+  {
+    PhaseTimer timer(PHASE_DETAIL, "Stack accumulate");
+    stack->frames++;
+    Accumulate(stack, reinterpret_cast<const unsigned short *>(job.pImgData));
+  }
+  guard.lock();
+
+  if (stack->frames >= stack->expected)
+  {
+    HandOff(guard);
+  }
+  nextSequence++;
+  turn.notify_all();
+}
+
+void FrameStacker::Close()
+{
+  unique_lock<mutex> guard(lock);
+  if (open)
+  {
+    if (open->frames < open->expected)
+    {
+      incompleteStacks++;
+    }
+    HandOff(guard);
+  }
+  finished.wait(guard, [this] { return !finishing; });
+  stopping = true;
+  handed.notify_all();
+  guard.unlock();
+
+  if (finisher.joinable())
+  {
+    finisher.join();
+  }
+}
+
+void FrameStacker::PrintStats()
+{
+  lock_guard<mutex> guard(lock);
+  printf("Master frames: %d settings combined (%s", mastersWritten, CombineName(combine));
+  if (incompleteStacks > 0)
+  {
+    printf(", %d short of repeats", incompleteStacks);
+  }
+  printf("), peak stacking memory %.1f MB.\n", peakBytes / 1e6);
+}
+
+/**
+  @fn void FrameStacker::Accumulate(Stack *stack, const unsigned short *pixels)
+    @brief Welford update of the running mean and variance, and the frame copy for median and clipped combines
+    @param stack Stack the frame is added to (frames already counts it)
+    @param pixels Frame pixels
+*/
+void FrameStacker::Accumulate(Stack *stack, const unsigned short *pixels)
+{
+  float inverseCount = 1.0f / stack->frames;
+  float *mean = stack->mean.data();
+  float *m2 = stack->m2.data();
+  ParallelPixels(stack->Pixels(), numThreads, [&](size_t first, size_t last) {
+    for (size_t p = first; p < last; p++)
+    {
+      float value = pixels[p];
+      float delta = value - mean[p];
+      mean[p] += delta * inverseCount;
+      m2[p] += delta * (value - mean[p]);
+    }
+  });
+
+  if (combine != STACK_MEDIAN && combine != STACK_CLIP)
+  {
+    return;
+  }
+  size_t frameBytes = 2 * stack->Pixels();
+  if (stack->spillFd >= 0)
+  {
+    off_t offset = (off_t)frameBytes * (stack->frames - 1);
+    size_t done = 0;
+    while (done < frameBytes)
+    {
+      ssize_t written = pwrite(stack->spillFd, (const char *)pixels + done, frameBytes - done, offset + done);
+      if (written <= 0)
+      {
+        printf("Could not spill frame for stacking. Error: %s.\n", strerror(errno));
+        break;
+      }
+      done += written;
+    }
+  }
+  else if (stack->kept.capacity() >= stack->Pixels() * stack->frames)
+  {
+    stack->kept.insert(stack->kept.end(), pixels, pixels + stack->Pixels());
+  }
+}
+
+/**
+  @fn void FrameStacker::HandOff(unique_lock<mutex> &guard)
+    @brief Hands the open stack to the finisher, waiting for it to be free first
+    @param guard Held lock
+*/
+void FrameStacker::HandOff(unique_lock<mutex> &guard)
+{
+  finished.wait(guard, [this] { return !finishing; });
+  finishing = move(open);
+  handed.notify_all();
+}
+
+/**
+  @fn void FrameStacker::FinisherLoop()
+    @brief Finisher thread body: combines and writes each handed-off stack
+*/
+void FrameStacker::FinisherLoop()
+{
+  TimingThreadName("stack finisher");
+  unique_lock<mutex> guard(lock);
+  while (true)
+  {
+    handed.wait(guard, [this] { return finishing || stopping; });
+    if (!finishing)
+    {
+      break;
+    }
+
+    Stack *stack = finishing.get();
+    guard.unlock();
+    Finish(stack);
+    guard.lock();
+
+    // Keep the arrays for the next stack, but not the frame copies
+    vector<unsigned short>().swap(finishing->kept);
+    if (finishing->spillFd >= 0)
+    {
+      close(finishing->spillFd);
+      finishing->spillFd = -1;
+    }
+    spare = move(finishing);
+    mastersWritten++;
+    finished.notify_all();
+  }
+}
+
+/**
+  @fn void FrameStacker::Finish(Stack *stack)
+    @brief Turns the running sums into the variance and master frames and writes them
+    @param stack Stack to finish
+*/
+void FrameStacker::Finish(Stack *stack)
+{
+  {
+    PhaseTimer timer(PHASE_DETAIL, "Stack combine");
+
+    // Sample variance of each pixel
+    int frames = stack->frames;
+    float *m2 = stack->m2.data();
+    ParallelPixels(stack->Pixels(), numThreads, [&](size_t first, size_t last) {
+      for (size_t p = first; p < last; p++)
+      {
+        m2[p] = frames > 1 ? m2[p] / (frames - 1) : 0.0f;
+      }
+    });
+
+    if (combine == STACK_MEDIAN || combine == STACK_CLIP)
+    {
+      Combine(stack);
+    }
+  }
+
+  PhaseTimer timer(PHASE_DETAIL, "Stack write");
+  if (WriteMaster(stack, stack->mean, CombineName(combine)) && WriteMaster(stack, stack->m2, "var"))
+  {
+    printf("Master and variance frames of %d images (%s) written.\n", stack->frames, CombineName(combine));
+  }
+}
+
+/**
+  @fn void FrameStacker::Combine(Stack *stack)
+    @brief Median or clipped combine of the kept frames into stack->mean, in bands that fit the memory limit
+    @param stack Stack to combine (m2 already holds the variance)
+*/
+void FrameStacker::Combine(Stack *stack)
+{
+  size_t frames = stack->frames;
+  size_t pixels = stack->Pixels();
+  bool spilled = stack->spillFd >= 0;
+  if (!spilled && stack->kept.size() < frames * pixels)
+  {
+    printf("Frame copies are incomplete, keeping the mean.\n");
+    return;
+  }
+
+  // Whole frames if they are in memory, otherwise as many rows of every frame as the memory limit allows
+  size_t bandRows = stack->sizeY;
+  if (spilled)
+  {
+    bandRows = memoryLimit / (2 * frames * stack->sizeX);
+    bandRows = max((size_t)1, min(bandRows, (size_t)stack->sizeY));
+  }
+  vector<unsigned short> band(spilled ? frames * bandRows * stack->sizeX : 0);
+
+  for (size_t firstRow = 0; firstRow < stack->sizeY; firstRow += bandRows)
+  {
+    size_t rows = min(bandRows, stack->sizeY - firstRow);
+    size_t bandStart = firstRow * stack->sizeX;
+    size_t bandPixels = rows * stack->sizeX;
+
+    // Frame f of the band starts at base + f * stride
+    const unsigned short *base;
+    size_t stride;
+    if (spilled)
+    {
+      for (size_t f = 0; f < frames; f++)
+      {
+        off_t offset = (off_t)(f * pixels + bandStart) * 2;
+        size_t bytes = bandPixels * 2;
+        char *destination = (char *)(band.data() + f * bandPixels);
+        size_t done = 0;
+        while (done < bytes)
+        {
+          ssize_t got = pread(stack->spillFd, destination + done, bytes - done, offset + done);
+          if (got <= 0)
+          {
+            printf("Could not read spilled frames. Error: %s. Keeping the mean.\n", got < 0 ? strerror(errno) : "end of file");
+            return;
+          }
+          done += got;
+        }
+      }
+      base = band.data();
+      stride = bandPixels;
+    }
+    else
+    {
+      base = stack->kept.data() + bandStart;
+      stride = pixels;
+    }
+
+    float *master = stack->mean.data() + bandStart;
+    const float *variance = stack->m2.data() + bandStart;
+    ParallelPixels(bandPixels, numThreads, [&](size_t first, size_t last) {
+      vector<float> values(frames);
+      for (size_t p = first; p < last; p++)
+      {
+        for (size_t f = 0; f < frames; f++)
+        {
+          values[f] = base[f * stride + p];
+        }
+
+        // Median (mean of the two middle values for an even count)
+        size_t middle = frames / 2;
+        nth_element(values.begin(), values.begin() + middle, values.end());
+        float median = values[middle];
+        if (frames % 2 == 0)
+        {
+          median = 0.5f * (median + *max_element(values.begin(), values.begin() + middle));
+        }
+        if (combine == STACK_MEDIAN)
+        {
+          master[p] = median;
+          continue;
+        }
+
+        // Mean of the values within clipSigma standard deviations of the median
+        float limit = clipSigma * sqrt(variance[p]);
+        double sum = 0;
+        int count = 0;
+        for (size_t f = 0; f < frames; f++)
+        {
+          if (fabs(values[f] - median) <= limit)
+          {
+            sum += values[f];
+            count++;
+          }
+        }
+        master[p] = count > 0 ? (float)(sum / count) : median;
+      }
+    });
+  }
+}
+
+/**
+  @fn bool FrameStacker::WriteMaster(Stack *stack, const vector<float> &image, const char *suffix)
+    @brief Writes a combined frame as a 32-bit float FITS image with the settings of the stack
+    @param stack Stack the image belongs to
+    @param image Pixels
+    @param suffix File name suffix (combine method, or var)
+  @return True on success
+*/
+bool FrameStacker::WriteMaster(Stack *stack, const vector<float> &image, const char *suffix)
+{
+  const FrameJob &settings = stack->settings;
+  string fitname = outputPrefix + "_master_exp_" + to_string((int)settings.exposureTime) + "us_gain_" +
+                   to_string(settings.gainSetting) + "_offset_" + to_string(settings.offsetSetting) + "_temp_" +
+                   to_string((int)settings.tempSetting) + "_filter_" + to_string(settings.filter) + "_mode_" +
+                   to_string(settings.readMode) + "_" + suffix + ".fits";
+  const char *fitsfilename = fitname.c_str();
+
+  fitsfile *fptr;
+  int status = 0;
+  long naxes[2] = {(long)stack->sizeX, (long)stack->sizeY};
+
+  // Remove if exists already
+  remove(fitsfilename);
+
+  fits_create_file(&fptr, fitsfilename, &status);
+  fits_create_img(fptr, FLOAT_IMG, 2, naxes, &status);
+  WriteFrameKeys(fptr, settings, &status);
+  int frames = stack->frames;
+  char method[FLEN_VALUE];
+  strcpy(method, CombineName(combine));
+  fits_update_key(fptr, TINT, "NCOMBINE", &frames, "Number of images combined", &status);
+  fits_update_key(fptr, TSTRING, "COMBINE", method, "Combine method", &status);
+  fits_write_img(fptr, TFLOAT, 1, (LONGLONG)image.size(), const_cast<float *>(image.data()), &status);
+
+  // Close File (always, so a failed write does not leak the handle)
+  int closeStatus = 0;
+  fits_close_file(fptr, &closeStatus);
+  if (status == 0)
+  {
+    status = closeStatus;
+  }
+
+  if (status != 0)
+  {
+    char errText[FLEN_STATUS];
+    fits_get_errstatus(status, errText);
+    printf("Could not write %s. CFITSIO error: %d (%s).\n", fitsfilename, status, errText);
+    return false;
+  }
+  return true;
+}
@@ -0,0 +1,118 @@
+/**
+ * @file FrameStack.h
+ *
+ * @brief Online master frame combination.
+ * The repeats taken at each setting are combined as they are written: a running per-pixel mean and variance
+ * (Welford) for every frame, plus, for median and sigma-clipped combines, a copy of each frame kept in memory up
+ * to a limit or spilled to an unlinked scratch file beyond it. When the last repeat arrives the stack is handed to a
+ * finisher thread, which combines it band by band (bands sized to the memory limit) and writes a master frame and a
+ * variance frame, while the next setting is already being captured.
+ *
+ */
+
+#ifndef FRAMESTACK_H
+#define FRAMESTACK_H
+
+#include <stddef.h>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct FrameJob;
+
+/**
+  @enum StackCombine
+    @brief How the repeats are combined into the master frame
+*/
+enum StackCombine
+{
+  STACK_NONE,   // No stacking
+  STACK_MEAN,   // Mean (Welford)
+  STACK_MEDIAN, // Per-pixel median
+  STACK_CLIP    // Per-pixel mean after clipping about the median
+};
+
+/**
+  @fn bool ParseStackCombine(const char *name, StackCombine *combine)
+    @brief Parses a combine method from the command line
+    @param name One of none, mean, median, clip
+    @param combine Parsed method
+  @return True if the name is known
+*/
+bool ParseStackCombine(const char *name, StackCombine *combine);
+
+/**
+  @class FrameStacker
+    @brief Combines the frames of each setting into master and variance frames
+*/
+class FrameStacker
+{
+public:
+  /**
+    @fn FrameStacker(StackCombine combine, size_t memoryLimit, double clipSigma, int numThreads, const std::string &outputPrefix)
+      @brief Starts the finisher thread
+      @param combine Combine method
+      @param memoryLimit Bytes of frame copies kept in memory for median and clipped combines (more are spilled to disk)
+      @param clipSigma Clipping threshold in standard deviations (STACK_CLIP)
+      @param numThreads Threads sharing the per-pixel work
+      @param outputPrefix Directory and name prefix of the master frames (also where frames are spilled)
+  */
+  FrameStacker(StackCombine combine, size_t memoryLimit, double clipSigma, int numThreads,
+               const std::string &outputPrefix);
+  ~FrameStacker();
+
+  /**
+    @fn void Add(const FrameJob &job)
+      @brief Adds a frame to the stack of its setting. Frames are taken in submission order (job.sequence), so
+             writer threads may call this concurrently. Must be called before the pixels are converted for writing.
+      @param job Frame to add
+  */
+  void Add(const FrameJob &job);
+
+  /**
+    @fn void Close()
+      @brief Finishes the open stack, even if it is short of repeats, and waits for the master frames to be written
+  */
+  void Close();
+
+  /**
+    @fn void PrintStats()
+      @brief Prints the number of master frames written and the memory used
+  */
+  void PrintStats();
+
+private:
+  struct Stack;
+  void Accumulate(Stack *stack, const unsigned short *pixels);
+  void HandOff(std::unique_lock<std::mutex> &guard);
+  void FinisherLoop();
+  void Finish(Stack *stack);
+  void Combine(Stack *stack);
+  bool WriteMaster(Stack *stack, const std::vector<float> &image, const char *suffix);
+
+  StackCombine combine;
+  size_t memoryLimit;
+  double clipSigma;
+  int numThreads;
+  std::string outputPrefix;
+  unsigned long nextSequence;        // Sequence number of the next frame to add
+  std::unique_ptr<Stack> open;      // Stack being filled
+  std::unique_ptr<Stack> finishing; // Stack being combined and written
+  std::unique_ptr<Stack> spare;     // Finished stack kept so its arrays are reused
+  bool stopping;
+  std::mutex lock;
+  std::condition_variable turn;     // Signalled when nextSequence advances
+  std::condition_variable finished; // Signalled when the finisher is free
+  std::condition_variable handed;   // Signalled when a stack is handed to the finisher (or on stop)
+  std::thread finisher;
+
+  // Statistics
+  int mastersWritten;
+  int incompleteStacks;
+  double peakBytes; // Largest memory footprint of the open and finishing stacks
+};
+
+#endif
@@ -0,0 +1,194 @@
+/**
+ * @file FrameStats.cpp
+ *
+ * @brief Per-frame pixel statistics.
+ *
+ */
+
+// Dependencies
+#include "FrameStats.h"
+#include <stdint.h>
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+static const int HISTOGRAM_BINS = 65536;
+static const int ROWS_PER_CLAIM = 64;      // Rows a thread claims at a time
+static const int MAX_CLIP_ITERATIONS = 10; // Sigma clipping usually converges in a few
+
+/**
+  @fn static void HistogramRows(const unsigned short *pixels, size_t count, uint32_t *histogram)
+    @brief Adds pixels to a histogram. Four interleaved sub-histograms keep runs of equal values (flat fields, bias)
+           from serializing on the same counter.
+    @param pixels Pixels to add
+    @param count Number of pixels
+    @param histogram Four consecutive histograms of HISTOGRAM_BINS bins
+*/
+static void HistogramRows(const unsigned short *pixels, size_t count, uint32_t *histogram)
+{
+  uint32_t *h0 = histogram;
+  uint32_t *h1 = histogram + HISTOGRAM_BINS;
+  uint32_t *h2 = histogram + 2 * HISTOGRAM_BINS;
+  uint32_t *h3 = histogram + 3 * HISTOGRAM_BINS;
+  size_t i = 0;
+  for (; i + 4 <= count; i += 4)
+  {
+    h0[pixels[i]]++;
+    h1[pixels[i + 1]]++;
+    h2[pixels[i + 2]]++;
+    h3[pixels[i + 3]]++;
+  }
+  for (; i < count; i++)
+  {
+    h0[pixels[i]]++;
+  }
+}
+
+/**
+  @fn static void MomentsInRange(const vector<uint64_t> &histogram, int lo, int hi, double *mean, double *stddev, uint64_t *count)
+    @brief Mean and standard deviation of the histogram bins lo to hi
+    @param histogram Histogram
+    @param lo First bin
+    @param hi Last bin
+    @param mean Mean
+    @param stddev Standard deviation
+    @param count Pixels in the range
+*/
+static void MomentsInRange(const vector<uint64_t> &histogram, int lo, int hi, double *mean, double *stddev,
+                           uint64_t *count)
+{
+  uint64_t n = 0;
+  double sum = 0;
+  for (int v = lo; v <= hi; v++)
+  {
+    n += histogram[v];
+    sum += (double)v * histogram[v];
+  }
+  *count = n;
+  *mean = n > 0 ? sum / n : 0.0;
+
+  // Second pass about the mean, for accuracy
+  double squares = 0;
+  for (int v = lo; v <= hi; v++)
+  {
+    double delta = v - *mean;
+    squares += delta * delta * histogram[v];
+  }
+  *stddev = n > 1 ? sqrt(squares / (n - 1)) : 0.0;
+}
+
+FrameStats ComputeFrameStats(const unsigned short *pixels, unsigned int sizeX, unsigned int sizeY, int saturation,
+                             double clipSigma, int numThreads)
+{
+  if (numThreads < 1)
+  {
+    numThreads = 1;
+  }
+
+  // Histogram the row bands in parallel, one set of sub-histograms per thread
+  vector<vector<uint32_t>> partial(numThreads, vector<uint32_t>(4 * HISTOGRAM_BINS, 0));
+  atomic<unsigned int> nextRow(0);
+  auto histogramBands = [&](int t) {
+    while (true)
+    {
+      unsigned int first = nextRow.fetch_add(ROWS_PER_CLAIM);
+      if (first >= sizeY)
+      {
+        return;
+      }
+      unsigned int rows = sizeY - first < (unsigned int)ROWS_PER_CLAIM ? sizeY - first : ROWS_PER_CLAIM;
+      HistogramRows(pixels + (size_t)first * sizeX, (size_t)rows * sizeX, partial[t].data());
+    }
+  };
+
+  vector<thread> workers;
+  for (int t = 1; t < numThreads; t++)
+  {
+    workers.push_back(thread(histogramBands, t));
+  }
+  histogramBands(0);
+  for (size_t i = 0; i < workers.size(); i++)
+  {
+    workers[i].join();
+  }
+
+  vector<uint64_t> histogram(HISTOGRAM_BINS, 0);
+  for (int t = 0; t < numThreads; t++)
+  {
+    for (int s = 0; s < 4; s++)
+    {
+      const uint32_t *sub = partial[t].data() + s * HISTOGRAM_BINS;
+      for (int v = 0; v < HISTOGRAM_BINS; v++)
+      {
+        histogram[v] += sub[v];
+      }
+    }
+  }
+
+  FrameStats stats = {};
+  uint64_t total = 0;
+  MomentsInRange(histogram, 0, HISTOGRAM_BINS - 1, &stats.mean, &stats.stddev, &total);
+  if (total == 0)
+  {
+    return stats;
+  }
+
+  // Range, saturation, and the exact median (mean of the two middle values for an even count)
+  stats.min = 0;
+  while (histogram[stats.min] == 0)
+  {
+    stats.min++;
+  }
+  stats.max = HISTOGRAM_BINS - 1;
+  while (histogram[stats.max] == 0)
+  {
+    stats.max--;
+  }
+  for (int v = saturation; v < HISTOGRAM_BINS; v++)
+  {
+    stats.saturated += histogram[v];
+  }
+
+  uint64_t lowerRank = (total - 1) / 2, upperRank = total / 2;
+  int lowerValue = -1, upperValue = -1;
+  uint64_t seen = 0;
+  for (int v = 0; v < HISTOGRAM_BINS && upperValue < 0; v++)
+  {
+    seen += histogram[v];
+    if (lowerValue < 0 && seen > lowerRank)
+    {
+      lowerValue = v;
+    }
+    if (seen > upperRank)
+    {
+      upperValue = v;
+    }
+  }
+  stats.median = 0.5 * (lowerValue + upperValue);
+
+  // Sigma clipping about the median until no more pixels are rejected
+  int lo = stats.min, hi = stats.max;
+  double clippedMean = stats.mean, clippedStddev = stats.stddev;
+  uint64_t kept = total;
+  for (int iteration = 0; iteration < MAX_CLIP_ITERATIONS; iteration++)
+  {
+    int newLo = max(lo, (int)ceil(stats.median - clipSigma * clippedStddev));
+    int newHi = min(hi, (int)floor(stats.median + clipSigma * clippedStddev));
+    if (newLo > newHi || (newLo == lo && newHi == hi))
+    {
+      break;
+    }
+    lo = newLo;
+    hi = newHi;
+    MomentsInRange(histogram, lo, hi, &clippedMean, &clippedStddev, &kept);
+  }
+  stats.clippedMean = clippedMean;
+  stats.clippedStddev = clippedStddev;
+  stats.clippedPixels = (long)(total - kept);
+
+  return stats;
+}
@@ -0,0 +1,47 @@
+/**
+ * @file FrameStats.h
+ *
+ * @brief Per-frame pixel statistics.
+ * One pass over the frame (split into row bands across threads) builds an exact 16-bit histogram; the mean,
+ * standard deviation, exact median, min/max, saturated pixel count and the sigma-clipped mean and standard deviation
+ * are all derived from it, so clipping iterations cost 65536 bins rather than another pass over the pixels.
+ *
+ */
+
+#ifndef FRAMESTATS_H
+#define FRAMESTATS_H
+
+#include <stddef.h>
+
+/**
+  @struct FrameStats
+    @brief Statistics of one frame (ADU)
+*/
+struct FrameStats
+{
+  double mean;          // Mean of all pixels
+  double median;        // Exact median of all pixels
+  double stddev;        // Standard deviation of all pixels
+  int min;              // Lowest pixel value
+  int max;              // Highest pixel value
+  long saturated;       // Pixels at or above the saturation level
+  double clippedMean;   // Mean after iterative sigma clipping
+  double clippedStddev; // Standard deviation after iterative sigma clipping
+  long clippedPixels;   // Pixels rejected by the clipping
+};
+
+/**
+  @fn FrameStats ComputeFrameStats(const unsigned short *pixels, unsigned int sizeX, unsigned int sizeY, int saturation, double clipSigma, int numThreads)
+    @brief Computes the statistics of a 16-bit frame
+    @param pixels Frame pixels
+    @param sizeX Frame width
+    @param sizeY Frame height
+    @param saturation Saturation level (ADU)
+    @param clipSigma Clipping threshold in standard deviations
+    @param numThreads Threads sharing the row bands
+  @return Frame statistics
+*/
+FrameStats ComputeFrameStats(const unsigned short *pixels, unsigned int sizeX, unsigned int sizeY, int saturation,
+                             double clipSigma, int numThreads);
+
+#endif
@@ -0,0 +1,650 @@
+/**
+ * @file FrameWriter.cpp
+ *
+ * @brief Asynchronous FITS writer pipeline.
+ *
+ */
+
+// Dependencies
+#include "FrameWriter.h"
+#include "BiasProfile.h"
+#include "DefectMap.h"
+#include "DiskScheduler.h"
+#include "FitsNative.h"
+#include "FrameCatalog.h"
+#include "FramePreview.h"
+#include "StagingMigrator.h"
+#include "FrameStack.h"
+#include "PhotonTransfer.h"
+#include "SweepJournal.h"
+#include "FramePool.h"
+#include "Timing.h"
+#include <stdio.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include <chrono>
+
+using namespace std;
+
+/**
+  @fn static double SecondsSince(chrono::steady_clock::time_point start)
+    @brief Seconds elapsed on the monotonic clock since start
+    @param start Start time
+  @return Elapsed time in seconds
+*/
+static double SecondsSince(chrono::steady_clock::time_point start)
+{
+  return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+int WriteFitsFrame(const FrameJob &job)
+{
+  fitsfile *fptr;
+  int status = 0;
+  long naxes[2] = {(long)job.roiSizeX, (long)job.roiSizeY};
+  const char *fitsfilename = job.fileName.c_str();
+
+  // Remove if exists already
+  remove(fitsfilename);
+
+  // Create File
+  double spanStart = MonotonicSeconds();
+  fits_create_file(&fptr, fitsfilename, &status);
+  fits_create_img(fptr, USHORT_IMG, 2, naxes, &status);
+
+  // Headers Information
+  WriteFrameKeys(fptr, job, &status);
+  double spanEnd = MonotonicSeconds();
+  TimingSpan(PHASE_DETAIL, "FITS create", spanStart, spanEnd);
+
+  // Write to File
+  spanStart = spanEnd;
+  fits_write_img(fptr, TUSHORT, 1, (LONGLONG)job.roiSizeX * job.roiSizeY, job.pImgData, &status);
+  spanEnd = MonotonicSeconds();
+  TimingSpan(PHASE_DETAIL, "FITS write", spanStart, spanEnd);
+
+  // Close File (always, so a failed write does not leak the handle)
+  spanStart = spanEnd;
+  int closeStatus = 0;
+  fits_close_file(fptr, &closeStatus);
+  TimingSpan(PHASE_DETAIL, "FITS close", spanStart, MonotonicSeconds());
+  if (status == 0)
+  {
+    status = closeStatus;
+  }
+
+  if (status != 0)
+  {
+    char errText[FLEN_STATUS];
+    fits_get_errstatus(status, errText);
+    printf("Could not write %s. CFITSIO error: %d (%s).\n", fitsfilename, status, errText);
+  }
+
+  return status;
+}
+
+void WriteFrameKeys(fitsfile *fptr, const FrameJob &job, int *status)
+{
+  // Header values (CFITSIO wants non-const pointers)
+  double tempSetting = job.tempSetting;
+  int exposureTime = (int)job.exposureTime;
+  int offsetSetting = job.offsetSetting;
+  int gainSetting = job.gainSetting;
+  int readMode = job.readMode;
+  long unixTime = job.unixTime;
+
+  fits_update_key(fptr, TDOUBLE, "INTTEMP", &tempSetting, "Camera Temperature", status);
+  fits_update_key(fptr, TINT, "EXPTIME", &exposureTime, "Exposure time in microseconds", status);
+  fits_update_key(fptr, TINT, "OFFSET", &offsetSetting, "Offset Setting", status);
+  fits_update_key(fptr, TINT, "GAIN", &gainSetting, "Gain Setting", status);
+  fits_update_key(fptr, TINT, "QHREADMOE", &readMode, "ReadMode Setting", status);
+  fits_update_key(fptr, TLONG, "TIME", &unixTime, "UNIX Time", status);
+
+  // Pixel statistics
+  if (job.hasStats)
+  {
+    FrameStats stats = job.stats;
+    fits_update_key(fptr, TDOUBLE, "MEAN", &stats.mean, "Mean pixel value (ADU)", status);
+    fits_update_key(fptr, TDOUBLE, "MEDIAN", &stats.median, "Median pixel value (ADU)", status);
+    fits_update_key(fptr, TDOUBLE, "STDDEV", &stats.stddev, "Standard deviation (ADU)", status);
+    fits_update_key(fptr, TINT, "DATAMIN", &stats.min, "Lowest pixel value", status);
+    fits_update_key(fptr, TINT, "DATAMAX", &stats.max, "Highest pixel value", status);
+    fits_update_key(fptr, TLONG, "NSATUR", &stats.saturated, "Saturated pixels", status);
+    fits_update_key(fptr, TDOUBLE, "CLIPMEAN", &stats.clippedMean, "Sigma-clipped mean (ADU)", status);
+    fits_update_key(fptr, TDOUBLE, "CLIPSTD", &stats.clippedStddev, "Sigma-clipped standard deviation (ADU)", status);
+  }
+}
+
+FrameWriter::FrameWriter(int numWriters, size_t queueDepth)
+    : queueDepth(queueDepth > 0 ? queueDepth : 1), inFlight(0), stopping(false), compression(COMPRESS_NONE),
+      compressLevel(0), compressThreads(1), nativeWriter(true), statsEnabled(false),
+      statsSaturation(65535), statsClipSigma(3), statsThreads(1), statsFile(NULL), stacker(NULL), ptcAnalyzer(NULL), defectTracker(NULL), biasTracker(NULL), preview(NULL), diskScheduler(NULL), diskClient(0), journal(NULL), catalog(NULL), staging(NULL), nextSequence(0), stackKey(0), stackSize(1), stackIndex(0), containerType(CONTAINER_NONE), container(NULL), framesWritten(0), writeErrors(0), bytesWritten(0), diskBytes(0),
+      writeSeconds(0), blockedSeconds(0), maxQueued(0)
+{
+  for (int i = 0; i < numWriters; i++)
+  {
+    writers.push_back(thread(&FrameWriter::WriterLoop, this));
+  }
+}
+
+FrameWriter::~FrameWriter()
+{
+  Stop();
+  delete container;
+}
+
+void FrameWriter::Submit(FrameJob *job)
+{
+  // No writer threads: write in the caller, as the program always used to
+  if (writers.empty())
+  {
+    {
+      unique_lock<mutex> guard(lock);
+      StampJob(job);
+      inFlight++;
+    }
+    WriteJob(job);
+    return;
+  }
+
+  unique_lock<mutex> guard(lock);
+
+  // Backpressure: wait for the writers if the disk is falling behind
+  if (queue.size() >= queueDepth)
+  {
+    printf("Writer queue full (%zu frames), waiting for disk...\n", queue.size());
+    chrono::steady_clock::time_point waitStart = chrono::steady_clock::now();
+    notFull.wait(guard, [this] { return queue.size() < queueDepth; });
+    blockedSeconds += SecondsSince(waitStart);
+  }
+
+  StampJob(job);
+  queue.push_back(job);
+  inFlight++;
+  if (queue.size() > maxQueued)
+  {
+    maxQueued = queue.size();
+  }
+  notEmpty.notify_one();
+}
+
+void FrameWriter::SetCompression(FitsCompression compression, int level, int threads)
+{
+  lock_guard<mutex> guard(lock);
+  this->compression = compression;
+  compressLevel = level;
+  compressThreads = threads > 0 ? threads : 1;
+}
+
+void FrameWriter::SetStatistics(bool enabled, int saturation, double clipSigma, int threads, const string &csvPath)
+{
+  lock_guard<mutex> guard(lock);
+  statsEnabled = enabled;
+  statsSaturation = saturation;
+  statsClipSigma = clipSigma;
+  statsThreads = threads > 0 ? threads : 1;
+  if (statsFile != NULL)
+  {
+    fclose(statsFile);
+    statsFile = NULL;
+  }
+  if (enabled && !csvPath.empty())
+  {
+    statsFile = fopen(csvPath.c_str(), "w");
+    if (statsFile == NULL)
+    {
+      printf("Could not create statistics summary %s.\n", csvPath.c_str());
+      return;
+    }
+    fprintf(statsFile, "file,time,temp,exposure_us,gain,offset,mean,median,stddev,min,max,saturated,clipped_mean,"
+                       "clipped_stddev,clipped_pixels\n");
+  }
+}
+
+void FrameWriter::SetNativeWriter(bool native)
+{
+  lock_guard<mutex> guard(lock);
+  nativeWriter = native;
+}
+
+void FrameWriter::SetStacker(FrameStacker *stacker)
+{
+  lock_guard<mutex> guard(lock);
+  this->stacker = stacker;
+}
+
+void FrameWriter::SetPtcAnalyzer(PtcAnalyzer *analyzer)
+{
+  lock_guard<mutex> guard(lock);
+  ptcAnalyzer = analyzer;
+}
+
+void FrameWriter::SetDefectTracker(DefectTracker *tracker)
+{
+  lock_guard<mutex> guard(lock);
+  defectTracker = tracker;
+}
+
+void FrameWriter::SetBiasTracker(BiasTracker *tracker)
+{
+  lock_guard<mutex> guard(lock);
+  biasTracker = tracker;
+}
+
+void FrameWriter::SetDiskScheduler(DiskScheduler *scheduler, int client)
+{
+  lock_guard<mutex> guard(lock);
+  diskScheduler = scheduler;
+  diskClient = client;
+}
+
+void FrameWriter::SetPreview(FramePreview *preview)
+{
+  lock_guard<mutex> guard(lock);
+  this->preview = preview;
+}
+
+void FrameWriter::SetJournal(SweepJournal *journal)
+{
+  lock_guard<mutex> guard(lock);
+  this->journal = journal;
+}
+
+void FrameWriter::SetCatalog(FrameCatalog *catalog)
+{
+  lock_guard<mutex> guard(lock);
+  this->catalog = catalog;
+}
+
+void FrameWriter::SetStaging(StagingMigrator *staging)
+{
+  lock_guard<mutex> guard(lock);
+  this->staging = staging;
+}
+
+void FrameWriter::SetContainer(FitsContainerType type, const string &outputPrefix)
+{
+  lock_guard<mutex> guard(lock);
+  delete container;
+  containerType = type;
+  container = type == CONTAINER_NONE ? NULL : new FitsContainerWriter(type, outputPrefix);
+}
+
+void FrameWriter::SetStackBlock(int key, int size)
+{
+  FitsContainerWriter *ended;
+  int endedKey, endedFrames;
+  {
+    lock_guard<mutex> guard(lock);
+    ended = container;
+    endedKey = stackKey;
+    endedFrames = stackIndex;
+    stackKey = key;
+    stackSize = size;
+    stackIndex = 0;
+  }
+
+  // Every frame of the previous setting has been submitted, so its container can be finished once they are written
+  if (ended != NULL && endedFrames > 0)
+  {
+    ended->EndBlock(endedKey, endedFrames);
+  }
+}
+
+/**
+  @fn void FrameWriter::StampJob(FrameJob *job)
+    @brief Stamps a submitted frame with its sequence number and setting (lock held)
+    @param job Frame being submitted
+*/
+void FrameWriter::StampJob(FrameJob *job)
+{
+  job->sequence = nextSequence++;
+  job->stackKey = stackKey;
+  job->stackSize = stackSize;
+  job->stackIndex = stackIndex++;
+}
+
+const char *FrameWriter::FileExtension() const
+{
+  return compression == COMPRESS_NONE ? ".fits" : ".fits.fz";
+}
+
+void FrameWriter::Flush()
+{
+  unique_lock<mutex> guard(lock);
+  drained.wait(guard, [this] { return inFlight == 0; });
+}
+
+void FrameWriter::Stop()
+{
+  Flush();
+
+  {
+    lock_guard<mutex> guard(lock);
+    stopping = true;
+  }
+  notEmpty.notify_all();
+
+  for (size_t i = 0; i < writers.size(); i++)
+  {
+    writers[i].join();
+  }
+  writers.clear();
+
+  // Finish the last setting's container now that nothing is being written
+  if (container != NULL)
+  {
+    container->Close();
+  }
+
+  lock_guard<mutex> guard(lock);
+  if (statsFile != NULL)
+  {
+    fclose(statsFile);
+    statsFile = NULL;
+  }
+}
+
+void FrameWriter::PrintStats()
+{
+  lock_guard<mutex> guard(lock);
+
+  printf("Frames written: %lu (%lu failed), %.1f MB in %.2f s of writer time", framesWritten, writeErrors,
+         bytesWritten / 1e6, writeSeconds);
+  if (writeSeconds > 0)
+  {
+    printf(" (%.1f MB/s per writer)", bytesWritten / 1e6 / writeSeconds);
+  }
+  printf(".\n");
+  if (bytesWritten > 0)
+  {
+    printf("Output: %s%s, %.1f MB on disc (%.1f%% of the raw pixel data).\n", CompressionName(compression),
+           containerType == CONTAINER_CUBE  ? " (cube per setting)"
+           : containerType == CONTAINER_MEF ? " (multi-extension file per setting)"
+           : compression != COMPRESS_NONE   ? ""
+           : nativeWriter                   ? " (native writer)"
+                                            : " (CFITSIO writer)",
+           diskBytes / 1e6, 100 * diskBytes / bytesWritten);
+  }
+  printf("Capture waited %.2f s on a full writer queue (max queued: %zu of %zu).\n", blockedSeconds, maxQueued,
+         queueDepth);
+}
+
+unsigned long FrameWriter::FramesWritten()
+{
+  lock_guard<mutex> guard(lock);
+  return framesWritten - writeErrors;
+}
+
+double FrameWriter::BytesWritten()
+{
+  lock_guard<mutex> guard(lock);
+  return bytesWritten;
+}
+
+double FrameWriter::DiskBytes()
+{
+  lock_guard<mutex> guard(lock);
+  return diskBytes;
+}
+
+/**
+  @fn void FrameWriter::WriterLoop()
+    @brief Writer thread body: writes queued frames until Stop is called
+*/
+void FrameWriter::WriterLoop()
+{
+  TimingThreadName("FITS writer");
+  while (true)
+  {
+    FrameJob *job;
+    {
+      unique_lock<mutex> guard(lock);
+      notEmpty.wait(guard, [this] { return stopping || !queue.empty(); });
+      if (queue.empty())
+      {
+        return; // Stopping and nothing left to write
+      }
+      job = queue.front();
+      queue.pop_front();
+    }
+    notFull.notify_one();
+
+    WriteJob(job);
+  }
+}
+
+/**
+  @fn void FrameWriter::WriteJob(FrameJob *job)
+    @brief Writes one frame, returns its buffer to the pool, and updates the statistics
+    @param job Frame to write
+*/
+void FrameWriter::WriteJob(FrameJob *job)
+{
+  FitsCompression jobCompression;
+  int jobLevel, jobThreads;
+  bool jobNative, jobStats;
+  int jobSaturation, jobStatsThreads;
+  double jobClipSigma;
+  FrameStacker *jobStacker;
+  PtcAnalyzer *jobPtc;
+  DefectTracker *jobDefects;
+  BiasTracker *jobBias;
+  FramePreview *jobPreview;
+  DiskScheduler *jobScheduler;
+  int jobClient;
+  FitsContainerWriter *jobContainer;
+  SweepJournal *jobJournal;
+  FrameCatalog *jobCatalog;
+  StagingMigrator *jobStaging;
+  {
+    lock_guard<mutex> guard(lock);
+    jobCompression = compression;
+    jobLevel = compressLevel;
+    jobThreads = compressThreads;
+    jobNative = nativeWriter;
+    jobStats = statsEnabled;
+    jobSaturation = statsSaturation;
+    jobClipSigma = statsClipSigma;
+    jobStatsThreads = statsThreads;
+    jobStacker = stacker;
+    jobPtc = ptcAnalyzer;
+    jobDefects = defectTracker;
+    jobBias = biasTracker;
+    jobPreview = preview;
+    jobScheduler = diskScheduler;
+    jobClient = diskClient;
+    jobContainer = container;
+    jobJournal = journal;
+    jobCatalog = catalog;
+    jobStaging = container == NULL ? staging : NULL;
+  }
+
+  // Statistics, stacking, photon transfer, defect counting and bias profiles first: the native writer converts the pixels in place
+  if (jobStats)
+  {
+    PhaseTimer timer(PHASE_DETAIL, "Frame statistics");
+    job->stats = ComputeFrameStats(reinterpret_cast<const unsigned short *>(job->pImgData), job->roiSizeX,
+                                   job->roiSizeY, jobSaturation, jobClipSigma, jobStatsThreads);
+    job->hasStats = true;
+  }
+  if (jobStacker != NULL)
+  {
+    jobStacker->Add(*job);
+  }
+  if (jobPtc != NULL)
+  {
+    jobPtc->Add(*job);
+  }
+  if (jobDefects != NULL)
+  {
+    jobDefects->Add(*job);
+  }
+  if (jobBias != NULL)
+  {
+    jobBias->Add(*job);
+  }
+  if (jobJournal != NULL)
+  {
+    PhaseTimer timer(PHASE_DETAIL, "Frame checksum");
+    job->checksum = crc32(0L, job->pImgData, 2 * job->roiSizeX * job->roiSizeY);
+  }
+
+  // Bin the preview now, and write it while the frame itself is written (to staging too, when the frame is staged;
+  // the thread gets its own copy of the settings, as the file names are swapped below)
+  BinnedFrame binned;
+  FrameJob previewJob;
+  string previewFits, previewPng;
+  thread previewWriter;
+  double previewStart = 0, previewEnd = 0;
+  if (jobPreview != NULL)
+  {
+    binned = jobPreview->Bin(*job);
+    if (jobStaging != NULL)
+    {
+      previewFits = binned.fitsName;
+      previewPng = binned.pngName;
+      binned.fitsName = jobStaging->StagedName(previewFits);
+      binned.pngName = previewPng.empty() ? previewPng : jobStaging->StagedName(previewPng);
+    }
+    previewJob = *job;
+    previewWriter = thread([&] {
+      previewStart = MonotonicSeconds();
+      jobPreview->Write(binned, previewJob);
+      previewEnd = MonotonicSeconds();
+    });
+  }
+
+  // Wait for this camera's turn at the disk when it is shared with other cameras
+  if (jobScheduler != NULL)
+  {
+    jobScheduler->Acquire(jobClient, 2.0 * job->roiSizeX * job->roiSizeY);
+  }
+
+  // Staged frames are written locally; everything else keeps referring to them by their archive name
+  double reserved = 0;
+  if (jobStaging != NULL)
+  {
+    reserved = 2.0 * job->roiSizeX * job->roiSizeY + 2 * 2880; // Pixels, header and padding
+    jobStaging->Reserve(reserved);
+    job->stagedName = jobStaging->StagedName(job->fileName);
+    swap(job->fileName, job->stagedName);
+  }
+
+  chrono::steady_clock::time_point writeStart = chrono::steady_clock::now();
+  int status;
+  double fileBytes = 0;
+  if (jobContainer != NULL)
+  {
+    status = jobContainer->Write(*job, &fileBytes);
+  }
+  else if (jobCompression == COMPRESS_NONE && jobNative)
+  {
+    status = WriteNativeFitsFrame(*job);
+  }
+  else if (jobCompression == COMPRESS_NONE)
+  {
+    status = WriteFitsFrame(*job);
+  }
+  else
+  {
+    status = WriteCompressedFitsFrame(*job, jobCompression, jobLevel, jobThreads);
+  }
+  double elapsed = SecondsSince(writeStart);
+  TimingAdd(PHASE_WRITE, elapsed);
+
+  // Size the file while it is still under the name it was written to: once staged, the migrator may move it any time
+  if (jobContainer == NULL)
+  {
+    struct stat fileInfo;
+    fileBytes = stat(job->fileName.c_str(), &fileInfo) == 0 ? (double)fileInfo.st_size : 0.0;
+  }
+  if (jobStaging != NULL)
+  {
+    swap(job->fileName, job->stagedName);
+  }
+
+  // Only a frame that is safely on disk counts as taken when the sweep is resumed
+  if (status == 0 && jobJournal != NULL)
+  {
+    jobJournal->Record(*job);
+  }
+  // A staged frame is cataloged by the migrator once it is in the archive
+  CatalogRecord record;
+  bool cataloged = false;
+  if (status == 0 && jobCatalog != NULL)
+  {
+    PhaseTimer timer(PHASE_DETAIL, "Frame cataloging");
+    if (jobStaging != NULL)
+    {
+      cataloged = jobCatalog->Describe(*job, &record);
+    }
+    else
+    {
+      jobCatalog->Add(*job);
+    }
+  }
+  if (jobStaging != NULL && status == 0)
+  {
+    jobStaging->Add(job->stagedName, job->fileName, reserved, cataloged ? &record : NULL);
+  }
+  else if (jobStaging != NULL)
+  {
+    jobStaging->Cancel(reserved);
+  }
+  if (jobScheduler != NULL)
+  {
+    jobScheduler->Release();
+  }
+  if (previewWriter.joinable())
+  {
+    previewWriter.join();
+    TimingSpan(PHASE_DETAIL, "Preview writing", previewStart, previewEnd);
+  }
+  struct stat previewInfo;
+  if (!previewFits.empty() && stat(binned.fitsName.c_str(), &previewInfo) == 0)
+  {
+    jobStaging->Add(binned.fitsName, previewFits, 0, NULL);
+  }
+  if (!previewPng.empty() && stat(binned.pngName.c_str(), &previewInfo) == 0)
+  {
+    jobStaging->Add(binned.pngName, previewPng, 0, NULL);
+  }
+
+  if (status == 0)
+  {
+    printf("Image with temp %.2fC, exp %.3fsec, offset %d, gain %d, saved successfully to disc.\n", job->tempSetting,
+           job->exposureTime / 1000000, job->offsetSetting, job->gainSetting);
+  }
+
+  double bytes = 2.0 * job->roiSizeX * job->roiSizeY;
+  job->framePool->Release(job->pImgData);
+
+  lock_guard<mutex> guard(lock);
+  framesWritten++;
+  if (status != 0)
+  {
+    writeErrors++;
+  }
+  else
+  {
+    bytesWritten += bytes;
+    diskBytes += fileBytes;
+    if (statsFile != NULL && job->hasStats)
+    {
+      const FrameStats &stats = job->stats;
+      fprintf(statsFile, "%s,%ld,%.2f,%d,%d,%d,%.3f,%.1f,%.3f,%d,%d,%ld,%.3f,%.3f,%ld\n", job->fileName.c_str(),
+              job->unixTime, job->tempSetting, (int)job->exposureTime, job->gainSetting, job->offsetSetting,
+              stats.mean, stats.median, stats.stddev, stats.min, stats.max, stats.saturated, stats.clippedMean,
+              stats.clippedStddev, stats.clippedPixels);
+      fflush(statsFile);
+    }
+  }
+  writeSeconds += elapsed;
+  delete job;
+  inFlight--;
+  if (inFlight == 0)
+  {
+    drained.notify_all();
+  }
+}
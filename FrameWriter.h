@@ -0,0 +1,314 @@
+/**
+ * @file FrameWriter.h
+ *
+ * @brief Asynchronous FITS writer pipeline.
+ * Finished frames are queued by the capture loop and written to disk by one or more writer threads,
+ * so the camera can start the next exposure while the previous frame is still being saved.
+ *
+ */
+
+#ifndef FRAMEWRITER_H
+#define FRAMEWRITER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <fitsio.h>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "FitsCompress.h"
+#include "FitsContainer.h"
+#include "FrameStats.h"
+
+class DefectTracker;
+class FrameCatalog;
+class DiskScheduler;
+class FramePool;
+class FramePreview;
+class FrameStacker;
+class PtcAnalyzer;
+class BiasTracker;
+class StagingMigrator;
+class SweepJournal;
+
+/**
+  @struct FrameJob
+    @brief A finished frame waiting to be written, together with the settings it was taken at
+*/
+struct FrameJob
+{
+  unsigned char *pImgData; // Image data, leased from framePool until written
+  FramePool *framePool;    // Pool the writer returns pImgData to
+  unsigned int roiSizeX;   // Image size in X
+  unsigned int roiSizeY;   // Image size in Y
+  int gainSetting;         // Gain setting of the frame
+  int offsetSetting;       // Offset setting of the frame
+  double exposureTime;     // Exposure time (in us)
+  double tempSetting;      // Temperature setting of the frame
+  int readMode;            // Camera readmode
+  int filter;              // Filter wheel position of the frame
+  int repeat;              // Image number at the setting (the last part of the file name)
+  long unixTime;           // UNIX time the frame was read out
+  double sensorTemp;       // Sensor temperature measured when the frame was taken
+  std::string fileName;    // Full path of the .fits file to write
+  std::string stagedName;  // Staging file it is written to first, then migrated to fileName (empty for none)
+  bool hasStats;           // Set once stats has been computed (written into the header)
+  FrameStats stats;        // Pixel statistics of the frame
+  uint32_t checksum;       // CRC-32 of the pixels as read out (computed when journaling)
+  uint64_t dataOffset;     // Byte offset of the pixels in a container file (set by the container writer)
+  unsigned long sequence;  // Submission order, stamped by Submit
+  int stackKey;            // Setting the frame is stacked with (stamped by Submit)
+  int stackSize;           // Repeats taken at that setting (stamped by Submit)
+  int stackIndex;          // Frame number within the setting, from 0 (stamped by Submit)
+};
+
+/**
+  @fn int WriteFitsFrame(const FrameJob &job)
+    @brief Writes a frame and its headers to a .fits file
+    @param job Frame to write
+  @return CFITSIO status (0 on success)
+*/
+int WriteFitsFrame(const FrameJob &job);
+
+/**
+  @fn void WriteFrameKeys(fitsfile *fptr, const FrameJob &job, int *status)
+    @brief Writes the frame's settings into the current header (INTTEMP, EXPTIME, OFFSET, GAIN, QHREADMOE, TIME),
+           followed by its statistics if they have been computed
+    @param fptr Open FITS file
+    @param job Frame the header describes
+    @param status CFITSIO status
+*/
+void WriteFrameKeys(fitsfile *fptr, const FrameJob &job, int *status);
+
+/**
+  @class FrameWriter
+    @brief Bounded queue of finished frames drained by writer threads
+*/
+class FrameWriter
+{
+public:
+  /**
+    @fn FrameWriter(int numWriters, size_t queueDepth)
+      @brief Starts the writer threads
+      @param numWriters Number of writer threads (0 writes synchronously in Submit)
+      @param queueDepth Maximum number of frames waiting to be written before Submit blocks
+  */
+  FrameWriter(int numWriters, size_t queueDepth);
+  ~FrameWriter();
+
+  /**
+    @fn void Submit(FrameJob *job)
+      @brief Hands a frame to the writers, blocking while the queue is full (backpressure)
+      @param job Frame to write; the writer returns its buffer to the pool and deletes the job once written
+  */
+  void Submit(FrameJob *job);
+
+  /**
+    @fn void SetCompression(FitsCompression compression, int level, int threads)
+      @brief Selects tile-compressed output for frames submitted from now on
+      @param compression Compression type (COMPRESS_NONE for plain FITS)
+      @param level zlib level for GZIP, scale for HCOMPRESS
+      @param threads Threads compressing the tiles of each frame
+  */
+  void SetCompression(FitsCompression compression, int level, int threads);
+
+  /**
+    @fn void SetStatistics(bool enabled, int saturation, double clipSigma, int threads, const std::string &csvPath)
+      @brief Computes pixel statistics of each frame before it is written, for its header and a per-sweep CSV summary
+      @param enabled False to skip the statistics
+      @param saturation Saturation level (ADU)
+      @param clipSigma Sigma clipping threshold
+      @param threads Threads computing the statistics of each frame
+      @param csvPath Summary file, one line per frame (empty for none)
+  */
+  void SetStatistics(bool enabled, int saturation, double clipSigma, int threads, const std::string &csvPath);
+
+  /**
+    @fn void SetNativeWriter(bool native)
+      @brief Selects the native writer (default) or CFITSIO for uncompressed frames submitted from now on
+      @param native True for WriteNativeFitsFrame, false for WriteFitsFrame
+  */
+  void SetNativeWriter(bool native);
+
+  /**
+    @fn void SetStacker(FrameStacker *stacker)
+      @brief Adds every frame to a master frame stack before it is written. Set before the first frame is submitted.
+      @param stacker Stacker (NULL for none)
+  */
+  void SetStacker(FrameStacker *stacker);
+
+  /**
+    @fn void SetPtcAnalyzer(PtcAnalyzer *analyzer)
+      @brief Adds every frame to the photon transfer analysis before it is written. Set before the first frame is
+             submitted.
+      @param analyzer Analyzer (NULL for none)
+  */
+  void SetPtcAnalyzer(PtcAnalyzer *analyzer);
+
+  /**
+    @fn void SetDefectTracker(DefectTracker *tracker)
+      @brief Adds every frame to the hot and dead pixel counters before it is written. Set before the first frame is
+             submitted.
+      @param tracker Tracker (NULL for none)
+  */
+  void SetDefectTracker(DefectTracker *tracker);
+
+  /**
+    @fn void SetBiasTracker(BiasTracker *tracker)
+      @brief Adds every frame to the bias profiles before it is written. Set before the first frame is submitted.
+      @param tracker Tracker (NULL for none)
+  */
+  void SetBiasTracker(BiasTracker *tracker);
+
+  /**
+    @fn void SetPreview(FramePreview *preview)
+      @brief Bins every frame before it is written, and writes its preview on a helper thread alongside the frame.
+             Set before the first frame is submitted.
+      @param preview Preview maker (NULL for none)
+  */
+  void SetPreview(FramePreview *preview);
+
+  /**
+    @fn void SetDiskScheduler(DiskScheduler *scheduler, int client)
+      @brief Takes a write slot from a scheduler shared with other cameras before each frame goes to disk
+      @param scheduler Scheduler (NULL to write without one)
+      @param client This writer's client number in the scheduler
+  */
+  void SetDiskScheduler(DiskScheduler *scheduler, int client);
+
+  /**
+    @fn void SetContainer(FitsContainerType type, const std::string &outputPrefix)
+      @brief Writes the repeats of each setting into one cube or multi-extension file instead of a file per frame.
+             Set before the first frame is submitted; uncompressed output only.
+      @param type Container type (CONTAINER_NONE for a file per frame)
+      @param outputPrefix Path the container file names start with
+  */
+  void SetContainer(FitsContainerType type, const std::string &outputPrefix);
+
+  /**
+    @fn void SetJournal(SweepJournal *journal)
+      @brief Checksums every frame and records it in the sweep journal once it is on disk
+      @param journal Journal (NULL for none)
+  */
+  void SetJournal(SweepJournal *journal);
+
+  /**
+    @fn void SetCatalog(FrameCatalog *catalog)
+      @brief Appends every frame written to the catalog of its directory
+      @param catalog Catalog (NULL for none)
+  */
+  void SetCatalog(FrameCatalog *catalog);
+
+  /**
+    @fn void SetStaging(StagingMigrator *staging)
+      @brief Writes every frame to the staging directory and queues it for migration to its archive name.
+             Containers are always written in place.
+      @param staging Staging directory and migrator (NULL to write in place)
+  */
+  void SetStaging(StagingMigrator *staging);
+
+  /**
+    @fn void SetStackBlock(int key, int size)
+      @brief Tags frames submitted from now on as belonging to one setting (for stacking and pairing)
+      @param key Setting (the sweep block index)
+      @param size Repeats taken at the setting
+  */
+  void SetStackBlock(int key, int size);
+
+  /**
+    @fn const char *FileExtension() const
+    @return Extension saved files should get (".fits", or ".fits.fz" when compressed)
+  */
+  const char *FileExtension() const;
+
+  /**
+    @fn void Flush()
+      @brief Blocks until every submitted frame has been written to disk
+  */
+  void Flush();
+
+  /**
+    @fn void Stop()
+      @brief Flushes the queue and joins the writer threads
+  */
+  void Stop();
+
+  /**
+    @fn void PrintStats()
+      @brief Prints write throughput and how long capture was held up by the writers
+  */
+  void PrintStats();
+
+  /**
+    @fn unsigned long FramesWritten()
+    @return Frames successfully written so far
+  */
+  unsigned long FramesWritten();
+
+  /**
+    @fn double BytesWritten()
+    @return Pixel bytes successfully written so far
+  */
+  double BytesWritten();
+
+  /**
+    @fn double DiskBytes()
+    @return Size on disk of the files written so far
+  */
+  double DiskBytes();
+
+private:
+  void WriterLoop();
+  void WriteJob(FrameJob *job);
+  void StampJob(FrameJob *job);
+
+  std::vector<std::thread> writers; // Writer threads
+  std::deque<FrameJob *> queue;     // Frames waiting to be written
+  size_t queueDepth;                // Maximum queue length
+  size_t inFlight;                  // Frames queued or being written
+  bool stopping;                    // Set when the writers should exit
+  std::mutex lock;
+  std::condition_variable notEmpty; // Signalled when a frame is queued
+  std::condition_variable notFull;  // Signalled when a frame leaves the queue
+  std::condition_variable drained;  // Signalled when inFlight reaches zero
+  FitsCompression compression;      // Output compression
+  int compressLevel;                // Compression level
+  int compressThreads;              // Threads compressing each frame
+  bool nativeWriter;                // Write uncompressed frames without CFITSIO
+  bool statsEnabled;                // Compute pixel statistics of each frame
+  int statsSaturation;              // Saturation level for the statistics
+  double statsClipSigma;            // Sigma clipping threshold
+  int statsThreads;                 // Threads computing the statistics of each frame
+  FILE *statsFile;                  // Per-sweep statistics summary (NULL for none)
+  FrameStacker *stacker;            // Master frame stacker (NULL for none)
+  PtcAnalyzer *ptcAnalyzer;         // Photon transfer analysis (NULL for none)
+  DefectTracker *defectTracker;     // Hot and dead pixel counters (NULL for none)
+  BiasTracker *biasTracker;         // Bias profiles (NULL for none)
+  FramePreview *preview;            // Binned previews (NULL for none)
+  DiskScheduler *diskScheduler;     // Write slots shared with other cameras (NULL for none)
+  int diskClient;                   // Client number in diskScheduler
+  SweepJournal *journal;            // Journal of the frames written (NULL for none)
+  FrameCatalog *catalog;            // Catalog of the frames written (NULL for none)
+  StagingMigrator *staging;         // Staging directory the frames are written to (NULL to write in place)
+  unsigned long nextSequence;       // Sequence number of the next submitted frame
+  int stackKey;                     // Setting of the frames being submitted
+  int stackSize;                    // Repeats taken at that setting
+  int stackIndex;                   // Frames submitted at that setting
+  FitsContainerType containerType;  // Output container
+  FitsContainerWriter *container;   // Cube or multi-extension output (NULL for a file per frame)
+
+  // Statistics
+  unsigned long framesWritten;
+  unsigned long writeErrors;
+  double bytesWritten;   // Pixel bytes of the frames written
+  double diskBytes;      // Size of the files on disk
+  double writeSeconds;   // Time spent inside WriteFitsFrame, summed over writers
+  double blockedSeconds; // Time Submit spent waiting for a free queue slot
+  size_t maxQueued;      // Highest queue length seen
+};
+
+#endif
@@ -0,0 +1,317 @@
+/**
+ * @file PhotonTransfer.cpp
+ *
+ * @brief Photon transfer curve analysis.
+ *
+ */
+
+// Dependencies
+#include "PhotonTransfer.h"
+#include "FrameWriter.h"
+#include "Timing.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <map>
+#include <thread>
+
+using namespace std;
+
+static const double FIT_FULL_WELL_FRACTION = 0.7; // Tiles above this fraction of the full well are left out of the fit
+
+/**
+  @fn static double Median(vector<double> values)
+    @brief Median of a list of values
+    @param values Values (copied, as they are reordered)
+  @return Median (0 for an empty list)
+*/
+static double Median(vector<double> values)
+{
+  if (values.empty())
+  {
+    return 0.0;
+  }
+  size_t middle = values.size() / 2;
+  nth_element(values.begin(), values.begin() + middle, values.end());
+  double median = values[middle];
+  if (values.size() % 2 == 0)
+  {
+    median = 0.5 * (median + *max_element(values.begin(), values.begin() + middle));
+  }
+  return median;
+}
+
+PtcResult FitPhotonTransfer(const vector<PtcPoint> &points, int saturation)
+{
+  PtcResult result = {};
+
+  // Median tile mean and variance of each exposure time
+  map<double, vector<double>> means, variances;
+  for (size_t i = 0; i < points.size(); i++)
+  {
+    if (points[i].mean < saturation)
+    {
+      means[points[i].exposureTime].push_back(points[i].mean);
+      variances[points[i].exposureTime].push_back(points[i].variance);
+    }
+  }
+  result.exposures = means.size();
+  if (means.empty())
+  {
+    return result;
+  }
+
+  // Bias and read noise from the shortest exposure; the full well where the variance peaks, if it turns over
+  result.biasLevel = Median(means.begin()->second);
+  result.readNoiseAdu = sqrt(Median(variances.begin()->second));
+  double peakVariance = -1, peakMean = 0;
+  bool turnedOver = false;
+  for (map<double, vector<double>>::iterator it = means.begin(); it != means.end(); ++it)
+  {
+    double variance = Median(variances[it->first]);
+    if (variance > peakVariance)
+    {
+      peakVariance = variance;
+      peakMean = Median(it->second);
+      turnedOver = false;
+    }
+    else
+    {
+      turnedOver = true;
+    }
+  }
+
+  // Least squares line variance = a + b * signal through the tiles in the shot noise regime
+  double limit = turnedOver ? FIT_FULL_WELL_FRACTION * (peakMean - result.biasLevel) : HUGE_VAL;
+  double n = 0, sumX = 0, sumY = 0, sumXX = 0, sumXY = 0;
+  for (size_t i = 0; i < points.size(); i++)
+  {
+    double signal = points[i].mean - result.biasLevel;
+    if (points[i].mean < saturation && signal <= limit)
+    {
+      n++;
+      sumX += signal;
+      sumY += points[i].variance;
+      sumXX += signal * signal;
+      sumXY += signal * points[i].variance;
+    }
+  }
+  result.fitPoints = (int)n;
+  double denominator = n * sumXX - sumX * sumX;
+  if (result.exposures < 2 || denominator <= 0)
+  {
+    return result;
+  }
+  double slope = (n * sumXY - sumX * sumY) / denominator;
+  if (slope <= 0)
+  {
+    return result;
+  }
+
+  result.conversionGain = 1.0 / slope;
+  result.readNoise = result.conversionGain * result.readNoiseAdu;
+  result.fullWell = turnedOver ? result.conversionGain * (peakMean - result.biasLevel) : 0.0;
+  return result;
+}
+
+PtcAnalyzer::PtcAnalyzer(int tileSize, int saturation, int numThreads)
+    : tileSize(tileSize > 1 ? tileSize : 2), saturation(saturation), numThreads(numThreads > 0 ? numThreads : 1),
+      nextSequence(0), pendingKey(-1)
+{
+}
+
+void PtcAnalyzer::Add(const FrameJob &job)
+{
+  unique_lock<mutex> guard(lock);
+  turn.wait(guard, [&] { return job.sequence == nextSequence; });
+
+  // Only the thread holding the turn touches the pending frame, so the other writers can wait without the lock
+  guard.unlock();
+  const unsigned short *pixels = reinterpret_cast<const unsigned short *>(job.pImgData);
+  size_t count = (size_t)job.roiSizeX * job.roiSizeY;
+  if (pendingKey == job.stackKey && pending.size() == count)
+  {
+    PhaseTimer timer(PHASE_DETAIL, "PTC pair");
+    AddPair(pending.data(), pixels, job);
+    pendingKey = -1;
+  }
+  else
+  {
+    pending.assign(pixels, pixels + count);
+    pendingKey = job.stackKey;
+  }
+  guard.lock();
+
+  nextSequence++;
+  turn.notify_all();
+}
+
+/**
+  @fn void PtcAnalyzer::AddPair(const unsigned short *first, const unsigned short *second, const FrameJob &job)
+    @brief Computes the mean signal and difference variance of every full tile of a pair of frames
+    @param first First frame of the pair
+    @param second Second frame of the pair
+    @param job Second frame's job, for its size and settings
+*/
+void PtcAnalyzer::AddPair(const unsigned short *first, const unsigned short *second, const FrameJob &job)
+{
+  unsigned int tilesX = job.roiSizeX / tileSize;
+  unsigned int tilesY = job.roiSizeY / tileSize;
+  vector<PtcPoint> points(tilesX * tilesY);
+  double pixels = (double)tileSize * tileSize;
+
+  // One row of tiles at a time per thread; the sums are exact in 64 bits
+  atomic<unsigned int> nextTileRow(0);
+  auto tileRows = [&]() {
+    vector<int64_t> sum(tilesX), difference(tilesX), squares(tilesX);
+    while (true)
+    {
+      unsigned int ty = nextTileRow.fetch_add(1);
+      if (ty >= tilesY)
+      {
+        return;
+      }
+      fill(sum.begin(), sum.end(), 0);
+      fill(difference.begin(), difference.end(), 0);
+      fill(squares.begin(), squares.end(), 0);
+      for (unsigned int y = ty * tileSize; y < (ty + 1) * tileSize; y++)
+      {
+        const unsigned short *a = first + (size_t)y * job.roiSizeX;
+        const unsigned short *b = second + (size_t)y * job.roiSizeX;
+        for (unsigned int tx = 0; tx < tilesX; tx++)
+        {
+          int64_t tileSum = 0, tileDifference = 0, tileSquares = 0;
+          for (unsigned int x = tx * tileSize; x < (tx + 1) * tileSize; x++)
+          {
+            int d = (int)a[x] - (int)b[x];
+            tileSum += a[x] + b[x];
+            tileDifference += d;
+            tileSquares += (int64_t)d * d;
+          }
+          sum[tx] += tileSum;
+          difference[tx] += tileDifference;
+          squares[tx] += tileSquares;
+        }
+      }
+      for (unsigned int tx = 0; tx < tilesX; tx++)
+      {
+        PtcPoint &point = points[ty * tilesX + tx];
+        double differenceMean = difference[tx] / pixels;
+        point.exposureTime = job.exposureTime;
+        point.mean = sum[tx] / (2 * pixels);
+        point.variance = (squares[tx] - difference[tx] * differenceMean) / (pixels - 1) / 2;
+      }
+    }
+  };
+
+  vector<thread> workers;
+  for (int i = 1; i < numThreads; i++)
+  {
+    workers.push_back(thread(tileRows));
+  }
+  tileRows();
+  for (size_t i = 0; i < workers.size(); i++)
+  {
+    workers[i].join();
+  }
+
+  lock_guard<mutex> guard(lock);
+  Setting *setting = NULL;
+  for (size_t i = 0; i < settings.size(); i++)
+  {
+    if (settings[i].gainSetting == job.gainSetting && settings[i].offsetSetting == job.offsetSetting &&
+        settings[i].tempSetting == job.tempSetting && settings[i].readMode == job.readMode)
+    {
+      setting = &settings[i];
+    }
+  }
+  if (setting == NULL)
+  {
+    Setting added = {job.gainSetting, job.offsetSetting, job.tempSetting, job.readMode, 0, vector<PtcPoint>()};
+    settings.push_back(added);
+    setting = &settings.back();
+  }
+  setting->pairs++;
+  setting->points.insert(setting->points.end(), points.begin(), points.end());
+}
+
+vector<PtcResult> PtcAnalyzer::Results()
+{
+  lock_guard<mutex> guard(lock);
+  vector<PtcResult> results;
+  for (size_t i = 0; i < settings.size(); i++)
+  {
+    PtcResult result = FitPhotonTransfer(settings[i].points, saturation);
+    result.gainSetting = settings[i].gainSetting;
+    result.offsetSetting = settings[i].offsetSetting;
+    result.tempSetting = settings[i].tempSetting;
+    result.readMode = settings[i].readMode;
+    result.pairs = settings[i].pairs;
+    results.push_back(result);
+  }
+  return results;
+}
+
+void PtcAnalyzer::PrintResults(const string &csvPath)
+{
+  vector<PtcResult> results = Results();
+  FILE *csv = NULL;
+  if (!csvPath.empty())
+  {
+    csv = fopen(csvPath.c_str(), "w");
+    if (csv == NULL)
+    {
+      printf("Could not create photon transfer summary %s.\n", csvPath.c_str());
+    }
+    else
+    {
+      fprintf(csv, "gain,offset,temp,read_mode,exposures,pairs,bias_adu,read_noise_adu,gain_e_per_adu,read_noise_e,"
+                   "full_well_e,fit_points\n");
+    }
+  }
+
+  printf(" \n");
+  printf("Photon transfer (%d pixel tiles):\n", tileSize);
+  printf("%5s %6s %7s %4s %5s %5s %9s %7s %8s %7s %10s\n", "Gain", "Offset", "Temp", "Mode", "Exps", "Pairs",
+         "Bias", "RN ADU", "e-/ADU", "RN e-", "Full well");
+  for (size_t i = 0; i < results.size(); i++)
+  {
+    const PtcResult &r = results[i];
+    printf("%5d %6d %7.2f %4d %5d %5d %9.1f %7.3f", r.gainSetting, r.offsetSetting, r.tempSetting, r.readMode,
+           r.exposures, r.pairs, r.biasLevel, r.readNoiseAdu);
+    if (r.conversionGain > 0)
+    {
+      printf(" %8.4f %7.3f", r.conversionGain, r.readNoise);
+    }
+    else
+    {
+      printf(" %8s %7s", "-", "-");
+    }
+    if (r.fullWell > 0)
+    {
+      printf(" %10.0f\n", r.fullWell);
+    }
+    else
+    {
+      printf(" %10s\n", "-");
+    }
+
+    if (csv != NULL)
+    {
+      fprintf(csv, "%d,%d,%.2f,%d,%d,%d,%.3f,%.4f,%.5f,%.4f,%.1f,%d\n", r.gainSetting, r.offsetSetting, r.tempSetting,
+              r.readMode, r.exposures, r.pairs, r.biasLevel, r.readNoiseAdu, r.conversionGain, r.readNoise,
+              r.fullWell, r.fitPoints);
+    }
+  }
+  if (results.empty())
+  {
+    printf("No pairs of frames (photon transfer needs at least 2 repeats per setting).\n");
+  }
+  if (csv != NULL)
+  {
+    fclose(csv);
+    printf("Photon transfer results written to %s.\n", csvPath.c_str());
+  }
+}
@@ -0,0 +1,129 @@
+/**
+ * @file PhotonTransfer.h
+ *
+ * @brief Photon transfer curve analysis.
+ * Consecutive repeats at a setting are paired as they are written. For each pair, the mean signal and the variance
+ * of the difference image are computed per ROI tile, in parallel over tile rows. Only these tile statistics are
+ * kept (plus one frame while its partner is awaited). At the end of the sweep the points of each gain, offset,
+ * temperature and read mode are fitted for conversion gain, read noise and full well.
+ *
+ */
+
+#ifndef PHOTONTRANSFER_H
+#define PHOTONTRANSFER_H
+
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <vector>
+
+struct FrameJob;
+
+/**
+  @struct PtcPoint
+    @brief Statistics of one ROI tile of one pair of frames (ADU)
+*/
+struct PtcPoint
+{
+  double exposureTime; // Exposure time of the pair (in us)
+  double mean;         // Mean signal of the two frames
+  double variance;     // Variance of the difference image / 2 (the variance of one frame without fixed pattern)
+};
+
+/**
+  @struct PtcResult
+    @brief Fitted characterization of one gain, offset, temperature and read mode
+*/
+struct PtcResult
+{
+  int gainSetting;       // Gain setting
+  int offsetSetting;     // Offset setting
+  double tempSetting;    // Temperature setting
+  int readMode;          // Read mode
+  int exposures;         // Exposure times with at least one pair
+  int pairs;             // Pairs of frames analyzed
+  double biasLevel;      // Mean signal of the shortest exposure (ADU)
+  double conversionGain; // Electrons per ADU (0 if the fit failed)
+  double readNoiseAdu;   // Read noise from the shortest exposure (ADU)
+  double readNoise;      // Read noise (electrons)
+  double fullWell;       // Signal above bias at which the variance turns over (electrons, 0 if it did not)
+  int fitPoints;         // Tiles used in the fit
+};
+
+/**
+  @fn PtcResult FitPhotonTransfer(const std::vector<PtcPoint> &points, int saturation)
+    @brief Fits a photon transfer curve: read noise and bias from the shortest exposure, the full well from the
+           exposure with the highest variance, and the conversion gain from a least squares line through the tiles
+           below 70% of the full well
+    @param points Tile statistics of all pairs of one setting
+    @param saturation Saturation level (ADU); tiles at or above it are ignored
+  @return Fit (setting fields left for the caller)
+*/
+PtcResult FitPhotonTransfer(const std::vector<PtcPoint> &points, int saturation);
+
+/**
+  @class PtcAnalyzer
+    @brief Pairs frames and collects their tile statistics, per setting
+*/
+class PtcAnalyzer
+{
+public:
+  /**
+    @fn PtcAnalyzer(int tileSize, int saturation, int numThreads)
+      @param tileSize Tile width and height (pixels)
+      @param saturation Saturation level (ADU)
+      @param numThreads Threads sharing the tile rows of each pair
+  */
+  PtcAnalyzer(int tileSize, int saturation, int numThreads);
+
+  /**
+    @fn void Add(const FrameJob &job)
+      @brief Adds a frame. Frames are taken in submission order (job.sequence), so writer threads may call this
+             concurrently. Must be called before the pixels are converted for writing.
+      @param job Frame to add
+  */
+  void Add(const FrameJob &job);
+
+  /**
+    @fn std::vector<PtcResult> Results()
+      @brief Fits every setting analyzed so far
+    @return One result per gain, offset, temperature and read mode
+  */
+  std::vector<PtcResult> Results();
+
+  /**
+    @fn void PrintResults(const std::string &csvPath)
+      @brief Prints the results table and writes it as CSV
+      @param csvPath CSV file (empty for none)
+  */
+  void PrintResults(const std::string &csvPath);
+
+private:
+  /**
+    @struct Setting
+      @brief Points collected at one gain, offset, temperature and read mode
+  */
+  struct Setting
+  {
+    int gainSetting;
+    int offsetSetting;
+    double tempSetting;
+    int readMode;
+    int pairs;
+    std::vector<PtcPoint> points;
+  };
+
+  void AddPair(const unsigned short *first, const unsigned short *second, const FrameJob &job);
+
+  int tileSize;
+  int saturation;
+  int numThreads;
+  unsigned long nextSequence;          // Sequence number of the next frame to add
+  std::vector<unsigned short> pending; // First frame of the pair being formed
+  int pendingKey;                      // Setting (FrameJob::stackKey) of the pending frame (-1 for none)
+  std::vector<Setting> settings;
+  std::mutex lock;
+  std::condition_variable turn; // Signalled when nextSequence advances
+};
+
+#endif
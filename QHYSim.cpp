@@ -0,0 +1,610 @@
+/**
+ * @file QHYSim.cpp
+ *
+ * @brief Simulated stand-in for the subset of the QHYCCD SDK used by SingleFrameMode.
+ * Link this instead of -lqhyccd to exercise the capture loop without a camera (see `make sim` and `make bench`).
+ *
+ * Behaviour is configured through environment variables:
+ *   QHYSIM_CAMERAS          Number of simulated cameras, each with its own state (default 1)
+ *   QHYSIM_READOUT_MS       Readout time per frame in milliseconds (default 1500)
+ *   QHYSIM_USB_MS           Readout time added per unit of CONTROL_USBTRAFFIC in milliseconds (default 0)
+ *   QHYSIM_USB_FAIL_BELOW   CONTROL_USBTRAFFIC below which one frame in three fails to read out (default 0)
+ *   QHYSIM_EXPOSURE_SCALE   Factor applied to the requested exposure time (default 1.0)
+ *   QHYSIM_LIVE_FRAME_MS    Shortest frame period in live (stream) mode in milliseconds (default 250)
+ *   QHYSIM_AMBIENT_C        Ambient temperature the sensor starts at, in Celsius (default 20)
+ *   QHYSIM_COOLER_DELTA_C   Largest temperature drop below ambient the cooler can hold (default 35)
+ *   QHYSIM_COOLER_TAU_S     Time constant of the first-order cooler response in seconds (default 60)
+ *   QHYSIM_CFW_SLOTS        Filter wheel slots, 0 for no filter wheel (default 7)
+ *   QHYSIM_CFW_MOVE_S       Filter wheel move time per slot in seconds (default 1.5)
+ *   QHYSIM_CFW_REPORTS_TARGET  1 for a wheel that reports the target slot while moving instead of 'N' (default 0)
+ *   QHYSIM_NOISE            1 for synthetic noise frames, 0 for a flat pedestal (default 1)
+ *   QHYSIM_READ_NOISE_E     Read noise in electrons (default 3.5)
+ *   QHYSIM_DARK_E           Dark current at 20 C in e-/pixel/s, doubling every 6 C (default 0.05)
+ *   QHYSIM_FLUX_E           Illumination in e-/pixel/s (default 0)
+ *   QHYSIM_HOT_FRACTION     Fraction of hot pixels (default 1e-5)
+ *   QHYSIM_COSMICS          Cosmic ray tracks per frame, each a few pixels long (default 0)
+ *   QHYSIM_OVERSCAN         Overscan columns at the right edge of the sensor, bias and read noise only (default 0)
+ *   QHYSIM_BIAS_TEMPCO      Change of the bias pedestal per degree of sensor temperature above 20 C, in ADU (default 0)
+ *
+ */
+
+// Dependencies
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "qhyccd.h"
+#include <chrono>
+#include <cmath>
+#include <mutex>
+#include <thread>
+
+using namespace std;
+
+static const unsigned int SIM_MAX_X = 9600; // Simulated sensor size (QHY600M)
+static const unsigned int SIM_MAX_Y = 6422;
+static const int SIM_PARAMS = 64;           // Size of the CONTROL_ID value table
+static const int NOISE_TABLE_SIZE = 1 << 16; // Precomputed unit-variance Gaussian samples
+
+/**
+  @struct SimCamera
+    @brief State of a simulated camera
+*/
+struct SimCamera
+{
+  mutex lock;               // The SDK may be called from several threads
+  int index;                // Camera number (from the ID it was opened with)
+  unsigned int startX;      // Current ROI start in X
+  unsigned int sizeX;       // Current ROI size in X
+  unsigned int sizeY;       // Current ROI size in Y
+  unsigned int binX;        // Binning in X
+  unsigned int binY;        // Binning in Y
+  unsigned int bits;        // Bit depth
+  double params[SIM_PARAMS]; // Last value set for each CONTROL_ID
+  bool exposing;            // True between ExpQHYCCDSingleFrame and readout
+  double exposureStart;     // When the exposure started
+  unsigned long frameCount; // Frames read out so far
+  int streamMode;           // 0 for single frame, 1 for live
+  bool live;                // True between BeginQHYCCDLive and StopQHYCCDLive
+  double liveStart;         // When live mode started
+  unsigned long liveNext;   // Index of the next live frame not yet delivered
+
+  // Cooler
+  double sensorTemp;   // Current sensor temperature
+  double coolerTarget; // Requested temperature (NAN while the cooler is off)
+  double thermalTime;  // When sensorTemp was last updated
+
+  // Filter wheel
+  int cfwPosition;  // Slot the wheel is at (or moving from)
+  int cfwTarget;    // Slot the wheel is moving to
+  double cfwArrive; // When the current move completes
+};
+
+/**
+  @fn static double SimEnv(const char *name, double defaultValue)
+    @brief Reads a numeric simulator setting from the environment
+    @param name Environment variable name
+    @param defaultValue Value to use when the variable is not set
+  @return Setting value
+*/
+static double SimEnv(const char *name, double defaultValue)
+{
+  const char *value = getenv(name);
+  return value ? atof(value) : defaultValue;
+}
+
+/**
+  @fn static double SimNow()
+  @return Seconds on the monotonic clock
+*/
+static double SimNow()
+{
+  return chrono::duration<double>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/**
+  @fn static void SimSleep(double seconds)
+    @brief Sleeps for the given number of seconds
+    @param seconds Time to sleep
+*/
+static void SimSleep(double seconds)
+{
+  if (seconds > 0)
+  {
+    this_thread::sleep_for(chrono::duration<double>(seconds));
+  }
+}
+
+/**
+  @fn static uint64_t XorShift(uint64_t &state)
+    @brief xorshift64* pseudo-random generator
+    @param state Generator state (non-zero)
+  @return Next pseudo-random value
+*/
+static uint64_t XorShift(uint64_t &state)
+{
+  state ^= state >> 12;
+  state ^= state << 25;
+  state ^= state >> 27;
+  return state * 2685821657736338717ULL;
+}
+
+/**
+  @fn static const float *NoiseTable()
+  @return Table of NOISE_TABLE_SIZE unit-variance Gaussian samples, built on first use
+*/
+static const float *NoiseTable()
+{
+  static float table[NOISE_TABLE_SIZE];
+  static once_flag built;
+  call_once(built, [] {
+    uint64_t state = 0x9E3779B97F4A7C15ULL;
+    for (int i = 0; i < NOISE_TABLE_SIZE; i += 2)
+    {
+      // Box-Muller
+      double u1 = ((XorShift(state) >> 11) + 1.0) / 9007199254740993.0;
+      double u2 = (XorShift(state) >> 11) / 9007199254740992.0;
+      double r = sqrt(-2 * log(u1));
+      table[i] = (float)(r * cos(2 * M_PI * u2));
+      table[i + 1] = (float)(r * sin(2 * M_PI * u2));
+    }
+  });
+  return table;
+}
+
+static SimCamera *SimCam(qhyccd_handle *handle)
+{
+  return static_cast<SimCamera *>(handle);
+}
+
+/**
+  @fn static void SimUpdateThermal(SimCamera *cam)
+    @brief Advances the first-order cooler model to the current time
+    @param cam Simulated camera (locked by the caller)
+*/
+static void SimUpdateThermal(SimCamera *cam)
+{
+  double now = SimNow();
+  double ambient = SimEnv("QHYSIM_AMBIENT_C", 20);
+  double floorTemp = ambient - SimEnv("QHYSIM_COOLER_DELTA_C", 35);
+  double tau = SimEnv("QHYSIM_COOLER_TAU_S", 60);
+
+  // The sensor relaxes towards the cooler target (or ambient when off), limited by the cooler's capacity
+  double goal = std::isnan(cam->coolerTarget) ? ambient : fmax(cam->coolerTarget, floorTemp);
+  double dt = now - cam->thermalTime;
+  cam->sensorTemp = goal + (cam->sensorTemp - goal) * (tau > 0 ? exp(-dt / tau) : 0.0);
+  cam->thermalTime = now;
+
+  // PWM: what it takes to hold the current temperature, plus a push while still approaching the target
+  double hold = (ambient - cam->sensorTemp) / (ambient - floorTemp);
+  double push = (cam->sensorTemp - goal) / (ambient - floorTemp);
+  double pwm = std::isnan(cam->coolerTarget) ? 0.0 : 255 * fmin(1.0, fmax(0.0, hold + 2 * push));
+  cam->params[CONTROL_CURTEMP] = cam->sensorTemp;
+  cam->params[CONTROL_CURPWM] = pwm;
+}
+
+/**
+  @fn static void SimFillFrame(SimCamera *cam, uint16_t *pixels, unsigned int width, unsigned int height, double exposure)
+    @brief Synthesizes a frame: bias pedestal, dark current, illumination, read and shot noise, hot pixels and cosmic rays
+    @param cam Simulated camera (locked by the caller)
+    @param pixels Output pixels
+    @param width Frame width
+    @param height Frame height
+    @param exposure Exposure time in seconds
+*/
+static void SimFillFrame(SimCamera *cam, uint16_t *pixels, unsigned int width, unsigned int height, double exposure)
+{
+  size_t count = (size_t)width * height;
+  double bias = 10 * cam->params[CONTROL_OFFSET] + SimEnv("QHYSIM_BIAS_TEMPCO", 0) * (cam->sensorTemp - 20);
+  if (SimEnv("QHYSIM_NOISE", 1) == 0)
+  {
+    for (size_t i = 0; i < count; i++)
+    {
+      pixels[i] = (uint16_t)bias;
+    }
+    return;
+  }
+
+  // Conversion gain falls from ~1.0 e-/ADU at gain 0 by a factor of ten over 120 gain steps
+  double eGain = pow(10.0, -cam->params[CONTROL_GAIN] / 120.0);
+  double dark = SimEnv("QHYSIM_DARK_E", 0.05) * pow(2.0, (cam->sensorTemp - 20) / 6.0);
+  double signalE = (dark + SimEnv("QHYSIM_FLUX_E", 0)) * exposure;
+  double readNoiseE = SimEnv("QHYSIM_READ_NOISE_E", 3.5);
+  float mean = (float)(bias + signalE / eGain);
+  float sigma = (float)(sqrt(readNoiseE * readNoiseE + signalE) / eGain);
+  float hotLevel = (float)(bias + (200 * dark * exposure + 500) / eGain);
+  uint64_t hotThreshold = (uint64_t)(SimEnv("QHYSIM_HOT_FRACTION", 1e-5) * 18446744073709551615.0);
+
+  // Frame column where the overscan starts (width if the ROI leaves it out)
+  unsigned int overscan = (unsigned int)SimEnv("QHYSIM_OVERSCAN", 0);
+  unsigned int overscanFrom = width;
+  if (overscan > 0 && cam->startX + cam->sizeX > SIM_MAX_X - overscan)
+  {
+    unsigned int sensorFrom = SIM_MAX_X - overscan;
+    overscanFrom = sensorFrom > cam->startX ? (sensorFrom - cam->startX) / cam->binX : 0;
+  }
+  float overscanSigma = (float)(readNoiseE / eGain);
+
+  const float *table = NoiseTable();
+  uint64_t state = 0x2545F4914F6CDD1DULL + (cam->frameCount + ((uint64_t)cam->index << 32)) * 0x9E3779B97F4A7C15ULL;
+  for (size_t i = 0; i < count; i++)
+  {
+    uint64_t random = XorShift(state);
+    float value = mean + sigma * table[random & (NOISE_TABLE_SIZE - 1)];
+
+    // Hot pixels sit at fixed positions from frame to frame
+    uint64_t position = (i + 1) * 0xD6E8FEB86659FD93ULL;
+    position ^= position >> 32;
+    if (position * 0xD6E8FEB86659FD93ULL < hotThreshold)
+    {
+      value = hotLevel;
+    }
+
+    // The overscan is not exposed: pedestal and read noise only
+    if (overscanFrom < width && i % width >= overscanFrom)
+    {
+      value = (float)bias + overscanSigma * table[random & (NOISE_TABLE_SIZE - 1)];
+    }
+
+    pixels[i] = (uint16_t)fmin(65535.0f, fmax(0.0f, value));
+  }
+
+  // Cosmic ray tracks of 1 to 4 pixels, along a row or a column
+  int cosmics = (int)SimEnv("QHYSIM_COSMICS", 0);
+  for (int c = 0; c < cosmics; c++)
+  {
+    uint64_t random = XorShift(state);
+    size_t x = (random >> 8) % width;
+    size_t y = (random >> 32) % height;
+    int length = 1 + (int)(random & 3);
+    bool vertical = (random >> 2) & 1;
+    float deposit = (float)(2000 + (random >> 4 & 0xFFF)) / (float)eGain;
+    for (int p = 0; p < length && x < width && y < height; p++)
+    {
+      pixels[y * width + x] = (uint16_t)fmin(65535.0f, pixels[y * width + x] + deposit);
+      vertical ? y++ : x++;
+    }
+  }
+}
+
+uint32_t InitQHYCCDResource(void)
+{
+  return QHYCCD_SUCCESS;
+}
+
+uint32_t ReleaseQHYCCDResource(void)
+{
+  return QHYCCD_SUCCESS;
+}
+
+uint32_t ScanQHYCCD(void)
+{
+  return (uint32_t)SimEnv("QHYSIM_CAMERAS", 1);
+}
+
+uint32_t GetQHYCCDId(uint32_t index, char *id)
+{
+  if (index >= ScanQHYCCD())
+  {
+    return QHYCCD_ERROR;
+  }
+  sprintf(id, "QHY600M-SIM%u", index);
+  return QHYCCD_SUCCESS;
+}
+
+qhyccd_handle *OpenQHYCCD(char *id)
+{
+  unsigned int index;
+  if (sscanf(id, "QHY600M-SIM%u", &index) != 1 || index >= ScanQHYCCD())
+  {
+    return NULL;
+  }
+  SimCamera *cam = new SimCamera();
+  cam->index = index;
+  cam->startX = 0;
+  cam->sizeX = SIM_MAX_X;
+  cam->sizeY = SIM_MAX_Y;
+  cam->binX = 1;
+  cam->binY = 1;
+  cam->bits = 16;
+  cam->exposing = false;
+  cam->frameCount = 0;
+  cam->streamMode = 0;
+  cam->live = false;
+  cam->sensorTemp = SimEnv("QHYSIM_AMBIENT_C", 20);
+  cam->coolerTarget = NAN;
+  cam->thermalTime = SimNow();
+  cam->cfwPosition = 0;
+  cam->cfwTarget = 0;
+  cam->cfwArrive = 0;
+  return cam;
+}
+
+uint32_t CloseQHYCCD(qhyccd_handle *handle)
+{
+  delete SimCam(handle);
+  return QHYCCD_SUCCESS;
+}
+
+uint32_t SetQHYCCDReadMode(qhyccd_handle *handle, uint32_t modeNumber)
+{
+  (void)handle;
+  (void)modeNumber;
+  return QHYCCD_SUCCESS;
+}
+
+uint32_t SetQHYCCDStreamMode(qhyccd_handle *handle, uint8_t mode)
+{
+  SimCamera *cam = SimCam(handle);
+  if (mode > 1)
+  {
+    return QHYCCD_ERROR;
+  }
+  lock_guard<mutex> guard(cam->lock);
+  cam->streamMode = mode;
+  return QHYCCD_SUCCESS;
+}
+
+uint32_t InitQHYCCD(qhyccd_handle *handle)
+{
+  (void)handle;
+  return QHYCCD_SUCCESS;
+}
+
+uint32_t SetQHYCCDParam(qhyccd_handle *handle, CONTROL_ID controlId, double value)
+{
+  SimCamera *cam = SimCam(handle);
+  if ((int)controlId < 0 || (int)controlId >= SIM_PARAMS)
+  {
+    return QHYCCD_ERROR;
+  }
+
+  lock_guard<mutex> guard(cam->lock);
+  if (controlId == CONTROL_COOLER)
+  {
+    SimUpdateThermal(cam);
+    cam->coolerTarget = value;
+  }
+  else if (controlId == CONTROL_MANULPWM && value == 0)
+  {
+    SimUpdateThermal(cam);
+    cam->coolerTarget = NAN; // Manual PWM of zero switches the cooler off until a target is set
+  }
+  cam->params[controlId] = value;
+  return QHYCCD_SUCCESS;
+}
+
+double GetQHYCCDParam(qhyccd_handle *handle, CONTROL_ID controlId)
+{
+  SimCamera *cam = SimCam(handle);
+  if ((int)controlId < 0 || (int)controlId >= SIM_PARAMS)
+  {
+    return QHYCCD_ERROR;
+  }
+
+  if (controlId == CONTROL_CFWSLOTSNUM)
+  {
+    return SimEnv("QHYSIM_CFW_SLOTS", 7);
+  }
+
+  lock_guard<mutex> guard(cam->lock);
+  if (controlId == CONTROL_CURTEMP || controlId == CONTROL_CURPWM)
+  {
+    SimUpdateThermal(cam);
+  }
+  return cam->params[controlId];
+}
+
+uint32_t SetQHYCCDResolution(qhyccd_handle *handle, uint32_t x, uint32_t y, uint32_t xsize, uint32_t ysize)
+{
+  SimCamera *cam = SimCam(handle);
+  if (x + xsize > SIM_MAX_X || y + ysize > SIM_MAX_Y)
+  {
+    return QHYCCD_ERROR;
+  }
+  lock_guard<mutex> guard(cam->lock);
+  cam->startX = x;
+  cam->sizeX = xsize;
+  cam->sizeY = ysize;
+  return QHYCCD_SUCCESS;
+}
+
+uint32_t GetQHYCCDOverScanArea(qhyccd_handle *handle, uint32_t *startX, uint32_t *startY, uint32_t *sizeX,
+                               uint32_t *sizeY)
+{
+  (void)handle;
+  unsigned int overscan = (unsigned int)SimEnv("QHYSIM_OVERSCAN", 0);
+  *startX = overscan > 0 ? SIM_MAX_X - overscan : 0;
+  *startY = 0;
+  *sizeX = overscan;
+  *sizeY = overscan > 0 ? SIM_MAX_Y : 0;
+  return QHYCCD_SUCCESS;
+}
+
+uint32_t SetQHYCCDBinMode(qhyccd_handle *handle, uint32_t wbin, uint32_t hbin)
+{
+  SimCamera *cam = SimCam(handle);
+  if (wbin == 0 || hbin == 0)
+  {
+    return QHYCCD_ERROR;
+  }
+  lock_guard<mutex> guard(cam->lock);
+  cam->binX = wbin;
+  cam->binY = hbin;
+  return QHYCCD_SUCCESS;
+}
+
+uint32_t SetQHYCCDBitsMode(qhyccd_handle *handle, uint32_t bits)
+{
+  SimCamera *cam = SimCam(handle);
+  lock_guard<mutex> guard(cam->lock);
+  cam->bits = bits;
+  return QHYCCD_SUCCESS;
+}
+
+uint32_t GetQHYCCDMemLength(qhyccd_handle *handle)
+{
+  (void)handle;
+  return SIM_MAX_X * SIM_MAX_Y * 2;
+}
+
+uint32_t ExpQHYCCDSingleFrame(qhyccd_handle *handle)
+{
+  SimCamera *cam = SimCam(handle);
+  lock_guard<mutex> guard(cam->lock);
+  if (cam->streamMode != 0)
+  {
+    return QHYCCD_ERROR;
+  }
+  cam->exposing = true;
+  cam->exposureStart = SimNow();
+  return QHYCCD_SUCCESS;
+}
+
+uint32_t GetQHYCCDSingleFrame(qhyccd_handle *handle, uint32_t *w, uint32_t *h, uint32_t *bpp, uint32_t *channels,
+                              uint8_t *imgdata)
+{
+  SimCamera *cam = SimCam(handle);
+  double exposure;
+  {
+    lock_guard<mutex> guard(cam->lock);
+    if (!cam->exposing)
+    {
+      return QHYCCD_ERROR;
+    }
+    exposure = cam->params[CONTROL_EXPOSURE] / 1e6;
+  }
+
+  // Wait out the remainder of the exposure
+  SimSleep(exposure * SimEnv("QHYSIM_EXPOSURE_SCALE", 1.0) - (SimNow() - cam->exposureStart));
+
+  // Read out: synthesizing the frame counts towards the readout time
+  double readoutStart = SimNow();
+  double usbTraffic;
+  unsigned long frame;
+  {
+    lock_guard<mutex> guard(cam->lock);
+    SimUpdateThermal(cam);
+    *w = cam->sizeX / cam->binX;
+    *h = cam->sizeY / cam->binY;
+    *bpp = cam->bits;
+    *channels = 1;
+    SimFillFrame(cam, reinterpret_cast<uint16_t *>(imgdata), *w, *h, exposure);
+    frame = cam->frameCount++;
+    cam->exposing = false;
+    usbTraffic = cam->params[CONTROL_USBTRAFFIC];
+  }
+  // A higher USB traffic setting slows the transfer down; too low a setting loses frames
+  double readoutSeconds = (SimEnv("QHYSIM_READOUT_MS", 1500) + usbTraffic * SimEnv("QHYSIM_USB_MS", 0)) / 1000.0;
+  SimSleep(readoutSeconds - (SimNow() - readoutStart));
+  if (usbTraffic < SimEnv("QHYSIM_USB_FAIL_BELOW", 0) && frame % 3 == 0)
+  {
+    return QHYCCD_ERROR;
+  }
+
+  return QHYCCD_SUCCESS;
+}
+
+uint32_t BeginQHYCCDLive(qhyccd_handle *handle)
+{
+  SimCamera *cam = SimCam(handle);
+  lock_guard<mutex> guard(cam->lock);
+  if (cam->streamMode != 1)
+  {
+    return QHYCCD_ERROR;
+  }
+  cam->live = true;
+  cam->liveStart = SimNow();
+  cam->liveNext = 0;
+  return QHYCCD_SUCCESS;
+}
+
+uint32_t GetQHYCCDLiveFrame(qhyccd_handle *handle, uint32_t *w, uint32_t *h, uint32_t *bpp, uint32_t *channels,
+                            uint8_t *imgdata)
+{
+  SimCamera *cam = SimCam(handle);
+  lock_guard<mutex> guard(cam->lock);
+  if (!cam->live)
+  {
+    return QHYCCD_ERROR;
+  }
+
+  // The sensor runs continuously; frames not fetched in time are overwritten by the next one
+  double exposure = cam->params[CONTROL_EXPOSURE] / 1e6;
+  double period = fmax(exposure * SimEnv("QHYSIM_EXPOSURE_SCALE", 1.0), SimEnv("QHYSIM_LIVE_FRAME_MS", 250) / 1000.0);
+  unsigned long completed = (unsigned long)((SimNow() - cam->liveStart) / period);
+  if (completed <= cam->liveNext)
+  {
+    return QHYCCD_ERROR; // No new frame yet
+  }
+  cam->liveNext = completed;
+
+  SimUpdateThermal(cam);
+  *w = cam->sizeX / cam->binX;
+  *h = cam->sizeY / cam->binY;
+  *bpp = cam->bits;
+  *channels = 1;
+  SimFillFrame(cam, reinterpret_cast<uint16_t *>(imgdata), *w, *h, exposure);
+  cam->frameCount++;
+  return QHYCCD_SUCCESS;
+}
+
+uint32_t StopQHYCCDLive(qhyccd_handle *handle)
+{
+  SimCamera *cam = SimCam(handle);
+  lock_guard<mutex> guard(cam->lock);
+  cam->live = false;
+  return QHYCCD_SUCCESS;
+}
+
+uint32_t CancelQHYCCDExposingAndReadout(qhyccd_handle *handle)
+{
+  SimCamera *cam = SimCam(handle);
+  lock_guard<mutex> guard(cam->lock);
+  cam->exposing = false;
+  return QHYCCD_SUCCESS;
+}
+
+uint32_t IsQHYCCDCFWPlugged(qhyccd_handle *handle)
+{
+  (void)handle;
+  return SimEnv("QHYSIM_CFW_SLOTS", 7) > 0 ? QHYCCD_SUCCESS : QHYCCD_ERROR;
+}
+
+uint32_t GetQHYCCDCFWStatus(qhyccd_handle *handle, char *status)
+{
+  SimCamera *cam = SimCam(handle);
+  if (SimEnv("QHYSIM_CFW_SLOTS", 7) <= 0)
+  {
+    return QHYCCD_ERROR;
+  }
+
+  lock_guard<mutex> guard(cam->lock);
+  if (cam->cfwPosition != cam->cfwTarget && SimNow() >= cam->cfwArrive)
+  {
+    cam->cfwPosition = cam->cfwTarget;
+  }
+
+  // Like the real wheel, report 'N' while moving; some wheels report the target slot at once
+  bool reportsTarget = SimEnv("QHYSIM_CFW_REPORTS_TARGET", 0) != 0;
+  status[0] = cam->cfwPosition == cam->cfwTarget || reportsTarget ? (char)('0' + cam->cfwTarget) : 'N';
+  status[1] = 0;
+  return QHYCCD_SUCCESS;
+}
+
+uint32_t SendOrder2QHYCCDCFW(qhyccd_handle *handle, char *order, uint32_t length)
+{
+  SimCamera *cam = SimCam(handle);
+  int slots = (int)SimEnv("QHYSIM_CFW_SLOTS", 7);
+  if (slots <= 0 || length < 1 || order[0] < '0' || order[0] >= '0' + slots)
+  {
+    return QHYCCD_ERROR;
+  }
+
+  lock_guard<mutex> guard(cam->lock);
+  int target = order[0] - '0';
+  int distance = abs(target - cam->cfwPosition);
+  distance = distance < slots - distance ? distance : slots - distance; // The wheel takes the short way round
+  cam->cfwTarget = target;
+  cam->cfwArrive = SimNow() + distance * SimEnv("QHYSIM_CFW_MOVE_S", 1.5);
+  return QHYCCD_SUCCESS;
+}
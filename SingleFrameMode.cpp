@@ -14,13 +14,38 @@
 #include <unistd.h>
 #include <string.h>
 #include <fitsio.h>
+#include <getopt.h>
 #include "qhyccd.h"
+#include "BiasProfile.h"
+#include "CameraState.h"
+#include "FramePool.h"
+#include "FrameBroadcast.h"
+#include "FrameCatalog.h"
+#include "FramePreview.h"
+#include "FrameQuality.h"
+#include "DefectMap.h"
+#include "DiskScheduler.h"
+#include "FilterWheel.h"
+#include "FrameStack.h"
+#include "FrameWriter.h"
+#include "PhotonTransfer.h"
+#include "StagingMigrator.h"
+#include "SweepJournal.h"
+#include "SweepPlan.h"
+#include "TempMonitor.h"
+#include "Timing.h"
+#include "UsbTuner.h"
 #include <ctime>
+#include <thread>
 #include <cmath>
 #include <iostream>
+#include <memory>
+#include <vector>
 
 using namespace std;
 
+const int SECOND = 1000000; // Constant to multiply exposure time with, since QHY600M takes microseconds
+
 // !!Important!! -- These functions were tested with the QHY600 camera, some functions may not work properly with other QHYCCD cameras. 
 // Please comment out relevant functions accordingly
 
@@ -33,21 +58,12 @@ using namespace std;
 //=============================================
 
 /**
-  @fn qhyccd_handle CamInitialize(unsigned int retVal, int USB_TRAFFIC, unsigned int roiStartX, unsigned int roiStartY, unsigned int roiSizeX, unsigned int roiSizeY, int camBinX, int camBinY, int readMode)
-    @brief Initialize the camera, set the readmode, image resolution, binning mode, and bit resolution, and return the camera handle
+  @fn vector<string> CamList(unsigned int retVal)
+    @brief Finds the connected cameras
     @param retVal Return value
-    @param USB_TRAFFIC USB traffic value
-    @param roiStartX Region of Interest starting X coordinate
-    @param roiStartY Region of Interest starting Y coordinate
-    @param roiSizeX Region of Interest size in X
-    @param roiSizeY Region of Interest size in Y
-    @param camBinX Camera binning size (X)
-    @param camBinY Camera binning size (Y)
-    @param readMode Camera readmode
-  @return Return QHY camera handle and set readmode, image resolution, binning mode, and bit resolution
+  @return Camera IDs, in SDK index order
 */
-qhyccd_handle *CamInitialize(unsigned int retVal, int USB_TRAFFIC, unsigned int roiStartX, unsigned int roiStartY,
-                               unsigned int roiSizeX, unsigned int roiSizeY, int camBinX, int camBinY, int readMode)
+vector<string> CamList(unsigned int retVal)
 {
   // Check number of cameras connected
   int numCams = ScanQHYCCD();
@@ -62,39 +78,69 @@ qhyccd_handle *CamInitialize(unsigned int retVal, int USB_TRAFFIC, unsigned int
     exit(1);
   }
 
-  // Get Camera ID
-  char camId[32];
-  retVal = GetQHYCCDId(0, camId);
-
-  // Check if we could get camera ID
-  if (retVal == QHYCCD_SUCCESS)
-  {
-    printf("Got Camera ID successfully. ID is %s .\n", camId);
-    printf("\n");
-  }
-  else
+  vector<string> camIds;
+  for (int i = 0; i < numCams; i++)
   {
-    printf("Could not get camera ID. Error: %d. Program will now exit. \n", retVal);
-    exit(1);
+    // Get Camera ID
+    char camId[32];
+    retVal = GetQHYCCDId(i, camId);
+
+    // Check if we could get camera ID
+    if (retVal == QHYCCD_SUCCESS)
+    {
+      printf("Got Camera ID successfully. ID is %s .\n", camId);
+      camIds.push_back(camId);
+    }
+    else
+    {
+      printf("Could not get camera ID. Error: %d. Program will now exit. \n", retVal);
+      exit(1);
+    }
   }
+  printf("\n");
+
+  return camIds;
+}
 
+/**
+  @fn qhyccd_handle CamInitialize(unsigned int retVal, const char *camId, CameraState **cameraState, int USB_TRAFFIC, unsigned int roiStartX, unsigned int roiStartY, unsigned int roiSizeX, unsigned int roiSizeY, int camBinX, int camBinY, int readMode)
+    @brief Initialize the camera, set the readmode, image resolution, binning mode, and bit resolution, and return the camera handle
+    @param retVal Return value
+    @param camId ID of the camera to open (from CamList)
+    @param cameraState Set to the settings cache of the camera, through which all later settings go (owned by the caller)
+    @param USB_TRAFFIC USB traffic value
+    @param roiStartX Region of Interest starting X coordinate
+    @param roiStartY Region of Interest starting Y coordinate
+    @param roiSizeX Region of Interest size in X
+    @param roiSizeY Region of Interest size in Y
+    @param camBinX Camera binning size (X)
+    @param camBinY Camera binning size (Y)
+    @param readMode Camera readmode
+  @return Return QHY camera handle and set readmode, image resolution, binning mode, and bit resolution
+*/
+qhyccd_handle *CamInitialize(unsigned int retVal, const char *camId, CameraState **cameraState, int USB_TRAFFIC,
+                               unsigned int roiStartX, unsigned int roiStartY, unsigned int roiSizeX,
+                               unsigned int roiSizeY, int camBinX, int camBinY, int readMode)
+{
   // Open Camera
-  qhyccd_handle *pCamHandle = OpenQHYCCD(camId);
+  qhyccd_handle *pCamHandle = OpenQHYCCD(const_cast<char *>(camId));
 
   // Check if we could open the camera
-  if (retVal == QHYCCD_SUCCESS)
+  if (pCamHandle != NULL)
   {
     printf("Camera opened successfully.\n");
     printf("\n");
   }
   else
   {
-    printf("Could not open camera. Error: %d. Program will now exit. \n", retVal);
+    printf("Could not open camera %s. Program will now exit. \n", camId);
     exit(1);
   }
+  CameraState *state = new CameraState(pCamHandle);
+  *cameraState = state;
 
   // Set ReadMode
-  retVal = SetQHYCCDReadMode(pCamHandle, readMode);
+  retVal = state->SetReadMode(readMode);
   if (retVal != QHYCCD_SUCCESS)
   {
     printf("Could not set read mode. Error: %d. Program will now exit. \n", retVal);
@@ -102,7 +148,7 @@ qhyccd_handle *CamInitialize(unsigned int retVal, int USB_TRAFFIC, unsigned int
   }
 
   // Set Single Frame Mode (mode = 0)
-  retVal = SetQHYCCDStreamMode(pCamHandle, 0);
+  retVal = state->SetStreamMode(0);
   if (retVal != QHYCCD_SUCCESS)
   {
     printf("Could not set stream mode. Error: %d. Program will now exit. \n", retVal);
@@ -110,7 +156,7 @@ qhyccd_handle *CamInitialize(unsigned int retVal, int USB_TRAFFIC, unsigned int
   }
 
   // Initialize Camera
-  retVal = InitQHYCCD(pCamHandle);
+  retVal = state->Initialize(NULL);
   if (retVal != QHYCCD_SUCCESS)
   {
     printf("Could not initialize camera. Error: %d. Program will now exit. \n", retVal);
@@ -129,7 +175,7 @@ qhyccd_handle *CamInitialize(unsigned int retVal, int USB_TRAFFIC, unsigned int
   printf("Camera readmode set to %d.\n", readMode);
 
   // Set USB Traffic Setting
-  retVal = SetQHYCCDParam(pCamHandle, CONTROL_USBTRAFFIC, USB_TRAFFIC);
+  retVal = state->SetParam(CONTROL_USBTRAFFIC, USB_TRAFFIC, "SetQHYCCDParam USBTRAFFIC", NULL);
   if (retVal == QHYCCD_SUCCESS)
   {
     printf("USB traffic set to %d.\n", USB_TRAFFIC);
@@ -140,7 +186,7 @@ qhyccd_handle *CamInitialize(unsigned int retVal, int USB_TRAFFIC, unsigned int
   }
 
   // Set Image Resolution
-  retVal = SetQHYCCDResolution(pCamHandle, roiStartX, roiStartY, roiSizeX, roiSizeY);
+  retVal = state->SetResolution(roiStartX, roiStartY, roiSizeX, roiSizeY);
   if (retVal == QHYCCD_SUCCESS)
   {
     printf("Image resolution set to %dx%d.\n", roiSizeX, roiSizeY);
@@ -151,7 +197,7 @@ qhyccd_handle *CamInitialize(unsigned int retVal, int USB_TRAFFIC, unsigned int
   }
 
   // Set Binning mode
-  retVal = SetQHYCCDBinMode(pCamHandle, camBinX, camBinY);
+  retVal = state->SetBinMode(camBinX, camBinY);
   if (retVal == QHYCCD_SUCCESS)
   {
     printf("Binning mode set to %dx%d.\n", camBinX, camBinY);
@@ -162,7 +208,7 @@ qhyccd_handle *CamInitialize(unsigned int retVal, int USB_TRAFFIC, unsigned int
   }
 
   // Set Bit Resolution
-  retVal = SetQHYCCDBitsMode(pCamHandle, 16);
+  retVal = state->SetBitsMode(16);
   if (retVal == QHYCCD_SUCCESS)
   {
     printf("Camera bit resolution set to %d.\n", 16);
@@ -178,220 +224,339 @@ qhyccd_handle *CamInitialize(unsigned int retVal, int USB_TRAFFIC, unsigned int
 }
 
 /**
-  @fn void CamSettings(unsigned int retVal, qhyccd_handle *pCamHandle, int gainSetting, int offsetSetting, double exposureTime)
-    @brief Sets the gain, offset, and exposure time of the camera
-    @param retVal Return value
+  @fn BiasRegion CamOverscanArea(qhyccd_handle *pCamHandle, unsigned int roiStartX, unsigned int roiStartY, unsigned int roiSizeX, unsigned int roiSizeY, int camBinX, int camBinY)
+    @brief Finds the part of the camera's overscan area that is read out with the ROI
     @param pCamHandle Camera handle
+    @param roiStartX Region of Interest starting X coordinate
+    @param roiStartY Region of Interest starting Y coordinate
+    @param roiSizeX Region of Interest size in X
+    @param roiSizeY Region of Interest size in Y
+    @param camBinX Binning in X
+    @param camBinY Binning in Y
+  @return Overscan area in frame pixels (empty if the camera has none or the ROI leaves it out)
+*/
+BiasRegion CamOverscanArea(qhyccd_handle *pCamHandle, unsigned int roiStartX, unsigned int roiStartY,
+                           unsigned int roiSizeX, unsigned int roiSizeY, int camBinX, int camBinY)
+{
+  BiasRegion area = {0, 0, 0, 0};
+  uint32_t startX, startY, sizeX, sizeY;
+  if (GetQHYCCDOverScanArea(pCamHandle, &startX, &startY, &sizeX, &sizeY) != QHYCCD_SUCCESS || sizeX == 0 || sizeY == 0)
+  {
+    printf("The camera reports no overscan area; bias levels are taken from the image area only.\n");
+    return area;
+  }
+
+  // Intersect with the ROI, then move to the binned frame the pixels arrive in
+  unsigned int left = max(startX, roiStartX), top = max(startY, roiStartY);
+  unsigned int right = min(startX + sizeX, roiStartX + roiSizeX), bottom = min(startY + sizeY, roiStartY + roiSizeY);
+  if (left >= right || top >= bottom)
+  {
+    printf("The overscan area (%u,%u %ux%u) is outside the ROI; bias levels are taken from the image area only.\n",
+           startX, startY, sizeX, sizeY);
+    return area;
+  }
+  unsigned int firstX = (left - roiStartX + camBinX - 1) / camBinX, endX = (right - roiStartX) / camBinX;
+  unsigned int firstY = (top - roiStartY + camBinY - 1) / camBinY, endY = (bottom - roiStartY) / camBinY;
+  if (firstX >= endX || firstY >= endY)
+  {
+    printf("No whole binned pixel falls in the overscan area; bias levels are taken from the image area only.\n");
+    return area;
+  }
+  area.startX = firstX;
+  area.startY = firstY;
+  area.sizeX = endX - firstX;
+  area.sizeY = endY - firstY;
+  printf("Overscan level taken from frame pixels %u,%u %ux%u.\n", area.startX, area.startY, area.sizeX, area.sizeY);
+  return area;
+}
+
+/**
+  @fn void CamStreamMode(unsigned int retVal, CameraState *cameraState, int streamMode, int USB_TRAFFIC, unsigned int roiStartX, unsigned int roiStartY, unsigned int roiSizeX, unsigned int roiSizeY, int camBinX, int camBinY, int readMode)
+    @brief Switches the camera between single frame (0) and live (1) mode; the SDK needs the camera re-initialized for this, so the settings from CamInitialize are applied again
+    @param retVal Return value
+    @param cameraState Camera settings cache
+    @param streamMode 0 for single frame mode, 1 for live mode
+    @param USB_TRAFFIC USB traffic value
+    @param roiStartX Region of Interest starting X coordinate
+    @param roiStartY Region of Interest starting Y coordinate
+    @param roiSizeX Region of Interest size in X
+    @param roiSizeY Region of Interest size in Y
+    @param camBinX Camera binning size (X)
+    @param camBinY Camera binning size (Y)
+    @param readMode Camera readmode
+*/
+void CamStreamMode(unsigned int retVal, CameraState *cameraState, int streamMode, int USB_TRAFFIC, unsigned int roiStartX,
+                     unsigned int roiStartY, unsigned int roiSizeX, unsigned int roiSizeY, int camBinX, int camBinY, int readMode)
+{
+  // Both modes go in before the one initialization they need
+  retVal = cameraState->SetReadMode(readMode);
+  if (retVal != QHYCCD_SUCCESS)
+  {
+    printf("Could not set read mode. Error: %d.\n", retVal);
+  }
+
+  // Set Stream Mode
+  retVal = cameraState->SetStreamMode(streamMode);
+  if (retVal != QHYCCD_SUCCESS)
+  {
+    printf("Could not set stream mode. Error: %d. Program will now exit. \n", retVal);
+    exit(1);
+  }
+
+  // Initialize Camera again in the new mode (skipped if it is already in it)
+  bool initialized;
+  retVal = cameraState->Initialize(&initialized);
+  if (retVal != QHYCCD_SUCCESS)
+  {
+    printf("Could not initialize camera. Error: %d. Program will now exit. \n", retVal);
+    exit(1);
+  }
+
+  // Restore USB traffic, resolution, binning and bit depth (only sent if the initialization reset them)
+  retVal = cameraState->SetParam(CONTROL_USBTRAFFIC, USB_TRAFFIC, "SetQHYCCDParam USBTRAFFIC", NULL);
+  if (retVal != QHYCCD_SUCCESS)
+  {
+    printf("Could not set USB traffic setting. Error: %d.\n", retVal);
+  }
+  retVal = cameraState->SetResolution(roiStartX, roiStartY, roiSizeX, roiSizeY);
+  if (retVal != QHYCCD_SUCCESS)
+  {
+    printf("Could not set the image resolution. Error: %d.\n", retVal);
+  }
+  retVal = cameraState->SetBinMode(camBinX, camBinY);
+  if (retVal != QHYCCD_SUCCESS)
+  {
+    printf("Could not set the binning mode. Error: %d.\n", retVal);
+  }
+  retVal = cameraState->SetBitsMode(16);
+  if (retVal != QHYCCD_SUCCESS)
+  {
+    printf("Could not set the bit resolution. Error: %d.\n", retVal);
+  }
+
+  if (initialized)
+  {
+    printf("Camera switched to %s mode.\n", streamMode ? "live" : "single frame");
+  }
+}
+
+/**
+  @fn void CamSettings(unsigned int retVal, CameraState *cameraState, int gainSetting, int offsetSetting, double exposureTime)
+    @brief Sets the gain, offset, and exposure time of the camera; settings the camera already has are not sent
+    @param retVal Return value
+    @param cameraState Camera settings cache
     @param gainSetting Gain setting to set camera to
     @param offsetSetting Offset setting to set camera to
     @param exposureTime Exposure time
 */
-void CamSettings(unsigned int retVal, qhyccd_handle *pCamHandle, int gainSetting, int offsetSetting,
+void CamSettings(unsigned int retVal, CameraState *cameraState, int gainSetting, int offsetSetting,
                       double exposureTime)
 {
+  bool issued;
+
   // Set Gain Setting
-  retVal = SetQHYCCDParam(pCamHandle, CONTROL_GAIN, gainSetting);
-  if (retVal == QHYCCD_SUCCESS)
+  retVal = cameraState->SetParam(CONTROL_GAIN, gainSetting, "SetQHYCCDParam GAIN", &issued);
+  if (retVal == QHYCCD_SUCCESS && issued)
   {
     printf("Gain set to %d.\n", gainSetting);
   }
-  else
+  else if (retVal != QHYCCD_SUCCESS)
   {
     printf("Could not set the gain setting. Error: %d.\n", retVal);
   }
 
   // Set Offset
-  retVal = SetQHYCCDParam(pCamHandle, CONTROL_OFFSET, offsetSetting);
-  if (retVal == QHYCCD_SUCCESS)
+  retVal = cameraState->SetParam(CONTROL_OFFSET, offsetSetting, "SetQHYCCDParam OFFSET", &issued);
+  if (retVal == QHYCCD_SUCCESS && issued)
   {
     printf("Offset set to %d.\n", offsetSetting);
   }
-  else
+  else if (retVal != QHYCCD_SUCCESS)
   {
     printf("Could not set the offset setting. Error: %d.\n", retVal);
   }
 
   // Set Exposure Time
-  retVal = SetQHYCCDParam(pCamHandle, CONTROL_EXPOSURE, exposureTime);
-  if (retVal == QHYCCD_SUCCESS)
+  retVal = cameraState->SetParam(CONTROL_EXPOSURE, exposureTime, "SetQHYCCDParam EXPOSURE", &issued);
+  if (retVal == QHYCCD_SUCCESS && issued)
   {
     printf("Exposure set to %.6f seconds. \n", exposureTime / 1000000);
   }
-  else
+  else if (retVal != QHYCCD_SUCCESS)
   {
     printf("Could not set the exposure time. Error: %d.\n", retVal);
   }
 }
 
 /**
-  @fn void TempRegulation(unsigned int retVal, qhyccd_handle *pCamHandle, double tempSetting, double tempError)
-    @brief Sets the temperature of the camera sensor within the specified temperature error range
+  @fn void TempRegulation(unsigned int retVal, CameraState *cameraState, double tempSetting, double tempError, double settleSeconds, TempMonitor *tempMonitor)
+    @brief Sets the temperature of the camera sensor (unless it is already the target) and waits until it has been within the specified temperature error range for the settle window
     @param retVal Return value
-    @param pCamHandle Camera handle
+    @param cameraState Camera settings cache
     @param tempSetting Temperature to set camera to
     @param tempError Temperature setting error range
+    @param settleSeconds Time the temperature must stay within the error range
+    @param tempMonitor Background temperature telemetry
 */
-void TempRegulation(unsigned int retVal, qhyccd_handle *pCamHandle, double tempSetting, double tempError)
+void TempRegulation(unsigned int retVal, CameraState *cameraState, double tempSetting, double tempError,
+                    double settleSeconds, TempMonitor *tempMonitor)
 {
 
   printf(" \n"); // Print new line
 
-  // Get Current Temperature
-  double currentTemp = GetQHYCCDParam(pCamHandle, CONTROL_CURTEMP);
-
   // Set Temperature to the temperature setting we want
-  retVal = SetQHYCCDParam(pCamHandle, CONTROL_COOLER, tempSetting);
+  retVal = cameraState->SetParam(CONTROL_COOLER, tempSetting, "SetQHYCCDParam COOLER", NULL);
   if (retVal != QHYCCD_SUCCESS)
   {
     printf("Could not set the temperature. Error: %d.\n", retVal);
     return; // Return if we could not set the temperature
   }
 
-  // Get cooler PWM value
-  double pwmValue = GetQHYCCDParam(pCamHandle, CONTROL_CURPWM);
-
-  // If the temperature is not within the error range
-  if (abs(currentTemp - tempSetting) > tempError)
-  {
-    // Then run the check temperature loop thrice to avoid overshooting
-    for (int tempLoop = 0; tempLoop < 3; tempLoop++)
-    {
-      // Sleep for 1 second to get new temperature
-      sleep(1);
-
-      // Get current temperature again to loop
-      currentTemp = GetQHYCCDParam(pCamHandle, CONTROL_CURTEMP);
-
-      // While the temperature is outside of the error range
-      while (abs(currentTemp - tempSetting) > tempError)
-      {
-        // Get cooler PWM again
-        pwmValue = GetQHYCCDParam(pCamHandle, CONTROL_CURPWM);
-
-        // Report temperature progress and cooler PWM to screen
-        if ((currentTemp - tempSetting) > tempError)
-        {
-          printf("Current Temperature: %.2f || You Want: %.2f . Camera is cooling down. \n", currentTemp, tempSetting);
-          printf("Cooler PWM is %.1f, running at %.1f%% of full power. \n", pwmValue, pwmValue / 255.0 * 100);
-          printf(" \n");
-        }
-
-        else
-        {
-          printf("Current Temperature: %.2f || You Want: %.2f . Camera is heating up. \n", currentTemp, tempSetting);
-          printf("Cooler PWM is %.1f, running at %.1f%% of full power. \n", pwmValue, pwmValue / 255.0 * 100);
-          printf(" \n");
-        }
-
-        // Try again in 2 seconds
-        sleep(2);
-
-        // Get current temperature again to loop again
-        currentTemp = GetQHYCCDParam(pCamHandle, CONTROL_CURTEMP);
-      }
-    }
-
-    // Sleep for 1 second before running
-    sleep(1);
-  }
+  // Wait (on the telemetry thread's samples, not fixed sleeps) until the temperature has settled
+  tempMonitor->SetTarget(tempSetting, tempError, settleSeconds);
+  tempMonitor->WaitStable();
 
-  printf("Camera temperature set to %.2f C. \n", tempSetting);
+  TempSample latest = tempMonitor->Latest();
+  printf("Camera temperature set to %.2f C (currently %.2f C, cooler PWM %.1f). \n", tempSetting, latest.temp, latest.pwm);
 }
 
 /**
-  @fn void FilterWheelControl(unsigned int retVal, qhyccd_handle *pCamHandle, char fwPosition)
-    @brief Checks if a filter wheel is connected and if so, moves the filter wheel to the requested position
-    @param retVal Return value
-    @param pCamHandle Camera handle
-    @param fwPosition Filter wheel position to move to
+  @fn void QueueFrame(unsigned char *pImgData, unsigned int roiSizeX, unsigned int roiSizeY, int gainSetting, int offsetSetting, double exposureTime, double tempSetting, double sensorTemp, int readMode, int filter, int runner, string savePath, FramePool *framePool, FrameWriter *frameWriter)
+    @brief Names a captured frame after its settings and hands it to the writer pipeline, which returns the buffer to the pool once it is on disc
+    @param pImgData Image data leased from framePool
+    @param roiSizeX Image size in X
+    @param roiSizeY Image size in Y
+    @param gainSetting Gain setting of the frame
+    @param offsetSetting Offset setting of the frame
+    @param exposureTime Exposure time
+    @param tempSetting Temperature setting of the frame
+    @param sensorTemp Sensor temperature measured when the frame was taken
+    @param readMode Camera readmode
+    @param filter Filter wheel position of the frame
+    @param runner The number of image being taken at that specific setting
+    @param savePath Path to save image to
+    @param framePool Pool the image buffer is leased from
+    @param frameWriter Writer pipeline
 */
-void FilterWheelControl(unsigned int retVal, qhyccd_handle *pCamHandle, int fwPos)
+void QueueFrame(unsigned char *pImgData, unsigned int roiSizeX, unsigned int roiSizeY, int gainSetting, int offsetSetting,
+                double exposureTime, double tempSetting, double sensorTemp, int readMode, int filter, int runner,
+                string savePath, FramePool *framePool, FrameWriter *frameWriter)
 {
-  retVal = IsQHYCCDCFWPlugged(pCamHandle); // Check if filter wheel is plugged in
+  // Image Processing to .fits file
+  long curUnixTime = time(0);
 
-  char fwPosition = '0' + fwPos;
+  // Naming:
+  string fitname = savePath + "_" + to_string(curUnixTime) + "_exp_" + to_string((int)exposureTime) + "us_gain_" + to_string(gainSetting) + "_offset_" + to_string(offsetSetting) + "_temp_" + to_string((int)tempSetting) + "_" + to_string(runner) + frameWriter->FileExtension();
+
+  FrameJob *job = new FrameJob();
+  job->pImgData = pImgData;
+  job->framePool = framePool;
+  job->roiSizeX = roiSizeX;
+  job->roiSizeY = roiSizeY;
+  job->gainSetting = gainSetting;
+  job->offsetSetting = offsetSetting;
+  job->exposureTime = exposureTime;
+  job->tempSetting = tempSetting;
+  job->sensorTemp = sensorTemp;
+  job->readMode = readMode;
+  job->filter = filter;
+  job->repeat = runner;
+  job->unixTime = curUnixTime;
+  job->fileName = fitname;
+
+  PhaseTimer timer(PHASE_QUEUE);
+  frameWriter->Submit(job);
+}
 
-  // If filter wheel is plugged in
-  if (retVal == QHYCCD_SUCCESS)
+/**
+  @fn bool CheckFrame(QualityGate *qualityGate, unsigned char *pImgData, unsigned int sizeX, unsigned int sizeY, unsigned int roiSizeX, unsigned int roiSizeY, bool readoutOk, bool lastAttempt)
+    @brief Runs the quality check on a frame just read out, and reports and counts a failure
+    @param qualityGate Quality check of the camera
+    @param pImgData Image data
+    @param sizeX Image size in X returned by the readout
+    @param sizeY Image size in Y returned by the readout
+    @param roiSizeX Region of Interest size in X requested
+    @param roiSizeY Region of Interest size in Y requested
+    @param readoutOk False if the readout failed
+    @param lastAttempt True if the frame cannot be taken again
+  @return True if the frame should be saved
+*/
+bool CheckFrame(QualityGate *qualityGate, unsigned char *pImgData, unsigned int sizeX, unsigned int sizeY,
+                unsigned int roiSizeX, unsigned int roiSizeY, bool readoutOk, bool lastAttempt)
+{
+  FrameQuality quality = qualityGate->Check(reinterpret_cast<const unsigned short *>(pImgData), sizeX, sizeY, roiSizeX,
+                                            roiSizeY, readoutOk);
+  if (quality.flags == 0)
   {
-    char status[64] = {0};
-    retVal = GetQHYCCDCFWStatus(pCamHandle, status); // Get current position
-    if (retVal == QHYCCD_SUCCESS)
-    {
-      printf("Filter wheel is plugged in and is at position: %s. \n", status); // Print current position
-    }
-    else
-    {
-      printf("Could not get filter wheel status. Error: %d.\n", retVal); // Print error
-    }
+    return true;
+  }
 
-    // Compare if the filter wheel is at the position we want it to be
-    if (status[0] != fwPosition)
+  string reasons;
+  for (int i = 0; i < QUALITY_FLAG_COUNT; i++)
+  {
+    if (quality.flags & (1 << i))
     {
-      retVal = SendOrder2QHYCCDCFW(pCamHandle, &fwPosition, 1); // Send order to filter wheel to move to new position
-      if (retVal == QHYCCD_SUCCESS)
-      {
-        printf("Filter wheel is moving to position: %c. \n", fwPosition); // Print that the filter wheel is moving
-      }
-      else
-      {
-        printf("Could not move filter wheel. Error: %d.\n", retVal); // Print error
-      }
-
-      // Check if filter wheel is moving
-      retVal = GetQHYCCDCFWStatus(pCamHandle, status);
-      if (retVal != QHYCCD_SUCCESS)
-      {
-        printf("Could not get filter wheel status. Error: %d.\n", retVal); // Print error
-      }
-
-      // If filter wheel needs to go to position 0 (slot 1)
-      if (status[0] == fwPosition)
-      {
-        int sleeper = 0; // To print progress on screen
-
-        while (sleeper < 11)
-        {
-          sleep(1); // Sleep for 1 second
-          printf("Filter wheel is still moving.\n");
-          sleeper++; // Add onto sleeper
-        }
-      }
-      else // If filter wheel needs to go to any other position
-      {
-        // While camera is moving
-        while (fwPosition != status[0])
-        {
-          sleep(1);                                        // Sleep for 1 second
-          retVal = GetQHYCCDCFWStatus(pCamHandle, status); // Check status again
-          if (retVal != QHYCCD_SUCCESS)
-          {
-            printf("Could not get filter wheel status. Error: %d.\n", retVal); // Print error
-          }
-          else
-          {
-            printf("Filter wheel is still moving.\n"); // Print that the filter wheel is still moving
-          }
-        }
-      }
-
-      // Print final position of filter wheel
-      printf("Filter wheel has been moved to position: %c. \n", fwPosition); // Print new position
+      reasons += (reasons.empty() ? "" : ", ") + string(QualityFlagName(1 << i));
     }
   }
-
-  // If filter wheel is not detected
-  else
+  printf("Image failed the quality check (%s; %ld cosmic ray hits, %ld hot pixels left out, %d banded rows, %d zero rows at the end)%s\n",
+         reasons.c_str(), quality.cosmicHits, quality.persistentHits, quality.bandedRows, quality.zeroRows,
+         lastAttempt ? ", saving it as no retakes are left." : ", retaking it.");
+  if (lastAttempt)
   {
-    printf("No filter wheel detected. \n"); // Print that it is not detected
+    qualityGate->CountKept();
+    return true;
   }
+  qualityGate->CountRetake();
+  return false;
+}
 
-  printf("\n");
+/**
+  @fn void BroadcastFrame(FrameBroadcast *broadcast, const unsigned char *pImgData, unsigned int sizeX, unsigned int sizeY, unsigned int bpp, unsigned int channels, int gainSetting, int offsetSetting, double exposureTime, double tempSetting, double sensorTemp, int readMode, int filter, int repeat, double readoutTime)
+    @brief Publishes a frame just read out to live consumers, before it is checked or written
+    @param broadcast Shared-memory frame ring
+    @param pImgData Image data
+    @param sizeX Image size in X
+    @param sizeY Image size in Y
+    @param bpp Bits per pixel
+    @param channels Channels per pixel
+    @param gainSetting Gain setting of the frame
+    @param offsetSetting Offset setting of the frame
+    @param exposureTime Exposure time
+    @param tempSetting Temperature setting of the frame
+    @param sensorTemp Latest sensor temperature
+    @param readMode Camera readmode
+    @param filter Filter wheel position of the frame
+    @param repeat Image number at the setting
+    @param readoutTime When the readout returned (MonotonicSeconds)
+*/
+void BroadcastFrame(FrameBroadcast *broadcast, const unsigned char *pImgData, unsigned int sizeX, unsigned int sizeY,
+                    unsigned int bpp, unsigned int channels, int gainSetting, int offsetSetting, double exposureTime,
+                    double tempSetting, double sensorTemp, int readMode, int filter, int repeat, double readoutTime)
+{
+  BroadcastFrameInfo info;
+  memset(&info, 0, sizeof(info));
+  info.sizeX = sizeX;
+  info.sizeY = sizeY;
+  info.bpp = bpp;
+  info.channels = channels;
+  info.gain = gainSetting;
+  info.offset = offsetSetting;
+  info.readMode = readMode;
+  info.filter = filter;
+  info.repeat = repeat;
+  info.exposureUs = exposureTime;
+  info.tempSetting = tempSetting;
+  info.sensorTemp = sensorTemp;
+  info.unixTime = time(0);
+  info.readoutTime = readoutTime;
+  broadcast->Publish(pImgData, info);
 }
 
 /**
-  @fn void CamCapture(unsigned int retVal, qhyccd_handle *pCamHandle, int runTimes, int runner, unsigned int roiStartX, unsigned int roiStartY, unsigned int roiSizeX, unsigned int roiSizeY, unsigned int bpp, int gainSetting, int offsetSetting, double exposureTime, double tempSetting, int readMode, string savePath)
-    @brief Takes an image and saves a .fits file to disk with the settings in the filename
+  @fn bool CamCapture(unsigned int retVal, qhyccd_handle *pCamHandle, int runTimes, int runner, unsigned int roiStartX, unsigned int roiStartY, unsigned int roiSizeX, unsigned int roiSizeY, unsigned int bpp, int gainSetting, int offsetSetting, double exposureTime, double tempSetting, int readMode, int filter, string savePath, FramePool *framePool, FrameWriter *frameWriter, TempMonitor *tempMonitor, QualityGate *qualityGate, FrameBroadcast *broadcast, bool lastAttempt)
+    @brief Takes an image and hands it to the writer pipeline to be saved as a .fits file with the settings in the filename,
+           unless it fails the quality check and may be taken again
     @param retVal Return value
     @param pCamHandle Camera handle
     @param runTimes Number of times to take pictures at each specific setting
@@ -406,84 +571,63 @@ void FilterWheelControl(unsigned int retVal, qhyccd_handle *pCamHandle, int fwPo
     @param exposureTime Exposure time
     @param tempSetting Temperature to set camera to
     @param readMode Camera readmode
+    @param filter Filter wheel position the image is taken through
     @param savePath Path to save image to
+    @param framePool Pool the image buffer is leased from
+    @param frameWriter Writer pipeline that saves the frame while the next exposure runs
+    @param tempMonitor Background temperature sampling, for the sensor temperature of the frame
+    @param qualityGate Quality check of the frame (NULL to save every frame)
+    @param broadcast Shared-memory ring the frame is published to as soon as it is read out (NULL for none)
+    @param lastAttempt True to save the frame even if it fails the check (its retakes have run out)
+  @return False if the frame failed the check and was discarded, to be taken again
 */
-void CamCapture(unsigned int retVal, qhyccd_handle *pCamHandle, int runTimes, int runner, unsigned int roiStartX,
+bool CamCapture(unsigned int retVal, qhyccd_handle *pCamHandle, int runTimes, int runner, unsigned int roiStartX,
                   unsigned int roiStartY, unsigned int roiSizeX, unsigned int roiSizeY, unsigned int bpp, int gainSetting,
-                  int offsetSetting, double exposureTime, double tempSetting, int readMode, string savePath)
+                  int offsetSetting, double exposureTime, double tempSetting, int readMode, int filter, string savePath,
+                  FramePool *framePool, FrameWriter *frameWriter, TempMonitor *tempMonitor, QualityGate *qualityGate,
+                  FrameBroadcast *broadcast, bool lastAttempt)
 {
+  unsigned int requestedX = roiSizeX;
+  unsigned int requestedY = roiSizeY;
+
   // Channel of Image
   unsigned int channels;
 
+  // Lease an image buffer (sized from GetQHYCCDMemLength when the pool was created)
+  double phaseStart = MonotonicSeconds();
+  unsigned char *pImgData = framePool->Acquire();
+  TimingAdd(PHASE_BUFFER, MonotonicSeconds() - phaseStart);
+
   // Single Frame
+  phaseStart = MonotonicSeconds();
   retVal = ExpQHYCCDSingleFrame(pCamHandle);
   if (retVal != QHYCCD_SUCCESS)
   {
     printf("Could not start exposure. Error: %d. \n", retVal);
   }
-
-  // Image Data Variable
-  unsigned char *pImgData = 0;
-
-  // Get Requested Memory Length
-  uint32_t length = GetQHYCCDMemLength(pCamHandle);
-  pImgData = new unsigned char[length];
-  memset(pImgData, 0, length);
-
-  printf("Buffer length = %d.\n", length);
+  TimingAdd(PHASE_EXPOSURE, MonotonicSeconds() - phaseStart);
 
   // Take Single Frame
+  phaseStart = MonotonicSeconds();
   retVal = GetQHYCCDSingleFrame(pCamHandle, &roiSizeX, &roiSizeY, &bpp, &channels, pImgData);
-  if (retVal == QHYCCD_SUCCESS)
+  bool readoutOk = retVal == QHYCCD_SUCCESS;
+  if (readoutOk && broadcast)
+  {
+    BroadcastFrame(broadcast, pImgData, roiSizeX, roiSizeY, bpp, channels, gainSetting, offsetSetting, exposureTime,
+                   tempSetting, tempMonitor->Latest().temp, readMode, filter, runner, MonotonicSeconds());
+  }
+  if (readoutOk)
   {
     printf("Successfully got image of size: %dx%d.\n", roiSizeX, roiSizeY);
   }
   else
   {
     printf("Could not grab image data from camera. Error: %d. \n", retVal);
+    memset(pImgData, 0, framePool->BufferLength()); // Do not save a previous frame left in the reused buffer
   }
+  TimingAdd(PHASE_READOUT, MonotonicSeconds() - phaseStart);
 
-  // Image Processing to .fits file
-
-  // Create File
-  fitsfile *fptr;
-  int status = 0;
-  long naxes[2] = {roiSizeX, roiSizeY};
-  long curUnixTime = time(0);
-
-  // Naming:
-  string fitname = savePath + "_" + to_string(curUnixTime) + "_exp_" + to_string((int)exposureTime) + "us_gain_" + to_string(gainSetting) + "_offset_" + to_string(offsetSetting) + "_temp_" + to_string((int)tempSetting) + "_" + to_string(runner) + ".fits";
-  const char *fitsfilename = fitname.c_str();
-
-  // Remove if exists already
-  remove(fitsfilename);
-
-  // Create File
-  fits_create_file(&fptr, fitsfilename, &status);
-  fits_create_img(fptr, USHORT_IMG, 2, naxes, &status);
-
-  // Headers Information
-  fits_update_key(fptr, TDOUBLE, "INTTEMP", &tempSetting, "Camera Temperature", &status);
-  fits_update_key(fptr, TINT, "EXPTIME", &exposureTime, "Exposure time in microseconds", &status);
-  fits_update_key(fptr, TINT, "OFFSET", &offsetSetting, "Offset Setting", &status);
-  fits_update_key(fptr, TINT, "GAIN", &gainSetting, "Gain Setting", &status);
-  fits_update_key(fptr, TINT, "QHREADMOE", &readMode, "ReadMode Setting", &status);
-  fits_update_key(fptr, TLONG, "TIME", &curUnixTime, "UNIX Time", &status);
-
-  // Write to File
-  fits_write_img(fptr, TUSHORT, 1, roiSizeX * roiSizeY, pImgData, &status);
-
-  // Close File
-  fits_close_file(fptr, &status);
-
-  // Report progress
-  printf("Image with temp %.2fC, exp %.3fsec, offset %d, gain %d, saved successfully to disc.\n", tempSetting, exposureTime / 1000000, offsetSetting, gainSetting);
-  printf(" \n");
-
-  // Delete Image Data
-  delete[] pImgData;
-
-  // Cancel Exposing and Readout
+  // Cancel Exposing and Readout (the frame is in memory, so the camera is free for the next exposure)
   retVal = CancelQHYCCDExposingAndReadout(pCamHandle);
   if (retVal == QHYCCD_SUCCESS)
   {
@@ -493,53 +637,339 @@ void CamCapture(unsigned int retVal, qhyccd_handle *pCamHandle, int runTimes, in
   {
     printf("Could not cancel exposure and readout. Error: %d. \n", retVal);
   }
+
+  // Check the frame while the camera is still at its setting
+  if (qualityGate && !CheckFrame(qualityGate, pImgData, roiSizeX, roiSizeY, requestedX, requestedY, readoutOk, lastAttempt))
+  {
+    framePool->Release(pImgData);
+    printf(" \n");
+    return false;
+  }
+
+  // Hand the frame to the writers
+  QueueFrame(pImgData, roiSizeX, roiSizeY, gainSetting, offsetSetting, exposureTime, tempSetting,
+             tempMonitor->Latest().temp, readMode, filter, runner, savePath, framePool, frameWriter);
+
+  printf(" \n");
+  return true;
 }
 
 /**
-  @fn void CamExit(unsigned int retVal, qhyccd_handle *pCamHandle)
-    @brief Closes camera and releases SDK resource
+  @fn void CamLiveCapture(unsigned int retVal, qhyccd_handle *pCamHandle, int runTimes, int firstRepeat, unsigned int roiSizeX, unsigned int roiSizeY, unsigned int bpp, int gainSetting, int offsetSetting, double exposureTime, double tempSetting, int readMode, int filter, string savePath, FramePool *framePool, FrameWriter *frameWriter, TempMonitor *tempMonitor, QualityGate *qualityGate, FrameBroadcast *broadcast, int maxRetakes)
+    @brief Takes a sequence of images in live mode without stopping the sensor between frames, and hands each to the writer pipeline
     @param retVal Return value
-    @param pCamHandle Camera handle
+    @param pCamHandle Camera handle (already in live mode, see CamStreamMode)
+    @param runTimes Number of images to save at this setting
+    @param firstRepeat Number of the first image (the last part of its file name)
+    @param roiSizeX Region of Interest size in X
+    @param roiSizeY Region of Interest size in Y
+    @param bpp Channel of image
+    @param gainSetting Gain setting of the frames
+    @param offsetSetting Offset setting of the frames
+    @param exposureTime Exposure time
+    @param tempSetting Temperature setting of the frames
+    @param readMode Camera readmode
+    @param filter Filter wheel position the frames are taken through
+    @param savePath Path to save images to
+    @param framePool Ring of preallocated buffers the frames are read into
+    @param frameWriter Writer pipeline that saves the frames
+    @param tempMonitor Background temperature sampling, for the sensor temperature of each frame
+    @param qualityGate Quality check of each frame (NULL to save every frame)
+    @param broadcast Shared-memory ring each frame is published to as soon as it arrives, even if it is dropped (NULL for none)
+    @param maxRetakes Failed frames in a row that are replaced by the next frame before one is saved anyway
 */
-void CamExit(unsigned int retVal, qhyccd_handle *pCamHandle)
+void CamLiveCapture(unsigned int retVal, qhyccd_handle *pCamHandle, int runTimes, int firstRepeat,
+                      unsigned int roiSizeX, unsigned int roiSizeY, unsigned int bpp, int gainSetting, int offsetSetting,
+                      double exposureTime, double tempSetting, int readMode, int filter, string savePath,
+                      FramePool *framePool, FrameWriter *frameWriter, TempMonitor *tempMonitor, QualityGate *qualityGate,
+                      FrameBroadcast *broadcast, int maxRetakes)
 {
-  // Close Camera Handle
-  retVal = CloseQHYCCD(pCamHandle);
-  if (retVal == QHYCCD_SUCCESS)
-  {
-    printf("Camera handle closed successfully. \n");
-  }
-  else
-  {
-    printf("Could not close camera handle. Error: %d. \n", retVal);
-  }
+  // Channel of Image
+  unsigned int channels;
 
-  // Release SDK Resources
-  retVal = ReleaseQHYCCDResource();
-  if (retVal == QHYCCD_SUCCESS)
+  // Scratch buffer for frames that arrive while every pooled buffer is still waiting for the writers
+  vector<unsigned char> dropBuffer;
+
+  retVal = BeginQHYCCDLive(pCamHandle);
+  if (retVal != QHYCCD_SUCCESS)
   {
-    printf("SDK resources released successfully. \n");
+    printf("Could not start live mode. Error: %d. \n", retVal);
+    return;
   }
-  else
+
+  int saved = 0;         // Frames handed to the writers
+  int retakes = 0;       // Failed frames in a row replaced by the next frame
+  int dropped = 0;       // Frames read while the buffer ring was full
+  int missed = 0;        // Frames the sensor produced that were never fetched (from the frame spacing)
+  double firstFrame = 0; // When the first frame arrived
+  double lastFrame = 0;  // When the latest frame arrived
+  double minSpacing = 0; // Shortest time between frames (the sensor's frame period)
+  double timeout = 10 + 3 * exposureTime / 1000000; // Give up if no frame arrives for this long
+
+  double waitStart = MonotonicSeconds();
+  while (saved < runTimes)
   {
-    printf("Could not release SDK resources. Error: %d. Program will now exit.\n", retVal);
-    exit(1);
-  }
+    // Read into the next free buffer of the ring, or into the scratch buffer if the writers are behind
+    unsigned char *pImgData = framePool->TryAcquire();
+    if (!pImgData)
+    {
+      dropBuffer.resize(framePool->BufferLength());
+    }
 
-  printf("Goodbye! Please visit us again.\n");
-}
+    unsigned int sizeX = roiSizeX;
+    unsigned int sizeY = roiSizeY;
+    retVal = GetQHYCCDLiveFrame(pCamHandle, &sizeX, &sizeY, &bpp, &channels, pImgData ? pImgData : dropBuffer.data());
+    double now = MonotonicSeconds();
 
-//===============================================
-//===============================================
-//=================|-----------|=================
-//=================|THE PROGRAM|=================
-//=================|-----------|=================
-//===============================================
-//===============================================
+    if (retVal != QHYCCD_SUCCESS)
+    {
+      // No new frame yet
+      if (pImgData)
+      {
+        framePool->Release(pImgData);
+      }
+      if (now - waitStart > timeout)
+      {
+        printf("No live frame for %.1f s, giving up on this setting.\n", now - waitStart);
+        break;
+      }
+      this_thread::sleep_for(chrono::milliseconds(1));
+      continue;
+    }
+    TimingAdd(PHASE_EXPOSURE, now - waitStart);
+    waitStart = now;
 
-int main(int argc, char *argv[])
+    // Live consumers get every frame, including the ones the writers have no buffer for
+    if (broadcast)
+    {
+      BroadcastFrame(broadcast, pImgData ? pImgData : dropBuffer.data(), sizeX, sizeY, bpp, channels, gainSetting,
+                     offsetSetting, exposureTime, tempSetting, tempMonitor->Latest().temp, readMode, filter,
+                     firstRepeat + saved, now);
+    }
+
+    // Frame spacing
+    if (firstFrame == 0)
+    {
+      firstFrame = now;
+    }
+    else
+    {
+      double spacing = now - lastFrame;
+      if (minSpacing == 0 || spacing < minSpacing)
+      {
+        minSpacing = spacing;
+      }
+      if (spacing > 1.5 * minSpacing)
+      {
+        missed += (int)(spacing / minSpacing + 0.5) - 1;
+      }
+    }
+    lastFrame = now;
+
+    if (!pImgData)
+    {
+      dropped++;
+      continue;
+    }
+
+    // The sensor keeps running, so a failed frame is replaced by the next one
+    if (qualityGate &&
+        !CheckFrame(qualityGate, pImgData, sizeX, sizeY, roiSizeX, roiSizeY, true, retakes >= maxRetakes))
+    {
+      framePool->Release(pImgData);
+      retakes++;
+      continue;
+    }
+    retakes = 0;
+
+    QueueFrame(pImgData, sizeX, sizeY, gainSetting, offsetSetting, exposureTime, tempSetting, tempMonitor->Latest().temp,
+               readMode, filter, firstRepeat + saved, savePath, framePool, frameWriter);
+    saved++;
+  }
+
+  retVal = StopQHYCCDLive(pCamHandle);
+  if (retVal != QHYCCD_SUCCESS)
+  {
+    printf("Could not stop live mode. Error: %d. \n", retVal);
+  }
+
+  // Report achieved rate and losses
+  double elapsed = lastFrame - firstFrame;
+  printf("Live sequence: %d frames saved, %d dropped (writers behind), about %d missed by the sensor", saved, dropped,
+         missed);
+  if (saved + dropped > 1 && elapsed > 0)
+  {
+    printf(", %.2f frames/s", (saved + dropped - 1) / elapsed);
+  }
+  printf(".\n");
+  printf(" \n");
+}
+
+/**
+  @fn void CamClose(unsigned int retVal, qhyccd_handle *pCamHandle, FramePool *framePool, FrameWriter *frameWriter)
+    @brief Waits for all frames of a camera to be written, reports its writer and buffer statistics, and closes it
+    @param retVal Return value
+    @param pCamHandle Camera handle
+    @param framePool Frame buffer pool to report on
+    @param frameWriter Writer pipeline to flush
+*/
+void CamClose(unsigned int retVal, qhyccd_handle *pCamHandle, FramePool *framePool, FrameWriter *frameWriter)
 {
+  // Finish writing every queued frame before letting go of the camera
+  printf("Waiting for queued images to be written to disc...\n");
+  frameWriter->Stop();
+  frameWriter->PrintStats();
+  framePool->PrintStats();
 
+  // Close Camera Handle
+  retVal = CloseQHYCCD(pCamHandle);
+  if (retVal == QHYCCD_SUCCESS)
+  {
+    printf("Camera handle closed successfully. \n");
+  }
+  else
+  {
+    printf("Could not close camera handle. Error: %d. \n", retVal);
+  }
+}
+
+/**
+  @fn void CamExit(unsigned int retVal, string tracePath, unsigned long framesWritten, double diskBytes)
+    @brief Reports timing over all cameras and releases SDK resource
+    @param retVal Return value
+    @param tracePath Chrome/Perfetto trace file to write (empty for none)
+    @param framesWritten Frames written by all cameras
+    @param diskBytes Size on disk of those frames
+*/
+void CamExit(unsigned int retVal, string tracePath, unsigned long framesWritten, double diskBytes)
+{
+  TimingReport(framesWritten, diskBytes);
+  if (!tracePath.empty())
+  {
+    TimingWriteTrace(tracePath);
+  }
+
+  // Release SDK Resources
+  retVal = ReleaseQHYCCDResource();
+  if (retVal == QHYCCD_SUCCESS)
+  {
+    printf("SDK resources released successfully. \n");
+  }
+  else
+  {
+    printf("Could not release SDK resources. Error: %d. Program will now exit.\n", retVal);
+    exit(1);
+  }
+
+  printf("Goodbye! Please visit us again.\n");
+}
+
+/**
+  @fn bool ParseList(const char *text, vector<T> &values)
+    @brief Parses a comma-separated list of numbers from the command line
+    @param text List to parse, e.g. "56,60"
+    @param values Parsed values (replaced)
+  @return True if every entry was a number
+*/
+template <typename T>
+bool ParseList(const char *text, vector<T> &values)
+{
+  values.clear();
+  while (*text)
+  {
+    char *end;
+    double value = strtod(text, &end);
+    if (end == text || (*end != ',' && *end != 0))
+    {
+      printf("Could not parse list \"%s\".\n", text);
+      return false;
+    }
+    values.push_back((T)value);
+    text = *end ? end + 1 : end;
+  }
+  return !values.empty();
+}
+
+/**
+  @fn void PrintUsage(const char *programName)
+    @brief Prints the command line options
+    @param programName Name the program was invoked with
+*/
+void PrintUsage(const char *programName)
+{
+  printf("Usage: %s [options]\n", programName);
+  printf("  -o, --save-path PATH     Directory and name prefix of saved images\n");
+  printf("  -g, --gains LIST         Gain settings to loop over, e.g. 56,60\n");
+  printf("  -f, --offsets LIST       Offset settings to loop over\n");
+  printf("  -t, --temps LIST         Temperatures to loop over (Celsius)\n");
+  printf("  -e, --exposures LIST     Exposure times to loop over (seconds)\n");
+  printf("  -n, --repeats N          Images to take at each unique setting\n");
+  printf("      --temp-error C       Temperature regulation error range\n");
+  printf("      --temp-settle S      Time the temperature must stay in range before imaging (seconds, default 3)\n");
+  printf("      --temp-interval S    Time between background temperature samples (seconds, default 0.5)\n");
+  printf("      --filter LIST        Filter wheel position(s) to loop over (0 to 6)\n");
+  printf("      --filter-timeout S   Time after which a filter wheel move is reported as failed (seconds, default 60)\n");
+  printf("      --no-schedule        Take the sweep in nested loop order instead of minimizing transitions\n");
+  printf("      --cool-rate C        Cooling/warming rate for the schedule estimate (Celsius per minute, default 2)\n");
+  printf("      --readout S          Readout time for the schedule estimate (seconds, default 2)\n");
+  printf("  -l, --live-max-exposure S  Take exposures of up to S seconds in live (stream) mode\n");
+  printf("  -w, --writers N          Number of FITS writer threads (0 writes before the next exposure; default 1)\n");
+  printf("  -q, --queue-depth N      Frames that may wait for the writers before capture blocks (default 2)\n");
+  printf("  -c, --compress TYPE      Tile-compress saved images: none, rice, gzip or hcompress (default none)\n");
+  printf("      --compress-level N   zlib level for gzip (default 1), scale for hcompress (default 0, lossless)\n");
+  printf("      --compress-threads N Threads compressing each image (default: all cores)\n");
+  printf("      --container TYPE     Save the repeats of each setting in one file: none, cube or mef (default none)\n");
+  printf("      --cfitsio            Write uncompressed images with CFITSIO instead of the native writer\n");
+  printf("  -b, --pool-buffers N     Reusable frame buffers (0 allocates one per frame; default writers + queue depth + 1)\n");
+  printf("      --hugepages          Back frame buffers with huge pages\n");
+  printf("      --mlock              Lock frame buffers in memory\n");
+  printf("      --no-stats           Do not compute per-image statistics\n");
+  printf("      --stats-csv FILE     Per-image statistics summary (default: save path + _stats.csv)\n");
+  printf("      --saturation ADU     Saturation level for the saturated pixel count (default 65535)\n");
+  printf("      --clip-sigma S       Sigma clipping threshold for the clipped statistics and stack (default 3)\n");
+  printf("      --stack TYPE         Combine the repeats of each setting into a master frame: none, mean, median or clip\n");
+  printf("      --stack-memory MB    Memory for the frame copies of median and clipped stacks (default 2048)\n");
+  printf("      --ptc                Fit gain, read noise and full well from pairs of repeats (photon transfer)\n");
+  printf("      --ptc-tile N         Tile size of the photon transfer statistics (pixels, default 256)\n");
+  printf("      --ptc-csv FILE       Photon transfer results (default: save path + _ptc.csv)\n");
+  printf("      --defects            Build a hot and dead pixel mask per gain and temperature during the sweep\n");
+  printf("      --defect-sigma S     Sigma above the clipped mean at which a pixel counts as hot (default 5)\n");
+  printf("      --defect-min-exposure S  Shortest exposure compared for hot pixels (seconds, default 5)\n");
+  printf("      --defect-min-signal ADU  Lowest mean signal of an image compared for dead pixels (default 10000)\n");
+  printf("      --bias               Track bias levels, row and column profiles and overscan per setting during the sweep\n");
+  printf("      --bias-csv FILE      Bias summary (default: save path + _bias.csv; profiles go to save path + _bias.bin)\n");
+  printf("      --preview N          Also write an NxN binned preview .fits and a PNG thumbnail of every image (default 0, none)\n");
+  printf("      --preview-combine TYPE  Combination of each binned block: mean or sum (default mean)\n");
+  printf("      --preview-png W      Greatest thumbnail width in pixels (0 for no thumbnail; default 1024)\n");
+  printf("      --broadcast NAME     Publish every image to live consumers in shared memory NAME as soon as it is read out\n");
+  printf("      --broadcast-slots N  Images kept in the shared memory ring (default 3)\n");
+  printf("      --no-quality         Save every image without the quality check (readout, truncation, banding, cosmic rays)\n");
+  printf("      --retakes N          Times an image that fails the quality check is taken again before it is saved anyway (default 2)\n");
+  printf("      --cosmic-limit N     Cosmic ray hits per megapixel above which an image fails the check (default 100)\n");
+  printf("      --journal FILE       Journal of the images written (default: save path + _journal.txt)\n");
+  printf("      --no-journal         Do not keep the journal (the sweep cannot be resumed)\n");
+  printf("      --resume             Continue an interrupted sweep, skipping the images in its journal\n");
+  printf("      --staging DIR        Write images to a fast local DIR first and migrate them to the save path in the background\n");
+  printf("      --staging-limit GB   Staged data not yet migrated above which writing waits (default 90%% of the free space in DIR)\n");
+  printf("      --no-catalog         Do not add the images to frames.catalog in the save directory\n");
+  printf("      --trace FILE         Chrome/Perfetto trace of the sweep (default: save path + _trace.json)\n");
+  printf("      --no-trace           Do not write the trace\n");
+  printf("      --cameras LIST       Indices of the cameras to sweep at once (default: every camera found)\n");
+  printf("      --disk-slots N       Images written at once over all cameras (default: the writers of one camera)\n");
+  printf("      --usb-traffic N      USB traffic setting (default: the tuned value of the camera, or 10)\n");
+  printf("      --tune-usb           Measure bias readout at each USB traffic value, store the fastest stable one, and exit\n");
+  printf("      --tune-usb-values LIST  USB traffic values to measure (default 0,5,10,15,20,30,40,60)\n");
+  printf("      --tune-usb-frames N  Bias images taken at each USB traffic value (default 5)\n");
+  printf("      --usb-cache FILE     Tuned USB traffic per camera ID (default: ~/.qhyccd_usb_traffic)\n");
+  printf("  -h, --help               Show this message\n");
+}
+
+/**
+  @struct SweepOptions
+    @brief Settings of the sweep and the writer pipeline, shared by every camera
+*/
+struct SweepOptions
+{
   // Variables Preset
   unsigned int roiStartX = 0;   // ROI Start x
   unsigned int roiStartY = 0;   // ROI Start y
@@ -547,10 +977,708 @@ int main(int argc, char *argv[])
   unsigned int roiSizeY = 6422; // Max y
   int camBinX = 1;              // Binning
   int camBinY = 1;              // Binning
-  int USB_TRAFFIC = 10;         // USB Traffic
+  int USB_TRAFFIC = 10;         // USB Traffic (used when the camera has no tuned value)
+  int usbTrafficGiven = 0;      // USB_TRAFFIC was set on the command line and overrides the tuned value
+  int tuneUsb = 0;              // Tune the USB traffic of each camera instead of taking the sweep
+  vector<int> tuneUsbValues = {0, 5, 10, 15, 20, 30, 40, 60}; // USB traffic values measured by the tuner
+  int tuneUsbFrames = 5;        // Bias images taken at each value
+  string usbCachePath;          // Tuned USB traffic per camera ID (default: ~/.qhyccd_usb_traffic)
   unsigned int bpp = 16;        // Bit Depth of Image
   int readMode = 1;             // ReadMode
-  const int SECOND = 1000000;   // Constant to multiply exposure time with, since QHY600M takes microseconds
+  string savePath = "/home/user/Documents/Images/qhyImg"; // Path to save image with first part of image name at the end
+  int numWriters = 1;           // FITS writer threads
+  int writerQueueDepth = 2;     // Finished frames allowed to wait for the writers (~123 MB each)
+  int poolBuffers = -1;         // Reusable frame buffers (-1 sizes the pool to the writer pipeline)
+  int useCfitsio = 0;           // Write uncompressed frames with CFITSIO instead of the native writer
+  int useHugePages = 0;         // Back frame buffers with huge pages
+  int lockBuffers = 0;          // mlock frame buffers
+  int computeStats = 1;         // Compute per-image statistics (header keys and summary file)
+  string statsPath;             // Statistics summary (default: save path + _stats.csv)
+  int saturation = 65535;       // Saturation level (ADU)
+  double clipSigma = 3.0;       // Sigma clipping threshold
+  StackCombine stackCombine = STACK_NONE; // Master frame combination of the repeats of each setting
+  double stackMemory = 2048;    // Memory for the frame copies of median and clipped stacks (MB)
+  int photonTransfer = 0;       // Analyze pairs of repeats for a photon transfer curve
+  int ptcTile = 256;            // Photon transfer tile size (pixels)
+  string ptcPath;               // Photon transfer results (default: save path + _ptc.csv)
+  int defectMaps = 0;           // Build hot and dead pixel maps during the sweep
+  double defectSigma = 5.0;     // Standard deviations above the clipped mean at which a pixel counts as hot
+  double defectMinExposure = 5; // Shortest exposure compared for hot pixels (seconds)
+  double defectMinSignal = 10000; // Lowest clipped mean of a frame compared for dead pixels (ADU)
+  int biasProfiles = 0;         // Track bias levels, row and column profiles and overscan during the sweep
+  string biasPath;              // Bias summary (default: save path + _bias.csv)
+  int previewBin = 0;           // Binning of the preview of each frame (0 for no previews)
+  int previewSum = 0;           // Sum the binned blocks instead of averaging them
+  int previewPngWidth = 1024;   // Greatest thumbnail width (0 for no thumbnail)
+  string broadcastName;         // Shared memory the images are published to (empty for none)
+  int broadcastSlots = 3;       // Images kept in the shared memory ring
+  int qualityCheck = 1;         // Check each frame before it is written, and retake the ones that fail
+  int maxRetakes = 2;           // Retakes of a failed frame before it is saved anyway
+  double cosmicLimit = 100;     // Cosmic ray hits per megapixel above which a frame fails
+  int writeJournal = 1;         // Journal every image written, so the sweep can be resumed
+  string journalPath;           // Journal file (default: save path + _journal.txt)
+  int resume = 0;               // Skip the images an interrupted run of the same sweep already took
+  string stagingDir;            // Local directory images are written to before migration (empty to write in place)
+  double stagingLimit = 0;      // Staged GB not yet migrated above which writing waits (0 for 90% of the free space)
+  int writeCatalog = 1;         // Add every image written to the catalog of its directory
+  int writeTrace = 1;           // Write a Chrome/Perfetto trace of the sweep
+  string tracePath;             // Trace file (default: save path + _trace.json)
+  FitsCompression compression = COMPRESS_NONE; // Output compression
+  FitsContainerType container = CONTAINER_NONE; // Cube or multi-extension file per setting
+  double liveMaxExposure = -1;  // Exposures up to this many seconds are taken in live mode (-1 never uses live mode)
+  int compressLevel = -1;       // Compression level (-1 for the default of the compression type)
+  int compressThreads = thread::hardware_concurrency(); // Threads compressing each image
+
+  // The List of All Variables -- SET THESE TO TAKE IMAGES (or override them on the command line)
+  vector<int> sampleGains = {56,60};    // List of gain settings to loop over
+  vector<int> sampleOffsets = {20,40};  // List of offset setings to loop over
+  vector<double> sampleTemps = {18,20}; // List of temperatures to loop over (in Celsius)
+  vector<double> sampleExps = {5,10};  // List of exposure times to loop over (in seconds)
+  int howManyTimesToRun = 2;   // How many times to take pictures at each unique setting
+  double tempError = 0.3;      // Temperature regulation error range
+  double tempSettle = 3.0;     // Time the temperature must stay within the error range before imaging (seconds)
+  double tempInterval = 0.5;   // Time between background temperature samples (seconds)
+  double filterTimeout = 60.0; // Time after which a filter wheel move is reported as failed (seconds)
+  vector<int> fwPositions = {2}; // Set this to the filter wheel position(s) you want (between 0 and 6)
+  int scheduleSweep = 1;       // Reorder the sweep to minimize slow hardware transitions
+  vector<int> cameraList;      // Indices of the cameras to sweep (empty for every camera found)
+  int diskSlots = -1;          // Frames written at once over all cameras (-1 for the writers of one camera)
+  SweepCostModel costModel = DefaultCostModel(); // Estimated cost of each transition
+};
+
+/**
+  @struct CameraSweep
+    @brief One camera and its pipeline: frame buffers, writers, and the analyses fed by the writers
+*/
+struct CameraSweep
+{
+  string camId;                        // Camera ID
+  string savePath;                     // Path to save this camera's images to
+  qhyccd_handle *pCamHandle;           // Camera handle
+  int usbTraffic;                      // USB traffic setting of this camera
+  unique_ptr<CameraState> cameraState; // Settings applied to the camera
+  unique_ptr<FramePool> framePool;     // Frame buffers
+  unique_ptr<FrameWriter> frameWriter; // Writer pipeline
+  unique_ptr<FrameStacker> stacker;    // Master frame stacker (if --stack)
+  unique_ptr<PtcAnalyzer> ptcAnalyzer; // Photon transfer analysis (if --ptc)
+  unique_ptr<DefectTracker> defects;   // Hot and dead pixel maps (if --defects)
+  unique_ptr<BiasTracker> bias;        // Bias levels and profiles (if --bias)
+  unique_ptr<FramePreview> preview;    // Binned previews and thumbnails (if --preview)
+  unique_ptr<SweepJournal> journal;    // Journal of the images on disk (unless --no-journal)
+  unique_ptr<FrameBroadcast> broadcast; // Shared-memory ring for live consumers (if --broadcast)
+  string ptcPath;                      // Photon transfer results file
+  string biasPath;                     // Bias summary file
+  int diskClient;                      // Client number in the shared disk scheduler
+  double sweepSeconds;                 // Time the sweep took
+};
+
+/**
+  @fn string CameraPath(const string &path, const string &camId, bool multipleCameras)
+    @brief Makes an output path unique to a camera when several are swept at once
+    @param path Path given for the whole run
+    @param camId Camera ID
+    @param multipleCameras False to return the path unchanged
+  @return Path with the camera ID inserted before the extension (appended if there is none)
+*/
+string CameraPath(const string &path, const string &camId, bool multipleCameras)
+{
+  if (!multipleCameras)
+  {
+    return path;
+  }
+  size_t slash = path.rfind('/');
+  size_t dot = path.rfind('.');
+  if (dot == string::npos || (slash != string::npos && dot < slash))
+  {
+    return path + "_" + camId;
+  }
+  return path.substr(0, dot) + "_" + camId + path.substr(dot);
+}
+
+/**
+  @fn int CamTuneUsbTraffic(qhyccd_handle *pCamHandle, CameraState *cameraState, const string &camId, const SweepOptions &options)
+    @brief Takes bias frames at each USB traffic value, picks the fastest value at which every frame was read out, and
+           stores it for the camera so later runs start with it
+    @param pCamHandle Camera handle (opened by CamInitialize)
+    @param cameraState Camera settings cache
+    @param camId Camera ID
+    @param options Tuning settings
+  @return Chosen USB traffic value, applied to the camera
+*/
+int CamTuneUsbTraffic(qhyccd_handle *pCamHandle, CameraState *cameraState, const string &camId, const SweepOptions &options)
+{
+  printf("Tuning USB traffic of camera %s: %d bias images at each of %zu values...\n", camId.c_str(), options.tuneUsbFrames, options.tuneUsbValues.size());
+
+  double tuneStart = MonotonicSeconds();
+  vector<unsigned char> buffer(GetQHYCCDMemLength(pCamHandle));
+  vector<UsbTrafficResult> results = MeasureUsbTraffic(pCamHandle, cameraState, options.tuneUsbValues, options.tuneUsbFrames, buffer.data());
+  TimingSpan(PHASE_DETAIL, "USB traffic tuning", tuneStart, MonotonicSeconds());
+
+  int picked = PickUsbTraffic(results);
+  PrintUsbTraffic(results, picked);
+  if (picked < 0)
+  {
+    return options.USB_TRAFFIC;
+  }
+
+  const UsbTrafficResult &result = results[picked];
+  if (result.failures > 0)
+  {
+    printf("Every USB traffic value lost images; %d lost the fewest (%d of %d).\n", result.usbTraffic, result.failures, result.frames);
+  }
+  if (SaveUsbTraffic(options.usbCachePath, camId, result))
+  {
+    printf("USB traffic %d stored for camera %s in %s.\n", result.usbTraffic, camId.c_str(), options.usbCachePath.c_str());
+  }
+  else
+  {
+    printf("Could not store the USB traffic in %s.\n", options.usbCachePath.c_str());
+  }
+
+  // Leave the camera at the chosen value
+  unsigned int retVal = cameraState->SetParam(CONTROL_USBTRAFFIC, result.usbTraffic, "SetQHYCCDParam USBTRAFFIC", NULL);
+  if (retVal != QHYCCD_SUCCESS)
+  {
+    printf("Could not set USB traffic setting. Error: %d.\n", retVal);
+  }
+  printf(" \n");
+
+  return result.usbTraffic;
+}
+
+/**
+  @fn void RunSweep(unsigned int retVal, CameraSweep *camera, const SweepOptions &options)
+    @brief Takes the whole sweep on one camera, then closes it
+    @param retVal Return value
+    @param camera Camera and its pipeline (opened by CamInitialize)
+    @param options Sweep settings
+*/
+void RunSweep(unsigned int retVal, CameraSweep *camera, const SweepOptions &options)
+{
+  TimingThreadName((camera->camId + " capture").c_str());
+  double sweepStart = MonotonicSeconds();
+
+  qhyccd_handle *pCamHandle = camera->pCamHandle;
+  CameraState *cameraState = camera->cameraState.get();
+  FramePool &framePool = *camera->framePool;
+  FrameWriter &frameWriter = *camera->frameWriter;
+  string savePath = camera->savePath;
+  unsigned int roiStartX = options.roiStartX;
+  unsigned int roiStartY = options.roiStartY;
+  unsigned int roiSizeX = options.roiSizeX;
+  unsigned int roiSizeY = options.roiSizeY;
+  int camBinX = options.camBinX;
+  int camBinY = options.camBinY;
+  int USB_TRAFFIC = camera->usbTraffic;
+  unsigned int bpp = options.bpp;
+  int readMode = options.readMode;
+  SweepCostModel costModel = options.costModel;
+
+  // Sample the sensor temperature in the background for the rest of the sweep
+  TempMonitor tempMonitor(pCamHandle, options.tempInterval, 4096);
+
+  // Track filter wheel moves in the background
+  FilterWheel filterWheel(pCamHandle, options.filterTimeout);
+
+  // Check each frame on this thread, while the camera is still at its setting, on the cores the cameras' writers leave
+  unique_ptr<QualityGate> qualityGate;
+  if (options.qualityCheck)
+  {
+    int cores = (int)thread::hardware_concurrency() / (int)options.cameraList.size();
+    qualityGate.reset(new QualityGate(options.cosmicLimit, max(1, cores - options.numWriters)));
+  }
+
+  // Expand the sweep into blocks, one per unique setting
+  vector<SweepBlock> plan = BuildSweepPlan(options.sampleTemps, options.fwPositions, options.sampleOffsets, options.sampleGains, options.sampleExps, options.howManyTimesToRun, options.liveMaxExposure);
+
+  // Leave out the images an earlier run of this sweep already has on disk
+  if (options.resume && camera->journal)
+  {
+    size_t settings = plan.size();
+    int skipped = camera->journal->SkipCompleted(plan, readMode);
+    printf("Resuming the sweep: %d images already taken, %zu of %zu settings left.\n", skipped, plan.size(), settings);
+  }
+
+  // Where the camera starts from
+  double startTemp = tempMonitor.Latest().temp;
+  int startFilter = filterWheel.Position();
+  costModel.filterSlots = filterWheel.Slots(); // 0 without a wheel: no moves
+
+  // Order the blocks to minimize the estimated wall time
+  double estimatedTotal = EstimateSweep(plan, costModel, startTemp, startFilter);
+  if (options.scheduleSweep)
+  {
+    printf("Sweep in nested loop order estimated at %.1f s.\n", estimatedTotal);
+    ScheduleSweep(plan, costModel, startTemp, startFilter);
+    estimatedTotal = EstimateSweep(plan, costModel, startTemp, startFilter);
+  }
+  printf("Sweep of %zu settings estimated at %.1f s.\n", plan.size(), estimatedTotal);
+  printf(" \n");
+
+  int totalNumberOfFiles = 0; // How many images will be taken
+  for (size_t b = 0; b < plan.size(); b++)
+  {
+    totalNumberOfFiles += plan[b].repeats;
+  }
+
+  int takingImage = 1; // Which image is being taken
+
+  // Take the pictures, one block of settings at a time
+  for (size_t b = 0; b < plan.size(); b++)
+  {
+    SweepBlock &block = plan[b];
+    double blockStart = MonotonicSeconds();
+
+    double exposureTime = block.exposureSeconds * SECOND;   // Exposure time (in us)
+    int gainSetting = block.gainSetting;                    // Gain Setting
+    int offsetSetting = block.offsetSetting;                // Offset Setting
+    double tempSetting = block.tempSetting;                 // Temperature of Camera
+    int runTimes = block.repeats;                           // How Many Pictures To Get
+    frameWriter.SetStackBlock(b, runTimes);
+
+    // Switch between single frame and live mode if needed
+    if (block.changes & CHANGE_MODE)
+    {
+      double modeStart = MonotonicSeconds();
+      CamStreamMode(retVal, cameraState, block.liveMode, USB_TRAFFIC, roiStartX, roiStartY, roiSizeX, roiSizeY, camBinX, camBinY, readMode);
+      TimingAdd(PHASE_SETTINGS, MonotonicSeconds() - modeStart);
+    }
+
+    // Start moving the filter wheel; settings and temperature regulation proceed while it moves
+    if (block.changes & CHANGE_FILTER)
+    {
+      filterWheel.MoveTo(block.filter);
+    }
+
+    // Set camera settings that differ from what the camera has
+    double phaseStart = MonotonicSeconds();
+    CamSettings(retVal, cameraState, gainSetting, offsetSetting, exposureTime);
+    TimingAdd(PHASE_SETTINGS, MonotonicSeconds() - phaseStart);
+
+    // Set and regulate temperature
+    if (block.changes & (CHANGE_TEMP | CHANGE_MODE))
+    {
+      phaseStart = MonotonicSeconds();
+      TempRegulation(retVal, cameraState, tempSetting, options.tempError, options.tempSettle, &tempMonitor);
+      TimingAdd(PHASE_TEMPERATURE, MonotonicSeconds() - phaseStart);
+    }
+
+    // Capture only needs the filter wheel in position
+    phaseStart = MonotonicSeconds();
+    if (!filterWheel.WaitInPosition())
+    {
+      printf("Filter wheel is not at position %d. \n", block.filter);
+    }
+    TimingAdd(PHASE_FILTER, MonotonicSeconds() - phaseStart);
+
+    // In live mode the sensor runs continuously: take the whole sequence at once
+    if (block.liveMode)
+    {
+      printf("Taking images %d to %d of %d images in live mode... \n", takingImage, takingImage + runTimes - 1, totalNumberOfFiles);
+      CamLiveCapture(retVal, pCamHandle, runTimes, block.firstRepeat, roiSizeX, roiSizeY, bpp, gainSetting, offsetSetting, exposureTime, tempSetting, readMode, block.filter, savePath, &framePool, &frameWriter, &tempMonitor, qualityGate.get(), camera->broadcast.get(), options.maxRetakes);
+      takingImage += runTimes;
+    }
+    else
+    {
+      // Loop to take multiple pictures
+      for (int runner = 0; runner < runTimes; runner++)
+      {
+        // Check the latest temperature sample; only regulate again if it has drifted out of range
+        phaseStart = MonotonicSeconds();
+        if (!tempMonitor.IsStable())
+        {
+          TempRegulation(retVal, cameraState, tempSetting, options.tempError, options.tempSettle, &tempMonitor);
+        }
+        TimingAdd(PHASE_TEMPERATURE, MonotonicSeconds() - phaseStart);
+
+        // Print which image is being taken
+        printf("Taking image %d of %d images... \n", takingImage, totalNumberOfFiles);
+
+        // Take the picture and save it, taking it again at once while it fails the quality check
+        int retakes = 0;
+        while (!CamCapture(retVal, pCamHandle, runTimes, block.firstRepeat + runner, roiStartX, roiStartY, roiSizeX, roiSizeY, bpp, gainSetting, offsetSetting, exposureTime, tempSetting, readMode, block.filter, savePath, &framePool, &frameWriter, &tempMonitor, qualityGate.get(), camera->broadcast.get(), retakes >= options.maxRetakes))
+        {
+          retakes++;
+        }
+
+        // Increment takingImage
+        takingImage++;
+      }
+    }
+
+    block.achievedSeconds = MonotonicSeconds() - blockStart;
+    printf("Settings %zu of %zu done in %.1f s (estimated %.1f s).\n", b + 1, plan.size(), block.achievedSeconds, block.estimatedSeconds);
+    printf(" \n");
+  }
+
+  // Estimated versus achieved time per block
+  PrintSweepReport(plan);
+
+  // Stop the telemetry and filter wheel tracking before the camera is closed
+  cameraState->PrintStats();
+  if (qualityGate)
+  {
+    qualityGate->PrintStats(MonotonicSeconds() - sweepStart);
+  }
+  filterWheel.PrintStats();
+  filterWheel.Stop();
+  tempMonitor.Stop();
+
+  // Write the last master frames
+  frameWriter.Flush();
+  if (camera->journal)
+  {
+    camera->journal->PrintStats();
+  }
+  if (camera->preview)
+  {
+    camera->preview->PrintStats();
+  }
+  if (camera->broadcast)
+  {
+    camera->broadcast->PrintStats();
+  }
+  if (camera->stacker)
+  {
+    camera->stacker->Close();
+    camera->stacker->PrintStats();
+  }
+
+  // Masks of the last temperature
+  if (camera->defects)
+  {
+    camera->defects->Close();
+    camera->defects->PrintResults();
+  }
+
+  // Photon transfer results of the whole sweep
+  if (camera->ptcAnalyzer)
+  {
+    camera->ptcAnalyzer->PrintResults(camera->ptcPath);
+  }
+
+  // Bias levels of the last setting, and the tables of the whole sweep
+  if (camera->bias)
+  {
+    camera->bias->Close();
+    camera->bias->PrintResults(camera->biasPath);
+  }
+
+  camera->sweepSeconds = MonotonicSeconds() - sweepStart;
+  printf("Camera %s finished its sweep in %.1f s.\n", camera->camId.c_str(), camera->sweepSeconds);
+
+  // Close camera
+  CamClose(retVal, pCamHandle, &framePool, &frameWriter);
+}
+
+
+//===============================================
+//===============================================
+//=================|-----------|=================
+//=================|THE PROGRAM|=================
+//=================|-----------|=================
+//===============================================
+//===============================================
+
+int main(int argc, char *argv[])
+{
+
+  SweepOptions options;
+
+  // Command Line Options
+  struct option longOptions[] = {
+      {"save-path", required_argument, 0, 'o'},
+      {"gains", required_argument, 0, 'g'},
+      {"offsets", required_argument, 0, 'f'},
+      {"temps", required_argument, 0, 't'},
+      {"exposures", required_argument, 0, 'e'},
+      {"repeats", required_argument, 0, 'n'},
+      {"temp-error", required_argument, 0, 'E'},
+      {"temp-settle", required_argument, 0, 'S'},
+      {"temp-interval", required_argument, 0, 'I'},
+      {"filter-timeout", required_argument, 0, 'W'},
+      {"filter", required_argument, 0, 'F'},
+      {"no-schedule", no_argument, &options.scheduleSweep, 0},
+      {"cool-rate", required_argument, 0, 'C'},
+      {"readout", required_argument, 0, 'R'},
+      {"writers", required_argument, 0, 'w'},
+      {"queue-depth", required_argument, 0, 'q'},
+      {"live-max-exposure", required_argument, 0, 'l'},
+      {"compress", required_argument, 0, 'c'},
+      {"compress-level", required_argument, 0, 'L'},
+      {"compress-threads", required_argument, 0, 'T'},
+      {"pool-buffers", required_argument, 0, 'b'},
+      {"container", required_argument, 0, 'Z'},
+      {"cfitsio", no_argument, &options.useCfitsio, 1},
+      {"hugepages", no_argument, &options.useHugePages, 1},
+      {"mlock", no_argument, &options.lockBuffers, 1},
+      {"no-stats", no_argument, &options.computeStats, 0},
+      {"stats-csv", required_argument, 0, 'V'},
+      {"saturation", required_argument, 0, 'A'},
+      {"clip-sigma", required_argument, 0, 'K'},
+      {"stack", required_argument, 0, 'M'},
+      {"stack-memory", required_argument, 0, 'Y'},
+      {"ptc", no_argument, &options.photonTransfer, 1},
+      {"ptc-tile", required_argument, 0, 'U'},
+      {"ptc-csv", required_argument, 0, 'X'},
+      {"defects", no_argument, &options.defectMaps, 1},
+      {"defect-sigma", required_argument, 0, 'a'},
+      {"defect-min-exposure", required_argument, 0, 'd'},
+      {"defect-min-signal", required_argument, 0, 'i'},
+      {"bias", no_argument, &options.biasProfiles, 1},
+      {"bias-csv", required_argument, 0, 's'},
+      {"preview", required_argument, 0, 'p'},
+      {"preview-combine", required_argument, 0, 'm'},
+      {"preview-png", required_argument, 0, 'x'},
+      {"broadcast", required_argument, 0, 'y'},
+      {"broadcast-slots", required_argument, 0, 'z'},
+      {"no-quality", no_argument, &options.qualityCheck, 0},
+      {"retakes", required_argument, 0, 'r'},
+      {"cosmic-limit", required_argument, 0, 'k'},
+      {"journal", required_argument, 0, 'J'},
+      {"no-journal", no_argument, &options.writeJournal, 0},
+      {"staging", required_argument, 0, 'j'},
+      {"staging-limit", required_argument, 0, 'v'},
+      {"no-catalog", no_argument, &options.writeCatalog, 0},
+      {"resume", no_argument, &options.resume, 1},
+      {"trace", required_argument, 0, 'P'},
+      {"no-trace", no_argument, &options.writeTrace, 0},
+      {"cameras", required_argument, 0, 'D'},
+      {"disk-slots", required_argument, 0, 'G'},
+      {"usb-traffic", required_argument, 0, 'u'},
+      {"tune-usb", no_argument, &options.tuneUsb, 1},
+      {"tune-usb-values", required_argument, 0, 'N'},
+      {"tune-usb-frames", required_argument, 0, 'B'},
+      {"usb-cache", required_argument, 0, 'H'},
+      {"help", no_argument, 0, 'h'},
+      {0, 0, 0, 0}};
+  int opt;
+  while ((opt = getopt_long(argc, argv, "o:g:f:t:e:n:l:w:q:c:b:h", longOptions, 0)) != -1)
+  {
+    switch (opt)
+    {
+    case 'o':
+      options.savePath = optarg;
+      break;
+    case 'P':
+      options.tracePath = optarg;
+      break;
+    case 'J':
+      options.journalPath = optarg;
+      break;
+    case 'a':
+      options.defectSigma = atof(optarg);
+      break;
+    case 'd':
+      options.defectMinExposure = atof(optarg);
+      break;
+    case 'i':
+      options.defectMinSignal = atof(optarg);
+      break;
+    case 's':
+      options.biasPath = optarg;
+      break;
+    case 'p':
+      options.previewBin = atoi(optarg);
+      break;
+    case 'm':
+      if (strcmp(optarg, "sum") != 0 && strcmp(optarg, "mean") != 0)
+      {
+        printf("Unknown preview combine \"%s\".\n", optarg);
+        return 1;
+      }
+      options.previewSum = strcmp(optarg, "sum") == 0;
+      break;
+    case 'x':
+      options.previewPngWidth = atoi(optarg);
+      break;
+    case 'y':
+      options.broadcastName = optarg;
+      break;
+    case 'j':
+      options.stagingDir = optarg;
+      break;
+    case 'v':
+      options.stagingLimit = atof(optarg);
+      break;
+    case 'z':
+      options.broadcastSlots = atoi(optarg);
+      break;
+    case 'r':
+      options.maxRetakes = atoi(optarg);
+      break;
+    case 'k':
+      options.cosmicLimit = atof(optarg);
+      break;
+    case 'V':
+      options.statsPath = optarg;
+      break;
+    case 'A':
+      options.saturation = atoi(optarg);
+      break;
+    case 'K':
+      options.clipSigma = atof(optarg);
+      break;
+    case 'M':
+      if (!ParseStackCombine(optarg, &options.stackCombine))
+      {
+        printf("Unknown stack combine \"%s\".\n", optarg);
+        return 1;
+      }
+      break;
+    case 'Y':
+      options.stackMemory = atof(optarg);
+      break;
+    case 'U':
+      options.ptcTile = atoi(optarg);
+      break;
+    case 'X':
+      options.ptcPath = optarg;
+      break;
+    case 'g':
+      if (!ParseList(optarg, options.sampleGains))
+      {
+        return 1;
+      }
+      break;
+    case 'f':
+      if (!ParseList(optarg, options.sampleOffsets))
+      {
+        return 1;
+      }
+      break;
+    case 't':
+      if (!ParseList(optarg, options.sampleTemps))
+      {
+        return 1;
+      }
+      break;
+    case 'e':
+      if (!ParseList(optarg, options.sampleExps))
+      {
+        return 1;
+      }
+      break;
+    case 'n':
+      options.howManyTimesToRun = atoi(optarg);
+      break;
+    case 'E':
+      options.tempError = atof(optarg);
+      break;
+    case 'S':
+      options.tempSettle = atof(optarg);
+      break;
+    case 'I':
+      options.tempInterval = atof(optarg);
+      break;
+    case 'W':
+      options.filterTimeout = atof(optarg);
+      break;
+    case 'F':
+      if (!ParseList(optarg, options.fwPositions))
+      {
+        return 1;
+      }
+      break;
+    case 'C':
+      options.costModel.coolRate = options.costModel.heatRate = atof(optarg);
+      break;
+    case 'R':
+      options.costModel.readoutSeconds = atof(optarg);
+      break;
+    case 'w':
+      options.numWriters = atoi(optarg);
+      break;
+    case 'q':
+      options.writerQueueDepth = atoi(optarg);
+      break;
+    case 'l':
+      options.liveMaxExposure = atof(optarg);
+      break;
+    case 'c':
+      if (!ParseCompression(optarg, &options.compression))
+      {
+        printf("Unknown compression \"%s\".\n", optarg);
+        return 1;
+      }
+      break;
+    case 'Z':
+      if (!ParseContainer(optarg, &options.container))
+      {
+        printf("Unknown container \"%s\".\n", optarg);
+        return 1;
+      }
+      break;
+    case 'L':
+      options.compressLevel = atoi(optarg);
+      break;
+    case 'T':
+      options.compressThreads = atoi(optarg);
+      break;
+    case 'b':
+      options.poolBuffers = atoi(optarg);
+      break;
+    case 'D':
+      if (!ParseList(optarg, options.cameraList))
+      {
+        return 1;
+      }
+      break;
+    case 'G':
+      options.diskSlots = atoi(optarg);
+      break;
+    case 'u':
+      options.USB_TRAFFIC = atoi(optarg);
+      options.usbTrafficGiven = 1;
+      break;
+    case 'N':
+      if (!ParseList(optarg, options.tuneUsbValues))
+      {
+        return 1;
+      }
+      break;
+    case 'B':
+      options.tuneUsbFrames = atoi(optarg);
+      break;
+    case 'H':
+      options.usbCachePath = optarg;
+      break;
+    case 0:
+      break; // Flag options
+    case 'h':
+      PrintUsage(argv[0]);
+      return 0;
+    default:
+      PrintUsage(argv[0]);
+      return 1;
+    }
+  }
+
+  if (options.container != CONTAINER_NONE && options.compression != COMPRESS_NONE)
+  {
+    printf("Containers hold uncompressed frames; --container cannot be combined with --compress.\n");
+    return 1;
+  }
+  if (options.container != CONTAINER_NONE && !options.stagingDir.empty())
+  {
+    printf("Containers are written in place; --container cannot be combined with --staging.\n");
+    return 1;
+  }
+  if (options.container != CONTAINER_NONE)
+  {
+    options.writeJournal = 0; // Container headers are only final once a setting is complete
+  }
+  if (options.resume && !options.writeJournal)
+  {
+    printf("--resume needs the sweep journal; it cannot be combined with --no-journal or --container.\n");
+    return 1;
+  }
+
+  if (options.usbCachePath.empty())
+  {
+    const char *home = getenv("HOME");
+    options.usbCachePath = string(home ? home : ".") + "/.qhyccd_usb_traffic";
+  }
 
   // Initialize SDK
   unsigned int retVal = InitQHYCCDResource();
@@ -567,71 +1695,282 @@ int main(int argc, char *argv[])
     exit(1);
   }
 
-  // Initialize the camera and set initial settings
-  qhyccd_handle *pCamHandle = CamInitialize(retVal, USB_TRAFFIC, roiStartX, roiStartY, roiSizeX, roiSizeY, camBinX, camBinY, readMode);
+  // Start the sweep clock
+  TimingStart();
+  TimingThreadName("main");
+  if (!options.writeTrace)
+  {
+    options.tracePath.clear();
+  }
+  else if (options.tracePath.empty())
+  {
+    options.tracePath = options.savePath + "_trace.json";
+  }
+
+  // Find the cameras and pick the ones to sweep (every camera found by default)
+  vector<string> camIds = CamList(retVal);
+  if (options.cameraList.empty())
+  {
+    for (size_t i = 0; i < camIds.size(); i++)
+    {
+      options.cameraList.push_back(i);
+    }
+  }
+  for (size_t i = 0; i < options.cameraList.size(); i++)
+  {
+    if (options.cameraList[i] < 0 || options.cameraList[i] >= (int)camIds.size())
+    {
+      printf("There is no camera %d (%zu found). Program will now exit. \n", options.cameraList[i], camIds.size());
+      exit(1);
+    }
+  }
+  bool multipleCameras = options.cameraList.size() > 1;
 
-  retVal = SetQHYCCDParam(pCamHandle, CONTROL_MANULPWM, 0);
+  // Calibration mode: tune the USB traffic of each camera in turn, then exit without taking the sweep
+  if (options.tuneUsb)
+  {
+    for (size_t i = 0; i < options.cameraList.size(); i++)
+    {
+      string camId = camIds[options.cameraList[i]];
+      CameraState *cameraState;
+      qhyccd_handle *pCamHandle = CamInitialize(retVal, camId.c_str(), &cameraState, options.USB_TRAFFIC, options.roiStartX, options.roiStartY, options.roiSizeX, options.roiSizeY, options.camBinX, options.camBinY, options.readMode);
+      CamTuneUsbTraffic(pCamHandle, cameraState, camId, options);
+      cameraState->PrintStats();
+      delete cameraState;
+
+      retVal = CloseQHYCCD(pCamHandle);
+      if (retVal != QHYCCD_SUCCESS)
+      {
+        printf("Could not close camera handle. Error: %d. \n", retVal);
+      }
+    }
+    CamExit(retVal, options.tracePath, 0, 0);
+    return 0;
+  }
 
-  // The List of All Variables -- SET THESE TO TAKE IMAGES
-  int sampleGains[] = {56,60};    // List of gain settings to loop over
-  int sampleOffsets[] = {20,40};  // List of offset setings to loop over
-  double sampleTemps[] = {18,20}; // List of temperatures to loop over (in Celsius)
-  double sampleExps[] = {5,10};  // List of exposure times to loop over (in seconds)
-  int howManyTimesToRun = 2;   // How many times to take pictures at each unique setting
-  double tempError = 0.3;      // Temperature regulation error range
-  int fwPosition = 2;          // Set this to the filter wheel position you want (between 0 and 6)
+  // Allocate the frame buffers once: one being captured, one per writer, and one per queue slot
+  if (options.poolBuffers < 0)
+  {
+    options.poolBuffers = options.numWriters > 0 ? options.numWriters + options.writerQueueDepth + 1 : 1;
+  }
+  if (options.compressLevel < 0)
+  {
+    options.compressLevel = options.compression == COMPRESS_GZIP ? 1 : 0;
+  }
 
-  int totalNumberOfFiles = sizeof(sampleTemps) / sizeof(sampleTemps[0]) * sizeof(sampleOffsets) / sizeof(sampleOffsets[0]) * sizeof(sampleGains) / sizeof(sampleGains[0]) * sizeof(sampleExps) / sizeof(sampleExps[0]) * howManyTimesToRun; // How many images will be taken
+  // Cameras swept together take turns at the disk
+  unique_ptr<DiskScheduler> diskScheduler;
+  if (multipleCameras)
+  {
+    int slots = options.diskSlots > 0 ? options.diskSlots : max(options.numWriters, 1);
+    diskScheduler.reset(new DiskScheduler(slots));
+    printf("Sweeping %zu cameras at once, %d frame(s) written at a time.\n", options.cameraList.size(), slots);
+  }
 
-  int takingImage = 1; // Which image is being taken
+  // Every camera's images go to the same directory, so they share its staging area and catalog
+  size_t slash = options.savePath.rfind('/');
+  string saveDir = slash == string::npos ? "." : options.savePath.substr(0, slash);
+  unique_ptr<FrameCatalog> catalog;
+  if (options.writeCatalog)
+  {
+    catalog.reset(new FrameCatalog(saveDir));
+    if (!catalog->IsOpen())
+    {
+      catalog.reset();
+    }
+  }
+  unique_ptr<StagingMigrator> staging; // Declared after the catalog, which it appends to until it is destroyed
+  if (!options.stagingDir.empty())
+  {
+    staging.reset(new StagingMigrator(options.stagingDir, saveDir, options.stagingLimit * 1e9, catalog.get()));
+    if (staging->IsOpen())
+    {
+      staging->Drain(); // Images an earlier run left in staging must be in place before its journal is read
+    }
+    else
+    {
+      staging.reset();
+    }
+  }
 
-  // LoOp ThE lOoPs and take the pictures
-  for (unsigned int t = 0; t < sizeof(sampleTemps) / sizeof(sampleTemps[0]); t++)
+  // Open each camera and give it its own frame buffers, writers and analyses
+  vector<unique_ptr<CameraSweep>> cameras;
+  for (size_t i = 0; i < options.cameraList.size(); i++)
   {
-    for (unsigned int o = 0; o < sizeof(sampleOffsets) / sizeof(sampleOffsets[0]); o++)
+    unique_ptr<CameraSweep> camera(new CameraSweep());
+    camera->camId = camIds[options.cameraList[i]];
+    camera->savePath = CameraPath(options.savePath, camera->camId, multipleCameras);
+    camera->sweepSeconds = 0;
+
+    // Start from the USB traffic tuned for this camera, unless one was given
+    camera->usbTraffic = options.USB_TRAFFIC;
+    if (!options.usbTrafficGiven && LoadUsbTraffic(options.usbCachePath, camera->camId, &camera->usbTraffic))
     {
-      for (unsigned int g = 0; g < sizeof(sampleGains) / sizeof(sampleGains[0]); g++)
-      {
-        for (unsigned int e = 0; e < sizeof(sampleExps) / sizeof(sampleExps[0]); e++)
-        {
-          double exposureTime = sampleExps[e] * SECOND;           // Exposure time (in us)
-          int gainSetting = sampleGains[g];                       // Gain Setting
-          int offsetSetting = sampleOffsets[o];                   // Offset Setting
-          double tempSetting = sampleTemps[t];                    // Temperature of Camera
-          int runTimes = howManyTimesToRun;                       // How Many Pictures To Get
-          string savePath = "/home/user/Documents/Images/qhyImg"; // Path to save image with first part of image name at the end
+      printf("Using the tuned USB traffic %d of camera %s from %s.\n", camera->usbTraffic, camera->camId.c_str(), options.usbCachePath.c_str());
+    }
+
+    // Initialize the camera and set initial settings
+    double initStart = MonotonicSeconds();
+    CameraState *cameraState;
+    camera->pCamHandle = CamInitialize(retVal, camera->camId.c_str(), &cameraState, camera->usbTraffic, options.roiStartX, options.roiStartY, options.roiSizeX, options.roiSizeY, options.camBinX, options.camBinY, options.readMode);
+    TimingAdd(PHASE_INIT, MonotonicSeconds() - initStart);
+
+    camera->cameraState.reset(cameraState);
+
+    retVal = cameraState->SetParam(CONTROL_MANULPWM, 0, "SetQHYCCDParam MANULPWM", NULL);
 
-          // Operate filter wheel
-          FilterWheelControl(retVal, pCamHandle, fwPosition);
+    camera->framePool.reset(new FramePool(GetQHYCCDMemLength(camera->pCamHandle), options.poolBuffers, options.useHugePages, options.lockBuffers));
 
-          // Set camera settings
-          CamSettings(retVal, pCamHandle, gainSetting, offsetSetting, exposureTime);
+    // Start the FITS writers so frames are saved while the next exposure runs
+    FrameWriter *frameWriter = new FrameWriter(options.numWriters, options.writerQueueDepth);
+    camera->frameWriter.reset(frameWriter);
+    frameWriter->SetCompression(options.compression, options.compressLevel, options.compressThreads);
+    frameWriter->SetNativeWriter(!options.useCfitsio);
+    frameWriter->SetContainer(options.container, camera->savePath);
+    frameWriter->SetStatistics(options.computeStats, options.saturation, options.clipSigma, thread::hardware_concurrency(),
+                               options.statsPath.empty() ? camera->savePath + "_stats.csv" : CameraPath(options.statsPath, camera->camId, multipleCameras));
+    if (diskScheduler)
+    {
+      camera->diskClient = diskScheduler->AddClient(camera->camId);
+      frameWriter->SetDiskScheduler(diskScheduler.get(), camera->diskClient);
+    }
 
-          // Set and regulate temperature
-          TempRegulation(retVal, pCamHandle, tempSetting, tempError);
+    // Combine the repeats of each setting into master frames as they are written
+    if (options.stackCombine != STACK_NONE)
+    {
+      camera->stacker.reset(new FrameStacker(options.stackCombine, (size_t)(options.stackMemory * 1e6), options.clipSigma, thread::hardware_concurrency(), camera->savePath));
+      frameWriter->SetStacker(camera->stacker.get());
+    }
 
-          // Loop to take multiple pictures
-          for (int runner = 0; runner < runTimes; runner++)
-          {
-            // Set and regulate temperature again
-            TempRegulation(retVal, pCamHandle, tempSetting, tempError);
+    // Pair the repeats of each setting for the photon transfer curve, keeping only tile statistics
+    if (options.photonTransfer)
+    {
+      camera->ptcAnalyzer.reset(new PtcAnalyzer(options.ptcTile, options.saturation, thread::hardware_concurrency()));
+      camera->ptcPath = options.ptcPath.empty() ? camera->savePath + "_ptc.csv" : CameraPath(options.ptcPath, camera->camId, multipleCameras);
+      frameWriter->SetPtcAnalyzer(camera->ptcAnalyzer.get());
+    }
 
-            // Print which image is being taken
-            printf("Taking image %d of %d images... \n", takingImage, totalNumberOfFiles);
+    // Count hot and dead pixels as the images are written
+    if (options.defectMaps)
+    {
+      camera->defects.reset(new DefectTracker(options.defectSigma, options.defectMinExposure, options.defectMinSignal, thread::hardware_concurrency(), camera->savePath));
+      frameWriter->SetDefectTracker(camera->defects.get());
+    }
 
-            // Take the picture and save it
-            CamCapture(retVal, pCamHandle, runTimes, runner, roiStartX, roiStartY, roiSizeX, roiSizeY, bpp, gainSetting, offsetSetting, exposureTime, tempSetting, readMode, savePath);
+    // Reduce every image to its bias level and row and column profiles as it is written
+    if (options.biasProfiles)
+    {
+      BiasRegion overscan = CamOverscanArea(camera->pCamHandle, options.roiStartX, options.roiStartY, options.roiSizeX, options.roiSizeY, options.camBinX, options.camBinY);
+      camera->bias.reset(new BiasTracker(overscan, thread::hardware_concurrency(), camera->savePath + "_bias.bin"));
+      camera->biasPath = options.biasPath.empty() ? camera->savePath + "_bias.csv" : CameraPath(options.biasPath, camera->camId, multipleCameras);
+      frameWriter->SetBiasTracker(camera->bias.get());
+    }
 
-            // Increment takingImage
-            takingImage++;
-          }
-        }
+    // Quick-look previews next to the images
+    if (options.previewBin > 0)
+    {
+      camera->preview.reset(new FramePreview(options.previewBin, options.previewSum, options.previewPngWidth, thread::hardware_concurrency()));
+      frameWriter->SetPreview(camera->preview.get());
+    }
+
+    // Journal each image once it is safely on disk
+    if (options.writeJournal)
+    {
+      // A staged sweep keeps its journal in staging, next to the images it lists until they are migrated
+      string journalPath = camera->savePath + "_journal.txt";
+      if (!options.journalPath.empty())
+      {
+        journalPath = CameraPath(options.journalPath, camera->camId, multipleCameras);
+      }
+      else if (staging)
+      {
+        journalPath = staging->LocalName(journalPath);
+      }
+      camera->journal.reset(new SweepJournal(journalPath, options.resume));
+      if (camera->journal->IsOpen())
+      {
+        frameWriter->SetJournal(camera->journal.get());
+      }
+      else
+      {
+        camera->journal.reset();
       }
     }
+
+    if (catalog)
+    {
+      frameWriter->SetCatalog(catalog.get());
+    }
+    if (staging)
+    {
+      frameWriter->SetStaging(staging.get());
+    }
+
+    // Publish each image to live consumers as soon as it is read out
+    if (!options.broadcastName.empty())
+    {
+      camera->broadcast.reset(new FrameBroadcast(CameraPath(options.broadcastName, camera->camId, multipleCameras), max(options.broadcastSlots, 1), camera->framePool->BufferLength()));
+      if (!camera->broadcast->IsOpen())
+      {
+        camera->broadcast.reset();
+      }
+    }
+
+    cameras.push_back(move(camera));
+  }
+
+  // Take the sweep, on a capture thread per camera when there are several
+  if (!multipleCameras)
+  {
+    RunSweep(retVal, cameras[0].get(), options);
+  }
+  else
+  {
+    vector<thread> captureThreads;
+    for (size_t i = 0; i < cameras.size(); i++)
+    {
+      captureThreads.push_back(thread(RunSweep, retVal, cameras[i].get(), cref(options)));
+    }
+    for (size_t i = 0; i < captureThreads.size(); i++)
+    {
+      captureThreads[i].join();
+    }
+  }
+
+  // Throughput of each camera
+  unsigned long framesWritten = 0;
+  double diskBytes = 0;
+  if (multipleCameras)
+  {
+    printf(" \n");
+    printf("%-20s %7s %9s %10s %8s %9s %14s\n", "Camera", "Images", "GB", "Sweep (s)", "MB/s", "Images/s", "Disk wait (s)");
+  }
+  for (size_t i = 0; i < cameras.size(); i++)
+  {
+    FrameWriter *frameWriter = cameras[i]->frameWriter.get();
+    framesWritten += frameWriter->FramesWritten();
+    diskBytes += frameWriter->DiskBytes();
+    if (multipleCameras)
+    {
+      double seconds = cameras[i]->sweepSeconds > 0 ? cameras[i]->sweepSeconds : 1e-9;
+      printf("%-20s %7lu %9.2f %10.1f %8.1f %9.3f %14.1f\n", cameras[i]->camId.c_str(), frameWriter->FramesWritten(),
+             frameWriter->DiskBytes() / 1e9, cameras[i]->sweepSeconds, frameWriter->DiskBytes() / 1e6 / seconds,
+             frameWriter->FramesWritten() / seconds, diskScheduler->WaitSeconds(cameras[i]->diskClient));
+    }
+  }
+
+  if (staging)
+  {
+    staging->Drain();
+    staging->PrintStats();
+  }
+  if (catalog)
+  {
+    catalog->PrintStats();
   }
 
-  // Close camera and release SDK resources
-  CamExit(retVal, pCamHandle);
+  // Report timing and release SDK resources
+  CamExit(retVal, options.tracePath, framesWritten, diskBytes);
 
   // Exit
   return 0;
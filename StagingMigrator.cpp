@@ -0,0 +1,788 @@
+/**
+ * @file StagingMigrator.cpp
+ *
+ * @brief Local staging of the frames written, with background migration to the archive directory.
+ *
+ */
+
+// Dependencies
+#include "StagingMigrator.h"
+#include "FitsChecksum.h"
+#include "Timing.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+using namespace std;
+
+static const size_t COPY_CHUNK_BYTES = 8 << 20; // Bytes read and written at a time
+static const int FITS_BLOCK_BYTES = 2880;
+static const int FITS_MAX_HEADER_BLOCKS = 64;   // Longest header looked at when adding checksums
+static const int MAX_ATTEMPTS = 3;              // Migrations of a file tried before it is left in staging
+static const double DEFAULT_LIMIT_FRACTION = 0.9; // Share of the free staging space used when no limit is given
+
+/**
+  @class Xxh64
+    @brief Streaming XXH64 hash (seed 0), as printed by xxhsum -H1
+*/
+class Xxh64
+{
+public:
+  Xxh64() : total(0), buffered(0)
+  {
+    lanes[0] = PRIME1 + PRIME2;
+    lanes[1] = PRIME2;
+    lanes[2] = 0;
+    lanes[3] = 0 - PRIME1;
+  }
+
+  void Update(const unsigned char *data, size_t bytes)
+  {
+    total += bytes;
+    if (buffered > 0)
+    {
+      size_t take = min(bytes, (size_t)32 - buffered);
+      memcpy(buffer + buffered, data, take);
+      buffered += take;
+      data += take;
+      bytes -= take;
+      if (buffered < 32)
+      {
+        return;
+      }
+      Stripe(buffer);
+      buffered = 0;
+    }
+    for (; bytes >= 32; data += 32, bytes -= 32)
+    {
+      Stripe(data);
+    }
+    memcpy(buffer, data, bytes);
+    buffered = bytes;
+  }
+
+  uint64_t Digest() const
+  {
+    uint64_t hash;
+    if (total >= 32)
+    {
+      hash = Rotate(lanes[0], 1) + Rotate(lanes[1], 7) + Rotate(lanes[2], 12) + Rotate(lanes[3], 18);
+      for (int i = 0; i < 4; i++)
+      {
+        hash = (hash ^ Round(0, lanes[i])) * PRIME1 + PRIME4;
+      }
+    }
+    else
+    {
+      hash = PRIME5;
+    }
+    hash += total;
+
+    const unsigned char *tail = buffer;
+    size_t left = buffered;
+    for (; left >= 8; tail += 8, left -= 8)
+    {
+      hash = Rotate(hash ^ Round(0, Read64(tail)), 27) * PRIME1 + PRIME4;
+    }
+    if (left >= 4)
+    {
+      hash = Rotate(hash ^ (uint64_t)Read32(tail) * PRIME1, 23) * PRIME2 + PRIME3;
+      tail += 4;
+      left -= 4;
+    }
+    for (; left > 0; tail++, left--)
+    {
+      hash = Rotate(hash ^ *tail * PRIME5, 11) * PRIME1;
+    }
+    hash ^= hash >> 33;
+    hash *= PRIME2;
+    hash ^= hash >> 29;
+    hash *= PRIME3;
+    hash ^= hash >> 32;
+    return hash;
+  }
+
+private:
+  static const uint64_t PRIME1 = 11400714785074694791ULL;
+  static const uint64_t PRIME2 = 14029467366897019727ULL;
+  static const uint64_t PRIME3 = 1609587929392839161ULL;
+  static const uint64_t PRIME4 = 9650029242287828579ULL;
+  static const uint64_t PRIME5 = 2870177450012600261ULL;
+
+  static uint64_t Rotate(uint64_t value, int bits)
+  {
+    return value << bits | value >> (64 - bits);
+  }
+  static uint64_t Read64(const unsigned char *data)
+  {
+    uint64_t value;
+    memcpy(&value, data, 8); // XXH64 reads little-endian words, as x86 does
+    return value;
+  }
+  static uint32_t Read32(const unsigned char *data)
+  {
+    uint32_t value;
+    memcpy(&value, data, 4);
+    return value;
+  }
+  static uint64_t Round(uint64_t lane, uint64_t input)
+  {
+    return Rotate(lane + input * PRIME2, 31) * PRIME1;
+  }
+  void Stripe(const unsigned char *data)
+  {
+    for (int i = 0; i < 4; i++)
+    {
+      lanes[i] = Round(lanes[i], Read64(data + 8 * i));
+    }
+  }
+
+  uint64_t lanes[4];
+  uint64_t total;
+  unsigned char buffer[32];
+  size_t buffered;
+};
+
+/**
+  @struct CopySegment
+    @brief Piece of the archive copy, with the hash of what was written there
+*/
+struct CopySegment
+{
+  uint64_t offset; // Offset in the file
+  uint64_t bytes;  // Length
+  uint64_t hash;   // XXH64 of the bytes written
+};
+
+/**
+  @fn static bool ReadAll(int fd, unsigned char *buffer, size_t bytes, uint64_t offset)
+  @return True if bytes could be read at offset
+*/
+static bool ReadAll(int fd, unsigned char *buffer, size_t bytes, uint64_t offset)
+{
+  while (bytes > 0)
+  {
+    ssize_t got = pread(fd, buffer, bytes, offset);
+    if (got <= 0)
+    {
+      if (got < 0 && errno == EINTR)
+      {
+        continue;
+      }
+      return false;
+    }
+    buffer += got;
+    bytes -= got;
+    offset += got;
+  }
+  return true;
+}
+
+/**
+  @fn static bool WriteAll(int fd, const unsigned char *buffer, size_t bytes, uint64_t offset)
+  @return True if bytes could be written at offset
+*/
+static bool WriteAll(int fd, const unsigned char *buffer, size_t bytes, uint64_t offset)
+{
+  while (bytes > 0)
+  {
+    ssize_t put = pwrite(fd, buffer, bytes, offset);
+    if (put <= 0)
+    {
+      if (put < 0 && errno == EINTR)
+      {
+        continue;
+      }
+      return false;
+    }
+    buffer += put;
+    bytes -= put;
+    offset += put;
+  }
+  return true;
+}
+
+/**
+  @fn static uint64_t Hash(const unsigned char *data, size_t bytes)
+  @return XXH64 of a buffer
+*/
+static uint64_t Hash(const unsigned char *data, size_t bytes)
+{
+  Xxh64 hash;
+  hash.Update(data, bytes);
+  return hash.Digest();
+}
+
+/**
+  @fn static string Card(const string &key, const string &value, const string &comment)
+  @return 80-character header card with a string value
+*/
+static string Card(const string &key, const string &value, const string &comment)
+{
+  string card = key;
+  card.resize(8, ' ');
+  card += "= '" + value + "'";
+  if (card.size() < 30)
+  {
+    card.resize(30, ' ');
+  }
+  card += " / " + comment;
+  card.resize(80, ' ');
+  return card;
+}
+
+/**
+  @fn static bool AddChecksumKeys(string &header, uint32_t dataSum)
+    @brief Sets DATASUM and CHECKSUM in a header, using blank cards after END if they are missing
+    @param header Header blocks
+    @param dataSum Sum of the HDU's data unit
+  @return False if the header has no room for the keys
+*/
+static bool AddChecksumKeys(string &header, uint32_t dataSum)
+{
+  int cards = header.size() / 80;
+  int end = -1, dataSumCard = -1, checksumCard = -1;
+  for (int i = 0; i < cards && end < 0; i++)
+  {
+    if (header.compare(i * 80, 8, "END     ") == 0)
+    {
+      end = i;
+    }
+    else if (header.compare(i * 80, 8, "DATASUM ") == 0)
+    {
+      dataSumCard = i;
+    }
+    else if (header.compare(i * 80, 8, "CHECKSUM") == 0)
+    {
+      checksumCard = i;
+    }
+  }
+  int needed = (dataSumCard < 0) + (checksumCard < 0);
+  if (end < 0 || end + needed >= cards)
+  {
+    return false;
+  }
+  if (dataSumCard < 0)
+  {
+    dataSumCard = end++;
+  }
+  if (checksumCard < 0)
+  {
+    checksumCard = end++;
+  }
+  header.replace(end * 80, 80, string("END").append(77, ' '));
+
+  // CHECKSUM is encoded so that the whole HDU, with it in place of zeros, sums to -0
+  header.replace(dataSumCard * 80, 80, Card("DATASUM", to_string(dataSum), "Data unit checksum"));
+  header.replace(checksumCard * 80, 80, Card("CHECKSUM", "0000000000000000", "HDU checksum"));
+  uint32_t sum = FitsSumAdd(FitsSum(reinterpret_cast<const unsigned char *>(header.data()), header.size(), 0), dataSum);
+  header.replace(checksumCard * 80 + 11, 16, FitsEncodeChecksum(sum));
+  return true;
+}
+
+/**
+  @fn static long long CardValue(const string &header, size_t card)
+  @return Integer value of a header card
+*/
+static long long CardValue(const string &header, size_t card)
+{
+  return atoll(header.substr(card * 80 + 10, 70).c_str());
+}
+
+/**
+  @fn static bool ReadHeader(int fd, uint64_t position, uint64_t fileBytes, string *header, uint64_t *paddedBytes)
+    @brief Reads the header of the HDU starting at position, up to END
+    @param fd File
+    @param position Offset of the HDU
+    @param fileBytes Size of the file
+    @param header Header blocks
+    @param paddedBytes Length of the HDU's data unit, padding included
+  @return False if there is no whole HDU at position (not FITS, or cut short)
+*/
+static bool ReadHeader(int fd, uint64_t position, uint64_t fileBytes, string *header, uint64_t *paddedBytes)
+{
+  bool end = false;
+  long long bitpix = 0, naxis = 0, pcount = 0, gcount = 1, pixels = 1;
+  header->clear();
+  for (int block = 0; block < FITS_MAX_HEADER_BLOCKS && !end; block++)
+  {
+    header->resize(header->size() + FITS_BLOCK_BYTES);
+    if (!ReadAll(fd, reinterpret_cast<unsigned char *>(&(*header)[header->size() - FITS_BLOCK_BYTES]),
+                 FITS_BLOCK_BYTES, position + header->size() - FITS_BLOCK_BYTES))
+    {
+      return false;
+    }
+    for (size_t card = header->size() / 80 - FITS_BLOCK_BYTES / 80; card < header->size() / 80 && !end; card++)
+    {
+      const char *text = header->data() + card * 80;
+      if (strncmp(text, "END     ", 8) == 0)
+      {
+        end = true;
+      }
+      else if (strncmp(text, "BITPIX  =", 9) == 0)
+      {
+        bitpix = CardValue(*header, card);
+      }
+      else if (strncmp(text, "NAXIS   =", 9) == 0)
+      {
+        naxis = CardValue(*header, card);
+      }
+      else if (strncmp(text, "NAXIS", 5) == 0 && text[8] == '=')
+      {
+        pixels *= CardValue(*header, card);
+      }
+      else if (strncmp(text, "PCOUNT  =", 9) == 0)
+      {
+        pcount = CardValue(*header, card);
+      }
+      else if (strncmp(text, "GCOUNT  =", 9) == 0)
+      {
+        gcount = CardValue(*header, card);
+      }
+    }
+  }
+  long long dataBytes = naxis > 0 ? llabs(bitpix) / 8 * gcount * (pcount + pixels) : 0;
+  *paddedBytes = (dataBytes + FITS_BLOCK_BYTES - 1) / FITS_BLOCK_BYTES * FITS_BLOCK_BYTES;
+  return end && position + header->size() + *paddedBytes <= fileBytes;
+}
+
+/**
+  @fn static bool CopyRange(int source, int target, uint64_t from, uint64_t to, vector<unsigned char> &buffer, uint32_t *dataSum, vector<CopySegment> *segments)
+    @brief Copies a range of a file in buffer-sized pieces, hashing each piece
+    @param source File copied
+    @param target Copy, written at the same offsets
+    @param from Start of the range
+    @param to End of the range
+    @param buffer Scratch buffer
+    @param dataSum FITS sum of the range, added to (NULL for none)
+    @param segments Pieces written
+  @return False if the range could not be read or written
+*/
+static bool CopyRange(int source, int target, uint64_t from, uint64_t to, vector<unsigned char> &buffer,
+                      uint32_t *dataSum, vector<CopySegment> *segments)
+{
+  for (uint64_t offset = from; offset < to; offset += buffer.size())
+  {
+    size_t chunk = min((uint64_t)buffer.size(), to - offset);
+    if (!ReadAll(source, buffer.data(), chunk, offset) || !WriteAll(target, buffer.data(), chunk, offset))
+    {
+      return false;
+    }
+    if (dataSum != NULL)
+    {
+      *dataSum = FitsSum(buffer.data(), chunk, *dataSum);
+    }
+    CopySegment segment = {offset, chunk, Hash(buffer.data(), chunk)};
+    segments->push_back(segment);
+  }
+  return true;
+}
+
+/**
+  @fn static void SyncDirectory(const string &directory)
+    @brief Flushes the entries of a directory, so a file renamed into it survives a crash
+    @param directory Directory
+*/
+static void SyncDirectory(const string &directory)
+{
+  int fd = open(directory.c_str(), O_RDONLY | O_DIRECTORY);
+  if (fd >= 0)
+  {
+    fsync(fd);
+    close(fd);
+  }
+}
+
+StagingMigrator::StagingMigrator(const string &stagingDir, const string &archiveDir, double limitBytes,
+                                 FrameCatalog *catalog)
+    : stagingDir(stagingDir), archiveDir(archiveDir.empty() ? "." : archiveDir), limitBytes(limitBytes),
+      catalog(catalog), manifest(NULL), busy(false), stop(false), stagedBytes(0), highWaterBytes(0), migrated(0), failed(0), retried(0),
+      checksummedHdus(0), skippedHdus(0), migratedBytes(0), migrateSeconds(0), lagSeconds(0), maxLagSeconds(0),
+      throttled(0), throttleSeconds(0)
+{
+  struct stat info;
+  if (stat(stagingDir.c_str(), &info) != 0 && mkdir(stagingDir.c_str(), 0755) != 0)
+  {
+    printf("Could not create staging directory %s: %s. Writing straight to %s.\n", stagingDir.c_str(),
+           strerror(errno), this->archiveDir.c_str());
+    return;
+  }
+  string localDir = stagingDir + "/local";
+  if (stat(localDir.c_str(), &info) != 0 && mkdir(localDir.c_str(), 0755) != 0)
+  {
+    printf("Could not create %s: %s. Writing straight to %s.\n", localDir.c_str(), strerror(errno),
+           this->archiveDir.c_str());
+    return;
+  }
+  string manifestPath = this->archiveDir + "/frames.xxh64";
+  manifest = fopen(manifestPath.c_str(), "a");
+  if (manifest == NULL)
+  {
+    printf("Could not open %s: %s. Writing straight to %s.\n", manifestPath.c_str(), strerror(errno),
+           this->archiveDir.c_str());
+    return;
+  }
+
+  // Leave headroom on the staging disk when no limit was given
+  struct statvfs space;
+  if (this->limitBytes <= 0 && statvfs(stagingDir.c_str(), &space) == 0)
+  {
+    this->limitBytes = DEFAULT_LIMIT_FRACTION * space.f_bavail * space.f_frsize;
+  }
+
+  // Files an interrupted run staged but never migrated go first
+  DIR *dir = opendir(stagingDir.c_str());
+  while (dir != NULL)
+  {
+    struct dirent *entry = readdir(dir);
+    if (entry == NULL)
+    {
+      closedir(dir);
+      break;
+    }
+    string name = stagingDir + "/" + entry->d_name;
+    if (stat(name.c_str(), &info) == 0 && S_ISREG(info.st_mode))
+    {
+      StagedFile file;
+      file.stagedName = name;
+      file.archiveName = this->archiveDir + "/" + entry->d_name;
+      file.bytes = info.st_size;
+      file.stagedTime = MonotonicSeconds();
+      file.attempts = 0;
+      FILE *recordFile = fopen(RecordName(file.archiveName).c_str(), "rb");
+      file.hasRecord = recordFile != NULL && fread(&file.record, sizeof(file.record), 1, recordFile) == 1;
+      if (recordFile != NULL)
+      {
+        fclose(recordFile);
+      }
+      queue.push_back(file);
+      stagedBytes += file.bytes;
+    }
+  }
+  highWaterBytes = stagedBytes;
+  if (!queue.empty())
+  {
+    printf("Migrating %zu files (%.1f MB) left in %s by an earlier run.\n", queue.size(), stagedBytes / 1e6,
+           stagingDir.c_str());
+  }
+  printf("Staging frames in %s (up to %.1f GB), migrating them to %s.\n", stagingDir.c_str(), this->limitBytes / 1e9,
+         this->archiveDir.c_str());
+
+  migrator = thread(&StagingMigrator::Run, this);
+}
+
+StagingMigrator::~StagingMigrator()
+{
+  if (migrator.joinable())
+  {
+    Drain();
+    {
+      lock_guard<mutex> guard(lock);
+      stop = true;
+    }
+    wake.notify_all();
+    migrator.join();
+  }
+  if (manifest != NULL)
+  {
+    fclose(manifest);
+  }
+}
+
+bool StagingMigrator::IsOpen() const
+{
+  return manifest != NULL;
+}
+
+string StagingMigrator::StagedName(const string &archiveName) const
+{
+  size_t slash = archiveName.rfind('/');
+  return stagingDir + "/" + (slash == string::npos ? archiveName : archiveName.substr(slash + 1));
+}
+
+string StagingMigrator::LocalName(const string &archiveName) const
+{
+  size_t slash = archiveName.rfind('/');
+  return stagingDir + "/local/" + (slash == string::npos ? archiveName : archiveName.substr(slash + 1));
+}
+
+/**
+  @fn string StagingMigrator::RecordName(const string &archiveName) const
+  @return File holding the catalog record of a staged file until it is migrated
+*/
+string StagingMigrator::RecordName(const string &archiveName) const
+{
+  return LocalName(archiveName) + ".catalog";
+}
+
+void StagingMigrator::Reserve(double bytes)
+{
+  unique_lock<mutex> guard(lock);
+  if (stagedBytes + bytes > limitBytes && (busy || !queue.empty()))
+  {
+    // Only now, with staging nearly full, does the writer (and behind it the capture) slow down
+    double start = MonotonicSeconds();
+    progress.wait(guard, [&] { return stagedBytes + bytes <= limitBytes || (!busy && queue.empty()); });
+    double waited = MonotonicSeconds() - start;
+    TimingSpan(PHASE_DETAIL, "Staging full", start, start + waited);
+    throttled++;
+    throttleSeconds += waited;
+  }
+  stagedBytes += bytes;
+  highWaterBytes = max(highWaterBytes, stagedBytes);
+}
+
+void StagingMigrator::Add(const string &stagedName, const string &archiveName, double reservedBytes,
+                          const CatalogRecord *record)
+{
+  struct stat info;
+  StagedFile file;
+  file.stagedName = stagedName;
+  file.archiveName = archiveName;
+  file.bytes = stat(stagedName.c_str(), &info) == 0 ? (double)info.st_size : reservedBytes;
+  file.attempts = 0;
+  file.hasRecord = record != NULL && catalog != NULL;
+  if (file.hasRecord)
+  {
+    // Kept locally, so a frame a crash leaves in staging is still cataloged when the next run migrates it
+    file.record = *record;
+    FILE *recordFile = fopen(RecordName(archiveName).c_str(), "wb");
+    if (recordFile == NULL || fwrite(record, sizeof(*record), 1, recordFile) != 1)
+    {
+      printf("Could not write %s; %s is only cataloged if this run migrates it.\n",
+             RecordName(archiveName).c_str(), archiveName.c_str());
+    }
+    if (recordFile != NULL)
+    {
+      fclose(recordFile);
+    }
+  }
+  {
+    lock_guard<mutex> guard(lock);
+    stagedBytes += file.bytes - reservedBytes;
+    highWaterBytes = max(highWaterBytes, stagedBytes);
+    file.stagedTime = MonotonicSeconds();
+    queue.push_back(file);
+  }
+  wake.notify_one();
+}
+
+void StagingMigrator::Cancel(double reservedBytes)
+{
+  {
+    lock_guard<mutex> guard(lock);
+    stagedBytes -= reservedBytes;
+  }
+  progress.notify_all();
+}
+
+void StagingMigrator::Drain()
+{
+  unique_lock<mutex> guard(lock);
+  if (!busy && queue.empty())
+  {
+    return;
+  }
+  printf("Waiting for %zu staged files to be migrated to %s.\n", queue.size() + (busy ? 1 : 0), archiveDir.c_str());
+  progress.wait(guard, [&] { return !busy && queue.empty(); });
+}
+
+/**
+  @fn void StagingMigrator::Run()
+    @brief Migrator thread: migrates the queued files one at a time, retrying failures
+*/
+void StagingMigrator::Run()
+{
+  TimingThreadName("Staging migrator");
+  unique_lock<mutex> guard(lock);
+  while (true)
+  {
+    wake.wait(guard, [&] { return stop || !queue.empty(); });
+    if (queue.empty())
+    {
+      break;
+    }
+    StagedFile file = queue.front();
+    queue.pop_front();
+    busy = true;
+    guard.unlock();
+
+    double start = MonotonicSeconds();
+    uint64_t hash = 0;
+    int checksummed = 0, skipped = 0;
+    bool ok = Migrate(file, &hash, &checksummed, &skipped);
+    if (ok && file.hasRecord && catalog != NULL)
+    {
+      catalog->Append(file.record);
+      unlink(RecordName(file.archiveName).c_str());
+    }
+    double end = MonotonicSeconds();
+    TimingSpan(PHASE_DETAIL, "Staging migration", start, end);
+    if (!ok && file.attempts + 1 < MAX_ATTEMPTS)
+    {
+      this_thread::sleep_for(chrono::seconds(1)); // Give a hiccup of the archive mount time to pass
+    }
+
+    guard.lock();
+    busy = false;
+    migrateSeconds += end - start;
+    if (ok)
+    {
+      size_t slash = file.archiveName.rfind('/');
+      fprintf(manifest, "%016llx  %s\n", (unsigned long long)hash, file.archiveName.substr(slash + 1).c_str());
+      fflush(manifest);
+      migrated++;
+      migratedBytes += file.bytes;
+      checksummedHdus += checksummed;
+      skippedHdus += skipped;
+      lagSeconds += end - file.stagedTime;
+      maxLagSeconds = max(maxLagSeconds, end - file.stagedTime);
+      stagedBytes -= file.bytes;
+    }
+    else if (++file.attempts < MAX_ATTEMPTS)
+    {
+      retried++;
+      queue.push_back(file);
+    }
+    else
+    {
+      printf("Giving up on migrating %s; it stays in staging until the next run.\n", file.stagedName.c_str());
+      failed++;
+      stagedBytes -= file.bytes;
+    }
+    progress.notify_all();
+  }
+}
+
+/**
+  @fn bool StagingMigrator::Migrate(const StagedFile &file, uint64_t *hash, int *checksummed, int *skipped)
+    @brief Copies a staged file to the archive with checksum keys added, verifies the copy, and removes the staged file
+    @param file File to migrate
+    @param hash XXH64 of the archive copy
+    @param checksummed HDUs given DATASUM and CHECKSUM
+    @param skipped HDUs without room for them
+  @return False if the file could not be migrated (the staged file is kept)
+*/
+bool StagingMigrator::Migrate(const StagedFile &file, uint64_t *hash, int *checksummed, int *skipped)
+{
+  int source = open(file.stagedName.c_str(), O_RDONLY);
+  struct stat info;
+  if (source < 0 || fstat(source, &info) != 0)
+  {
+    printf("Could not open staged file %s: %s.\n", file.stagedName.c_str(), strerror(errno));
+    if (source >= 0)
+    {
+      close(source);
+    }
+    return false;
+  }
+  uint64_t fileBytes = info.st_size;
+  posix_fadvise(source, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+  // Copy each HDU's data unit while summing it, then write its header with the checksum keys over the space left
+  // for it, so the staged file is read only once
+  string partName = file.archiveName + ".part";
+  int target = open(partName.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (target < 0)
+  {
+    printf("Could not create %s: %s.\n", partName.c_str(), strerror(errno));
+    close(source);
+    return false;
+  }
+  vector<unsigned char> buffer(COPY_CHUNK_BYTES);
+  vector<CopySegment> segments;
+  bool ok = true;
+  uint64_t position = 0;
+  while (ok && position < fileBytes)
+  {
+    string header;
+    uint64_t paddedBytes;
+    if (!ReadHeader(source, position, fileBytes, &header, &paddedBytes))
+    {
+      ok = CopyRange(source, target, position, fileBytes, buffer, NULL, &segments); // Not FITS from here on
+      break;
+    }
+    uint64_t dataStart = position + header.size();
+    uint32_t dataSum = 0;
+    ok = CopyRange(source, target, dataStart, dataStart + paddedBytes, buffer, &dataSum, &segments);
+    if (AddChecksumKeys(header, dataSum))
+    {
+      (*checksummed)++;
+    }
+    else
+    {
+      (*skipped)++;
+    }
+    const unsigned char *headerBytes = reinterpret_cast<const unsigned char *>(header.data());
+    ok = ok && WriteAll(target, headerBytes, header.size(), position);
+    CopySegment segment = {position, header.size(), Hash(headerBytes, header.size())};
+    segments.push_back(segment);
+    position = dataStart + paddedBytes;
+  }
+  close(source);
+  ok = ok && fsync(target) == 0;
+  posix_fadvise(target, 0, 0, POSIX_FADV_DONTNEED); // So the check below reads what reached the archive
+  ok = close(target) == 0 && ok;
+
+  // Read the copy back in order, checking every piece, and hash the whole file for the manifest
+  sort(segments.begin(), segments.end(),
+       [](const CopySegment &a, const CopySegment &b) { return a.offset < b.offset; });
+  Xxh64 readBack;
+  int check = ok ? open(partName.c_str(), O_RDONLY) : -1;
+  ok = ok && check >= 0;
+  for (size_t i = 0; i < segments.size() && ok; i++)
+  {
+    const CopySegment &segment = segments[i];
+    buffer.resize(max(buffer.size(), (size_t)segment.bytes));
+    ok = ReadAll(check, buffer.data(), segment.bytes, segment.offset) &&
+         Hash(buffer.data(), segment.bytes) == segment.hash;
+    readBack.Update(buffer.data(), segment.bytes);
+  }
+  if (check >= 0)
+  {
+    close(check);
+  }
+  if (!ok)
+  {
+    printf("Could not migrate %s to %s.\n", file.stagedName.c_str(), file.archiveName.c_str());
+    unlink(partName.c_str());
+    return false;
+  }
+
+  // Only a verified copy replaces the staged file
+  if (rename(partName.c_str(), file.archiveName.c_str()) != 0)
+  {
+    printf("Could not rename %s: %s.\n", partName.c_str(), strerror(errno));
+    unlink(partName.c_str());
+    return false;
+  }
+  SyncDirectory(archiveDir);
+  unlink(file.stagedName.c_str());
+  *hash = readBack.Digest();
+  return true;
+}
+
+void StagingMigrator::PrintStats()
+{
+  lock_guard<mutex> guard(lock);
+  if (manifest == NULL)
+  {
+    return;
+  }
+  printf("Staging: %lu files (%.1f MB) migrated to %s, %lu retried, %lu left in staging. Migration %.1f MB/s, lag "
+         "%.2f s mean, %.2f s max. Staging high-water mark %.1f MB of %.1f MB; writers waited for room %lu times "
+         "(%.1f s).\n",
+         migrated, migratedBytes / 1e6, archiveDir.c_str(), retried, failed,
+         migrateSeconds > 0 ? migratedBytes / 1e6 / migrateSeconds : 0.0, migrated > 0 ? lagSeconds / migrated : 0.0,
+         maxLagSeconds, highWaterBytes / 1e6, limitBytes / 1e6, throttled, throttleSeconds);
+  printf("FITS checksums (%s kernel) added to %lu HDUs, %lu without room in their header.\n", FitsChecksumKernel(),
+         checksummedHdus, skippedHdus);
+}
@@ -0,0 +1,158 @@
+/**
+ * @file StagingMigrator.h
+ *
+ * @brief Local staging of the frames written, with background migration to the archive directory.
+ * The writers put each frame in a fast local staging directory instead of the archive (typically a network mount),
+ * so a stall of the archive never delays the next exposure. A migrator thread copies each staged file to the archive
+ * in large sequential reads and writes, reading the staged file only once. It sums each HDU's data unit (SSE2 or
+ * AVX2) as it copies it, then writes the HDU's header into the space left for it, with the FITS DATASUM and CHECKSUM
+ * keys added or updated where there is room for them, so the data never moves. Every piece written is hashed (XXH64).
+ * It then reads the archive copy back, checks each piece, renames the copy into place, removes the staged file, and
+ * appends the hash of the whole copy to `frames.xxh64` in the archive directory (the format `xxhsum -c` checks). A staged frame's catalog record is appended to the archive's catalog only then, so nothing but
+ * the migrator touches the archive. Until then the record waits in the `local` subdirectory of staging, which also
+ * holds files that stay local (the sweep journal) and is never migrated. Writers wait only when the staged bytes not
+ * yet migrated would exceed the staging limit. Files left in staging by an earlier run are migrated first.
+ *
+ */
+
+#ifndef STAGINGMIGRATOR_H
+#define STAGINGMIGRATOR_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include "FrameCatalog.h"
+
+/**
+  @class StagingMigrator
+    @brief Staging directory and the thread migrating its files to the archive. Shared by every camera's writers.
+*/
+class StagingMigrator
+{
+public:
+  /**
+    @fn StagingMigrator(const std::string &stagingDir, const std::string &archiveDir, double limitBytes, FrameCatalog *catalog)
+      @brief Starts the migrator thread and queues the files an earlier run left in staging
+      @param stagingDir Local staging directory
+      @param archiveDir Directory the files end up in
+      @param limitBytes Staged bytes not yet migrated above which writers wait (0 for 90% of the free space of staging)
+      @param catalog Catalog of the archive directory the records of migrated frames are appended to (NULL for none)
+  */
+  StagingMigrator(const std::string &stagingDir, const std::string &archiveDir, double limitBytes,
+                  FrameCatalog *catalog);
+
+  /**
+    @fn ~StagingMigrator()
+      @brief Migrates the files still queued, then stops the thread
+  */
+  ~StagingMigrator();
+
+  /**
+    @fn bool IsOpen() const
+    @return True if the staging directory and the migration manifest are usable
+  */
+  bool IsOpen() const;
+
+  /**
+    @fn std::string StagedName(const std::string &archiveName) const
+    @return Staging file a frame headed for the archive is written to
+  */
+  std::string StagedName(const std::string &archiveName) const;
+
+  /**
+    @fn std::string LocalName(const std::string &archiveName) const
+    @return File in staging that is never migrated, for a file that would otherwise go to the archive
+  */
+  std::string LocalName(const std::string &archiveName) const;
+
+  /**
+    @fn void Reserve(double bytes)
+      @brief Waits until a frame fits under the staging limit, then counts it as staged. Called by the writers.
+      @param bytes Expected file size
+  */
+  void Reserve(double bytes);
+
+  /**
+    @fn void Add(const std::string &stagedName, const std::string &archiveName, double reservedBytes, const CatalogRecord *record)
+      @brief Queues a staged file for migration
+      @param stagedName File written to staging
+      @param archiveName Where it goes
+      @param reservedBytes Bytes passed to Reserve for it (0 for none)
+      @param record Catalog record to append once the file is in the archive (NULL for none)
+  */
+  void Add(const std::string &stagedName, const std::string &archiveName, double reservedBytes,
+           const CatalogRecord *record);
+
+  /**
+    @fn void Cancel(double reservedBytes)
+      @brief Releases a reservation whose frame could not be written
+      @param reservedBytes Bytes passed to Reserve
+  */
+  void Cancel(double reservedBytes);
+
+  /**
+    @fn void Drain()
+      @brief Waits until every queued file has been migrated (or has failed)
+  */
+  void Drain();
+
+  /**
+    @fn void PrintStats()
+      @brief Prints the files migrated, the lag and throughput of migration, and the staging high-water mark
+  */
+  void PrintStats();
+
+private:
+  /**
+    @struct StagedFile
+      @brief A file waiting in staging
+  */
+  struct StagedFile
+  {
+    std::string stagedName;  // File in staging
+    std::string archiveName; // Where it goes
+    double bytes;            // Bytes counted against the staging limit
+    double stagedTime;       // When it was queued (MonotonicSeconds)
+    int attempts;            // Failed migrations so far
+    bool hasRecord;          // The file is cataloged once migrated
+    CatalogRecord record;    // Its catalog record (also kept in RecordName until then)
+  };
+
+  std::string RecordName(const std::string &archiveName) const;
+  void Run();
+  bool Migrate(const StagedFile &file, uint64_t *hash, int *checksummed, int *skipped);
+
+  std::string stagingDir;
+  std::string archiveDir;
+  double limitBytes;                 // Staged bytes above which writers wait
+  FrameCatalog *catalog;             // Catalog of the archive directory (NULL for none)
+  FILE *manifest;                    // Hash of every file migrated (frames.xxh64 in the archive)
+  std::mutex lock;
+  std::condition_variable wake;      // Signals the migrator: a file was queued, or stop
+  std::condition_variable progress;  // Signals writers and Drain: a file left staging
+  std::deque<StagedFile> queue;      // Files waiting for migration
+  bool busy;                         // A file is being migrated
+  bool stop;
+  std::thread migrator;
+
+  // Statistics
+  double stagedBytes;                // Bytes in staging or reserved for it
+  double highWaterBytes;             // Most bytes staged at once
+  unsigned long migrated;
+  unsigned long failed;
+  unsigned long retried;
+  unsigned long checksummedHdus;     // HDUs given DATASUM and CHECKSUM
+  unsigned long skippedHdus;         // HDUs without room in their header for the keys
+  double migratedBytes;
+  double migrateSeconds;             // Time spent migrating
+  double lagSeconds;                 // Total time from staging to archive
+  double maxLagSeconds;
+  unsigned long throttled;           // Frames whose writer waited for room in staging
+  double throttleSeconds;            // Time writers waited
+};
+
+#endif
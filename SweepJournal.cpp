@@ -0,0 +1,221 @@
+/**
+ * @file SweepJournal.cpp
+ *
+ * @brief Crash-safe record of the images a sweep has taken.
+ *
+ */
+
+// Dependencies
+#include "SweepJournal.h"
+#include "FrameWriter.h"
+#include "Timing.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+
+using namespace std;
+
+/**
+  @fn static string SettingKey(double tempSetting, int filter, int offsetSetting, int gainSetting, int exposureUs, int readMode)
+    @brief Formats a setting the way it is written in the journal
+  @return Setting fields separated by spaces
+*/
+static string SettingKey(double tempSetting, int filter, int offsetSetting, int gainSetting, int exposureUs,
+                         int readMode)
+{
+  char key[128];
+  snprintf(key, sizeof(key), "%.2f %d %d %d %d %d", tempSetting, filter, offsetSetting, gainSetting, exposureUs,
+           readMode);
+  return key;
+}
+
+/**
+  @fn static void SyncPath(const string &path, bool directory)
+    @brief Flushes a file, or the entry of a new file in its directory, to disk
+    @param path File or directory
+    @param directory True to sync the directory entries rather than the data
+*/
+static void SyncPath(const string &path, bool directory)
+{
+  int fd = open(path.c_str(), directory ? O_RDONLY | O_DIRECTORY : O_RDONLY);
+  if (fd < 0)
+  {
+    return;
+  }
+  if (directory)
+  {
+    fsync(fd);
+  }
+  else
+  {
+    fdatasync(fd);
+  }
+  close(fd);
+}
+
+SweepJournal::SweepJournal(const string &path, bool resume) : path(path), fd(-1), recorded(0), syncSeconds(0)
+{
+  // Entries since the last start of a sweep whose images are still on disk
+  if (resume)
+  {
+    ifstream file(path.c_str());
+    string line;
+    while (getline(file, line))
+    {
+      if (line.compare(0, 15, "# sweep started") == 0)
+      {
+        completed.clear();
+        continue;
+      }
+      if (line.empty() || line[0] == '#')
+      {
+        continue;
+      }
+      istringstream fields(line);
+      double tempSetting;
+      int filter, offsetSetting, gainSetting, exposureUs, readMode, repeat;
+      string checksum, fileName;
+      if (!(fields >> tempSetting >> filter >> offsetSetting >> gainSetting >> exposureUs >> readMode >> repeat >>
+            checksum) ||
+          !getline(fields >> ws, fileName))
+      {
+        continue; // Torn by the crash
+      }
+      struct stat fileInfo;
+      if (stat(fileName.c_str(), &fileInfo) != 0)
+      {
+        continue; // Image removed since; take it again
+      }
+      completed[SettingKey(tempSetting, filter, offsetSetting, gainSetting, exposureUs, readMode)].insert(repeat);
+    }
+  }
+
+  fd = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+  if (fd < 0)
+  {
+    printf("Could not open sweep journal %s: %s. The sweep will not be resumable.\n", path.c_str(), strerror(errno));
+    return;
+  }
+
+  // Start on a fresh line if the last entry was torn, and mark where this run begins
+  string marker;
+  struct stat journalInfo;
+  if (fstat(fd, &journalInfo) == 0 && journalInfo.st_size == 0)
+  {
+    marker = "# temp filter offset gain exposure_us read_mode repeat crc32 file\n";
+  }
+  else
+  {
+    char last = '\n';
+    int readFd = open(path.c_str(), O_RDONLY);
+    if (readFd >= 0)
+    {
+      if (pread(readFd, &last, 1, journalInfo.st_size - 1) != 1)
+      {
+        last = '\n';
+      }
+      close(readFd);
+    }
+    if (last != '\n')
+    {
+      marker = "\n";
+    }
+  }
+  char start[64];
+  snprintf(start, sizeof(start), "# sweep %s %ld\n", resume ? "resumed" : "started", (long)time(NULL));
+  marker += start;
+  if (write(fd, marker.data(), marker.size()) != (ssize_t)marker.size())
+  {
+    printf("Could not write to sweep journal %s.\n", path.c_str());
+  }
+  fdatasync(fd);
+}
+
+SweepJournal::~SweepJournal()
+{
+  if (fd >= 0)
+  {
+    close(fd);
+  }
+}
+
+bool SweepJournal::IsOpen() const
+{
+  return fd >= 0;
+}
+
+int SweepJournal::SkipCompleted(vector<SweepBlock> &plan, int readMode)
+{
+  int skipped = 0;
+  vector<SweepBlock> remaining;
+  for (size_t b = 0; b < plan.size(); b++)
+  {
+    SweepBlock block = plan[b];
+    string key = SettingKey(block.tempSetting, block.filter, block.offsetSetting, block.gainSetting,
+                            (int)(block.exposureSeconds * 1000000), readMode);
+    map<string, set<int>>::const_iterator done = completed.find(key);
+    if (done != completed.end())
+    {
+      int taken = min((int)done->second.size(), block.repeats);
+      skipped += taken;
+      block.repeats -= taken;
+      block.firstRepeat = *done->second.rbegin() + 1; // Never reuse the number of an image on disk
+    }
+    if (block.repeats > 0)
+    {
+      remaining.push_back(block);
+    }
+  }
+  plan.swap(remaining);
+  return skipped;
+}
+
+void SweepJournal::Record(const FrameJob &job)
+{
+  if (fd < 0)
+  {
+    return;
+  }
+
+  // The image must be on disk before its entry is
+  double start = MonotonicSeconds();
+  const string &writtenName = job.stagedName.empty() ? job.fileName : job.stagedName;
+  SyncPath(writtenName, false);
+  size_t slash = writtenName.rfind('/');
+  SyncPath(slash == string::npos ? "." : writtenName.substr(0, slash + 1), true);
+
+  char checksum[16];
+  snprintf(checksum, sizeof(checksum), "%08x", job.checksum);
+  string entry = SettingKey(job.tempSetting, job.filter, job.offsetSetting, job.gainSetting, (int)job.exposureTime,
+                            job.readMode) +
+                 " " + to_string(job.repeat) + " " + checksum + " " + job.fileName + "\n";
+
+  // One write per entry, so entries from different writer threads never interleave
+  lock_guard<mutex> guard(lock);
+  if (write(fd, entry.data(), entry.size()) != (ssize_t)entry.size())
+  {
+    printf("Could not record %s in the sweep journal.\n", job.fileName.c_str());
+  }
+  fdatasync(fd);
+  double end = MonotonicSeconds();
+  TimingSpan(PHASE_DETAIL, "Journal sync", start, end);
+  syncSeconds += end - start;
+  recorded++;
+}
+
+void SweepJournal::PrintStats()
+{
+  lock_guard<mutex> guard(lock);
+  if (fd < 0)
+  {
+    return;
+  }
+  printf("Sweep journal %s: %lu images recorded, %.2f s spent syncing.\n", path.c_str(), recorded, syncSeconds);
+}
@@ -0,0 +1,78 @@
+/**
+ * @file SweepJournal.h
+ *
+ * @brief Crash-safe record of the images a sweep has taken.
+ * Once an image is on disk, its file is synced and a line with its setting, repeat number, CRC-32 and file name is
+ * appended to the journal and synced too, so after a crash the journal lists exactly the images that survived.
+ * Each run appends a start marker; a resumed run reads the entries since the last start and drops the work they
+ * cover from the sweep plan, so only the images that were lost are taken again.
+ *
+ */
+
+#ifndef SWEEPJOURNAL_H
+#define SWEEPJOURNAL_H
+
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+#include "SweepPlan.h"
+
+struct FrameJob;
+
+/**
+  @class SweepJournal
+    @brief Append-only, synced journal of the images written in a sweep. Record is called by the writer threads.
+*/
+class SweepJournal
+{
+public:
+  /**
+    @fn SweepJournal(const std::string &path, bool resume)
+      @brief Opens the journal for appending, creating it if needed, and marks the start of a run
+      @param path Journal file
+      @param resume True to load the images taken since the last start of a sweep, and continue that sweep
+  */
+  SweepJournal(const std::string &path, bool resume);
+  ~SweepJournal();
+
+  /**
+    @fn bool IsOpen() const
+    @return True if the journal could be opened
+  */
+  bool IsOpen() const;
+
+  /**
+    @fn int SkipCompleted(std::vector<SweepBlock> &plan, int readMode)
+      @brief Removes the images already journaled from the plan: finished blocks are dropped, and the others take
+             only their remaining repeats, numbered after the highest repeat already taken
+      @param plan Unscheduled plan
+      @param readMode Camera readmode of the sweep
+    @return Images skipped
+  */
+  int SkipCompleted(std::vector<SweepBlock> &plan, int readMode);
+
+  /**
+    @fn void Record(const FrameJob &job)
+      @brief Syncs a written image to disk, then appends and syncs its entry
+      @param job Image that was written successfully (with its checksum)
+  */
+  void Record(const FrameJob &job);
+
+  /**
+    @fn void PrintStats()
+      @brief Prints the images recorded and the time spent syncing
+  */
+  void PrintStats();
+
+private:
+  std::string path;                                  // Journal file
+  int fd;                                            // Journal opened for appending (-1 if it could not be)
+  std::map<std::string, std::set<int>> completed;    // Repeats journaled per setting (on resume)
+  std::mutex lock;
+  unsigned long recorded;                            // Entries appended by this run
+  double syncSeconds;                                // Time spent syncing images and entries
+};
+
+#endif
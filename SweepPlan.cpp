@@ -0,0 +1,313 @@
+/**
+ * @file SweepPlan.cpp
+ *
+ * @brief Sweep planning and cost-aware scheduling.
+ *
+ */
+
+// Dependencies
+#include "SweepPlan.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <cmath>
+
+using namespace std;
+
+SweepCostModel DefaultCostModel()
+{
+  SweepCostModel model;
+  model.coolRate = 2.0;
+  model.heatRate = 2.0;
+  model.settleSeconds = 30.0;
+  model.filterSlotSeconds = 2.0;
+  model.filterSlots = 7;
+  model.modeSwitchSeconds = 2.0;
+  model.paramSeconds = 0.05;
+  model.readoutSeconds = 2.0;
+  model.liveFrameSeconds = 0.25;
+  return model;
+}
+
+vector<SweepBlock> BuildSweepPlan(const vector<double> &temps, const vector<int> &filters, const vector<int> &offsets,
+                                  const vector<int> &gains, const vector<double> &exposures, int repeats,
+                                  double liveMaxExposure)
+{
+  vector<SweepBlock> plan;
+  for (size_t t = 0; t < temps.size(); t++)
+  {
+    for (size_t f = 0; f < filters.size(); f++)
+    {
+      for (size_t o = 0; o < offsets.size(); o++)
+      {
+        for (size_t g = 0; g < gains.size(); g++)
+        {
+          for (size_t e = 0; e < exposures.size(); e++)
+          {
+            SweepBlock block;
+            block.tempSetting = temps[t];
+            block.filter = filters[f];
+            block.liveMode = liveMaxExposure >= 0 && exposures[e] <= liveMaxExposure;
+            block.offsetSetting = offsets[o];
+            block.gainSetting = gains[g];
+            block.exposureSeconds = exposures[e];
+            block.repeats = repeats;
+            block.firstRepeat = 0;
+            block.changes = CHANGE_ALL;
+            block.estimatedSeconds = 0;
+            block.achievedSeconds = 0;
+            plan.push_back(block);
+          }
+        }
+      }
+    }
+  }
+  return plan;
+}
+
+int FilterDistance(int from, int to, int slots)
+{
+  if (slots <= 0 || from == to)
+  {
+    return 0;
+  }
+  if (from < 0)
+  {
+    return slots / 2; // Unknown position: assume an average move
+  }
+  int distance = abs(to - from) % slots;
+  return min(distance, slots - distance);
+}
+
+// Levels of the schedule, from the most to the least expensive to change
+enum ScheduleLevel
+{
+  LEVEL_TEMP,
+  LEVEL_FILTER,
+  LEVEL_MODE,
+  LEVEL_OFFSET,
+  LEVEL_GAIN,
+  LEVEL_EXPOSURE,
+  LEVEL_COUNT
+};
+
+/**
+  @fn static double LevelValue(const SweepBlock &block, int level)
+  @return The block's setting at a schedule level
+*/
+static double LevelValue(const SweepBlock &block, int level)
+{
+  switch (level)
+  {
+  case LEVEL_TEMP:
+    return block.tempSetting;
+  case LEVEL_FILTER:
+    return block.filter;
+  case LEVEL_MODE:
+    return block.liveMode;
+  case LEVEL_OFFSET:
+    return block.offsetSetting;
+  case LEVEL_GAIN:
+    return block.gainSetting;
+  default:
+    return block.exposureSeconds;
+  }
+}
+
+/**
+  @fn static void OrderLevel(vector<SweepBlock> &blocks, int level, const SweepCostModel &model, SweepBlock &current)
+    @brief Recursively orders blocks: groups them by the setting at this level, orders the groups, then orders within each group
+    @param blocks Blocks sharing the settings of all earlier levels
+    @param level Schedule level to order by
+    @param model Cost model (for the filter wheel size)
+    @param current Settings the camera will be at before the first block; updated to the last block
+*/
+static void OrderLevel(vector<SweepBlock> &blocks, int level, const SweepCostModel &model, SweepBlock &current)
+{
+  if (level == LEVEL_COUNT || blocks.empty())
+  {
+    if (!blocks.empty())
+    {
+      current = blocks.back();
+    }
+    return;
+  }
+
+  // Distinct values at this level, ascending
+  vector<double> values;
+  for (size_t i = 0; i < blocks.size(); i++)
+  {
+    values.push_back(LevelValue(blocks[i], level));
+  }
+  sort(values.begin(), values.end());
+  values.erase(unique(values.begin(), values.end()), values.end());
+
+  vector<double> order;
+  if (level == LEVEL_TEMP)
+  {
+    // Cool monotonically: warmest first
+    order.assign(values.rbegin(), values.rend());
+  }
+  else if (level == LEVEL_FILTER)
+  {
+    // Nearest slot next, the short way round the wheel
+    int position = current.filter;
+    while (!values.empty())
+    {
+      size_t best = 0;
+      for (size_t i = 1; i < values.size(); i++)
+      {
+        if (FilterDistance(position, (int)values[i], model.filterSlots) <
+            FilterDistance(position, (int)values[best], model.filterSlots))
+        {
+          best = i;
+        }
+      }
+      position = (int)values[best];
+      order.push_back(values[best]);
+      values.erase(values.begin() + best);
+    }
+  }
+  else
+  {
+    // Sweep from whichever end is nearer the current value, so neighbouring groups snake back and forth
+    double now = LevelValue(current, level);
+    if (fabs(values.back() - now) < fabs(values.front() - now))
+    {
+      order.assign(values.rbegin(), values.rend());
+    }
+    else
+    {
+      order = values;
+    }
+  }
+
+  vector<SweepBlock> ordered;
+  for (size_t v = 0; v < order.size(); v++)
+  {
+    vector<SweepBlock> group;
+    for (size_t i = 0; i < blocks.size(); i++)
+    {
+      if (LevelValue(blocks[i], level) == order[v])
+      {
+        group.push_back(blocks[i]);
+      }
+    }
+    OrderLevel(group, level + 1, model, current);
+    ordered.insert(ordered.end(), group.begin(), group.end());
+  }
+  blocks.swap(ordered);
+}
+
+void ScheduleSweep(vector<SweepBlock> &plan, const SweepCostModel &model, double startTemp, int startFilter)
+{
+  SweepBlock current = plan.empty() ? SweepBlock() : plan.front();
+  current.tempSetting = startTemp;
+  current.filter = startFilter;
+  current.liveMode = 0;
+  OrderLevel(plan, LEVEL_TEMP, model, current);
+  EstimateSweep(plan, model, startTemp, startFilter);
+}
+
+double EstimateSweep(vector<SweepBlock> &plan, const SweepCostModel &model, double startTemp, int startFilter)
+{
+  double total = 0;
+  double temp = startTemp;
+  int filter = startFilter;
+  int liveMode = 0;
+
+  for (size_t b = 0; b < plan.size(); b++)
+  {
+    SweepBlock &block = plan[b];
+    const SweepBlock *previous = b > 0 ? &plan[b - 1] : 0;
+    double seconds = 0;
+
+    // Only settings that actually differ from the previous block are sent to the camera
+    block.changes = 0;
+    if (b == 0 || block.tempSetting != temp)
+    {
+      block.changes |= CHANGE_TEMP;
+    }
+    if (block.filter != filter)
+    {
+      block.changes |= CHANGE_FILTER;
+    }
+    if (block.liveMode != liveMode)
+    {
+      block.changes |= CHANGE_MODE | CHANGE_OFFSET | CHANGE_GAIN | CHANGE_EXPOSURE; // Re-initialization resets them
+    }
+    if (!previous || block.offsetSetting != previous->offsetSetting)
+    {
+      block.changes |= CHANGE_OFFSET;
+    }
+    if (!previous || block.gainSetting != previous->gainSetting)
+    {
+      block.changes |= CHANGE_GAIN;
+    }
+    if (!previous || block.exposureSeconds != previous->exposureSeconds)
+    {
+      block.changes |= CHANGE_EXPOSURE;
+    }
+
+    // Transitions: the filter wheel moves in the background while settings are sent and the temperature settles
+    double transition = 0;
+    double delta = block.tempSetting - temp;
+    if (delta < 0)
+    {
+      transition += -delta / model.coolRate * 60 + model.settleSeconds;
+    }
+    else if (delta > 0)
+    {
+      transition += delta / model.heatRate * 60 + model.settleSeconds;
+    }
+    for (int change = CHANGE_OFFSET; change <= CHANGE_EXPOSURE; change <<= 1)
+    {
+      if (block.changes & change)
+      {
+        transition += model.paramSeconds;
+      }
+    }
+    seconds += max(transition, FilterDistance(filter, block.filter, model.filterSlots) * model.filterSlotSeconds);
+    if (block.changes & CHANGE_MODE)
+    {
+      seconds += model.modeSwitchSeconds;
+    }
+
+    // Images
+    if (block.liveMode)
+    {
+      seconds += block.exposureSeconds + block.repeats * max(block.exposureSeconds, model.liveFrameSeconds);
+    }
+    else
+    {
+      seconds += block.repeats * (block.exposureSeconds + model.readoutSeconds);
+    }
+
+    block.estimatedSeconds = seconds;
+    total += seconds;
+    temp = block.tempSetting;
+    filter = block.filter;
+    liveMode = block.liveMode;
+  }
+  return total;
+}
+
+void PrintSweepReport(const vector<SweepBlock> &plan)
+{
+  double estimated = 0;
+  double achieved = 0;
+
+  printf(" \n");
+  printf("%5s %7s %6s %6s %6s %5s %9s %7s %13s %12s\n", "Block", "Temp", "Filter", "Mode", "Offset", "Gain", "Exp (s)",
+         "Images", "Estimated (s)", "Achieved (s)");
+  for (size_t b = 0; b < plan.size(); b++)
+  {
+    const SweepBlock &block = plan[b];
+    printf("%5zu %7.2f %6d %6s %6d %5d %9.3f %7d %13.1f %12.1f\n", b + 1, block.tempSetting, block.filter,
+           block.liveMode ? "live" : "single", block.offsetSetting, block.gainSetting, block.exposureSeconds,
+           block.repeats, block.estimatedSeconds, block.achievedSeconds);
+    estimated += block.estimatedSeconds;
+    achieved += block.achievedSeconds;
+  }
+  printf("Sweep estimated at %.1f s, took %.1f s.\n", estimated, achieved);
+}
@@ -0,0 +1,125 @@
+/**
+ * @file SweepPlan.h
+ *
+ * @brief Sweep planning and cost-aware scheduling.
+ * The sweep over temperature, filter, offset, gain and exposure is expanded into blocks (one per unique
+ * setting, each taking howManyTimesToRun images) and ordered to minimize the estimated wall time:
+ * temperatures are visited while cooling monotonically, blocks are grouped by filter and camera mode,
+ * and neighbouring blocks differ in as few settings as possible.
+ *
+ */
+
+#ifndef SWEEPPLAN_H
+#define SWEEPPLAN_H
+
+#include <vector>
+
+// Settings that change between one block and the next
+enum SweepChange
+{
+  CHANGE_TEMP = 1,
+  CHANGE_FILTER = 2,
+  CHANGE_MODE = 4,
+  CHANGE_OFFSET = 8,
+  CHANGE_GAIN = 16,
+  CHANGE_EXPOSURE = 32,
+  CHANGE_ALL = 63
+};
+
+/**
+  @struct SweepBlock
+    @brief One unique setting of the sweep and the images to take at it
+*/
+struct SweepBlock
+{
+  double tempSetting;       // Temperature (Celsius)
+  int filter;               // Filter wheel position
+  int liveMode;             // 1 to take the images in live mode
+  int offsetSetting;        // Offset setting
+  int gainSetting;          // Gain setting
+  double exposureSeconds;   // Exposure time (seconds)
+  int repeats;              // Images to take
+  int firstRepeat;          // Number of the first image (past those already taken when a sweep is resumed)
+  int changes;              // SweepChange flags relative to the previous block
+  double estimatedSeconds;  // Estimated time for the block, including its transitions
+  double achievedSeconds;   // Measured time for the block
+};
+
+/**
+  @struct SweepCostModel
+    @brief Estimated cost of each hardware transition and of taking an image
+*/
+struct SweepCostModel
+{
+  double coolRate;          // Cooling rate (Celsius per minute)
+  double heatRate;          // Warming rate (Celsius per minute)
+  double settleSeconds;     // Time to settle within the error range after a temperature change
+  double filterSlotSeconds; // Filter wheel move time per slot
+  int filterSlots;          // Slots on the filter wheel
+  double modeSwitchSeconds; // Time to switch between single frame and live mode
+  double paramSeconds;      // Time for one gain/offset/exposure write
+  double readoutSeconds;    // Single frame readout time
+  double liveFrameSeconds;  // Shortest frame period in live mode
+};
+
+/**
+  @fn int FilterDistance(int from, int to, int slots)
+    @brief Slots the filter wheel passes when moving the short way round
+    @param from Current position (-1 if unknown)
+    @param to Target position
+    @param slots Slots on the wheel
+  @return Number of slots moved
+*/
+int FilterDistance(int from, int to, int slots);
+
+/**
+  @fn SweepCostModel DefaultCostModel()
+  @return Cost model with typical values for a QHY600M
+*/
+SweepCostModel DefaultCostModel();
+
+/**
+  @fn std::vector<SweepBlock> BuildSweepPlan(const std::vector<double> &temps, const std::vector<int> &filters, const std::vector<int> &offsets, const std::vector<int> &gains, const std::vector<double> &exposures, int repeats, double liveMaxExposure)
+    @brief Expands the sweep lists into blocks, in the order the nested loops used to visit them
+    @param temps Temperatures (Celsius)
+    @param filters Filter wheel positions
+    @param offsets Offset settings
+    @param gains Gain settings
+    @param exposures Exposure times (seconds)
+    @param repeats Images to take at each setting
+    @param liveMaxExposure Exposures up to this many seconds use live mode (-1 for never)
+  @return Unscheduled plan
+*/
+std::vector<SweepBlock> BuildSweepPlan(const std::vector<double> &temps, const std::vector<int> &filters,
+                                       const std::vector<int> &offsets, const std::vector<int> &gains,
+                                       const std::vector<double> &exposures, int repeats, double liveMaxExposure);
+
+/**
+  @fn void ScheduleSweep(std::vector<SweepBlock> &plan, const SweepCostModel &model, double startTemp, int startFilter)
+    @brief Orders the plan to minimize estimated wall time and fills in changes and estimatedSeconds
+    @param plan Plan to reorder
+    @param model Cost model
+    @param startTemp Current sensor temperature
+    @param startFilter Current filter wheel position (-1 if unknown or no wheel)
+*/
+void ScheduleSweep(std::vector<SweepBlock> &plan, const SweepCostModel &model, double startTemp, int startFilter);
+
+/**
+  @fn double EstimateSweep(std::vector<SweepBlock> &plan, const SweepCostModel &model, double startTemp, int startFilter)
+    @brief Fills in changes and estimatedSeconds for the plan in its current order
+    @param plan Plan to estimate
+    @param model Cost model
+    @param startTemp Current sensor temperature
+    @param startFilter Current filter wheel position (-1 if unknown or no wheel)
+  @return Estimated total time in seconds
+*/
+double EstimateSweep(std::vector<SweepBlock> &plan, const SweepCostModel &model, double startTemp, int startFilter);
+
+/**
+  @fn void PrintSweepReport(const std::vector<SweepBlock> &plan)
+    @brief Prints the estimated and achieved time of every block and of the whole sweep
+    @param plan Executed plan
+*/
+void PrintSweepReport(const std::vector<SweepBlock> &plan);
+
+#endif
@@ -0,0 +1,186 @@
+/**
+ * @file TempMonitor.cpp
+ *
+ * @brief Background temperature telemetry.
+ *
+ */
+
+// Dependencies
+#include "TempMonitor.h"
+#include "Timing.h"
+#include <stdio.h>
+#include <chrono>
+#include <cmath>
+
+using namespace std;
+
+static const double PROGRESS_SECONDS = 5.0; // How often WaitStable reports progress
+
+TempMonitor::TempMonitor(qhyccd_handle *pCamHandle, double intervalSeconds, size_t capacity)
+    : pCamHandle(pCamHandle), intervalSeconds(intervalSeconds), ring(capacity > 0 ? capacity : 1), next(0), count(0),
+      target(NAN), tolerance(0), settle(0), inRangeSince(0), stopping(false)
+{
+  Sample(); // So Latest() is valid straight away
+  sampler = thread(&TempMonitor::Run, this);
+}
+
+TempMonitor::~TempMonitor()
+{
+  Stop();
+}
+
+void TempMonitor::SetTarget(double tempSetting, double tempError, double settleSeconds)
+{
+  {
+    lock_guard<mutex> guard(lock);
+    target = tempSetting;
+    tolerance = tempError;
+    settle = settleSeconds;
+
+    // Judge the new target against the samples already taken: if the sensor has been in range for a while,
+    // it counts towards the settle window
+    inRangeSince = 0;
+    for (size_t i = 1; i <= count; i++)
+    {
+      const TempSample &sample = ring[(next + ring.size() - i) % ring.size()];
+      if (fabs(sample.temp - target) > tolerance)
+      {
+        break;
+      }
+      inRangeSince = sample.time;
+    }
+  }
+  wake.notify_all();
+}
+
+bool TempMonitor::IsStable()
+{
+  lock_guard<mutex> guard(lock);
+  if (count == 0 || inRangeSince == 0)
+  {
+    return false;
+  }
+  const TempSample &latest = ring[(next + ring.size() - 1) % ring.size()];
+  return latest.time - inRangeSince >= settle;
+}
+
+void TempMonitor::WaitStable()
+{
+  unique_lock<mutex> guard(lock);
+  while (true)
+  {
+    const TempSample &latest = ring[(next + ring.size() - 1) % ring.size()];
+    if (inRangeSince != 0 && latest.time - inRangeSince >= settle)
+    {
+      break;
+    }
+
+    // Report temperature progress and cooler PWM to screen
+    if (fabs(latest.temp - target) > tolerance)
+    {
+      printf("Current Temperature: %.2f || You Want: %.2f . Camera is %s. \n", latest.temp, target,
+             latest.temp > target ? "cooling down" : "heating up");
+      printf("Cooler PWM is %.1f, running at %.1f%% of full power. \n", latest.pwm, latest.pwm / 255.0 * 100);
+      printf(" \n");
+    }
+    else
+    {
+      printf("Current Temperature: %.2f || You Want: %.2f . Settling for %.1f s more. \n", latest.temp, target,
+             settle - (latest.time - inRangeSince));
+    }
+
+    // Wake on every sample, report every few seconds
+    double reportAt = MonotonicSeconds() + PROGRESS_SECONDS;
+    while (!stopping && MonotonicSeconds() < reportAt)
+    {
+      sampled.wait_for(guard, chrono::duration<double>(intervalSeconds * 2));
+      const TempSample &now = ring[(next + ring.size() - 1) % ring.size()];
+      if (inRangeSince != 0 && now.time - inRangeSince >= settle)
+      {
+        break;
+      }
+    }
+    if (stopping)
+    {
+      return;
+    }
+  }
+}
+
+TempSample TempMonitor::Latest()
+{
+  lock_guard<mutex> guard(lock);
+  return ring[(next + ring.size() - 1) % ring.size()];
+}
+
+void TempMonitor::Stop()
+{
+  {
+    lock_guard<mutex> guard(lock);
+    stopping = true;
+  }
+  wake.notify_all();
+  sampled.notify_all();
+  if (sampler.joinable())
+  {
+    sampler.join();
+  }
+}
+
+/**
+  @fn void TempMonitor::Run()
+    @brief Sampling thread body
+*/
+void TempMonitor::Run()
+{
+  TimingThreadName("temperature monitor");
+  unique_lock<mutex> guard(lock);
+  while (!stopping)
+  {
+    wake.wait_for(guard, chrono::duration<double>(intervalSeconds));
+    if (stopping)
+    {
+      break;
+    }
+    guard.unlock();
+    Sample();
+    guard.lock();
+  }
+}
+
+/**
+  @fn void TempMonitor::Sample()
+    @brief Reads temperature and PWM, stores the sample, and updates the stability window
+*/
+void TempMonitor::Sample()
+{
+  TempSample sample;
+  double sampleStart = MonotonicSeconds();
+  sample.temp = GetQHYCCDParam(pCamHandle, CONTROL_CURTEMP);
+  sample.pwm = GetQHYCCDParam(pCamHandle, CONTROL_CURPWM);
+  sample.time = MonotonicSeconds();
+  TimingSpan(PHASE_DETAIL, "Temperature sample", sampleStart, sample.time);
+
+  {
+    lock_guard<mutex> guard(lock);
+    ring[next] = sample;
+    next = (next + 1) % ring.size();
+    if (count < ring.size())
+    {
+      count++;
+    }
+
+    if (!std::isnan(target) && fabs(sample.temp - target) <= tolerance)
+    {
+      if (inRangeSince == 0)
+      {
+        inRangeSince = sample.time;
+      }
+    }
+    else
+    {
+      inRangeSince = 0;
+    }
+  }
+  sampled.notify_all();
+}
@@ -0,0 +1,101 @@
+/**
+ * @file TempMonitor.h
+ *
+ * @brief Background temperature telemetry.
+ * A thread samples CONTROL_CURTEMP and CONTROL_CURPWM into a ring buffer and signals as soon as the sensor has
+ * been within the error range of the target for a settle window, so the capture loop never sleeps for a fixed time.
+ *
+ */
+
+#ifndef TEMPMONITOR_H
+#define TEMPMONITOR_H
+
+#include <stddef.h>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "qhyccd.h"
+
+/**
+  @struct TempSample
+    @brief One telemetry sample
+*/
+struct TempSample
+{
+  double time; // Monotonic time of the sample (seconds)
+  double temp; // Sensor temperature (Celsius)
+  double pwm;  // Cooler PWM (0-255)
+};
+
+/**
+  @class TempMonitor
+    @brief Samples the sensor temperature in the background and tracks when it is stable at the target
+*/
+class TempMonitor
+{
+public:
+  /**
+    @fn TempMonitor(qhyccd_handle *pCamHandle, double intervalSeconds, size_t capacity)
+      @brief Starts the sampling thread
+      @param pCamHandle Camera handle
+      @param intervalSeconds Time between samples
+      @param capacity Samples kept in the ring buffer
+  */
+  TempMonitor(qhyccd_handle *pCamHandle, double intervalSeconds, size_t capacity);
+  ~TempMonitor();
+
+  /**
+    @fn void SetTarget(double tempSetting, double tempError, double settleSeconds)
+      @brief Sets the temperature stability is judged against (the cooler itself is set by the caller)
+      @param tempSetting Target temperature
+      @param tempError Allowed error range
+      @param settleSeconds Time the temperature must stay within the error range
+  */
+  void SetTarget(double tempSetting, double tempError, double settleSeconds);
+
+  /**
+    @fn bool IsStable()
+    @return True if the latest samples have been within the error range for the settle window (no SDK call)
+  */
+  bool IsStable();
+
+  /**
+    @fn void WaitStable()
+      @brief Blocks until the temperature is stable, reporting progress every few seconds
+  */
+  void WaitStable();
+
+  /**
+    @fn TempSample Latest()
+    @return Most recent sample
+  */
+  TempSample Latest();
+
+  /**
+    @fn void Stop()
+      @brief Stops the sampling thread
+  */
+  void Stop();
+
+private:
+  void Run();
+  void Sample();
+
+  qhyccd_handle *pCamHandle;
+  double intervalSeconds;
+  std::vector<TempSample> ring; // Ring buffer of samples
+  size_t next;                  // Slot the next sample goes into
+  size_t count;                 // Samples in the ring
+  double target;                // Target temperature (NAN until set)
+  double tolerance;             // Allowed error range
+  double settle;                // Settle window
+  double inRangeSince;          // Time the temperature entered the error range (0 if outside)
+  bool stopping;
+  std::mutex lock;
+  std::condition_variable sampled; // Signalled after every sample
+  std::condition_variable wake;    // Wakes the sampling thread early (target change or stop)
+  std::thread sampler;
+};
+
+#endif
@@ -0,0 +1,284 @@
+/**
+ * @file Timing.cpp
+ *
+ * @brief Per-phase timing of the sweep.
+ *
+ */
+
+// Dependencies
+#include "Timing.h"
+#include <stdio.h>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <map>
+#include <mutex>
+#include <vector>
+
+using namespace std;
+
+static const char *phaseNames[PHASE_COUNT] = {"Camera initialization", "Filter wheel",       "Camera settings",
+                                              "Temperature regulation", "Buffer lease",       "Exposure",
+                                              "Readout",               "Writer queue",       "FITS write (async)"};
+
+static const size_t MAX_SPANS_PER_THREAD = 1 << 20; // Spans kept per thread (32 MB); later spans are counted only
+
+/**
+  @struct Span
+    @brief One recorded span
+*/
+struct Span
+{
+  const char *name; // Span name (NULL for the phase name)
+  int phase;        // TimingPhase, or PHASE_DETAIL
+  double start;     // Monotonic start (seconds)
+  double end;       // Monotonic end (seconds)
+};
+
+/**
+  @struct ThreadSpans
+    @brief Spans recorded by one thread. Only the owning thread appends, so its lock is uncontended until the report.
+*/
+struct ThreadSpans
+{
+  int id;
+  string name;
+  mutex lock;
+  vector<Span> spans;
+  unsigned long dropped;
+};
+
+static mutex registryLock;
+static vector<ThreadSpans *> registry; // Buffers of every thread that recorded a span (kept for the trace)
+static double sweepStart = 0;
+static thread_local ThreadSpans *localSpans = 0;
+
+/**
+  @fn static ThreadSpans *LocalSpans()
+    @brief Span buffer of the calling thread, registered on first use
+  @return Span buffer
+*/
+static ThreadSpans *LocalSpans()
+{
+  if (localSpans == 0)
+  {
+    ThreadSpans *spans = new ThreadSpans();
+    spans->dropped = 0;
+    spans->spans.reserve(256);
+    lock_guard<mutex> guard(registryLock);
+    spans->id = (int)registry.size() + 1;
+    spans->name = "thread " + to_string(spans->id);
+    registry.push_back(spans);
+    localSpans = spans;
+  }
+  return localSpans;
+}
+
+/**
+  @fn static double Percentile(vector<double> &values, double fraction)
+    @brief Nearest-rank percentile
+    @param values Values (sorted in place)
+    @param fraction Percentile as a fraction (0.5 for the median)
+  @return Percentile, 0 if there are no values
+*/
+static double Percentile(vector<double> &values, double fraction)
+{
+  if (values.empty())
+  {
+    return 0;
+  }
+  size_t rank = (size_t)ceil(fraction * values.size());
+  size_t index = rank > 0 ? rank - 1 : 0;
+  nth_element(values.begin(), values.begin() + index, values.end());
+  return values[index];
+}
+
+/**
+  @fn static void PrintRow(const char *name, vector<double> &durations, double wall)
+    @brief Prints one row of the timing table
+    @param name Phase or span name
+    @param durations Span durations (reordered)
+    @param wall Sweep wall time
+*/
+static void PrintRow(const char *name, vector<double> &durations, double wall)
+{
+  double total = 0;
+  for (size_t i = 0; i < durations.size(); i++)
+  {
+    total += durations[i];
+  }
+  size_t calls = durations.size();
+  double mean = calls ? 1000 * total / calls : 0.0;
+  double p50 = 1000 * Percentile(durations, 0.5);
+  double p99 = 1000 * Percentile(durations, 0.99);
+  printf("%-28s %10.3f %8zu %6.1f%% %11.3f %11.3f %11.3f\n", name, total, calls, wall > 0 ? 100 * total / wall : 0.0,
+         mean, p50, p99);
+}
+
+/**
+  @fn static void WriteJsonString(FILE *file, const char *text)
+    @brief Writes a quoted and escaped JSON string
+    @param file Output file
+    @param text String to write
+*/
+static void WriteJsonString(FILE *file, const char *text)
+{
+  fputc('"', file);
+  for (const char *c = text; *c; c++)
+  {
+    if (*c == '"' || *c == '\\')
+    {
+      fputc('\\', file);
+    }
+    fputc((unsigned char)*c < 0x20 ? ' ' : *c, file);
+  }
+  fputc('"', file);
+}
+
+double MonotonicSeconds()
+{
+  return chrono::duration<double>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void TimingStart()
+{
+  lock_guard<mutex> guard(registryLock);
+  for (size_t t = 0; t < registry.size(); t++)
+  {
+    lock_guard<mutex> spansGuard(registry[t]->lock);
+    registry[t]->spans.clear();
+    registry[t]->dropped = 0;
+  }
+  sweepStart = MonotonicSeconds();
+}
+
+void TimingThreadName(const char *name)
+{
+  ThreadSpans *spans = LocalSpans();
+  lock_guard<mutex> guard(spans->lock);
+  spans->name = name;
+}
+
+void TimingSpan(TimingPhase phase, const char *name, double start, double end)
+{
+  ThreadSpans *spans = LocalSpans();
+  lock_guard<mutex> guard(spans->lock);
+  if (spans->spans.size() >= MAX_SPANS_PER_THREAD)
+  {
+    spans->dropped++;
+    return;
+  }
+  Span span = {name, phase, start, end};
+  spans->spans.push_back(span);
+}
+
+void TimingAdd(TimingPhase phase, double seconds)
+{
+  double end = MonotonicSeconds();
+  TimingSpan(phase, 0, end - seconds, end);
+}
+
+void TimingReport(unsigned long frames, double bytes)
+{
+  double wall = MonotonicSeconds() - sweepStart;
+
+  // Group the span durations by phase, and detail spans by name
+  vector<double> phaseDurations[PHASE_COUNT];
+  map<string, vector<double>> detailDurations;
+  unsigned long dropped = 0;
+  {
+    lock_guard<mutex> guard(registryLock);
+    for (size_t t = 0; t < registry.size(); t++)
+    {
+      lock_guard<mutex> spansGuard(registry[t]->lock);
+      const vector<Span> &spans = registry[t]->spans;
+      for (size_t i = 0; i < spans.size(); i++)
+      {
+        double duration = spans[i].end - spans[i].start;
+        if (spans[i].phase < PHASE_COUNT)
+        {
+          phaseDurations[spans[i].phase].push_back(duration);
+        }
+        else
+        {
+          detailDurations[spans[i].name ? spans[i].name : "(unnamed)"].push_back(duration);
+        }
+      }
+      dropped += registry[t]->dropped;
+    }
+  }
+
+  printf(" \n");
+  printf("Sweep took %.2f s: %lu frames (%.3f frames/s), %.1f MB written (%.1f MB/s to disc).\n", wall, frames,
+         wall > 0 ? frames / wall : 0.0, bytes / 1e6, wall > 0 ? bytes / 1e6 / wall : 0.0);
+  printf("%-28s %10s %8s %7s %11s %11s %11s\n", "Phase", "Total (s)", "Calls", "% wall", "Mean (ms)", "p50 (ms)",
+         "p99 (ms)");
+  for (int i = 0; i < PHASE_COUNT; i++)
+  {
+    PrintRow(phaseNames[i], phaseDurations[i], wall);
+  }
+  if (!detailDurations.empty())
+  {
+    printf("%-28s\n", "Detail");
+    for (map<string, vector<double>>::iterator it = detailDurations.begin(); it != detailDurations.end(); ++it)
+    {
+      PrintRow(("  " + it->first).c_str(), it->second, wall);
+    }
+  }
+  if (dropped > 0)
+  {
+    printf("%lu spans were not recorded (per-thread buffer full).\n", dropped);
+  }
+  printf(" \n");
+}
+
+bool TimingWriteTrace(const string &fileName)
+{
+  FILE *file = fopen(fileName.c_str(), "w");
+  if (file == NULL)
+  {
+    printf("Could not write trace %s.\n", fileName.c_str());
+    return false;
+  }
+
+  // Chrome trace event format: complete ("X") events in microseconds since the start of the sweep
+  size_t events = 0;
+  fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+  fprintf(file, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"SingleFrameMode\"}}");
+  {
+    lock_guard<mutex> guard(registryLock);
+    for (size_t t = 0; t < registry.size(); t++)
+    {
+      lock_guard<mutex> spansGuard(registry[t]->lock);
+      fprintf(file, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":", registry[t]->id);
+      WriteJsonString(file, registry[t]->name.c_str());
+      fprintf(file, "}}");
+
+      const vector<Span> &spans = registry[t]->spans;
+      for (size_t i = 0; i < spans.size(); i++)
+      {
+        const Span &span = spans[i];
+        bool detail = span.phase >= PHASE_COUNT;
+        fprintf(file, ",\n{\"name\":");
+        WriteJsonString(file, span.name ? span.name : (detail ? "(unnamed)" : phaseNames[span.phase]));
+        fprintf(file, ",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":%d}",
+                detail ? "detail" : "phase", 1e6 * (span.start - sweepStart), 1e6 * (span.end - span.start),
+                registry[t]->id);
+        events++;
+      }
+    }
+  }
+  fprintf(file, "\n]}\n");
+
+  bool ok = ferror(file) == 0;
+  ok = fclose(file) == 0 && ok;
+  if (ok)
+  {
+    printf("Trace of %zu spans written to %s.\n", events, fileName.c_str());
+  }
+  else
+  {
+    printf("Could not write trace %s.\n", fileName.c_str());
+  }
+  return ok;
+}
@@ -0,0 +1,104 @@
+/**
+ * @file Timing.h
+ *
+ * @brief Per-phase timing of the sweep.
+ * Every timed phase is recorded as a span (name, thread, monotonic start and end) into a buffer owned by the
+ * recording thread, so recording never contends with other threads. At the end of a sweep the spans are summarized
+ * (frames/s, MB/s to disk, and total, mean, p50 and p99 per phase) and can be written as a Chrome/Perfetto trace.
+ *
+ */
+
+#ifndef TIMING_H
+#define TIMING_H
+
+#include <string>
+
+/**
+  @enum TimingPhase
+    @brief Phases of the sweep that are timed
+*/
+enum TimingPhase
+{
+  PHASE_INIT,        // CamInitialize and SDK setup
+  PHASE_FILTER,      // Waiting for the filter wheel to be in position
+  PHASE_SETTINGS,    // CamSettings and camera mode switches
+  PHASE_TEMPERATURE, // TempRegulation
+  PHASE_BUFFER,      // Leasing a frame buffer
+  PHASE_EXPOSURE,    // ExpQHYCCDSingleFrame (or waiting for a live frame)
+  PHASE_READOUT,     // GetQHYCCDSingleFrame (waits for the end of the exposure, then reads out)
+  PHASE_QUEUE,       // Handing the frame to the writers (includes backpressure waits)
+  PHASE_WRITE,       // FITS writing (writer threads, overlaps the phases above)
+  PHASE_COUNT,
+  PHASE_DETAIL = PHASE_COUNT // Span inside or alongside a phase: traced and summarized by name, not added to a phase
+};
+
+/**
+  @fn double MonotonicSeconds()
+  @return Seconds on the monotonic clock
+*/
+double MonotonicSeconds();
+
+/**
+  @fn void TimingStart()
+    @brief Discards all recorded spans and starts the sweep wall clock
+*/
+void TimingStart();
+
+/**
+  @fn void TimingThreadName(const char *name)
+    @brief Names the calling thread in the trace
+    @param name Thread name (copied)
+*/
+void TimingThreadName(const char *name);
+
+/**
+  @fn void TimingSpan(TimingPhase phase, const char *name, double start, double end)
+    @brief Records a span on the calling thread's buffer
+    @param phase Phase the time counts towards (PHASE_DETAIL for spans that are only traced)
+    @param name Span name (must outlive the sweep, e.g. a string literal; NULL for the phase name)
+    @param start Monotonic start time (seconds)
+    @param end Monotonic end time (seconds)
+*/
+void TimingSpan(TimingPhase phase, const char *name, double start, double end);
+
+/**
+  @fn void TimingAdd(TimingPhase phase, double seconds)
+    @brief Records a span of a phase that ends now
+    @param phase Phase the time was spent in
+    @param seconds Time spent
+*/
+void TimingAdd(TimingPhase phase, double seconds);
+
+/**
+  @fn void TimingReport(unsigned long frames, double bytes)
+    @brief Prints frames/s, MB/s to disk and the time spent in each phase and detail span since TimingStart
+    @param frames Frames written to disk
+    @param bytes Bytes written to disk
+*/
+void TimingReport(unsigned long frames, double bytes);
+
+/**
+  @fn bool TimingWriteTrace(const std::string &fileName)
+    @brief Writes all recorded spans as a Chrome/Perfetto trace (JSON, open in ui.perfetto.dev or chrome://tracing)
+    @param fileName Trace file to write
+    @return True on success
+*/
+bool TimingWriteTrace(const std::string &fileName);
+
+/**
+  @class PhaseTimer
+    @brief Records the time between construction and destruction as a span
+*/
+class PhaseTimer
+{
+public:
+  explicit PhaseTimer(TimingPhase phase, const char *name = 0) : phase(phase), name(name), start(MonotonicSeconds()) {}
+  ~PhaseTimer() { TimingSpan(phase, name, start, MonotonicSeconds()); }
+
+private:
+  TimingPhase phase;
+  const char *name;
+  double start;
+};
+
+#endif
@@ -0,0 +1,180 @@
+/**
+ * @file UsbTuner.cpp
+ *
+ * @brief Calibration of the USB traffic setting.
+ *
+ */
+
+// Dependencies
+#include "UsbTuner.h"
+#include "CameraState.h"
+#include "Timing.h"
+#include <stdio.h>
+#include <time.h>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+
+using namespace std;
+
+vector<UsbTrafficResult> MeasureUsbTraffic(qhyccd_handle *pCamHandle, CameraState *cameraState,
+                                           const vector<int> &values, int frames, unsigned char *buffer)
+{
+  vector<UsbTrafficResult> results;
+
+  // Bias frames: the readout is all that is timed
+  cameraState->SetParam(CONTROL_EXPOSURE, 1, "SetQHYCCDParam EXPOSURE", NULL);
+
+  for (size_t v = 0; v < values.size(); v++)
+  {
+    UsbTrafficResult result;
+    result.usbTraffic = values[v];
+    result.frames = frames;
+    result.failures = 0;
+    result.medianReadout = 0;
+    result.maxReadout = 0;
+
+    unsigned int retVal = cameraState->SetParam(CONTROL_USBTRAFFIC, values[v], "SetQHYCCDParam USBTRAFFIC", NULL);
+    if (retVal != QHYCCD_SUCCESS)
+    {
+      printf("Could not set USB traffic to %d. Error: %d.\n", values[v], retVal);
+      result.failures = frames;
+      results.push_back(result);
+      continue;
+    }
+
+    vector<double> readouts;
+    for (int i = 0; i < frames; i++)
+    {
+      retVal = ExpQHYCCDSingleFrame(pCamHandle);
+      if (retVal != QHYCCD_SUCCESS)
+      {
+        result.failures++;
+        CancelQHYCCDExposingAndReadout(pCamHandle);
+        continue;
+      }
+
+      unsigned int w, h, bpp, channels;
+      double readoutStart = MonotonicSeconds();
+      retVal = GetQHYCCDSingleFrame(pCamHandle, &w, &h, &bpp, &channels, buffer);
+      double readoutEnd = MonotonicSeconds();
+      TimingSpan(PHASE_DETAIL, "USB traffic tuning readout", readoutStart, readoutEnd);
+      CancelQHYCCDExposingAndReadout(pCamHandle);
+
+      if (retVal != QHYCCD_SUCCESS)
+      {
+        result.failures++;
+        continue;
+      }
+      readouts.push_back(readoutEnd - readoutStart);
+    }
+
+    if (!readouts.empty())
+    {
+      sort(readouts.begin(), readouts.end());
+      result.medianReadout = readouts[readouts.size() / 2];
+      result.maxReadout = readouts.back();
+    }
+    results.push_back(result);
+  }
+
+  return results;
+}
+
+int PickUsbTraffic(const vector<UsbTrafficResult> &results)
+{
+  int picked = -1;
+  for (size_t i = 0; i < results.size(); i++)
+  {
+    const UsbTrafficResult &result = results[i];
+    if (result.failures == result.frames)
+    {
+      continue; // Nothing was read out
+    }
+    if (picked < 0 || result.failures < results[picked].failures ||
+        (result.failures == results[picked].failures && result.medianReadout < results[picked].medianReadout))
+    {
+      picked = i;
+    }
+  }
+  if (picked < 0 && !results.empty())
+  {
+    picked = 0; // Every value failed every frame; keep the first
+  }
+  return picked;
+}
+
+void PrintUsbTraffic(const vector<UsbTrafficResult> &results, int picked)
+{
+  printf("%-12s %7s %9s %18s %15s\n", "USB traffic", "Frames", "Failures", "Median readout (s)", "Max readout (s)");
+  for (size_t i = 0; i < results.size(); i++)
+  {
+    const UsbTrafficResult &result = results[i];
+    printf("%-12d %7d %9d %18.3f %15.3f%s\n", result.usbTraffic, result.frames, result.failures,
+           result.medianReadout, result.maxReadout, (int)i == picked ? "  <- chosen" : "");
+  }
+}
+
+bool LoadUsbTraffic(const string &path, const string &camId, int *usbTraffic)
+{
+  ifstream file(path.c_str());
+  string line;
+  bool found = false;
+  while (getline(file, line))
+  {
+    if (line.empty() || line[0] == '#')
+    {
+      continue;
+    }
+    istringstream fields(line);
+    string id;
+    int value;
+    if (fields >> id >> value && id == camId)
+    {
+      *usbTraffic = value; // The last entry of the camera wins
+      found = true;
+    }
+  }
+  return found;
+}
+
+bool SaveUsbTraffic(const string &path, const string &camId, const UsbTrafficResult &result)
+{
+  // Keep the entries of the other cameras
+  vector<string> lines;
+  {
+    ifstream file(path.c_str());
+    string line;
+    while (getline(file, line))
+    {
+      istringstream fields(line);
+      string id;
+      if (line.empty() || line[0] == '#' || !(fields >> id) || id == camId)
+      {
+        continue;
+      }
+      lines.push_back(line);
+    }
+  }
+
+  char entry[256];
+  snprintf(entry, sizeof(entry), "%s %d %.1f %ld", camId.c_str(), result.usbTraffic, result.medianReadout * 1000,
+           (long)time(NULL));
+  lines.push_back(entry);
+
+  // Replace the file in one step so an interrupted run cannot truncate it
+  string tmpPath = path + ".tmp";
+  {
+    ofstream file(tmpPath.c_str());
+    file << "# camera_id usb_traffic median_readout_ms tuned_unix_time\n";
+    for (size_t i = 0; i < lines.size(); i++)
+    {
+      file << lines[i] << "\n";
+    }
+    if (!file)
+    {
+      return false;
+    }
+  }
+  return rename(tmpPath.c_str(), path.c_str()) == 0;
+}
@@ -0,0 +1,85 @@
+/**
+ * @file UsbTuner.h
+ *
+ * @brief Calibration of the USB traffic setting.
+ * The best CONTROL_USBTRAFFIC depends on the host controller, cable and hub: too high a value lengthens readout,
+ * too low a value loses frames. The tuner takes short bias frames at each candidate value, measures the readout
+ * latency and the failed frames, and picks the fastest value at which no frame failed. The result is cached per
+ * camera ID in a small text file so later runs start tuned.
+ *
+ */
+
+#ifndef USBTUNER_H
+#define USBTUNER_H
+
+#include <string>
+#include <vector>
+#include "qhyccd.h"
+
+class CameraState;
+
+/**
+  @struct UsbTrafficResult
+    @brief Readout measured at one USB traffic value
+*/
+struct UsbTrafficResult
+{
+  int usbTraffic;         // CONTROL_USBTRAFFIC value
+  int frames;             // Bias frames taken
+  int failures;           // Frames that could not be exposed or read out
+  double medianReadout;   // Median readout time of the frames read (seconds)
+  double maxReadout;      // Slowest readout (seconds)
+};
+
+/**
+  @fn std::vector<UsbTrafficResult> MeasureUsbTraffic(qhyccd_handle *pCamHandle, CameraState *cameraState, const std::vector<int> &values, int frames, unsigned char *buffer)
+    @brief Takes bias frames (shortest exposure) at each USB traffic value and times their readout. The camera is
+           left at the last value measured.
+    @param pCamHandle Camera handle, initialized in single frame mode
+    @param cameraState Settings cache of the camera
+    @param values USB traffic values to try
+    @param frames Frames to take at each value
+    @param buffer Image buffer of GetQHYCCDMemLength bytes
+  @return One result per value, in the order given
+*/
+std::vector<UsbTrafficResult> MeasureUsbTraffic(qhyccd_handle *pCamHandle, CameraState *cameraState,
+                                                const std::vector<int> &values, int frames, unsigned char *buffer);
+
+/**
+  @fn int PickUsbTraffic(const std::vector<UsbTrafficResult> &results)
+    @brief Picks the value with the fastest median readout among those with no failed frame, or the value with the
+           fewest failures if every value failed some
+    @param results Measurements from MeasureUsbTraffic
+  @return Index of the chosen result (-1 if there are none)
+*/
+int PickUsbTraffic(const std::vector<UsbTrafficResult> &results);
+
+/**
+  @fn void PrintUsbTraffic(const std::vector<UsbTrafficResult> &results, int picked)
+    @brief Prints the measurements as a table, marking the chosen value
+    @param results Measurements from MeasureUsbTraffic
+    @param picked Index of the chosen result
+*/
+void PrintUsbTraffic(const std::vector<UsbTrafficResult> &results, int picked);
+
+/**
+  @fn bool LoadUsbTraffic(const std::string &path, const std::string &camId, int *usbTraffic)
+    @brief Looks up the tuned USB traffic value of a camera
+    @param path Cache file
+    @param camId Camera ID
+    @param usbTraffic Set to the cached value if found
+  @return True if the camera has a cached value
+*/
+bool LoadUsbTraffic(const std::string &path, const std::string &camId, int *usbTraffic);
+
+/**
+  @fn bool SaveUsbTraffic(const std::string &path, const std::string &camId, const UsbTrafficResult &result)
+    @brief Stores the tuned USB traffic value of a camera, replacing its previous entry and keeping the others
+    @param path Cache file
+    @param camId Camera ID
+    @param result Chosen measurement
+  @return True if the file was written
+*/
+bool SaveUsbTraffic(const std::string &path, const std::string &camId, const UsbTrafficResult &result);
+
+#endif